@@ -301,6 +301,53 @@ nice_address_equal_full (const NiceAddress *a, const NiceAddress *b, gboolean co
 }
 
 
+/* The splitmix64 finaliser: spreads every input bit over the whole word */
+static inline guint64
+priv_mix64 (guint64 h)
+{
+  h ^= h >> 30;
+  h *= G_GUINT64_CONSTANT (0xbf58476d1ce4e5b9);
+  h ^= h >> 27;
+  h *= G_GUINT64_CONSTANT (0x94d049bb133111eb);
+  h ^= h >> 31;
+  return h;
+}
+
+NICEAPI_EXPORT guint
+nice_address_hash (const NiceAddress *addr)
+{
+  guint64 h;
+
+  switch (addr->s.addr.sa_family)
+    {
+    case AF_INET:
+      h = ((guint64) addr->s.ip4.sin_addr.s_addr << 16) |
+          addr->s.ip4.sin_port;
+      h = priv_mix64 (h ^ ((guint64) AF_INET << 48));
+      break;
+
+    case AF_INET6:
+      {
+        guint64 hi, lo;
+
+        memcpy (&hi, &addr->s.ip6.sin6_addr, sizeof (hi));
+        memcpy (&lo, (const guint8 *) &addr->s.ip6.sin6_addr + sizeof (hi),
+            sizeof (lo));
+        h = priv_mix64 (hi ^ ((guint64) AF_INET6 << 48) ^
+            ((guint64) addr->s.ip6.sin6_scope_id << 16) ^
+            addr->s.ip6.sin6_port);
+        h = priv_mix64 (h ^ lo);
+      }
+      break;
+
+    default:
+      return 0;
+    }
+
+  return (guint) (h ^ (h >> 32));
+}
+
+
 NICEAPI_EXPORT NiceAddress *
 nice_address_dup (const NiceAddress *a)
 {
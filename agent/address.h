@@ -269,6 +269,20 @@ nice_address_equal (const NiceAddress *a, const NiceAddress *b);
 NICE_EXPORT gboolean
 nice_address_equal_full (const NiceAddress *a, const NiceAddress *b, gboolean compare_ports);
 
+/**
+ * nice_address_hash:
+ * @addr: The #NiceAddress to hash
+ *
+ * Computes a hash of the family, address and port of @addr, suitable for
+ * use as a #GHashFunc together with nice_address_equal(). The value is
+ * computed in 64 bits and folded, so addresses that only differ in their
+ * port or in their last bytes still spread over the whole table.
+ *
+ * Returns: The hash of @addr
+ */
+NICE_EXPORT guint
+nice_address_hash (const NiceAddress *addr);
+
 /**
  * nice_address_to_string:
  * @addr: The #NiceAddress to query
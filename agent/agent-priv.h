@@ -57,6 +57,7 @@
 #include "stream.h"
 #include "conncheck.h"
 #include "component.h"
+#include "timer-wheel.h"
 #include "stun/stunagent.h"
 #include "stun/usages/turn.h"
 #include "stun/usages/ice.h"
@@ -70,6 +71,7 @@
 #define NICE_AGENT_MAX_CONNECTIVITY_CHECKS_DEFAULT 80 /* see spec 5.7.3 RFC 5245 and 3.1.4.8.2.1 of MS-ICE2.
                                                          We use the lower of the two suggested limits */
 #define NICE_AGENT_REGULAR_NOMINATION_TIMEOUT_DEFAULT 3000
+#define NICE_AGENT_TURN_QUEUE_SIZE_DEFAULT 65536 /* bytes per TURN socket */
 
 /* An upper limit to size of STUN packets handled (based on Ethernet
  * MTU and estimated typical sizes of ICE STUN packet */
@@ -92,6 +94,8 @@ struct _NiceAgent
   GTimeVal next_check_tv;         /* property: next conncheck timestamp */
   gchar *stun_server_ip;          /* property: STUN server IP */
   guint stun_server_port;         /* property: STUN server port */
+  NiceAddress stun_server;        /* stun_server_ip:stun_server_port parsed,
+                                     unset if there is none */
   gchar *proxy_ip;                /* property: Proxy server IP */
   guint proxy_port;               /* property: Proxy server port */
   NiceProxyType proxy_type;       /* property: Proxy type */
@@ -114,9 +118,9 @@ struct _NiceAgent
   NiceRNG *rng;                   /* random number generator */
   GSList *discovery_list;         /* list of CandidateDiscovery items */
   guint discovery_unsched_items;  /* number of discovery items unscheduled */
-  GSource *discovery_timer_source; /* source of discovery timer */
-  GSource *conncheck_timer_source; /* source of conncheck timer */
-  GSource *keepalive_timer_source; /* source of keepalive timer */
+  NiceTimer *discovery_timer_source; /* source of discovery timer */
+  NiceTimer *conncheck_timer_source; /* source of conncheck timer */
+  NiceTimer *keepalive_timer_source; /* source of keepalive timer */
   GSList *refresh_list;         /* list of CandidateRefresh items */
   guint64 tie_breaker;            /* tie breaker (ICE sect 5.2
                                      "Determining Role" ID-19) */
@@ -124,9 +128,29 @@ struct _NiceAgent
   NiceCompatibility compatibility; /* property: Compatibility mode */
   NiceCompatibility turn_compatibility; /* property: TURN server compatibility mode */
   StunAgent stun_agent;            /* STUN agent */
-  gboolean media_after_tick;       /* Received media after keepalive tick */
+  gboolean media_after_tick;       /* Received media after keepalive tick,
+                                      set with only the stream lock held so
+                                      only accessed with g_atomic_int_*() */
   gchar *software_attribute;       /* SOFTWARE attribute */
   gboolean reliable;               /* property: reliable */
+  gboolean udp_offload;            /* property: udp-offload */
+  guint64 demux_misclassified;     /* property: demux-misclassified */
+  guint turn_queue_size;           /* property: turn-queue-size */
+  gboolean turn_queue_drop_oldest; /* property: turn-queue-drop-oldest */
+  guint64 turn_queued_bytes;       /* property: turn-queued-bytes */
+  guint64 turn_dropped_bytes;      /* property: turn-dropped-bytes */
+  GMutex send_pairs_mutex;         /* protects send_pairs, the snapshot
+                                      reference counts and
+                                      send_pairs_waiters */
+  GCond send_pairs_cond;           /* signalled when a sender is done */
+  guint send_pairs_waiters;
+  GHashTable *send_pairs;          /* stream/component -> SelectedPairSnapshot,
+                                      read by nice_agent_send() without
+                                      taking agent_mutex */
+  GHashTable *stun_transactions;   /* StunTransactionId -> StunTransactionEntry
+                                      of every outstanding request */
+  GHashTable *stun_transaction_slots; /* StunAgentSavedIds * ->
+                                      StunTransactionEntry, owns the entries */
   /* XXX: add pointer to internal data struct for ABI-safe extensions */
 };
 
@@ -146,6 +170,16 @@ void agent_signal_gathering_done (NiceAgent *agent);
 void agent_lock (NiceAgent *agent);
 void agent_unlock (NiceAgent *agent);
 
+void agent_set_send_pair (NiceAgent *agent, guint stream_id,
+    guint component_id, SelectedPairSnapshot *pair);
+void agent_clear_send_pairs (NiceAgent *agent, Stream *stream);
+
+void agent_stun_transaction_add (NiceAgent *agent, StunAgent *stun_agent,
+    gpointer owner, StunMessage *msg);
+StunAgent *agent_stun_transaction_find (NiceAgent *agent, StunMethod method,
+    StunTransactionId id, gpointer *owner);
+void agent_stun_transactions_forget (NiceAgent *agent, StunAgent *stun_agent);
+
 void agent_signal_new_selected_pair (
   NiceAgent *agent,
   guint stream_id,
@@ -180,7 +214,8 @@ void agent_signal_initial_binding_request_received (NiceAgent *agent, Stream *st
 
 guint64 agent_candidate_pair_priority (NiceAgent *agent, NiceCandidate *local, NiceCandidate *remote);
 
-GSource *agent_timeout_add_with_context (NiceAgent *agent, guint interval, GSourceFunc function, gpointer data);
+NiceTimer *agent_timeout_add_with_context (NiceAgent *agent, guint interval, GSourceFunc function, gpointer data);
+NiceTimer *agent_refresh_timeout_add (NiceAgent *agent, guint interval, GSourceFunc function, gpointer data);
 
 void agent_attach_stream_component_socket (NiceAgent *agent,
     Stream *stream,
@@ -194,6 +229,7 @@ NiceTurnSocketCompatibility agent_to_turn_socket_compatibility (NiceAgent *agent
 void _priv_set_socket_tos (NiceAgent *agent, NiceSocket *sock, gint tos);
 void nice_agent_socket_rx_cb (NiceSocket* socket, NiceAddress* from, gchar* buf, gint len, gpointer userdata);
 void nice_agent_socket_tx_cb (NiceSocket* socket, gchar* buf, gint len, gsize queued, gpointer userdata);
+void nice_agent_turn_queue_cb (gint64 queued, guint64 dropped, gpointer userdata);
 
 guint32 agent_candidate_ice_priority (NiceAgent* agent, const NiceCandidate *candidate, NiceCandidateType type);
 
@@ -75,6 +75,7 @@
  * will it work tcp relaying??
  */
 #define MAX_BUFFER_SIZE 65536
+#define MAX_GRO_SEGMENTS 64
 #define DEFAULT_STUN_PORT  3478
 #define DEFAULT_UPNP_TIMEOUT 200
 
@@ -111,7 +112,14 @@ enum
   PROP_CONNCHECK_RETRANSMISSIONS,
   PROP_AGGRESSIVE_MODE,
   PROP_REGULAR_NOMINATION_TIMEOUT,
-  PROP_TIE_BREAKER
+  PROP_TIE_BREAKER,
+  PROP_UDP_OFFLOAD,
+  PROP_DEMUX_MISCLASSIFIED,
+  PROP_TURN_QUEUE_SIZE,
+  PROP_TURN_QUEUE_DROP_OLDEST,
+  PROP_TURN_QUEUED_BYTES,
+  PROP_TURN_DROPPED_BYTES,
+  PROP_TURN_REFRESH_LOAD
 };
 
 
@@ -172,6 +180,234 @@ agent_unlock (NiceAgent * agent)
   g_rec_mutex_unlock (&agent->agent_mutex);
 }
 
+#define SEND_PAIR_KEY(stream_id, component_id) \
+    GUINT_TO_POINTER (((stream_id) << 8) | ((component_id) & 0xff))
+
+/*
+ * Replaces the selected pair snapshot nice_agent_send() uses for the
+ * component, taking ownership of @pair (which may be NULL). Senders still
+ * holding the previous snapshot keep their reference until they are done.
+ */
+void
+agent_set_send_pair (NiceAgent * agent, guint stream_id, guint component_id,
+    SelectedPairSnapshot * pair)
+{
+  gpointer key = SEND_PAIR_KEY (stream_id, component_id);
+
+  g_mutex_lock (&agent->send_pairs_mutex);
+  if (pair)
+    g_hash_table_replace (agent->send_pairs, key, pair);
+  else
+    g_hash_table_remove (agent->send_pairs, key);
+  g_mutex_unlock (&agent->send_pairs_mutex);
+}
+
+static SelectedPairSnapshot *
+agent_get_send_pair (NiceAgent * agent, guint stream_id, guint component_id)
+{
+  SelectedPairSnapshot *pair;
+
+  g_mutex_lock (&agent->send_pairs_mutex);
+  pair = g_hash_table_lookup (agent->send_pairs,
+      SEND_PAIR_KEY (stream_id, component_id));
+  if (pair)
+    selected_pair_snapshot_ref (pair);
+  g_mutex_unlock (&agent->send_pairs_mutex);
+
+  return pair;
+}
+
+/*
+ * Drops the reference agent_get_send_pair() gave, waking up
+ * agent_clear_send_pairs() if it is waiting for it.
+ */
+static void
+agent_put_send_pair (NiceAgent * agent, SelectedPairSnapshot * pair)
+{
+  g_mutex_lock (&agent->send_pairs_mutex);
+  selected_pair_snapshot_unref (pair);
+  if (agent->send_pairs_waiters > 0)
+    g_cond_broadcast (&agent->send_pairs_cond);
+  g_mutex_unlock (&agent->send_pairs_mutex);
+}
+
+/*
+ * Unpublishes the snapshots of all components of @stream and waits for
+ * the senders still using them, so the sockets can be freed afterwards.
+ */
+void
+agent_clear_send_pairs (NiceAgent * agent, Stream * stream)
+{
+  GSList *i;
+
+  for (i = stream->components; i; i = i->next) {
+    Component *component = i->data;
+    gpointer key = SEND_PAIR_KEY (stream->id, component->id);
+    SelectedPairSnapshot *pair;
+
+    g_mutex_lock (&agent->send_pairs_mutex);
+    pair = g_hash_table_lookup (agent->send_pairs, key);
+    if (pair) {
+      g_hash_table_steal (agent->send_pairs, key);
+
+      /* a sender only holds on to it for the duration of one send, and
+       * never takes the agent lock while doing so */
+      agent->send_pairs_waiters++;
+      while (pair->ref_count > 1)
+        g_cond_wait (&agent->send_pairs_cond, &agent->send_pairs_mutex);
+      agent->send_pairs_waiters--;
+    }
+    g_mutex_unlock (&agent->send_pairs_mutex);
+
+    if (pair == NULL)
+      continue;
+
+    selected_pair_snapshot_unref (pair);
+  }
+}
+
+/*
+ * Index of the requests sent by the agent's StunAgents (the global one and
+ * those of the discoveries and refreshes), so that an inbound response can
+ * be matched to its StunAgent with a single lookup.
+ *
+ * Each entry points at the StunAgent slot the request is saved in. The
+ * StunAgent invalidates that slot by itself when the transaction is
+ * validated or forgotten, so entries are checked against it on lookup and
+ * replaced when the slot is reused; the table never holds more entries
+ * than there are slots in use.
+ */
+typedef struct {
+  StunTransactionId id;
+  StunMethod method;
+  StunAgent *stun_agent;
+  gpointer owner;
+  StunAgentSavedIds *saved;
+} StunTransactionEntry;
+
+static guint
+priv_stun_transaction_hash (gconstpointer key)
+{
+  guint32 h;
+
+  /* transaction IDs are random, any 32 bits of them will do */
+  memcpy (&h, (const guint8 *) key + sizeof (StunTransactionId) - sizeof (h),
+      sizeof (h));
+  return h;
+}
+
+static gboolean
+priv_stun_transaction_equal (gconstpointer a, gconstpointer b)
+{
+  return memcmp (a, b, sizeof (StunTransactionId)) == 0;
+}
+
+static void
+priv_stun_transaction_entry_free (StunTransactionEntry *entry)
+{
+  g_slice_free (StunTransactionEntry, entry);
+}
+
+static void
+priv_stun_transaction_remove (NiceAgent *agent, StunTransactionEntry *entry)
+{
+  g_hash_table_remove (agent->stun_transactions, entry->id);
+  g_hash_table_remove (agent->stun_transaction_slots, entry->saved);
+}
+
+/*
+ * Records the request @msg just built by @stun_agent on behalf of @owner.
+ * Anything but a request is ignored.
+ */
+void
+agent_stun_transaction_add (NiceAgent *agent, StunAgent *stun_agent,
+    gpointer owner, StunMessage *msg)
+{
+  StunTransactionEntry *entry;
+  StunAgentSavedIds *saved = NULL;
+  StunTransactionId id;
+  guint i;
+
+  if (stun_message_get_class (msg) != STUN_REQUEST)
+    return;
+
+  stun_message_id (msg, id);
+  for (i = 0; i < STUN_AGENT_MAX_SAVED_IDS; i++) {
+    if (stun_agent->sent_ids[i].valid &&
+        memcmp (stun_agent->sent_ids[i].id, id, sizeof (id)) == 0) {
+      saved = &stun_agent->sent_ids[i];
+      break;
+    }
+  }
+  if (saved == NULL)
+    return;
+
+  entry = g_hash_table_lookup (agent->stun_transaction_slots, saved);
+  if (entry)
+    priv_stun_transaction_remove (agent, entry);
+  entry = g_hash_table_lookup (agent->stun_transactions, id);
+  if (entry)
+    priv_stun_transaction_remove (agent, entry);
+
+  entry = g_slice_new (StunTransactionEntry);
+  memcpy (entry->id, id, sizeof (id));
+  entry->method = saved->method;
+  entry->stun_agent = stun_agent;
+  entry->owner = owner;
+  entry->saved = saved;
+
+  g_hash_table_insert (agent->stun_transactions, entry->id, entry);
+  g_hash_table_insert (agent->stun_transaction_slots, saved, entry);
+}
+
+/*
+ * Returns the StunAgent which sent the outstanding request @id, or NULL.
+ */
+StunAgent *
+agent_stun_transaction_find (NiceAgent *agent, StunMethod method,
+    StunTransactionId id, gpointer *owner)
+{
+  StunTransactionEntry *entry;
+
+  entry = g_hash_table_lookup (agent->stun_transactions, id);
+  if (entry == NULL)
+    return NULL;
+
+  if (!entry->saved->valid ||
+      memcmp (entry->saved->id, id, sizeof (StunTransactionId)) != 0) {
+    /* answered, forgotten or timed out since */
+    priv_stun_transaction_remove (agent, entry);
+    return NULL;
+  }
+
+  if (entry->method != method)
+    return NULL;
+
+  if (owner)
+    *owner = entry->owner;
+  return entry->stun_agent;
+}
+
+/*
+ * Drops every request of @stun_agent, which is about to be freed.
+ */
+void
+agent_stun_transactions_forget (NiceAgent *agent, StunAgent *stun_agent)
+{
+  guint i;
+
+  if (agent->stun_transaction_slots == NULL)
+    return;
+
+  for (i = 0; i < STUN_AGENT_MAX_SAVED_IDS; i++) {
+    StunTransactionEntry *entry = g_hash_table_lookup (
+        agent->stun_transaction_slots, &stun_agent->sent_ids[i]);
+
+    if (entry)
+      priv_stun_transaction_remove (agent, entry);
+  }
+}
+
 /*
  * ICE 4.1.2.1. "Recommended Formula" (ID-19):
  * returns number between 1 and 0x7effffff
@@ -623,6 +859,105 @@ nice_agent_class_init (NiceAgentClass * klass)
           0,     /* Not construct time so ignored */
           G_PARAM_READWRITE));
 
+  /**
+   * NiceAgent:udp-offload:
+   *
+   * Enable UDP segmentation (GSO) and receive (GRO) offload on the UDP
+   * sockets of the agent where the kernel supports it (Linux only). Runs of
+   * equally sized packets passed to nice_agent_send_messages() are then
+   * handed to the kernel as a single datagram, and coalesced datagrams are
+   * split into their segments again on receive.
+   *
+   * Only applies to sockets created after the property is set.
+   */
+  g_object_class_install_property (gobject_class, PROP_UDP_OFFLOAD,
+      g_param_spec_boolean ("udp-offload",
+          "Enable UDP GSO/GRO offload",
+          "Enable UDP segmentation and receive offload where supported",
+          FALSE, G_PARAM_READWRITE));
+
+  /**
+   * NiceAgent:demux-misclassified:
+   *
+   * The number of received packets that looked like STUN from their first
+   * byte (RFC 7983) but turned out not to be, because of a missing magic
+   * cookie or a bad length. They are passed on as application data, like
+   * any other packet that isn't STUN.
+   */
+  g_object_class_install_property (gobject_class, PROP_DEMUX_MISCLASSIFIED,
+      g_param_spec_uint64 ("demux-misclassified",
+          "Misclassified packets",
+          "Packets that looked like STUN but failed validation",
+          0, G_MAXUINT64, 0, G_PARAM_READABLE));
+
+  /**
+   * NiceAgent:turn-queue-size:
+   *
+   * The number of bytes each TURN relay socket may hold for peers it is
+   * still waiting on a permission for. The memory is only allocated once a
+   * socket has something to queue. When it is full, packets are dropped as
+   * #NiceAgent:turn-queue-drop-oldest says.
+   *
+   * Only applies to sockets created after the property is set.
+   */
+  g_object_class_install_property (gobject_class, PROP_TURN_QUEUE_SIZE,
+      g_param_spec_uint ("turn-queue-size",
+          "TURN permission queue size",
+          "Bytes each TURN socket queues while waiting for permissions",
+          1024, G_MAXUINT, NICE_AGENT_TURN_QUEUE_SIZE_DEFAULT,
+          G_PARAM_READWRITE));
+
+  /**
+   * NiceAgent:turn-queue-drop-oldest:
+   *
+   * Whether a full TURN permission queue (see #NiceAgent:turn-queue-size)
+   * drops the oldest packets to make room for a new one, or the new one.
+   *
+   * Only applies to sockets created after the property is set.
+   */
+  g_object_class_install_property (gobject_class, PROP_TURN_QUEUE_DROP_OLDEST,
+      g_param_spec_boolean ("turn-queue-drop-oldest",
+          "Drop oldest queued TURN packets",
+          "Whether a full TURN permission queue drops its oldest packets",
+          TRUE, G_PARAM_READWRITE));
+
+  /**
+   * NiceAgent:turn-queued-bytes:
+   *
+   * The number of bytes currently held by the TURN sockets of the agent for
+   * peers they are waiting on a permission for.
+   */
+  g_object_class_install_property (gobject_class, PROP_TURN_QUEUED_BYTES,
+      g_param_spec_uint64 ("turn-queued-bytes",
+          "Queued TURN bytes",
+          "Bytes waiting for a TURN permission",
+          0, G_MAXUINT64, 0, G_PARAM_READABLE));
+
+  /**
+   * NiceAgent:turn-dropped-bytes:
+   *
+   * The number of bytes the TURN sockets of the agent dropped because their
+   * permission queue was full.
+   */
+  g_object_class_install_property (gobject_class, PROP_TURN_DROPPED_BYTES,
+      g_param_spec_uint64 ("turn-dropped-bytes",
+          "Dropped TURN bytes",
+          "Bytes dropped from full TURN permission queues",
+          0, G_MAXUINT64, 0, G_PARAM_READABLE));
+
+  /**
+   * NiceAgent:turn-refresh-load:
+   *
+   * The number of TURN allocation, permission and channel binding refreshes
+   * due in the next minute on the #NiceAgent:main-context. Refreshes are
+   * scheduled per context, so this counts those of every agent sharing it.
+   */
+  g_object_class_install_property (gobject_class, PROP_TURN_REFRESH_LOAD,
+      g_param_spec_uint ("turn-refresh-load",
+          "Upcoming TURN refreshes",
+          "TURN refreshes due in the next minute on the main context",
+          0, G_MAXUINT, 0, G_PARAM_READABLE));
+
   /* install signals */
 
   /**
@@ -804,6 +1139,7 @@ nice_agent_init (NiceAgent * agent)
 
   /* set defaults; not construct params, so set here */
   agent->stun_server_port = DEFAULT_STUN_PORT;
+  nice_address_init (&agent->stun_server);
   agent->controlling_mode = TRUE;
   agent->max_conn_checks = NICE_AGENT_MAX_CONNECTIVITY_CHECKS_DEFAULT;
   agent->conncheck_timeout = STUN_TIMER_DEFAULT_TIMEOUT;
@@ -811,6 +1147,8 @@ nice_agent_init (NiceAgent * agent)
   agent->aggressive_mode = TRUE;
   agent->regular_nomination_timeout =
       NICE_AGENT_REGULAR_NOMINATION_TIMEOUT_DEFAULT;
+  agent->turn_queue_size = NICE_AGENT_TURN_QUEUE_SIZE_DEFAULT;
+  agent->turn_queue_drop_oldest = TRUE;
 
   agent->discovery_list = NULL;
   agent->discovery_unsched_items = 0;
@@ -818,7 +1156,7 @@ nice_agent_init (NiceAgent * agent)
   agent->conncheck_timer_source = NULL;
   agent->keepalive_timer_source = NULL;
   agent->refresh_list = NULL;
-  agent->media_after_tick = FALSE;
+  g_atomic_int_set (&agent->media_after_tick, FALSE);
   agent->software_attribute = NULL;
   agent->reliable_transport_events = g_queue_new ();
   agent->event_source = NULL;
@@ -835,6 +1173,15 @@ nice_agent_init (NiceAgent * agent)
   agent->override_tie_breaker = FALSE;
 
   g_rec_mutex_init (&agent->agent_mutex);
+  g_mutex_init (&agent->send_pairs_mutex);
+  g_cond_init (&agent->send_pairs_cond);
+  agent->send_pairs = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+      NULL, (GDestroyNotify) selected_pair_snapshot_unref);
+  agent->stun_transactions = g_hash_table_new (priv_stun_transaction_hash,
+      priv_stun_transaction_equal);
+  agent->stun_transaction_slots = g_hash_table_new_full (g_direct_hash,
+      g_direct_equal, NULL,
+      (GDestroyNotify) priv_stun_transaction_entry_free);
 }
 
 
@@ -954,6 +1301,35 @@ nice_agent_get_property (GObject * object,
       g_value_set_uint64 (value, agent->tie_breaker);
       break;
 
+    case PROP_UDP_OFFLOAD:
+      g_value_set_boolean (value, agent->udp_offload);
+      break;
+
+    case PROP_DEMUX_MISCLASSIFIED:
+      g_value_set_uint64 (value, agent->demux_misclassified);
+      break;
+
+    case PROP_TURN_QUEUE_SIZE:
+      g_value_set_uint (value, agent->turn_queue_size);
+      break;
+
+    case PROP_TURN_QUEUE_DROP_OLDEST:
+      g_value_set_boolean (value, agent->turn_queue_drop_oldest);
+      break;
+
+    case PROP_TURN_QUEUED_BYTES:
+      g_value_set_uint64 (value, agent->turn_queued_bytes);
+      break;
+
+    case PROP_TURN_DROPPED_BYTES:
+      g_value_set_uint64 (value, agent->turn_dropped_bytes);
+      break;
+
+    case PROP_TURN_REFRESH_LOAD:
+      g_value_set_uint (value,
+          nice_timer_count_refreshes (agent->main_context, 60 * 1000));
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
   }
@@ -962,6 +1338,28 @@ nice_agent_get_property (GObject * object,
 }
 
 
+/*
+ * Parses the stun-server properties once for all the components that don't
+ * have a STUN server of their own.
+ */
+static void
+priv_update_stun_server (NiceAgent * agent)
+{
+  GSList *i, *j;
+
+  nice_address_init (&agent->stun_server);
+  if (agent->stun_server_ip &&
+      nice_address_set_from_string (&agent->stun_server, agent->stun_server_ip))
+    nice_address_set_port (&agent->stun_server, agent->stun_server_port);
+
+  for (i = agent->streams; i; i = i->next) {
+    Stream *stream = i->data;
+
+    for (j = stream->components; j; j = j->next)
+      component_update_servers (agent, j->data);
+  }
+}
+
 static void
 nice_agent_set_property (GObject * object,
     guint property_id, const GValue * value, GParamSpec * pspec)
@@ -1002,10 +1400,12 @@ nice_agent_set_property (GObject * object,
     case PROP_STUN_SERVER:
       g_free (agent->stun_server_ip);
       agent->stun_server_ip = g_value_dup_string (value);
+      priv_update_stun_server (agent);
       break;
 
     case PROP_STUN_SERVER_PORT:
       agent->stun_server_port = g_value_get_uint (value);
+      priv_update_stun_server (agent);
       break;
 
     case PROP_CONTROLLING_MODE:
@@ -1074,6 +1474,18 @@ nice_agent_set_property (GObject * object,
       agent->tie_breaker = g_value_get_uint64 (value);
       break;
 
+    case PROP_UDP_OFFLOAD:
+      agent->udp_offload = g_value_get_boolean (value);
+      break;
+
+    case PROP_TURN_QUEUE_SIZE:
+      agent->turn_queue_size = g_value_get_uint (value);
+      break;
+
+    case PROP_TURN_QUEUE_DROP_OLDEST:
+      agent->turn_queue_drop_oldest = g_value_get_boolean (value);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
   }
@@ -1424,6 +1836,7 @@ NICEAPI_EXPORT guint
 nice_agent_add_stream (NiceAgent * agent, guint n_components)
 {
   Stream *stream;
+  GSList *i;
   guint ret = 0;
 
   agent_lock (agent);
@@ -1436,6 +1849,9 @@ nice_agent_add_stream (NiceAgent * agent, guint n_components)
 
   stream_initialize_credentials (stream, agent->rng);
 
+  for (i = stream->components; i; i = i->next)
+    component_update_servers (agent, i->data);
+
   ret = stream->id;
 
   agent_unlock (agent);
@@ -1498,7 +1914,10 @@ nice_agent_set_relay_info (NiceAgent * agent,
     GST_DEBUG_OBJECT (agent, "added relay server [%s]:%d of type %d",
         server_ip, server_port, type);
 
+    stream_lock (component->stream);
     component->turn_servers = g_list_append (component->turn_servers, turn);
+    stream_unlock (component->stream);
+    component_update_servers (agent, component);
   }
 
   agent_unlock (agent);
@@ -1521,6 +1940,7 @@ nice_agent_set_stun_info (NiceAgent * agent,
     g_free (component->stun_server_ip);
     component->stun_server_ip = g_strdup (stun_server_ip);
     component->stun_server_port = stun_server_port;
+    component_update_servers (agent, component);
   }
 
   agent_unlock (agent);
@@ -1812,6 +2232,7 @@ error:
 
   if (ret == FALSE) {
     priv_free_upnp (agent);
+    agent_clear_send_pairs (agent, stream);
     for (n = 0; n < stream->n_components; n++) {
       Component *component = stream_find_component_by_id (stream, n + 1);
 
@@ -1846,8 +2267,7 @@ static void
 priv_remove_keepalive_timer (NiceAgent * agent)
 {
   if (agent->keepalive_timer_source != NULL) {
-    g_source_destroy (agent->keepalive_timer_source);
-    g_source_unref (agent->keepalive_timer_source);
+    nice_timer_cancel (agent->keepalive_timer_source);
     agent->keepalive_timer_source = NULL;
   }
 }
@@ -1873,6 +2293,7 @@ nice_agent_remove_stream (NiceAgent * agent, guint stream_id)
 
   /* remove the stream itself */
   agent->streams = g_slist_remove (agent->streams, stream);
+  agent_clear_send_pairs (agent, stream);
   stream_free (stream);
 
   if (!agent->streams)
@@ -2222,8 +2643,6 @@ priv_add_remote_candidate (NiceAgent * agent,
     /* case 2: add a new candidate */
 
     candidate = nice_candidate_new (type);
-    component->remote_candidates = g_slist_append (component->remote_candidates,
-        candidate);
 
     candidate->stream_id = stream_id;
     candidate->component_id = component_id;
@@ -2260,6 +2679,8 @@ priv_add_remote_candidate (NiceAgent * agent,
       g_strlcpy (candidate->foundation, foundation,
           NICE_CANDIDATE_MAX_FOUNDATION);
 
+    component_add_remote_candidate (component, candidate);
+
     /*
      * Don't pair up remote peer reflexive candidates (RFC 5245 Section 7.2.1.3)
      */
@@ -2287,6 +2708,7 @@ nice_agent_set_remote_credentials (NiceAgent * agent,
 
     g_strlcpy (stream->remote_ufrag, ufrag, NICE_STREAM_MAX_UFRAG);
     g_strlcpy (stream->remote_password, pwd, NICE_STREAM_MAX_PWD);
+    stream_update_hmac_keys (stream);
 
     ret = TRUE;
     goto done;
@@ -2341,6 +2763,7 @@ nice_agent_set_local_credentials (NiceAgent * agent,
 
     g_strlcpy (stream->local_ufrag, ufrag, NICE_STREAM_MAX_UFRAG);
     g_strlcpy (stream->local_password, pwd, NICE_STREAM_MAX_PWD);
+    stream_update_hmac_keys (stream);
 
     ret = TRUE;
     goto done;
@@ -2426,24 +2849,58 @@ _nice_should_have_padding (NiceCompatibility compatibility)
   }
 }
 
+/*
+ * Whether the STUN messages coming from a source of @server_class carry
+ * the RFC 5389 magic cookie, which the demultiplexing can then rely on.
+ */
+static gboolean
+_nice_should_have_cookie (NiceAgent * agent, ComponentServerClass server_class)
+{
+  if (server_class != COMPONENT_SERVER_NONE)
+    return agent->turn_compatibility == NICE_COMPATIBILITY_RFC5245;
+  else
+    return agent->compatibility == NICE_COMPATIBILITY_RFC5245;
+}
+
+/*
+ * Returns TRUE if @buf holds a complete STUN message. Packets that aren't
+ * STUN by their first byte skip the parser; those that are but fail the
+ * cookie or length checks are counted as misclassified. Called with the
+ * agent lock held.
+ */
+static gboolean
+_nice_agent_is_stun (NiceAgent * agent, ComponentServerClass server_class,
+    gboolean has_padding, const gchar * buf, gint len)
+{
+  StunMessageDemux demux;
+
+  demux = stun_message_demux ((const uint8_t *) buf, (size_t) len,
+      _nice_should_have_cookie (agent, server_class));
+
+  if (demux == STUN_MESSAGE_DEMUX_STUN &&
+      stun_message_validate_buffer_length ((const uint8_t *) buf,
+          (size_t) len, has_padding) == len)
+    return TRUE;
+
+  if (demux == STUN_MESSAGE_DEMUX_STUN || demux == STUN_MESSAGE_DEMUX_INVALID)
+    agent->demux_misclassified++;
+
+  return FALSE;
+}
+
+/*
+ * Processes a datagram freshly read from @socket: lets TURN decapsulate it,
+ * handles STUN and checks the source. Returns the length of the application
+ * data left in @buf, or 0 if the packet was consumed or dropped.
+ */
 static gint
-_nice_agent_recv (NiceAgent * agent,
+_nice_agent_process_recv (NiceAgent * agent,
     Stream * stream,
     Component * component,
-    NiceSocket * socket, guint buf_len, gchar * buf, NiceAddress * from)
+    NiceSocket * socket, gint len, gchar * buf, NiceAddress * from)
 {
-  gint len;
-  GList *item;
   gboolean has_padding = _nice_should_have_padding (agent->compatibility);
-  NiceAddress stun_server;
-  gboolean found_server = FALSE;
-  gchar *stun_server_ip = NULL;
-  guint stun_server_port;
-
-  len = nice_socket_recv (socket, from, buf_len, buf);
-
-  if (len <= 0)
-    return len;
+  ComponentServerClass server_class;
 
 #ifndef NDEBUG
   if (len > 0) {
@@ -2457,85 +2914,47 @@ _nice_agent_recv (NiceAgent * agent,
   }
 #endif
 
-
-  if ((guint) len > buf_len) {
-    /* buffer is not big enough to accept this packet */
-    /* XXX: test this case */
-    return 0;
-  }
+  server_class = component_classify_source (component, from);
 
   /*
    * If the packet comes from a relayed candidate then let the turn socket
    * have first crack at it
    */
-  for (item = component->turn_servers; item; item = g_list_next (item)) {
-    TurnServer *turn = item->data;
-
-    if (nice_address_equal (from, &turn->server)) {
-      GSList *i = NULL;
+  if (server_class & COMPONENT_SERVER_TURN) {
+    GSList *i = NULL;
 
 #ifndef NDEBUG
-      GST_LOG_OBJECT (agent, "Packet received from TURN server candidate");
+    GST_LOG_OBJECT (agent, "Packet received from TURN server candidate");
 #endif
-      for (i = component->local_candidates; i; i = i->next) {
-        NiceCandidate *cand = i->data;
-        if (cand->type == NICE_CANDIDATE_TYPE_RELAYED &&
-            cand->stream_id == stream->id &&
-            cand->component_id == component->id) {
-          len = nice_turn_socket_parse_recv (cand->sockptr, &socket,
-              from, len, buf, from, buf, len);
-        }
+    for (i = component->local_candidates; i; i = i->next) {
+      NiceCandidate *cand = i->data;
+      if (cand->type == NICE_CANDIDATE_TYPE_RELAYED &&
+          cand->stream_id == stream->id &&
+          cand->component_id == component->id) {
+        len = nice_turn_socket_parse_recv (cand->sockptr, &socket,
+            from, len, buf, from, buf, len);
       }
-      break;
     }
+    /* @from is now the peer that sent the data indication */
+    server_class = component_classify_source (component, from);
   }
 
   /*
    * Now that the packet has been decapsulated from any data indication figure out the correct
    * padding based on compatibility mode
    */
-  if (component->stun_server_ip != NULL) {
-    stun_server_ip = component->stun_server_ip;
-    stun_server_port = component->stun_server_port;
-  } else {
-    stun_server_ip = agent->stun_server_ip;
-    stun_server_port = agent->stun_server_port;
-  }
-
-  if (stun_server_ip
-      && nice_address_set_from_string (&stun_server, stun_server_ip)) {
-    nice_address_set_port (&stun_server, stun_server_port);
-    if (nice_address_equal (from, &stun_server)) {
-      has_padding = _nice_should_have_padding (agent->turn_compatibility);
-#ifndef NDEBUG
-      GST_LOG_OBJECT (agent, "Packet received from STUN server, has_padding=%d",
-          has_padding);
-#endif
-      found_server = TRUE;
-    }
-  }
-
-  if (!found_server) {
-    for (item = component->turn_servers; item; item = g_list_next (item)) {
-      TurnServer *turn = item->data;
-
-      if (nice_address_equal (from, &turn->server)) {
-        has_padding = _nice_should_have_padding (agent->turn_compatibility);
+  if (server_class != COMPONENT_SERVER_NONE) {
+    has_padding = _nice_should_have_padding (agent->turn_compatibility);
 #ifndef NDEBUG
-        GST_LOG_OBJECT (agent,
-            "Packet received from TURN server, has_padding=%d", has_padding);
+    GST_LOG_OBJECT (agent, "Packet received from %s server, has_padding=%d",
+        (server_class & COMPONENT_SERVER_STUN) ? "STUN" : "TURN", has_padding);
 #endif
-      }
-    }
   }
 
-  agent->media_after_tick = TRUE;
+  g_atomic_int_set (&agent->media_after_tick, TRUE);
 
-  /* If the message’s stated length is equal to its actual length, it’s probably
-   * a STUN message; otherwise it’s probably data. */
   if (len > 0) {
-    if (stun_message_validate_buffer_length ((uint8_t *) buf, (size_t) len,
-            has_padding) == len) {
+    if (_nice_agent_is_stun (agent, server_class, has_padding, buf, len)) {
       if (conn_check_handle_inbound_stun (agent, stream, component, socket,
               from, buf, len))
         /* handled STUN message */
@@ -2553,13 +2972,160 @@ _nice_agent_recv (NiceAgent * agent,
           stream->id, component->id, address_str, nice_address_get_port (from));
       return 0;
     }
-    agent->media_after_tick = TRUE;
+    g_atomic_int_set (&agent->media_after_tick, TRUE);
   }
 
   /* unhandled STUN, pass to client */
   return len;
 }
 
+/*
+ * Runs each of the @n_messages received messages through
+ * _nice_agent_process_recv(); the messages carrying application data are
+ * moved to the front of @messages. Returns the number of those.
+ */
+static gint
+_nice_agent_process_recv_messages (NiceAgent * agent,
+    Stream * stream,
+    Component * component,
+    NiceSocket * socket, NiceInputMessage * messages, gint n_recvd)
+{
+  gint n_valid = 0;
+  gint i;
+
+  for (i = 0; i < n_recvd; i++) {
+    NiceInputMessage *message = &messages[i];
+    gint len = message->length;
+
+    if (len > 0)
+      len = _nice_agent_process_recv (agent, stream, component, socket, len,
+          message->buf, &message->from);
+
+    if (len > 0) {
+      message->length = len;
+      if (i != n_valid) {
+        NiceInputMessage tmp = messages[n_valid];
+
+        messages[n_valid] = *message;
+        *message = tmp;
+      }
+      n_valid++;
+    }
+  }
+
+  return n_valid;
+}
+
+/*
+ * Returns TRUE if none of the @n_messages received messages needs the
+ * agent: they can't be STUN by their first byte (RFC 7983) and weren't
+ * relayed by one of the TURN servers. Called with the stream lock held.
+ */
+static gboolean
+_nice_agent_messages_are_data (Component * component,
+    NiceInputMessage * messages, gint n_messages)
+{
+  gint i;
+
+  for (i = 0; i < n_messages; i++) {
+    NiceInputMessage *message = &messages[i];
+
+    if (message->length == 0)
+      continue;
+
+    if (stun_message_demux ((const uint8_t *) message->buf, message->length,
+            FALSE) == STUN_MESSAGE_DEMUX_STUN)
+      return FALSE;
+
+    if (component_classify_source (component, &message->from) &
+        COMPONENT_SERVER_TURN)
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+/*
+ * The part of _nice_agent_process_recv() left for plain data: drops the
+ * messages from unknown sources and moves the others to the front of
+ * @messages. Called with only the stream lock held.
+ */
+static gint
+_nice_agent_verify_data_messages (NiceAgent * agent,
+    Stream * stream,
+    Component * component,
+    NiceSocket * socket, NiceInputMessage * messages, gint n_recvd)
+{
+  gint n_valid = 0;
+  gint i;
+
+  for (i = 0; i < n_recvd; i++) {
+    NiceInputMessage *message = &messages[i];
+
+    if (message->length == 0)
+      continue;
+
+    if (!nice_component_verify_remote_candidate (component, &message->from,
+            socket)) {
+      gchar address_str[INET6_ADDRSTRLEN];
+      nice_address_to_string (&message->from, address_str);
+      GST_LOG_OBJECT (agent, "%u/%u: Dropping packet from unknown source : %s:%d",
+          stream->id, component->id, address_str,
+          nice_address_get_port (&message->from));
+      continue;
+    }
+
+    if (i != n_valid) {
+      NiceInputMessage tmp = messages[n_valid];
+
+      messages[n_valid] = *message;
+      *message = tmp;
+    }
+    n_valid++;
+  }
+
+  if (n_valid > 0)
+    g_atomic_int_set (&agent->media_after_tick, TRUE);
+
+  return n_valid;
+}
+
+/*
+ * Receives one datagram from a GRO enabled UDP socket into @buf and splits
+ * it into its segments before any STUN/TURN demultiplexing, as every
+ * segment is a packet of its own. The messages point into @buf.
+ */
+static gint
+_nice_agent_recv_segmented (NiceSocket * socket, guint buf_len, gchar * buf,
+    NiceInputMessage * messages, guint n_messages)
+{
+  NiceAddress from;
+  guint segment_size = 0;
+  guint offset;
+  guint n = 0;
+  gint len;
+
+  len = nice_udp_bsd_socket_recv_segmented (socket, &from, buf_len, buf,
+      &segment_size);
+  if (len <= 0)
+    return len;
+
+  if (segment_size == 0)
+    segment_size = len;
+
+  for (offset = 0; offset < (guint) len && n < n_messages;
+      offset += segment_size) {
+    NiceInputMessage *message = &messages[n++];
+
+    message->buf = buf + offset;
+    message->size = MIN (segment_size, len - offset);
+    message->length = message->size;
+    message->from = from;
+  }
+
+  return n;
+}
+
 
 NICEAPI_EXPORT gint
 nice_agent_send (NiceAgent * agent,
@@ -2567,8 +3133,20 @@ nice_agent_send (NiceAgent * agent,
 {
   Stream *stream;
   Component *component;
+  SelectedPairSnapshot *pair;
   gint ret = -1;
 
+  /* Fast path: established UDP components don't need the agent lock */
+  pair = agent_get_send_pair (agent, stream_id, component_id);
+  if (pair) {
+    GST_LOG_OBJECT (agent, "%u/%u: sending %d bytes", stream_id,
+        component_id, len);
+    ret = nice_udp_bsd_socket_send_to_sockaddr (pair->socket,
+        (struct sockaddr *) &pair->sockaddr, pair->sockaddr_len, len, buf);
+    agent_put_send_pair (agent, pair);
+    return ret;
+  }
+
   agent_lock (agent);
 
   if (agent_find_component (agent, stream_id, component_id, &stream, &component)
@@ -2593,6 +3171,51 @@ nice_agent_send (NiceAgent * agent,
   return ret;
 }
 
+NICEAPI_EXPORT gint
+nice_agent_send_messages (NiceAgent * agent,
+    guint stream_id, guint component_id,
+    const NiceOutputMessage * messages, guint n_messages)
+{
+  Stream *stream;
+  Component *component;
+  SelectedPairSnapshot *pair;
+  gint ret = -1;
+
+  pair = agent_get_send_pair (agent, stream_id, component_id);
+  if (pair) {
+    GST_LOG_OBJECT (agent, "%u/%u: sending %u messages", stream_id,
+        component_id, n_messages);
+    ret = nice_udp_bsd_socket_send_messages_to_sockaddr (pair->socket,
+        (struct sockaddr *) &pair->sockaddr, pair->sockaddr_len, messages,
+        n_messages);
+    agent_put_send_pair (agent, pair);
+    return ret;
+  }
+
+  agent_lock (agent);
+
+  if (agent_find_component (agent, stream_id, component_id, &stream, &component)
+      && component->selected_pair.local != NULL) {
+    NiceSocket *sock = component->selected_pair.local->sockptr;
+    NiceAddress *addr = &component->selected_pair.remote->addr;
+
+    if (sock) {
+#ifndef NDEBUG
+      gchar tmpbuf[INET6_ADDRSTRLEN];
+      nice_address_to_string (addr, tmpbuf);
+
+      GST_LOG_OBJECT (agent, "%u/%u: sending %u messages to [%s]:%d",
+          stream_id, component_id, n_messages, tmpbuf,
+          nice_address_get_port (addr));
+#endif
+      ret = nice_socket_send_messages (sock, addr, messages, n_messages);
+    }
+  }
+
+  agent_unlock (agent);
+  return ret;
+}
+
 
 NICEAPI_EXPORT GSList *
 nice_agent_get_local_candidates (NiceAgent * agent,
@@ -2725,6 +3348,7 @@ nice_agent_dispose (GObject * object)
   for (i = agent->streams; i; i = i->next) {
     Stream *s = i->data;
 
+    agent_clear_send_pairs (agent, s);
     stream_free (s);
   }
 
@@ -2754,6 +3378,18 @@ nice_agent_dispose (GObject * object)
   agent_unlock (agent);
   g_assert (agent->agent_mutex_th == NULL);
   g_rec_mutex_clear (&agent->agent_mutex);
+  if (agent->send_pairs != NULL) {
+    g_hash_table_unref (agent->send_pairs);
+    agent->send_pairs = NULL;
+    g_cond_clear (&agent->send_pairs_cond);
+    g_mutex_clear (&agent->send_pairs_mutex);
+  }
+  if (agent->stun_transactions != NULL) {
+    g_hash_table_unref (agent->stun_transactions);
+    agent->stun_transactions = NULL;
+    g_hash_table_unref (agent->stun_transaction_slots);
+    agent->stun_transaction_slots = NULL;
+  }
 
   if (G_OBJECT_CLASS (nice_agent_parent_class)->dispose)
     G_OBJECT_CLASS (nice_agent_parent_class)->dispose (object);
@@ -2769,6 +3405,8 @@ struct _IOCtx
   Stream *stream;
   Component *component;
   NiceSocket *socket;
+  NiceInputMessage *messages;   /* batch receive slots, allocated on demand */
+  gchar *messages_buf;          /* backing storage of the receive slots */
 };
 
 
@@ -2781,7 +3419,7 @@ io_ctx_new (NiceAgent * agent,
 
   ctx = g_slice_new0 (IOCtx);
   ctx->agent = agent;
-  ctx->stream = stream;
+  ctx->stream = stream_ref (stream);
   ctx->component = component;
   ctx->socket = socket;
   ctx->source = source;
@@ -2792,9 +3430,37 @@ io_ctx_new (NiceAgent * agent,
 static void
 io_ctx_free (IOCtx * ctx)
 {
+  g_free (ctx->messages);
+  g_free (ctx->messages_buf);
+  stream_unref (ctx->stream);
   g_slice_free (IOCtx, ctx);
 }
 
+/*
+ * Returns the NICE_AGENT_MAX_RECV_MESSAGES receive slots of @ctx, reset to
+ * point at their own NICE_AGENT_RECV_MESSAGE_SIZE bytes of buffer (a
+ * previous batch may have reordered them).
+ */
+static NiceInputMessage *
+io_ctx_get_messages (IOCtx * ctx)
+{
+  guint i;
+
+  if (ctx->messages == NULL) {
+    ctx->messages = g_new0 (NiceInputMessage, NICE_AGENT_MAX_RECV_MESSAGES);
+    ctx->messages_buf = g_malloc (NICE_AGENT_MAX_RECV_MESSAGES *
+        NICE_AGENT_RECV_MESSAGE_SIZE);
+  }
+
+  for (i = 0; i < NICE_AGENT_MAX_RECV_MESSAGES; i++) {
+    ctx->messages[i].buf = ctx->messages_buf + i * NICE_AGENT_RECV_MESSAGE_SIZE;
+    ctx->messages[i].size = NICE_AGENT_RECV_MESSAGE_SIZE;
+    ctx->messages[i].length = 0;
+  }
+
+  return ctx->messages;
+}
+
 /*
  * Callback from non gsocket based NiceSockets when data received.
  */
@@ -2807,11 +3473,8 @@ nice_agent_socket_rx_cb (NiceSocket * socket, NiceAddress * from,
   Stream *stream = ctx->stream;
   Component *component = ctx->component;
   gboolean has_padding = _nice_should_have_padding (agent->compatibility);
-  GList *item;
   gboolean is_stun = TRUE;
-  NiceAddress stun_server;
-  gchar *stun_server_ip = NULL;
-  guint stun_server_port;
+  ComponentServerClass server_class;
 
 
   if (len <= 0) {
@@ -2837,49 +3500,35 @@ nice_agent_socket_rx_cb (NiceSocket * socket, NiceAddress * from,
 #endif
 
   agent_lock (agent);
+  stream_lock (stream);
 
-  if (component->stun_server_ip != NULL) {
-    stun_server_ip = component->stun_server_ip;
-    stun_server_port = component->stun_server_port;
-  } else {
-    stun_server_ip = agent->stun_server_ip;
-    stun_server_port = agent->stun_server_port;
-  }
+  server_class = component_classify_source (component, from);
 
-  if (stun_server_ip
-      && nice_address_set_from_string (&stun_server, stun_server_ip)) {
-    nice_address_set_port (&stun_server, stun_server_port);
-    if (nice_address_equal (from, &stun_server)) {
+  if (nice_address_is_valid (&component->stun_server)) {
+    if (server_class & COMPONENT_SERVER_STUN) {
       has_padding = _nice_should_have_padding (agent->turn_compatibility);
     }
-  } else {
-    for (item = component->turn_servers; item; item = g_list_next (item)) {
-      TurnServer *turn = item->data;
-      if (nice_address_equal (from, &turn->server)) {
-        GSList *i = NULL;
-        has_padding = _nice_should_have_padding (agent->turn_compatibility);
+  } else if (server_class & COMPONENT_SERVER_TURN) {
+    GSList *i = NULL;
+    has_padding = _nice_should_have_padding (agent->turn_compatibility);
 
 #ifndef NDEBUG
-        GST_LOG_OBJECT (agent, "Packet received from TURN server candidate.");
+    GST_LOG_OBJECT (agent, "Packet received from TURN server candidate.");
 #endif
-        for (i = component->local_candidates; i; i = i->next) {
-          NiceCandidate *cand = i->data;
-          if (cand->type == NICE_CANDIDATE_TYPE_RELAYED &&
-              cand->stream_id == stream->id &&
-              cand->component_id == component->id) {
-            len = nice_turn_socket_parse_recv (cand->sockptr, &socket,
-                from, len, buf, from, buf, len);
-          }
-        }
-        break;
+    for (i = component->local_candidates; i; i = i->next) {
+      NiceCandidate *cand = i->data;
+      if (cand->type == NICE_CANDIDATE_TYPE_RELAYED &&
+          cand->stream_id == stream->id &&
+          cand->component_id == component->id) {
+        len = nice_turn_socket_parse_recv (cand->sockptr, &socket,
+            from, len, buf, from, buf, len);
       }
     }
   }
 
-  agent->media_after_tick = TRUE;
+  g_atomic_int_set (&agent->media_after_tick, TRUE);
 
-  if (stun_message_validate_buffer_length ((uint8_t *) buf, (size_t) len,
-          has_padding) != len) {
+  if (!_nice_agent_is_stun (agent, server_class, has_padding, buf, len)) {
     is_stun = FALSE;
   }
 
@@ -2897,6 +3546,7 @@ nice_agent_socket_rx_cb (NiceSocket * socket, NiceAddress * from,
       GST_LOG_OBJECT (agent, "%u/%u: Dropping packet from unknown source : %s:%d",
           stream->id, component->id, address_str, nice_address_get_port (from));
 
+      stream_unlock (stream);
       agent_unlock (agent);
       return;
     }
@@ -2907,12 +3557,29 @@ nice_agent_socket_rx_cb (NiceSocket * socket, NiceAddress * from,
       gint sid = stream->id;
       gint cid = component->id;
       NiceAgentRecvFunc callback = component->g_source_io_cb;
+      stream_unlock (stream);
       agent_unlock (agent);
       callback (agent, sid, cid, len, buf, cdata, from, &socket->addr);
+    } else if (component->g_source_messages_cb) {
+      gpointer cdata = component->data;
+      gint sid = stream->id;
+      gint cid = component->id;
+      NiceAgentRecvMessagesFunc callback = component->g_source_messages_cb;
+      NiceInputMessage message;
+
+      message.buf = buf;
+      message.size = len;
+      message.length = len;
+      message.from = *from;
+      stream_unlock (stream);
+      agent_unlock (agent);
+      callback (agent, sid, cid, 1, &message, cdata, &socket->addr);
     } else {
+      stream_unlock (stream);
       agent_unlock (agent);
     }
   } else {
+    stream_unlock (stream);
     agent_unlock (agent);
   }
 }
@@ -2996,6 +3663,22 @@ nice_agent_socket_tx_cb (NiceSocket * socket, gchar * buf, gint len,
   agent_unlock (agent);
 }
 
+/*
+ * Keeps the turn-queued-bytes and turn-dropped-bytes counters of the agent
+ * passed as @userdata to nice_turn_socket_new(). TURN sockets are only used
+ * with the agent lock held, which is what protects the counters.
+ */
+void
+nice_agent_turn_queue_cb (gint64 queued, guint64 dropped, gpointer userdata)
+{
+  NiceAgent *agent = userdata;
+
+  g_assert (agent->agent_mutex_th == g_thread_self ());
+
+  agent->turn_queued_bytes += queued;
+  agent->turn_dropped_bytes += dropped;
+}
+
 static gboolean
 nice_agent_g_source_cb (GSocket * gsocket,
     GIOCondition condition, gpointer data)
@@ -3004,44 +3687,118 @@ nice_agent_g_source_cb (GSocket * gsocket,
   NiceAgent *agent = ctx->agent;
   Stream *stream = ctx->stream;
   Component *component = ctx->component;
-  NiceAddress from;
+  NiceSocket *socket = ctx->socket;
+  NiceInputMessage segments[MAX_GRO_SEGMENTS];
+  NiceInputMessage *messages;
   gchar buf[MAX_BUFFER_SIZE];
+  gboolean agent_locked = FALSE;
   gint len;
 
-  agent_lock (agent);
+  /* The socket may only be looked at once the stream lock shows it is
+   * still there */
+  stream_lock (stream);
 
-  if (g_source_is_destroyed (g_main_current_source ())) {
-    agent_unlock (agent);
-    return FALSE;
+  if (g_source_is_destroyed (g_main_current_source ()))
+    goto destroyed;
+
+  /* Only UDP sockets may be read without the agent lock, the others keep
+   * state of their own the agent touches too */
+  if (socket->type != NICE_SOCKET_TYPE_UDP_BSD) {
+    stream_unlock (stream);
+    agent_lock (agent);
+    agent_locked = TRUE;
+    stream_lock (stream);
+
+    if (g_source_is_destroyed (g_main_current_source ()))
+      goto destroyed;
+  }
+
+  if (nice_udp_bsd_socket_has_gro (socket)) {
+    messages = segments;
+    len = _nice_agent_recv_segmented (socket, MAX_BUFFER_SIZE, buf, messages,
+        MAX_GRO_SEGMENTS);
+  } else if (component->g_source_messages_cb) {
+    messages = io_ctx_get_messages (ctx);
+    len = nice_socket_recv_messages (socket, messages,
+        NICE_AGENT_MAX_RECV_MESSAGES);
+  } else {
+    messages = segments;
+    messages->buf = buf;
+    messages->size = MAX_BUFFER_SIZE;
+    len = nice_socket_recv (socket, &messages->from, MAX_BUFFER_SIZE, buf);
+    if (len > 0) {
+      messages->length = len;
+      len = 1;
+    }
   }
 
-  len = _nice_agent_recv (agent, stream, component, ctx->socket,
-      MAX_BUFFER_SIZE, buf, &from);
+  if (len > 0) {
+    if (!agent_locked &&
+        !_nice_agent_messages_are_data (component, messages, len)) {
+      /* STUN or TURN traffic, take the locks in order */
+      stream_unlock (stream);
+      agent_lock (agent);
+      agent_locked = TRUE;
+      stream_lock (stream);
+
+      if (g_source_is_destroyed (g_main_current_source ()))
+        goto destroyed;
+    }
 
-  if (len > 0 && component->g_source_io_cb) {
+    if (agent_locked)
+      len = _nice_agent_process_recv_messages (agent, stream, component,
+          socket, messages, len);
+    else
+      len = _nice_agent_verify_data_messages (agent, stream, component,
+          socket, messages, len);
+  }
+
+  if (len > 0 && (component->g_source_messages_cb ||
+          component->g_source_io_cb)) {
     gpointer data = component->data;
     gint sid = stream->id;
     gint cid = component->id;
+    NiceAgentRecvMessagesFunc messages_cb = component->g_source_messages_cb;
     NiceAgentRecvFunc callback = component->g_source_io_cb;
-    /* Unlock the agent before calling the callback */
-    agent_unlock (agent);
-    callback (agent, sid, cid, len, buf, data, &from, &ctx->socket->addr);
-    goto done;
-  } else if (len < 0) {
+    gint i;
+
+    /* Unlock once for the whole batch before calling the callback */
+    stream_unlock (stream);
+    if (agent_locked)
+      agent_unlock (agent);
+
+    if (messages_cb) {
+      messages_cb (agent, sid, cid, len, messages, data, &socket->addr);
+    } else {
+      for (i = 0; i < len; i++)
+        callback (agent, sid, cid, messages[i].length, messages[i].buf, data,
+            &messages[i].from, &socket->addr);
+    }
+    return TRUE;
+  }
+
+  if (len < 0) {
     GSource *source = ctx->source;
 
-    GST_WARNING_OBJECT (agent, "_nice_agent_recv returned %d, errno (%d) : %s",
+    GST_WARNING_OBJECT (agent, "nice_socket_recv returned %d, errno (%d) : %s",
         len, errno, g_strerror (errno));
     component->gsources = g_slist_remove (component->gsources, source);
     g_source_destroy (source);
     g_source_unref (source);
   }
 
-  agent_unlock (agent);
-
-done:
+  stream_unlock (stream);
+  if (agent_locked)
+    agent_unlock (agent);
 
   return TRUE;
+
+destroyed:
+  stream_unlock (stream);
+  if (agent_locked)
+    agent_unlock (agent);
+
+  return FALSE;
 }
 
 /*
@@ -3057,6 +3814,9 @@ agent_attach_stream_component_socket (NiceAgent * agent,
 
   nice_socket_attach (socket, component->ctx);
 
+  if (agent->udp_offload && socket->type == NICE_SOCKET_TYPE_UDP_BSD)
+    nice_udp_bsd_socket_set_offload (socket, TRUE);
+
   if (!component->ctx)
     return;
 
@@ -3071,7 +3831,9 @@ agent_attach_stream_component_socket (NiceAgent * agent,
     GST_DEBUG_OBJECT (agent, "%u/%u: Attach source %p ctx %p", stream->id,
         component->id, source, component->ctx);
     g_source_attach (source, component->ctx);
+    stream_lock (stream);
     component->gsources = g_slist_append (component->gsources, source);
+    stream_unlock (stream);
   } else {
     GST_DEBUG_OBJECT (agent, "%u/%u: Source has no fileno", stream->id,
         component->id);
@@ -3107,6 +3869,8 @@ priv_detach_stream_component (NiceAgent * agent, Stream * stream,
 {
   GSList *i;
 
+  stream_lock (stream);
+
   for (i = component->gsources; i; i = i->next) {
     GSource *source = i->data;
     GST_DEBUG_OBJECT (agent, "%u/%u: Detach source %p ", stream->id,
@@ -3117,13 +3881,16 @@ priv_detach_stream_component (NiceAgent * agent, Stream * stream,
 
   g_slist_free (component->gsources);
   component->gsources = NULL;
+
+  stream_unlock (stream);
 }
 
-NICEAPI_EXPORT gboolean
-nice_agent_attach_recv (NiceAgent * agent,
+static gboolean
+priv_attach_recv (NiceAgent * agent,
     guint stream_id,
     guint component_id,
-    GMainContext * ctx, NiceAgentRecvFunc func, gpointer data)
+    GMainContext * ctx, NiceAgentRecvFunc func,
+    NiceAgentRecvMessagesFunc messages_func, gpointer data)
 {
   Component *component = NULL;
   Stream *stream = NULL;
@@ -3141,32 +3908,57 @@ nice_agent_attach_recv (NiceAgent * agent,
     goto done;
   }
 
-  if (component->g_source_io_cb)
+  if (component->g_source_io_cb || component->g_source_messages_cb)
     priv_detach_stream_component (agent, stream, component);
 
   ret = TRUE;
 
+  stream_lock (stream);
   component->g_source_io_cb = NULL;
+  component->g_source_messages_cb = NULL;
   component->data = NULL;
   if (component->ctx)
     g_main_context_unref (component->ctx);
   component->ctx = NULL;
 
-  if (func) {
+  if (func || messages_func) {
     component->g_source_io_cb = func;
+    component->g_source_messages_cb = messages_func;
     component->data = data;
     component->ctx = ctx;
     if (ctx)
       g_main_context_ref (ctx);
+  }
+  stream_unlock (stream);
 
+  if (func || messages_func)
     priv_attach_stream_component (agent, stream, component);
-  }
 
 done:
   agent_unlock (agent);
   return ret;
 }
 
+NICEAPI_EXPORT gboolean
+nice_agent_attach_recv (NiceAgent * agent,
+    guint stream_id,
+    guint component_id,
+    GMainContext * ctx, NiceAgentRecvFunc func, gpointer data)
+{
+  return priv_attach_recv (agent, stream_id, component_id, ctx, func, NULL,
+      data);
+}
+
+NICEAPI_EXPORT gboolean
+nice_agent_attach_recv_messages (NiceAgent * agent,
+    guint stream_id,
+    guint component_id,
+    GMainContext * ctx, NiceAgentRecvMessagesFunc func, gpointer data)
+{
+  return priv_attach_recv (agent, stream_id, component_id, ctx, NULL, func,
+      data);
+}
+
 
 NICEAPI_EXPORT gboolean
 nice_agent_set_selected_pair (NiceAgent * agent,
@@ -3218,20 +4010,20 @@ done:
 }
 
 
-GSource *
+NiceTimer *
 agent_timeout_add_with_context (NiceAgent * agent, guint interval,
     GSourceFunc function, gpointer data)
 {
-  GSource *source;
-
-  g_return_val_if_fail (function != NULL, NULL);
-
-  source = g_timeout_source_new (interval);
-
-  g_source_set_callback (source, function, data, NULL);
-  g_source_attach (source, agent->main_context);
+  return nice_timer_add (agent->main_context, interval, function, data);
+}
 
-  return source;
+/* For TURN refreshes, which may fire a little early, see timer-wheel.h */
+NiceTimer *
+agent_refresh_timeout_add (NiceAgent * agent, guint interval,
+    GSourceFunc function, gpointer data)
+{
+  return nice_timer_add_refresh (agent->main_context, interval, function,
+      data);
 }
 
 
@@ -3380,7 +4172,9 @@ nice_agent_set_component_drop_unknown_address (
         stream_id,
         component_id,
         drop_unknown_address ? "TRUE" : "FALSE");
+    stream_lock (stream);
     component->fallback_mode = !drop_unknown_address;
+    stream_unlock (stream);
   }
 
 done:
@@ -99,6 +99,7 @@
 
 
 #include <glib-object.h>
+#include <gio/gio.h>
 
 /**
  * NiceAgent:
@@ -160,6 +161,22 @@ NICE_EXPORT GType nice_candidate_get_type (void);
  */
 #define NICE_AGENT_MAX_REMOTE_CANDIDATES    25
 
+/**
+ * NICE_AGENT_MAX_RECV_MESSAGES:
+ *
+ * The maximum number of datagrams delivered in one batch to a
+ * #NiceAgentRecvMessagesFunc.
+ */
+#define NICE_AGENT_MAX_RECV_MESSAGES        32
+
+/**
+ * NICE_AGENT_RECV_MESSAGE_SIZE:
+ *
+ * The size of the receive buffer of each datagram in a batch delivered
+ * to a #NiceAgentRecvMessagesFunc.
+ */
+#define NICE_AGENT_RECV_MESSAGE_SIZE        2048
+
 /**
  * NiceComponentState:
  * @NICE_COMPONENT_STATE_DISCONNECTED: No activity scheduled
@@ -264,6 +281,57 @@ typedef void (*NiceAgentRecvFunc) (
   NiceAgent *agent, guint stream_id, guint component_id, guint len,
   gchar *buf, gpointer user_data, const NiceAddress *from, const NiceAddress *to);
 
+/**
+ * NiceInputMessage:
+ * @buf: The buffer holding the datagram
+ * @size: The size of @buf in bytes
+ * @length: The number of valid bytes in @buf
+ * @from: The address the datagram was received from
+ *
+ * A single datagram of a batch delivered to a #NiceAgentRecvMessagesFunc.
+ */
+typedef struct
+{
+  gchar *buf;
+  guint size;
+  guint length;
+  NiceAddress from;
+} NiceInputMessage;
+
+/**
+ * NiceAgentRecvMessagesFunc:
+ * @agent: The #NiceAgent Object
+ * @stream_id: The id of the stream
+ * @component_id: The id of the component of the stream
+ *        which received the data
+ * @n_messages: The number of messages in @messages
+ * @messages: The datagrams received, in arrival order
+ * @user_data: The user data set in nice_agent_attach_recv_messages()
+ * @to: The local address the datagrams were received on
+ *
+ * Callback function when a batch of data packets is received on a component.
+ * The messages, and the buffers they point to, are only valid for the
+ * duration of the callback.
+ *
+ */
+typedef void (*NiceAgentRecvMessagesFunc) (
+  NiceAgent *agent, guint stream_id, guint component_id, guint n_messages,
+  NiceInputMessage *messages, gpointer user_data, const NiceAddress *to);
+
+/**
+ * NiceOutputMessage:
+ * @buffers: (array length=n_buffers): The buffers making up the packet,
+ * sent back to back as a single datagram
+ * @n_buffers: The number of buffers in @buffers
+ *
+ * A single packet of a batch sent with nice_agent_send_messages().
+ */
+typedef struct
+{
+  const GOutputVector *buffers;
+  guint n_buffers;
+} NiceOutputMessage;
+
 /**
  * nice_agent_new_full:
  * @ctx: The Glib Mainloop Context to use for timers
@@ -675,6 +743,32 @@ nice_agent_send (
   guint len,
   const gchar *buf);
 
+/**
+ * nice_agent_send_messages:
+ * @agent: The #NiceAgent Object
+ * @stream_id: The ID of the stream to send to
+ * @component_id: The ID of the component to send to
+ * @messages: (array length=n_messages): The packets to send
+ * @n_messages: The number of packets in @messages
+ *
+ * Sends several data packets over a stream's component in one go. The
+ * selected pair is resolved and the agent lock taken only once for the whole
+ * batch, and UDP sockets hand the batch to the kernel with a single
+ * sendmmsg() call where available.
+ *
+ * The same rules as for nice_agent_send() apply to every packet.
+ *
+ * Returns: The number of packets sent, which may be less than @n_messages if
+ * the socket buffer filled up, or -1 if nothing could be sent
+ */
+NICE_EXPORT gint
+nice_agent_send_messages (
+  NiceAgent *agent,
+  guint stream_id,
+  guint component_id,
+  const NiceOutputMessage *messages,
+  guint n_messages);
+
 /**
  * nice_agent_get_local_candidates:
  * @agent: The #NiceAgent Object
@@ -794,6 +888,39 @@ nice_agent_attach_recv (
   NiceAgentRecvFunc func,
   gpointer data);
 
+/**
+ * nice_agent_attach_recv_messages: (skip)
+ * @agent: The #NiceAgent Object
+ * @stream_id: The ID of stream
+ * @component_id: The ID of the component
+ * @ctx: The Glib Mainloop Context to use for listening on the component
+ * @func: The callback function to be called when data is received on
+ * the stream's component
+ * @data: user data associated with the callback
+ *
+ * Like nice_agent_attach_recv(), but every wakeup of the component's sockets
+ * drains up to #NICE_AGENT_MAX_RECV_MESSAGES datagrams at once (using
+ * recvmmsg() where available), processes them under a single acquisition of
+ * the agent lock and hands them to @func as one batch.
+ *
+ <note>
+   <para>
+     Datagrams larger than #NICE_AGENT_RECV_MESSAGE_SIZE bytes are dropped on
+     this path.
+   </para>
+ </note>
+ *
+ * Returns: %TRUE on success, %FALSE if the stream or component IDs are invalid.
+ */
+NICE_EXPORT gboolean
+nice_agent_attach_recv_messages (
+  NiceAgent *agent,
+  guint stream_id,
+  guint component_id,
+  GMainContext *ctx,
+  NiceAgentRecvMessagesFunc func,
+  gpointer data);
+
 /**
  * nice_agent_set_selected_pair:
  * @agent: The #NiceAgent Object
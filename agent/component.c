@@ -60,6 +60,32 @@
 GST_DEBUG_CATEGORY_EXTERN (niceagent_debug);
 #define GST_CAT_DEFAULT niceagent_debug
 
+static guint
+priv_remote_candidate_hash (gconstpointer key)
+{
+  const NiceCandidate *candidate = key;
+
+  return nice_address_hash (&candidate->addr) ^ candidate->transport;
+}
+
+static gboolean
+priv_remote_candidate_equal (gconstpointer a, gconstpointer b)
+{
+  return nice_candidate_equal_target (a, b);
+}
+
+static guint
+priv_address_hash (gconstpointer key)
+{
+  return nice_address_hash (key);
+}
+
+static gboolean
+priv_address_equal (gconstpointer a, gconstpointer b)
+{
+  return nice_address_equal (a, b);
+}
+
 Component *
 component_new (guint id)
 {
@@ -74,6 +100,15 @@ component_new (guint id)
   component->enable_tcp_active = FALSE;
   component->writable = TRUE;
   component->peer_gathering_done = FALSE;
+  component->remote_candidate_index = g_hash_table_new (
+      priv_remote_candidate_hash, priv_remote_candidate_equal);
+  g_queue_init (&component->valid_candidates);
+  component->valid_candidate_index = g_hash_table_new (
+      priv_address_hash, priv_address_equal);
+  nice_address_init (&component->stun_server);
+  component->server_classes = g_hash_table_new_full (
+      priv_address_hash, priv_address_equal,
+      (GDestroyNotify) nice_address_free, NULL);
   return component;
 }
 
@@ -84,6 +119,10 @@ component_free (Component *cmp)
   GSList *i;
   GList *item;
 
+  g_hash_table_destroy (cmp->remote_candidate_index);
+  g_hash_table_destroy (cmp->valid_candidate_index);
+  g_hash_table_destroy (cmp->server_classes);
+
   for (i = cmp->local_candidates; i; i = i->next) {
     NiceCandidate *candidate = i->data;
     nice_candidate_free (candidate);
@@ -115,8 +154,8 @@ component_free (Component *cmp)
     g_slice_free (IncomingCheck, icheck);
   }
 
-  g_list_free_full (cmp->valid_candidates,
-      (GDestroyNotify) nice_candidate_free);
+  g_queue_foreach (&cmp->valid_candidates, (GFunc) nice_candidate_free, NULL);
+  g_queue_clear (&cmp->valid_candidates);
 
   g_slist_free (cmp->local_candidates);
   g_slist_free (cmp->remote_candidates);
@@ -136,8 +175,7 @@ component_free (Component *cmp)
   cmp->stun_server_ip = NULL;
 
   if (cmp->selected_pair.keepalive.tick_source != NULL) {
-    g_source_destroy (cmp->selected_pair.keepalive.tick_source);
-    g_source_unref (cmp->selected_pair.keepalive.tick_source);
+    nice_timer_cancel (cmp->selected_pair.keepalive.tick_source);
     cmp->selected_pair.keepalive.tick_source = NULL;
   }
 
@@ -212,6 +250,7 @@ component_restart (Component *cmp)
   }
   g_slist_free (cmp->remote_candidates),
     cmp->remote_candidates = NULL;
+  g_hash_table_remove_all (cmp->remote_candidate_index);
 
   for (i = cmp->incoming_checks; i; i = i->next) {
     IncomingCheck *icheck = i->data;
@@ -238,8 +277,7 @@ void component_update_selected_pair (NiceAgent* agent, Component *component, Nic
   g_assert (remote);
 
   if (component->selected_pair.keepalive.tick_source != NULL) {
-    g_source_destroy (component->selected_pair.keepalive.tick_source);
-    g_source_unref (component->selected_pair.keepalive.tick_source);
+    nice_timer_cancel (component->selected_pair.keepalive.tick_source);
     component->selected_pair.keepalive.tick_source = NULL;
   }
 
@@ -251,6 +289,8 @@ void component_update_selected_pair (NiceAgent* agent, Component *component, Nic
 
   nice_component_add_valid_candidate (agent, component,
       remote);
+
+  component_publish_selected_pair (agent, component);
 }
 
 /*
@@ -262,18 +302,80 @@ void component_update_selected_pair (NiceAgent* agent, Component *component, Nic
 NiceCandidate *
 component_find_remote_candidate (const Component *component, const NiceAddress *addr, NiceCandidateTransport transport)
 {
-  GSList *i;
+  NiceCandidate key;
 
-  for (i = component->remote_candidates; i; i = i->next) {
-    NiceCandidate *candidate = i->data;
+  if (!nice_address_is_valid (addr))
+    return NULL;
 
-    if (nice_address_equal(&candidate->addr, addr) &&
-	candidate->transport == transport)
-      return candidate;
+  key.addr = *addr;
+  key.transport = transport;
+
+  return g_hash_table_lookup (component->remote_candidate_index, &key);
+}
+
+/*
+ * Appends @candidate, whose address and transport must not change anymore,
+ * to the remote candidates of @component. The component takes ownership.
+ */
+void
+component_add_remote_candidate (Component *component, NiceCandidate *candidate)
+{
+  component->remote_candidates = g_slist_append (component->remote_candidates,
+      candidate);
+
+  /* Lookups return the first candidate added for a given target, as the
+   * list walk used to */
+  if (nice_address_is_valid (&candidate->addr) &&
+      !g_hash_table_contains (component->remote_candidate_index, candidate))
+    g_hash_table_add (component->remote_candidate_index, candidate);
+}
+
+static void
+priv_add_server_class (Component *component, const NiceAddress *addr,
+    ComponentServerClass server_class)
+{
+  gpointer current;
+
+  current = g_hash_table_lookup (component->server_classes, addr);
+  g_hash_table_insert (component->server_classes, nice_address_dup (addr),
+      GUINT_TO_POINTER (GPOINTER_TO_UINT (current) | server_class));
+}
+
+/*
+ * Rebuilds the addresses of the STUN and TURN servers used by @component,
+ * so that receiving doesn't have to parse or compare against each of them.
+ * Must be called with the agent lock held whenever they change.
+ */
+void
+component_update_servers (NiceAgent *agent, Component *component)
+{
+  GList *item;
+
+  stream_lock (component->stream);
 
+  if (component->stun_server_ip != NULL) {
+    nice_address_init (&component->stun_server);
+    if (nice_address_set_from_string (&component->stun_server,
+            component->stun_server_ip))
+      nice_address_set_port (&component->stun_server,
+          component->stun_server_port);
+  } else {
+    component->stun_server = agent->stun_server;
   }
 
-  return NULL;
+  g_hash_table_remove_all (component->server_classes);
+
+  if (nice_address_is_valid (&component->stun_server))
+    priv_add_server_class (component, &component->stun_server,
+        COMPONENT_SERVER_STUN);
+
+  for (item = component->turn_servers; item; item = g_list_next (item)) {
+    TurnServer *turn = item->data;
+
+    priv_add_server_class (component, &turn->server, COMPONENT_SERVER_TURN);
+  }
+
+  stream_unlock (component->stream);
 }
 
 /*
@@ -340,14 +442,12 @@ component_set_selected_remote_candidate (NiceAgent *agent, Component *component,
 
   if (!remote) {
     remote = nice_candidate_copy (candidate);
-    component->remote_candidates = g_slist_append (component->remote_candidates,
-        remote);
+    component_add_remote_candidate (component, remote);
     agent_signal_new_remote_candidate (agent, remote);
   }
 
   if (component->selected_pair.keepalive.tick_source != NULL) {
-    g_source_destroy (component->selected_pair.keepalive.tick_source);
-    g_source_unref (component->selected_pair.keepalive.tick_source);
+    nice_timer_cancel (component->selected_pair.keepalive.tick_source);
     component->selected_pair.keepalive.tick_source = NULL;
   }
 
@@ -356,10 +456,14 @@ component_set_selected_remote_candidate (NiceAgent *agent, Component *component,
   component->selected_pair.remote = remote;
   component->selected_pair.priority = priority;
 
+  component_publish_selected_pair (agent, component);
+
   /* Get into fallback mode where packets from any source is accepted once
    * this has been called. This is the expected behavior of pre-ICE SIP.
    */
+  stream_lock (component->stream);
   component->fallback_mode = TRUE;
+  stream_unlock (component->stream);
 
   return local;
 }
@@ -378,19 +482,59 @@ const char* component_state_to_string(NiceComponentState state)
   return "(invalid)";
 }
 
+/*
+ * Points the address index at another valid candidate with the same address
+ * as the one in @link, which is about to go away, or drops the entry.
+ */
+static void
+priv_valid_candidate_index_remove (Component *component, GList *link)
+{
+  NiceCandidate *cand = link->data;
+  GList *item;
+
+  if (g_hash_table_lookup (component->valid_candidate_index, &cand->addr) !=
+      link)
+    return;
+
+  g_hash_table_remove (component->valid_candidate_index, &cand->addr);
+
+  for (item = component->valid_candidates.head; item; item = item->next) {
+    NiceCandidate *other = item->data;
+
+    if (item != link && nice_address_equal (&other->addr, &cand->addr)) {
+      g_hash_table_insert (component->valid_candidate_index, &other->addr,
+          item);
+      break;
+    }
+  }
+}
+
 void
 nice_component_add_valid_candidate (NiceAgent *agent, Component *component,
     const NiceCandidate *candidate)
 {
-  guint count = 0;
-  GList *item, *last = NULL;
+  GList *item;
 
-  for (item = component->valid_candidates; item; item = item->next) {
+  stream_lock (component->stream);
+
+  item = g_hash_table_lookup (component->valid_candidate_index,
+      &candidate->addr);
+  if (item) {
     NiceCandidate *cand = item->data;
-    last = item;
-    count++;
-    if (nice_candidate_equal_target (cand, candidate))
+
+    /* The same address over another transport only shares the index entry,
+     * which is rare enough to warrant a walk */
+    if (cand->transport == candidate->transport) {
+      stream_unlock (component->stream);
       return;
+    }
+
+    for (item = component->valid_candidates.head; item; item = item->next) {
+      if (nice_candidate_equal_target (item->data, candidate)) {
+        stream_unlock (component->stream);
+        return;
+      }
+    }
   }
 
   /* New candidate */
@@ -399,21 +543,33 @@ nice_component_add_valid_candidate (NiceAgent *agent, Component *component,
   GST_DEBUG_OBJECT (agent, "%u/%u: Adding valid source address %s:%d",
       candidate->stream_id, candidate->component_id, address_str, nice_address_get_port (&candidate->addr));
 
-  component->valid_candidates = g_list_prepend (
-      component->valid_candidates, nice_candidate_copy (candidate));
+  g_queue_push_head (&component->valid_candidates,
+      nice_candidate_copy (candidate));
+  item = component->valid_candidates.head;
+  if (!g_hash_table_contains (component->valid_candidate_index,
+          &candidate->addr))
+    g_hash_table_insert (component->valid_candidate_index,
+        &((NiceCandidate *) item->data)->addr, item);
 
   /* Delete the last one to make sure we don't have a list that is too long,
    * the candidates are not freed on ICE restart as this would be more complex,
    * we just keep the list not too long.
    */
-  if (count > NICE_COMPONENT_MAX_VALID_CANDIDATES) {
-    NiceCandidate *cand = last->data;
-    component->valid_candidates = g_list_delete_link (
-        component->valid_candidates, last);
-    nice_candidate_free (cand);
+  if (component->valid_candidates.length >
+      NICE_COMPONENT_MAX_VALID_CANDIDATES + 1) {
+    GList *last = component->valid_candidates.tail;
+
+    priv_valid_candidate_index_remove (component, last);
+    nice_candidate_free (g_queue_pop_tail (&component->valid_candidates));
   }
+
+  stream_unlock (component->stream);
 }
 
+/*
+ * Must be called with the stream lock held, it reorders the valid
+ * candidates.
+ */
 gboolean
 nice_component_verify_remote_candidate (Component *component,
     const NiceAddress *address, NiceSocket *nicesock)
@@ -423,24 +579,73 @@ nice_component_verify_remote_candidate (Component *component,
     return TRUE;
   }
 
-  for (item = component->valid_candidates; item; item = item->next) {
-    NiceCandidate *cand = item->data;
+  item = g_hash_table_lookup (component->valid_candidate_index, address);
+  if (item == NULL)
+    return FALSE;
+
+  /* Keep the list in most-recently-used order, the tail is what gets
+   * evicted when it grows too long */
+  if (item != component->valid_candidates.head) {
+    g_queue_unlink (&component->valid_candidates, item);
+    g_queue_push_head_link (&component->valid_candidates, item);
+  }
+  return TRUE;
+}
 
-    if (nice_address_equal (address, &cand->addr)) {
+/*
+ * Returns a snapshot of the pair @local -> @remote for the lock-free send
+ * path, or NULL if the local socket may only be written to with the agent
+ * lock held (TURN, TCP and friends keep state of their own).
+ */
+SelectedPairSnapshot *
+selected_pair_snapshot_new (NiceCandidate *local, NiceCandidate *remote)
+{
+  NiceSocket *sock = local->sockptr;
+  SelectedPairSnapshot *pair;
 
-      /* fast return if it's already the first */
-      if (item == component->valid_candidates)
-        return TRUE;
+  if (sock == NULL || sock->type != NICE_SOCKET_TYPE_UDP_BSD)
+    return NULL;
 
-      /* Put the current candidate at the top so that in the normal use-case,
-       * this function becomes O(1).
-       */
-      component->valid_candidates = g_list_remove_link (
-          component->valid_candidates, item);
-      component->valid_candidates = g_list_concat (item,
-          component->valid_candidates);
-      return TRUE;
-    }
-  }
-  return FALSE;
+  pair = g_slice_new0 (SelectedPairSnapshot);
+  pair->ref_count = 1;
+  pair->socket = sock;
+  pair->remote = remote->addr;
+  nice_address_copy_to_sockaddr (&remote->addr,
+      (struct sockaddr *) &pair->sockaddr);
+  pair->sockaddr_len = pair->sockaddr.ss_family == AF_INET6 ?
+      sizeof (struct sockaddr_in6) : sizeof (struct sockaddr_in);
+
+  return pair;
+}
+
+SelectedPairSnapshot *
+selected_pair_snapshot_ref (SelectedPairSnapshot *pair)
+{
+  g_atomic_int_inc (&pair->ref_count);
+  return pair;
+}
+
+void
+selected_pair_snapshot_unref (SelectedPairSnapshot *pair)
+{
+  if (g_atomic_int_dec_and_test (&pair->ref_count))
+    g_slice_free (SelectedPairSnapshot, pair);
+}
+
+/*
+ * Publishes the current selected pair of @component for
+ * nice_agent_send(), replacing the previous one.
+ */
+void
+component_publish_selected_pair (NiceAgent *agent, Component *component)
+{
+  CandidatePair *selected = &component->selected_pair;
+  SelectedPairSnapshot *pair = NULL;
+
+  if (selected->local == NULL || selected->remote == NULL)
+    return;
+
+  pair = selected_pair_snapshot_new (selected->local, selected->remote);
+  agent_set_send_pair (agent, selected->local->stream_id, component->id,
+      pair);
 }
@@ -50,6 +50,7 @@ typedef struct _Component Component;
 #include "stun/usages/timer.h"
 #include "stream.h"
 #include "socket.h"
+#include "timer-wheel.h"
 
 G_BEGIN_DECLS
 
@@ -68,11 +69,12 @@ typedef struct _IncomingCheck IncomingCheck;
 struct _CandidatePairKeepalive
 {
   NiceAgent *agent;
-  GSource *tick_source;
+  NiceTimer *tick_source;
   guint stream_id;
   guint component_id;
   StunTimer timer;
-  uint8_t stun_buffer[STUN_MAX_MESSAGE_SIZE];
+  /* only ever holds header-only binding indications */
+  uint8_t stun_buffer[STUN_MAX_MESSAGE_SIZE_IPV4];
   StunMessage stun_message;
 };
 
@@ -84,6 +86,23 @@ struct _CandidatePair
   CandidatePairKeepalive keepalive;
 };
 
+/*
+ * Immutable copy of what is needed to send on the selected pair of a
+ * component. It is published in the agent's send pair table so that
+ * nice_agent_send() can use it without taking the agent lock; only
+ * sockets that can be written to from any thread get one.
+ */
+typedef struct _SelectedPairSnapshot SelectedPairSnapshot;
+
+struct _SelectedPairSnapshot
+{
+  gint ref_count;
+  NiceSocket *socket;
+  NiceAddress remote;
+  struct sockaddr_storage sockaddr;  /**< prebuilt destination address */
+  socklen_t sockaddr_len;
+};
+
 struct _IncomingCheck
 {
   NiceAddress from;
@@ -100,25 +119,46 @@ typedef struct {
   Component *component;
 } TcpUserData;
 
+/* What a packet's source address is to a component, see
+ * component_classify_source() */
+typedef enum
+{
+  COMPONENT_SERVER_NONE = 0,
+  COMPONENT_SERVER_STUN = 1 << 0,
+  COMPONENT_SERVER_TURN = 1 << 1,
+} ComponentServerClass;
+
 struct _Component
 {
+  Stream *stream;              /**< owning stream, see stream_lock() */
   NiceComponentType type;
   guint id;                    /**< component id */
   NiceComponentState state;
   GSList *local_candidates;    /**< list of Candidate objs */
   GSList *remote_candidates;   /**< list of Candidate objs */
-  GList *valid_candidates;     /* list of owned remote NiceCandidates that are part of valid pairs */
+  GQueue valid_candidates;     /* owned remote NiceCandidates that are part
+                                  of valid pairs, most recently used first */
+  GHashTable *remote_candidate_index; /* set of remote_candidates, keyed on
+                                         address and transport */
+  GHashTable *valid_candidate_index;  /* address -> link in valid_candidates,
+                                         protected by the stream lock */
   GSList *sockets;             /**< list of NiceSocket objs */
   GSList *gsources;            /**< list of GSource objs */
   GSList *incoming_checks;     /**< list of IncomingCheck objs */
   GList *turn_servers;             /**< List of TURN servers */
   gchar *stun_server_ip;          /* STUN server IP */
   guint stun_server_port;         /* STUN server port */
+  NiceAddress stun_server;        /* the STUN server this component uses,
+                                     its own or the agent's, parsed */
+  GHashTable *server_classes;     /* NiceAddress -> ComponentServerClass of
+                                     the STUN and TURN servers, stream lock */
 
   CandidatePair selected_pair; /**< independent from checklists,
                                   see ICE 11.1. "Sending Media" (ID-19) */
   NiceCandidate *restart_candidate; /**< for storing active remote candidate during a restart */
   NiceAgentRecvFunc g_source_io_cb; /**< function called on io cb */
+  NiceAgentRecvMessagesFunc g_source_messages_cb; /**< function called on io
+                                                       cb with a batch */
   gpointer data;                    /**< data passed to the io function */
   GMainContext *ctx;                /**< context for data callbacks for this
                                        component */
@@ -152,6 +192,22 @@ component_update_selected_pair (NiceAgent *agent, Component *component, NiceCand
 NiceCandidate *
 component_find_remote_candidate (const Component *component, const NiceAddress *addr, NiceCandidateTransport transport);
 
+void
+component_add_remote_candidate (Component *component, NiceCandidate *candidate);
+
+void
+component_update_servers (NiceAgent *agent, Component *component);
+
+static inline ComponentServerClass
+component_classify_source (Component *component, const NiceAddress *from)
+{
+  if (g_hash_table_size (component->server_classes) == 0)
+    return COMPONENT_SERVER_NONE;
+
+  return GPOINTER_TO_UINT (g_hash_table_lookup (component->server_classes,
+          from));
+}
+
 NiceCandidate *
 component_find_local_candidate (const Component *component, const NiceAddress *addr, NiceCandidateTransport transport);
 
@@ -169,6 +225,18 @@ gboolean
 nice_component_verify_remote_candidate (Component *component,
     const NiceAddress *address, NiceSocket *nicesock);
 
+SelectedPairSnapshot *
+selected_pair_snapshot_new (NiceCandidate *local, NiceCandidate *remote);
+
+SelectedPairSnapshot *
+selected_pair_snapshot_ref (SelectedPairSnapshot *pair);
+
+void
+selected_pair_snapshot_unref (SelectedPairSnapshot *pair);
+
+void
+component_publish_selected_pair (NiceAgent *agent, Component *component);
+
 G_END_DECLS
 
 #endif /* _NICE_COMPONENT_H */
@@ -135,29 +135,20 @@ static void priv_print_check_list (NiceAgent* agent, Stream* stream, GSList* lis
 
 static void priv_print_stream_diagnostics (NiceAgent* agent, Stream* stream)
 {
-  guint state_count[NICE_CHECK_STATE_LAST + 1];
-  GSList *i;
-
-  memset (state_count, 0, sizeof(state_count));
-
   /*
    * Stream summary
    */
-  for (i = stream->conncheck_list; i ; i = i->next) {
-    CandidateCheckPair *p = i->data;
-
-    g_assert (p->state < sizeof(state_count)/sizeof(state_count[0]));
-    state_count[p->state]++;
-  }
-
   GST_DEBUG_OBJECT (agent, "%u/*: timer tick #%u: %u checks (frozen:%u, in-progress:%u, "
       "waiting:%u, succeeded:%u, "
       "failed:%u, cancelled:%u)",
       stream->id, stream->tick_counter,
-      g_slist_length(stream->conncheck_list),
-      state_count[NICE_CHECK_FROZEN], state_count[NICE_CHECK_IN_PROGRESS],
-      state_count[NICE_CHECK_WAITING], state_count[NICE_CHECK_SUCCEEDED],
-      state_count[NICE_CHECK_FAILED], state_count[NICE_CHECK_CANCELLED]);
+      stream->n_checks,
+      stream->n_checks_by_state[NICE_CHECK_FROZEN],
+      stream->n_checks_by_state[NICE_CHECK_IN_PROGRESS],
+      stream->n_checks_by_state[NICE_CHECK_WAITING],
+      stream->n_checks_by_state[NICE_CHECK_SUCCEEDED],
+      stream->n_checks_by_state[NICE_CHECK_FAILED],
+      stream->n_checks_by_state[NICE_CHECK_CANCELLED]);
 
   priv_print_check_list (agent, stream, stream->conncheck_list, "Check list");
   priv_print_check_list (agent, stream, stream->valid_list, "Valid list");
@@ -170,6 +161,126 @@ static int priv_timer_expired (GTimeVal *timer, GTimeVal *now)
     now->tv_sec >= timer->tv_sec;
 }
 
+G_STATIC_ASSERT (NICE_CHECK_STATE_LAST <
+    G_N_ELEMENTS (((Stream *) NULL)->n_checks_by_state));
+
+/*
+ * The WAITING pairs of a stream are kept in a binary max-heap ordered by
+ * priority, so that picking the next ordinary check does not have to scan
+ * the whole check list. Each pair remembers its own index in the heap.
+ */
+static void priv_waiting_heap_set (GPtrArray *heap, guint index, CandidateCheckPair *pair)
+{
+  g_ptr_array_index (heap, index) = pair;
+  pair->waiting_index = index;
+}
+
+static void priv_waiting_heap_sift_up (GPtrArray *heap, guint index)
+{
+  CandidateCheckPair *pair = g_ptr_array_index (heap, index);
+
+  while (index > 0) {
+    guint parent = (index - 1) / 2;
+    CandidateCheckPair *p = g_ptr_array_index (heap, parent);
+
+    if (p->priority >= pair->priority)
+      break;
+    priv_waiting_heap_set (heap, index, p);
+    index = parent;
+  }
+  priv_waiting_heap_set (heap, index, pair);
+}
+
+static void priv_waiting_heap_sift_down (GPtrArray *heap, guint index)
+{
+  CandidateCheckPair *pair = g_ptr_array_index (heap, index);
+
+  for (;;) {
+    guint child = 2 * index + 1;
+    CandidateCheckPair *c;
+
+    if (child >= heap->len)
+      break;
+    if (child + 1 < heap->len &&
+        ((CandidateCheckPair *) g_ptr_array_index (heap, child + 1))->priority >
+        ((CandidateCheckPair *) g_ptr_array_index (heap, child))->priority)
+      child++;
+    c = g_ptr_array_index (heap, child);
+    if (pair->priority >= c->priority)
+      break;
+    priv_waiting_heap_set (heap, index, c);
+    index = child;
+  }
+  priv_waiting_heap_set (heap, index, pair);
+}
+
+static void priv_waiting_heap_push (Stream *stream, CandidateCheckPair *pair)
+{
+  g_ptr_array_add (stream->waiting_checks, pair);
+  priv_waiting_heap_sift_up (stream->waiting_checks,
+      stream->waiting_checks->len - 1);
+}
+
+static void priv_waiting_heap_remove (Stream *stream, CandidateCheckPair *pair)
+{
+  GPtrArray *heap = stream->waiting_checks;
+  guint index = pair->waiting_index;
+  CandidateCheckPair *last;
+
+  g_assert (pair->waiting_index >= 0 && index < heap->len &&
+      g_ptr_array_index (heap, index) == pair);
+
+  pair->waiting_index = -1;
+  last = g_ptr_array_index (heap, heap->len - 1);
+  g_ptr_array_set_size (heap, heap->len - 1);
+  if (last == pair)
+    return;
+
+  priv_waiting_heap_set (heap, index, last);
+  priv_waiting_heap_sift_up (heap, index);
+  priv_waiting_heap_sift_down (heap, last->waiting_index);
+}
+
+/*
+ * Restores the heap property after the priorities of the pairs changed
+ */
+static void priv_waiting_heap_rebuild (Stream *stream)
+{
+  GPtrArray *heap = stream->waiting_checks;
+  guint i;
+
+  for (i = heap->len / 2; i > 0; i--)
+    priv_waiting_heap_sift_down (heap, i - 1);
+}
+
+/*
+ * Adds a new pair to the stream's check list, keeping the list sorted and
+ * the per-state accounting up to date.
+ */
+static void priv_check_list_add (Stream *stream, CandidateCheckPair *pair)
+{
+  stream->conncheck_list = g_slist_insert_sorted (stream->conncheck_list, pair,
+                                                  (GCompareFunc)conn_check_compare);
+  pair->in_check_list = TRUE;
+  stream->n_checks++;
+  stream->n_checks_by_state[pair->state]++;
+  if (pair->state == NICE_CHECK_WAITING)
+    priv_waiting_heap_push (stream, pair);
+}
+
+static void priv_check_list_remove (Stream *stream, CandidateCheckPair *pair)
+{
+  if (!pair->in_check_list)
+    return;
+
+  stream->conncheck_list = g_slist_remove (stream->conncheck_list, pair);
+  pair->in_check_list = FALSE;
+  stream->n_checks--;
+  stream->n_checks_by_state[pair->state]--;
+  if (pair->waiting_index >= 0)
+    priv_waiting_heap_remove (stream, pair);
+}
+
 static void priv_set_pair_state (NiceAgent* agent, CandidateCheckPair* pair, NiceCheckState new_state)
 {
   if (new_state == NICE_CHECK_SUCCEEDED && pair->valid_pair == NULL) {
@@ -187,6 +298,17 @@ static void priv_set_pair_state (NiceAgent* agent, CandidateCheckPair* pair, Nic
         pair->stream_id, pair->component_id,
         pair, pair->foundation,
         priv_state_to_string(pair->state), priv_state_to_string (new_state));
+
+    if (pair->in_check_list && pair->state != new_state) {
+      Stream *stream = agent_find_stream (agent, pair->stream_id);
+
+      stream->n_checks_by_state[pair->state]--;
+      stream->n_checks_by_state[new_state]++;
+      if (pair->state == NICE_CHECK_WAITING)
+        priv_waiting_heap_remove (stream, pair);
+      if (new_state == NICE_CHECK_WAITING)
+        priv_waiting_heap_push (stream, pair);
+    }
     pair->state = new_state;
   }
 }
@@ -195,6 +317,7 @@ static CandidateCheckPair* priv_alloc_check_pair (NiceAgent* agent, Stream* stre
 {
   CandidateCheckPair *pair = g_slice_new0 (CandidateCheckPair);
 
+  pair->waiting_index = -1;
   stream->conncheck_heap = g_slist_prepend (stream->conncheck_heap, pair);
 
   return pair;
@@ -237,25 +360,14 @@ static gboolean priv_conn_check_list_is_ordered (GSList *conn_check_list)
 }
 
 /*
- * Finds the next connectivity check in WAITING state
+ * Finds the highest priority connectivity check in WAITING state
  */
-static CandidateCheckPair *priv_conn_check_find_next_waiting (GSList *conn_check_list)
+static CandidateCheckPair *priv_conn_check_find_next_waiting (Stream *stream)
 {
-  GSList *i;
+  if (stream->waiting_checks->len == 0)
+    return NULL;
 
-  /*
-   * List is sorted in priority order to first waiting check has
-   * the highest priority
-   */
-  g_assert (priv_conn_check_list_is_ordered (conn_check_list));
-
-  for (i = conn_check_list; i ; i = i->next) {
-    CandidateCheckPair *p = i->data;
-    if (p->state == NICE_CHECK_WAITING)
-      return p;
-  }
-
-  return NULL;
+  return g_ptr_array_index (stream->waiting_checks, 0);
 }
 
 /*
@@ -263,18 +375,7 @@ static CandidateCheckPair *priv_conn_check_find_next_waiting (GSList *conn_check
  */
 static gboolean priv_check_list_is_frozen (NiceAgent* agent, Stream* stream)
 {
-  GSList* i;
-
-  for (i = stream->conncheck_list; i; i = g_slist_next(i)) {
-    CandidateCheckPair* pair = i->data;
-
-    g_assert (pair->stream_id == stream->id);
-
-    if (pair->state != NICE_CHECK_FROZEN) {
-      return FALSE;
-    }
-  }
-  return TRUE;
+  return stream->n_checks_by_state[NICE_CHECK_FROZEN] == stream->n_checks;
 }
 
 /*
@@ -400,6 +501,9 @@ static gboolean priv_conn_check_unfreeze_next (NiceAgent *agent)
   for (i = agent->streams; i; i = i->next) {
     Stream *stream = i->data;
 
+    if (stream->n_checks_by_state[NICE_CHECK_FROZEN] == 0)
+      continue;
+
     /* Check invariants */
     g_assert (priv_conn_check_list_is_ordered (stream->conncheck_list));
     g_assert (priv_conn_check_list_is_ordered (stream->valid_list));
@@ -906,7 +1010,7 @@ static gboolean priv_conn_check_tick_unlocked (gpointer pointer)
   for (i = agent->streams; i ; i = i->next) {
     Stream *stream = i->data;
 
-    pair = priv_conn_check_find_next_waiting (stream->conncheck_list);
+    pair = priv_conn_check_find_next_waiting (stream);
     if (pair)
       break;
   }
@@ -941,8 +1045,7 @@ static gboolean priv_conn_check_tick_unlocked (gpointer pointer)
        the timer to be reset if we get a set_remote_candidates after this
        point */
     if (agent->conncheck_timer_source != NULL) {
-      g_source_destroy (agent->conncheck_timer_source);
-      g_source_unref (agent->conncheck_timer_source);
+      nice_timer_cancel (agent->conncheck_timer_source);
       agent->conncheck_timer_source = NULL;
     }
 
@@ -958,7 +1061,7 @@ static gboolean priv_conn_check_tick (gpointer pointer)
   gboolean ret;
 
   agent_lock (agent);
-  if (g_source_is_destroyed (g_main_current_source ())) {
+  if (nice_timer_is_cancelled (nice_timer_current ())) {
     agent_unlock (agent);
     return FALSE;
   }
@@ -1084,7 +1187,7 @@ static gboolean priv_conn_keepalive_tick (gpointer pointer)
   gboolean ret;
 
   agent_lock (agent);
-  if (g_source_is_destroyed (g_main_current_source ())) {
+  if (nice_timer_is_cancelled (nice_timer_current ())) {
     agent_unlock (agent);
     return FALSE;
   }
@@ -1092,8 +1195,7 @@ static gboolean priv_conn_keepalive_tick (gpointer pointer)
   ret = priv_conn_keepalive_tick_unlocked (agent);
   if (ret == FALSE) {
     if (agent->keepalive_timer_source) {
-      g_source_destroy (agent->keepalive_timer_source);
-      g_source_unref (agent->keepalive_timer_source);
+      nice_timer_cancel (agent->keepalive_timer_source);
       agent->keepalive_timer_source = NULL;
     }
   }
@@ -1113,14 +1215,13 @@ static gboolean priv_turn_allocate_refresh_retransmissions_tick (gpointer pointe
    * and in the meantime another thread destroys the source.
    * In that case, we don't need to run our retransmission tick since it should
    * have been cancelled */
-  if (g_source_is_destroyed (g_main_current_source ())) {
+  if (nice_timer_is_cancelled (nice_timer_current ())) {
     agent_unlock (agent);
     return FALSE;
   }
 
 
-  g_source_destroy (cand->tick_source);
-  g_source_unref (cand->tick_source);
+  nice_timer_cancel (cand->tick_source);
   cand->tick_source = NULL;
 
   switch (stun_timer_refresh (&cand->timer)) {
@@ -1203,14 +1304,15 @@ static void priv_turn_allocate_refresh_tick_unlocked (CandidateRefresh *cand)
       cand->stream->id, cand->component->id, buffer_len);
 
   if (cand->tick_source != NULL) {
-    g_source_destroy (cand->tick_source);
-    g_source_unref (cand->tick_source);
+    nice_timer_cancel (cand->tick_source);
     cand->tick_source = NULL;
   }
 
   if (buffer_len > 0) {
     struct sockaddr_storage server_address;
 
+    agent_stun_transaction_add (cand->agent, &cand->stun_agent, cand,
+        &cand->stun_message);
     stun_timer_start (&cand->timer, STUN_TIMER_DEFAULT_TIMEOUT,
                       STUN_TIMER_DEFAULT_MAX_RETRANSMISSIONS);
 
@@ -1242,7 +1344,7 @@ static gboolean priv_turn_allocate_refresh_tick (gpointer pointer)
   NiceAgent *agent = cand->agent;
 
   agent_lock (agent);
-  if (g_source_is_destroyed (g_main_current_source ())) {
+  if (nice_timer_is_cancelled (nice_timer_current ())) {
     agent_unlock (agent);
     return FALSE;
   }
@@ -1711,7 +1813,7 @@ static void priv_add_pair_to_valid_list (NiceAgent *agent, Stream *stream, Compo
  */
 static void priv_delete_conncheck (Stream* stream, CandidateCheckPair* pair)
 {
-  stream->conncheck_list = g_slist_remove (stream->conncheck_list, pair);
+  priv_check_list_remove (stream, pair);
   stream->valid_list = g_slist_remove (stream->valid_list, pair);
   stream->conncheck_heap = g_slist_remove (stream->conncheck_heap, pair);
   conn_check_free_item (pair, NULL);
@@ -1724,16 +1826,14 @@ static void priv_delete_conncheck (Stream* stream, CandidateCheckPair* pair)
  */
 static void priv_limit_conn_check_list_size (NiceAgent *agent, Stream* stream, guint upper_limit)
 {
-  guint list_len = g_slist_length (stream->conncheck_list);
-
   g_assert (upper_limit > 0);
 
-  while (g_slist_length (stream->conncheck_list) > upper_limit) {
+  while (stream->n_checks > upper_limit) {
     GSList* item = NULL;
 
     GST_DEBUG_OBJECT (agent, "%u/*: Pruning candidates. Conncheck list has %d elements. "
         "Maximum connchecks allowed : %d",
-        stream->id, list_len, upper_limit);
+        stream->id, stream->n_checks, upper_limit);
 
     /*
      * Remove the lowest priority check pair
@@ -1764,13 +1864,12 @@ static void priv_add_new_check_pair (NiceAgent *agent, guint stream_id, Componen
   pair->nominated = use_candidate;
   pair->controlling = agent->controlling_mode;
 
-  stream->conncheck_list = g_slist_insert_sorted (stream->conncheck_list, pair,
-                                                  (GCompareFunc)conn_check_compare);
+  priv_check_list_add (stream, pair);
 
   GST_DEBUG_OBJECT (agent, "%u/%u: added a new conncheck %p foundation:'%s' state:%s use-cand:%d conncheck-count=%u",
       stream_id,
       component->id, pair, pair->foundation, priv_state_to_string(initial_state), use_candidate,
-      g_slist_length (stream->conncheck_list));
+      stream->n_checks);
 
   priv_print_check_list (agent, stream, stream->conncheck_list, "Check list");
 
@@ -1910,8 +2009,7 @@ void conn_check_prune_all_streams (NiceAgent *agent)
   }
 
   if (agent->conncheck_timer_source != NULL) {
-    g_source_destroy (agent->conncheck_timer_source);
-    g_source_unref (agent->conncheck_timer_source);
+    nice_timer_cancel (agent->conncheck_timer_source);
     agent->conncheck_timer_source = NULL;
   }
 }
@@ -1934,6 +2032,9 @@ void conn_check_prune_stream (NiceAgent *agent, Stream *stream)
     g_slist_free (stream->conncheck_list);
     stream->conncheck_list = NULL;
   }
+  stream->n_checks = 0;
+  memset (stream->n_checks_by_state, 0, sizeof (stream->n_checks_by_state));
+  g_ptr_array_set_size (stream->waiting_checks, 0);
   if (stream->valid_list) {
     g_slist_free (stream->valid_list);
     stream->valid_list = NULL;
@@ -2133,16 +2234,21 @@ int conn_check_send (NiceAgent *agent, CandidateCheckPair *pair)
       pair->foundation, priority, cand_use);
 
   if (uname_len > 0) {
+    Stream *stream = agent_find_stream (agent, pair->stream_id);
 
-    buffer_len = stun_usage_ice_conncheck_create (&agent->stun_agent,
-        &pair->stun_message, pair->stun_buffer, sizeof(pair->stun_buffer),
+    buffer_len = stun_usage_ice_conncheck_create_from_template_with_key (
+        &agent->stun_agent, &pair->stun_message,
+        pair->stun_buffer, sizeof(pair->stun_buffer), &pair->stun_template,
         uname, uname_len, password, password_len,
         pair->nominated, controlling, priority,
         agent->tie_breaker,
         priv_get_candidate_identifier (agent, pair),
-        agent_to_ice_compatibility (agent));
+        agent_to_ice_compatibility (agent),
+        stream ? &stream->remote_hmac_key : NULL);
 
     if (buffer_len > 0) {
+      agent_stun_transaction_add (agent, &agent->stun_agent, agent,
+          &pair->stun_message);
       stun_timer_start (&pair->timer, agent->conncheck_timeout, agent->conncheck_retransmissions);
 
       GST_DEBUG_OBJECT (agent, "%u/%u: Sending conncheck msg len=%u to %s",
@@ -2599,6 +2705,7 @@ void conn_check_recalculate_pair_priorities (NiceAgent *agent)
     }
     stream->conncheck_list = g_slist_sort(stream->conncheck_list, (GCompareFunc)conn_check_compare);
     stream->valid_list = g_slist_sort(stream->valid_list, (GCompareFunc)conn_check_compare);
+    priv_waiting_heap_rebuild (stream);
     priv_print_check_list (agent, stream, stream->conncheck_list, "Check list (after re-priorisation)");
     g_assert (priv_conn_check_list_is_ordered (stream->conncheck_list));
   }
@@ -3024,8 +3131,8 @@ priv_add_new_turn_refresh (CandidateDiscovery *cdisco, NiceCandidate *relay_cand
   /* step: also start the refresh timer */
   /* refresh should be sent 1 minute before it expires */
   cand->timer_source =
-    agent_timeout_add_with_context (agent, priv_turn_lifetime_to_refresh_interval(lifetime),
-                                    priv_turn_allocate_refresh_tick, cand);
+    agent_refresh_timeout_add (agent, priv_turn_lifetime_to_refresh_interval(lifetime),
+                               priv_turn_allocate_refresh_tick, cand);
 
   return cand;
 }
@@ -3179,6 +3286,7 @@ static gboolean priv_map_reply_to_relay_request (NiceAgent *agent, StunMessage *
                  !(recv_realm_len == sent_realm_len &&
                    sent_realm != NULL &&
                    memcmp (sent_realm, recv_realm, sent_realm_len) == 0))) {
+              stun_usage_turn_forget_credentials (&d->stun_message);
               d->stun_resp_msg = *resp;
               memcpy (d->stun_resp_buffer, resp->buffer,
                       stun_message_length (resp));
@@ -3250,13 +3358,15 @@ static gboolean priv_map_reply_to_relay_refresh (NiceAgent *agent, StunMessage *
         stun_message_log(resp, FALSE, (struct sockaddr *)&server_address);
 
         if (res == STUN_USAGE_TURN_RETURN_RELAY_SUCCESS) {
+          /* the timer that sent this refresh has fired but is still ours */
+          if (cand->timer_source != NULL)
+            nice_timer_cancel (cand->timer_source);
           /* refresh should be sent 1 minute before it expires */
           cand->timer_source =
-            agent_timeout_add_with_context (cand->agent, priv_turn_lifetime_to_refresh_interval(lifetime),
-                                            priv_turn_allocate_refresh_tick, cand);
+            agent_refresh_timeout_add (cand->agent, priv_turn_lifetime_to_refresh_interval(lifetime),
+                                       priv_turn_allocate_refresh_tick, cand);
 
-          g_source_destroy (cand->tick_source);
-          g_source_unref (cand->tick_source);
+          nice_timer_cancel (cand->tick_source);
           cand->tick_source = NULL;
         } else if (res == STUN_USAGE_TURN_RETURN_ERROR) {
           int code = -1;
@@ -3282,6 +3392,7 @@ static gboolean priv_map_reply_to_relay_refresh (NiceAgent *agent, StunMessage *
                  !(recv_realm_len == sent_realm_len &&
                    sent_realm != NULL &&
                    memcmp (sent_realm, recv_realm, sent_realm_len) == 0))) {
+              stun_usage_turn_forget_credentials (&cand->stun_message);
               cand->stun_resp_msg = *resp;
               memcpy (cand->stun_resp_buffer, resp->buffer,
                       stun_message_length (resp));
@@ -3334,8 +3445,7 @@ static gboolean priv_map_reply_to_keepalive_conncheck (NiceAgent *agent,
       GST_DEBUG_OBJECT (agent, "%u/%u: Keepalive for selected pair received.",
           component->selected_pair.local->stream_id, component->id);
       if (component->selected_pair.keepalive.tick_source) {
-        g_source_destroy (component->selected_pair.keepalive.tick_source);
-        g_source_unref (component->selected_pair.keepalive.tick_source);
+        nice_timer_cancel (component->selected_pair.keepalive.tick_source);
         component->selected_pair.keepalive.tick_source = NULL;
       }
       component->selected_pair.keepalive.stun_message.buffer = NULL;
@@ -3400,17 +3510,32 @@ static bool conncheck_stun_validater (StunAgent *agent,
   return FALSE;
 }
 
+/* Requests are keyed on our password and responses on the peer's, the STUN
+ * agent only uses the precomputed states if the key really is that one */
+static const StunHmacKey *conncheck_stun_key_lookup (StunAgent *agent,
+    StunMessage *message, const uint8_t *key, size_t key_len, void *user_data)
+{
+  Stream *stream = user_data;
+
+  switch (stun_message_get_class (message)) {
+    case STUN_REQUEST:
+    case STUN_INDICATION:
+      return &stream->local_hmac_key;
+    default:
+      return &stream->remote_hmac_key;
+  }
+}
+
 static StunAgent* priv_find_stunagent_for_message (NiceAgent *agent, Stream *stream,
                                                    Component *component, NiceSocket *socket,
                                                    const NiceAddress *from, gchar *buf, guint len)
 {
-  GSList *i;
   StunMethod method = stun_get_type ((uint8_t *)buf);
   StunTransactionId msg_id;
+  StunAgent *stunagent;
+  gpointer owner = NULL;
   gchar fromstr[INET6_ADDRSTRLEN];
 
-  nice_address_to_string (from, fromstr);
-
   /*
    * If the incoming message is a response (or an error) then we must have a matching
    * transaction ID in one of our existing stun agents. All requests and indications must
@@ -3420,41 +3545,20 @@ static StunAgent* priv_find_stunagent_for_message (NiceAgent *agent, Stream *str
   case STUN_ERROR:
   case STUN_RESPONSE:
     if (stun_get_transaction_id ((uint8_t *)buf, len, msg_id)) {
-      if (stun_agent_find_transaction (&agent->stun_agent, method, msg_id)) {
-        GST_DEBUG_OBJECT (agent, "%u/%u: inbound STUN response from [%s]:%u (%u octets) matches global stun agent:",
-            stream->id, component->id,
-            fromstr, nice_address_get_port (from), len);
-        return &agent->stun_agent;
-      }
-
-      for (i = agent->discovery_list; i; i = i->next)
-      {
-        CandidateDiscovery *d = i->data;
-        if (stun_agent_find_transaction (&d->stun_agent, method, msg_id)) {
-          GST_DEBUG_OBJECT (agent, "%u/%u: inbound STUN response from [%s]:%u (%u octets) matches discovery stun agent:",
-              stream->id, component->id,
-              fromstr, nice_address_get_port (from), len);
-          return &d->stun_agent;
-        }
-      }
-
-      /* Try and match against the refresh list */
-      for (i = agent->refresh_list; i; i = i->next)
-      {
-        CandidateRefresh *r = i->data;
-
-        if (stun_agent_find_transaction (&r->stun_agent, method, msg_id)) {
-          GST_DEBUG_OBJECT (agent, "%u/%u: inbound STUN response from [%s]:%u (%u octets) matches refresh stun agent:",
-              stream->id, component->id,
-              fromstr, nice_address_get_port (from), len);
-          return &r->stun_agent;
-        }
+      stunagent = agent_stun_transaction_find (agent, method, msg_id, &owner);
+      if (stunagent) {
+        GST_LOG_OBJECT (agent, "%u/%u: inbound STUN response (%u octets) matches %s stun agent",
+            stream->id, component->id, len,
+            owner == agent ? "global" : "discovery/refresh");
+        return stunagent;
       }
 
+      nice_address_to_string (from, fromstr);
       GST_DEBUG_OBJECT (agent, "%u/%u: *** ERROR *** unmatched stun response from [%s]:%u (%u octets):",
           stream->id, component->id,
           fromstr, nice_address_get_port (from), len);
     } else {
+      nice_address_to_string (from, fromstr);
       GST_DEBUG_OBJECT (agent, "%u/%u: *** ERROR *** no transaction ID in stun response from [%s]:%u (%u octets):",
           stream->id, component->id,
           fromstr, nice_address_get_port (from), len);
@@ -3463,9 +3567,8 @@ static StunAgent* priv_find_stunagent_for_message (NiceAgent *agent, Stream *str
 
   case STUN_REQUEST:
   case STUN_INDICATION:
-    GST_DEBUG_OBJECT (agent, "%u/%u: inbound STUN request/indication packet from [%s]:%u (%u octets) using global stun agent:",
-        stream->id, component->id,
-        fromstr, nice_address_get_port (from), len);
+    GST_LOG_OBJECT (agent, "%u/%u: inbound STUN request/indication packet (%u octets) using global stun agent",
+        stream->id, component->id, len);
     return &agent->stun_agent;
   }
 
@@ -3499,10 +3602,10 @@ gboolean conn_check_handle_inbound_stun (NiceAgent *agent, Stream *stream,
   uint8_t *username;
   uint16_t username_len;
   StunMessage req;
+  StunMessageIndex index;
   StunMessage msg;
   StunValidationStatus valid;
   conncheck_validater_data validater_data = {agent, stream, component, NULL};
-  GSList *i;
   NiceCandidate *remote_candidate = NULL;
   NiceCandidateTransport remote_transport;
 
@@ -3524,8 +3627,9 @@ gboolean conn_check_handle_inbound_stun (NiceAgent *agent, Stream *stream,
     return FALSE;
   }
 
-  valid = stun_agent_validate (stunagent, &req,
-                               (uint8_t *) buf, len, conncheck_stun_validater, &validater_data);
+  valid = stun_agent_validate_with_keys (stunagent, &req, &index,
+                               (uint8_t *) buf, len, conncheck_stun_validater, &validater_data,
+                               conncheck_stun_key_lookup, stream);
 
   g_free (validater_data.password);
 
@@ -3571,8 +3675,8 @@ gboolean conn_check_handle_inbound_stun (NiceAgent *agent, Stream *stream,
     return TRUE;
   }
 
-  username = (uint8_t *) stun_message_find (&req, STUN_ATTRIBUTE_USERNAME,
-                                            &username_len);
+  username = (uint8_t *) stun_message_find_indexed (&req, &index,
+                                            STUN_ATTRIBUTE_USERNAME, &username_len);
 
   /*
    * Try and find a matching remote candidate. Infer the remote
@@ -3591,15 +3695,8 @@ gboolean conn_check_handle_inbound_stun (NiceAgent *agent, Stream *stream,
     remote_transport = NICE_CANDIDATE_TRANSPORT_UDP;
   }
 
-  for (i = component->remote_candidates; i; i = i->next) {
-    NiceCandidate *cand = i->data;
-
-    if (nice_address_equal (from, &cand->addr) &&
-        cand->transport == remote_transport) {
-      remote_candidate = cand;
-      break;
-    }
-  }
+  remote_candidate = component_find_remote_candidate (component, from,
+      remote_transport);
 
   if (valid != STUN_VALIDATION_SUCCESS) {
     GST_DEBUG_OBJECT (agent, "%u/%u: STUN message is unsuccessfull %d, ignoring", stream->id, component->id, valid);
@@ -3609,10 +3706,11 @@ gboolean conn_check_handle_inbound_stun (NiceAgent *agent, Stream *stream,
 
   if (stun_message_get_class (&req) == STUN_REQUEST) {
     rbuf_len = sizeof (rbuf);
-    res = stun_usage_ice_conncheck_create_reply (&agent->stun_agent, &req,
-                                                 &msg, rbuf, &rbuf_len, (struct sockaddr *) &sockaddr, sizeof (sockaddr),
+    res = stun_usage_ice_conncheck_create_reply_with_key (&agent->stun_agent, &req,
+                                                 &index, &msg, rbuf, &rbuf_len, (struct sockaddr *) &sockaddr, sizeof (sockaddr),
                                                  &control, agent->tie_breaker,
-                                                 agent_to_ice_compatibility (agent));
+                                                 agent_to_ice_compatibility (agent),
+                                                 &stream->local_hmac_key);
 
     if (res == STUN_USAGE_ICE_RETURN_ROLE_CONFLICT)
       priv_check_for_role_conflict (agent, control);
@@ -3620,8 +3718,10 @@ gboolean conn_check_handle_inbound_stun (NiceAgent *agent, Stream *stream,
     if (res == STUN_USAGE_ICE_RETURN_SUCCESS ||
         res == STUN_USAGE_ICE_RETURN_ROLE_CONFLICT) {
       /* case 1: valid incoming request, send a reply/error */
-      bool use_candidate = stun_usage_ice_conncheck_use_candidate (&req);
-      uint32_t priority = stun_usage_ice_conncheck_priority (&req);
+      bool use_candidate =
+          stun_usage_ice_conncheck_use_candidate_indexed (&req, &index);
+      uint32_t priority =
+          stun_usage_ice_conncheck_priority_indexed (&req, &index);
 
       if (stream->initial_binding_request_received != TRUE)
         agent_signal_initial_binding_request_received (agent, stream);
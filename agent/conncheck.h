@@ -45,6 +45,7 @@
 #include "agent.h"
 #include "stream.h"
 #include "stun/stunagent.h"
+#include "stun/usages/ice.h"
 #include "stun/usages/timer.h"
 
 #define NICE_CANDIDATE_PAIR_MAX_FOUNDATION        NICE_CANDIDATE_MAX_FOUNDATION*2
@@ -77,10 +78,15 @@ struct _CandidateCheckPair
   guint64 priority;
   GTimeVal next_tick;       /* next tick timestamp */
   StunTimer timer;
-  uint8_t stun_buffer[STUN_MAX_MESSAGE_SIZE];
+  /* large enough for the longest USERNAME, SOFTWARE and
+   * CANDIDATE-IDENTIFIER attributes together */
+  uint8_t stun_buffer[STUN_MAX_MESSAGE_SIZE_IPV6];
   StunMessage stun_message;
+  StunUsageIceConncheckTemplate stun_template; /* what stun_buffer holds */
   CandidateCheckPair *valid_pair;   /* For pairs that have succeeded this points to the valid pair created (which may be this pair,
                                      * any other pair on the checklist or indeed a brand new pair) */
+  gboolean in_check_list;   /* TRUE while on the stream's conncheck_list */
+  gint waiting_index;       /* index in the stream's waiting_checks heap, -1 if not WAITING */
 };
 
 void conn_check_add_for_remote_candidate (NiceAgent *agent, guint stream_id, Component *component, NiceCandidate *remote);
@@ -80,6 +80,7 @@ void discovery_free_item (gpointer data, gpointer user_data)
 {
   CandidateDiscovery *cand = data;
   g_assert (user_data == NULL);
+  agent_stun_transactions_forget (cand->agent, &cand->stun_agent);
   g_free (cand->msn_turn_username);
   g_free (cand->msn_turn_password);
   g_slice_free (CandidateDiscovery, cand);
@@ -97,8 +98,7 @@ void discovery_free (NiceAgent *agent)
   agent->discovery_unsched_items = 0;
 
   if (agent->discovery_timer_source != NULL) {
-    g_source_destroy (agent->discovery_timer_source);
-    g_source_unref (agent->discovery_timer_source);
+    nice_timer_cancel (agent->discovery_timer_source);
     agent->discovery_timer_source = NULL;
   }
 }
@@ -148,14 +148,14 @@ void refresh_free_item (gpointer data, gpointer user_data)
 
   g_assert (user_data == NULL);
 
+  agent_stun_transactions_forget (agent, &cand->stun_agent);
+
   if (cand->timer_source != NULL) {
-    g_source_destroy (cand->timer_source);
-    g_source_unref (cand->timer_source);
+    nice_timer_cancel (cand->timer_source);
     cand->timer_source = NULL;
   }
   if (cand->tick_source != NULL) {
-    g_source_destroy (cand->tick_source);
-    g_source_unref (cand->tick_source);
+    nice_timer_cancel (cand->tick_source);
     cand->tick_source = NULL;
   }
 
@@ -658,7 +658,9 @@ discovery_add_relay_candidate (
       G_OBJECT (agent), address,
       base_socket, &turn->server,
       turn->username, turn->password,
-      agent_to_turn_socket_compatibility (agent));
+      agent_to_turn_socket_compatibility (agent),
+      agent->turn_queue_size, agent->turn_queue_drop_oldest,
+      nice_agent_turn_queue_cb, agent);
   if (!relay_socket)
     goto errors;
 
@@ -849,8 +851,7 @@ NiceCandidate *discovery_learn_remote_peer_reflexive_candidate (
     priv_set_candidate_priority (agent, component, candidate);
   }
 
-  component->remote_candidates = g_slist_append (component->remote_candidates,
-      candidate);
+  component_add_remote_candidate (component, candidate);
 
   GST_DEBUG_OBJECT (agent, "%u/%u: adding new remote candidate, type=%s, transport=%s, foundation=%s",
       candidate->stream_id, candidate->component_id,
@@ -953,6 +954,8 @@ static gboolean priv_discovery_tick_unlocked (gpointer pointer)
         }
 
         if (buffer_len > 0) {
+          agent_stun_transaction_add (agent, &cand->stun_agent, cand,
+              &cand->stun_message);
           if (nice_socket_is_reliable (cand->nicesock)) {
             stun_timer_start_reliable (&cand->timer,
                 STUN_TIMER_DEFAULT_RELIABLE_TIMEOUT);
@@ -1076,7 +1079,7 @@ static gboolean priv_discovery_tick (gpointer pointer)
   gboolean ret;
 
   agent_lock (agent);
-  if (g_source_is_destroyed (g_main_current_source ())) {
+  if (nice_timer_is_cancelled (nice_timer_current ())) {
     GST_DEBUG ("Source was destroyed. "
         "Avoided race condition in priv_discovery_tick");
     agent_unlock (agent);
@@ -1086,8 +1089,7 @@ static gboolean priv_discovery_tick (gpointer pointer)
   ret = priv_discovery_tick_unlocked (pointer);
   if (ret == FALSE) {
     if (agent->discovery_timer_source != NULL) {
-      g_source_destroy (agent->discovery_timer_source);
-      g_source_unref (agent->discovery_timer_source);
+      nice_timer_cancel (agent->discovery_timer_source);
       agent->discovery_timer_source = NULL;
     }
   }
@@ -43,6 +43,7 @@
 
 #include "stream.h"
 #include "agent.h"
+#include "timer-wheel.h"
 
 typedef struct
 {
@@ -78,8 +79,8 @@ typedef struct
   Component *component;
   TurnServer *turn;
   StunAgent stun_agent;
-  GSource *timer_source;
-  GSource *tick_source;
+  NiceTimer *timer_source;
+  NiceTimer *tick_source;
   uint8_t *msn_turn_username;
   uint8_t *msn_turn_password;
   StunTimer timer;
@@ -56,8 +56,11 @@ stream_new (guint n_components)
   Component *component;
 
   stream = g_slice_new0 (Stream);
+  stream->ref_count = 1;
+  g_rec_mutex_init (&stream->lock);
   for (n = 0; n < n_components; n++) {
     component = component_new (n + 1);
+    component->stream = stream;
     stream->components = g_slist_append (stream->components, component);
   }
 
@@ -65,6 +68,7 @@ stream_new (guint n_components)
   stream->initial_binding_request_received = FALSE;
   stream->max_tcp_queue_size = NICE_STREAM_DEF_MAX_TCP_QUEUE;
   stream->trickle_ice = FALSE;
+  stream->waiting_checks = g_ptr_array_new ();
   return stream;
 }
 
@@ -81,13 +85,56 @@ stream_free (Stream *stream)
   g_slist_free (stream->local_addresses);
   stream->local_addresses = NULL;
 
+  stream_lock (stream);
   for (i = stream->components; i; i = i->next) {
     Component *component = i->data;
     component_free (component);
     i->data = NULL;
   }
   g_slist_free (stream->components);
-  g_slice_free (Stream, stream);
+  stream->components = NULL;
+  stream_unlock (stream);
+
+  g_ptr_array_free (stream->waiting_checks, TRUE);
+  stream->waiting_checks = NULL;
+
+  stun_hmac_key_clear (&stream->local_hmac_key);
+  stun_hmac_key_clear (&stream->remote_hmac_key);
+
+  stream_unref (stream);
+}
+
+/*
+ * Receive sources keep a reference so the stream lock outlives a
+ * dispatch racing with stream_free(). Only the lock and the id may be
+ * used after the stream was freed.
+ */
+Stream *
+stream_ref (Stream *stream)
+{
+  g_atomic_int_inc (&stream->ref_count);
+  return stream;
+}
+
+void
+stream_unref (Stream *stream)
+{
+  if (g_atomic_int_dec_and_test (&stream->ref_count)) {
+    g_rec_mutex_clear (&stream->lock);
+    g_slice_free (Stream, stream);
+  }
+}
+
+void
+stream_lock (Stream *stream)
+{
+  g_rec_mutex_lock (&stream->lock);
+}
+
+void
+stream_unlock (Stream *stream)
+{
+  g_rec_mutex_unlock (&stream->lock);
 }
 
 Component *
@@ -134,6 +181,22 @@ void stream_initialize_credentials (Stream *stream, NiceRNG *rng)
    *       '"ice-ufrag" and "ice-pwd" Attributes', ID-19) */
   nice_rng_generate_bytes_print (rng, NICE_STREAM_DEF_UFRAG - 1, stream->local_ufrag);
   nice_rng_generate_bytes_print (rng, NICE_STREAM_DEF_PWD - 1, stream->local_password);
+  stream_update_hmac_keys (stream);
+}
+
+/*
+ * Precomputes the MESSAGE-INTEGRITY states for the current passwords, to be
+ * called whenever one of them changes.
+ */
+void
+stream_update_hmac_keys (Stream *stream)
+{
+  stun_hmac_key_set (&stream->local_hmac_key,
+      (const uint8_t *) stream->local_password,
+      strlen (stream->local_password));
+  stun_hmac_key_set (&stream->remote_hmac_key,
+      (const uint8_t *) stream->remote_password,
+      strlen (stream->remote_password));
 }
 
 /*
@@ -45,6 +45,7 @@
 typedef struct _Stream Stream;
 
 #include "component.h"
+#include "stun/stunhmac.h"
 #include "random.h"
 
 G_BEGIN_DECLS
@@ -60,8 +61,19 @@ G_BEGIN_DECLS
 #define NICE_STREAM_DEF_PWD     22 + 1   /* pwd + NULL */
 #define NICE_STREAM_DEF_MAX_TCP_QUEUE 100
 
+/*
+ * Locking: the agent lock protects the stream list and everything the
+ * connectivity checks, discovery and timers touch. The stream lock
+ * additionally protects what the receive path of the stream needs: the
+ * sockets and their sources, the valid candidates, the TURN servers and
+ * the receive callbacks of its components. Writers hold both; the data
+ * path may hold the stream lock alone. When both are taken the agent lock
+ * must be taken first.
+ */
 struct _Stream
 {
+  gint ref_count;
+  GRecMutex lock;
   guint id;
   GSList *local_addresses;        /* list of NiceAddresses for local
                                      interfaces */
@@ -71,10 +83,17 @@ struct _Stream
   GSList *conncheck_list;         /* list of CandidatePair items */
   GSList *valid_list;             /* list of CandidatePair items */
   GSList *conncheck_heap;         /* list of CandidatePair items */
+  guint n_checks;                 /* length of conncheck_list */
+  guint n_checks_by_state[8];     /* conncheck_list counts per
+                                     NiceCheckState */
+  GPtrArray *waiting_checks;      /* binary max-heap by priority of the
+                                     WAITING pairs in conncheck_list */
   gchar local_ufrag[NICE_STREAM_MAX_UFRAG];
   gchar local_password[NICE_STREAM_MAX_PWD];
   gchar remote_ufrag[NICE_STREAM_MAX_UFRAG];
   gchar remote_password[NICE_STREAM_MAX_PWD];
+  StunHmacKey local_hmac_key;     /* MESSAGE-INTEGRITY states for */
+  StunHmacKey remote_hmac_key;    /* the two passwords */
   gboolean gathering;
   gint tos;
   guint tick_counter;
@@ -90,6 +109,18 @@ stream_new (guint n_components);
 void
 stream_free (Stream *stream);
 
+Stream *
+stream_ref (Stream *stream);
+
+void
+stream_unref (Stream *stream);
+
+void
+stream_lock (Stream *stream);
+
+void
+stream_unlock (Stream *stream);
+
 gboolean
 stream_all_components_ready (const Stream *stream);
 
@@ -99,6 +130,9 @@ stream_find_component_by_id (const Stream *stream, guint id);
 void
 stream_initialize_credentials (Stream *stream, NiceRNG *rng);
 
+void
+stream_update_hmac_keys (Stream *stream);
+
 void
 stream_restart (NiceAgent *agent, Stream *stream, NiceRNG *rng);
 
@@ -0,0 +1,571 @@
+/*
+ * This file is part of the Nice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Nice GLib ICE library.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include "timer-wheel.h"
+
+/*
+ * The wheel counts in milliseconds. The root level has one slot per
+ * millisecond for the next 256 ms, each of the three levels above it has
+ * 64 slots covering 64 times the span of the level below, for a total
+ * span of 2^26 ms (about 18 hours). Timers further out are parked in the
+ * last level and re-filed when their slot comes up.
+ *
+ * A slot above the root is "cascaded" when the wheel reaches the start of
+ * the block it covers: its timers are re-filed relative to the current
+ * tick, which moves them to a lower level.
+ */
+#define WHEEL_ROOT_BITS 8
+#define WHEEL_LEVEL_BITS 6
+#define WHEEL_LEVELS 4
+#define WHEEL_SLOTS (1 << WHEEL_ROOT_BITS)
+#define WHEEL_MAX_DELTA \
+  ((G_GUINT64_CONSTANT (1) << \
+      (WHEEL_ROOT_BITS + (WHEEL_LEVELS - 1) * WHEEL_LEVEL_BITS)) - 1)
+
+/*
+ * Refresh timers may fire up to a tenth of their interval, and at most
+ * REFRESH_MAX_EARLY ms, before they are due. Within that window they are
+ * moved to a random point of a REFRESH_QUANTUM ms grid, so the refreshes of
+ * many allocations share a wakeup while the ones started together are still
+ * spread out. Each wheel offsets its grid by a random phase.
+ */
+#define REFRESH_QUANTUM 5000
+#define REFRESH_MAX_EARLY 30000
+
+typedef struct _TimerWheel TimerWheel;
+
+struct _NiceTimer {
+  gint ref_count;
+  TimerWheel *wheel;
+  NiceTimer *prev;
+  NiceTimer *next;
+  gint level;           /* -1 when not filed in a slot */
+  guint slot;
+  gboolean cancelled;
+  guint64 expiry;       /* in ms on the monotonic clock */
+  guint interval;
+  gboolean refresh;     /* added with nice_timer_add_refresh() */
+  GSourceFunc function;
+  gpointer data;
+};
+
+struct _TimerWheel {
+  GSource source;
+  GMainContext *context;
+  GMutex mutex;
+  guint64 now;          /* next tick to be processed */
+  guint64 ready;        /* tick the source is due to wake up at */
+  NiceTimer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+  guint32 map[WHEEL_LEVELS][WHEEL_SLOTS / 32];
+  guint refresh_phase;
+  GHashTable *refresh_load; /* second of expiry -> pending refresh timers */
+};
+
+/* GMainContext -> TimerWheel, the wheels are owned by their context */
+static GMutex wheels_lock;
+static GHashTable *wheels = NULL;
+
+static GPrivate current_timer = G_PRIVATE_INIT (NULL);
+
+static gboolean timer_wheel_dispatch (GSource *source, GSourceFunc callback,
+    gpointer user_data);
+static void timer_wheel_finalize (GSource *source);
+
+static GSourceFuncs timer_wheel_funcs = {
+  NULL,
+  NULL,
+  timer_wheel_dispatch,
+  timer_wheel_finalize,
+};
+
+static inline guint
+level_shift (guint level)
+{
+  return level == 0 ? 0 : WHEEL_ROOT_BITS + (level - 1) * WHEEL_LEVEL_BITS;
+}
+
+static inline guint
+level_size (guint level)
+{
+  return level == 0 ? WHEEL_SLOTS : 1 << WHEEL_LEVEL_BITS;
+}
+
+static inline guint64
+timer_wheel_clock (void)
+{
+  return g_get_monotonic_time () / 1000;
+}
+
+static void
+timer_wheel_set_ready (TimerWheel *wheel, guint64 tick)
+{
+  wheel->ready = tick;
+  g_source_set_ready_time (&wheel->source,
+      tick == G_MAXUINT64 ? -1 : (gint64) tick * 1000);
+}
+
+/* Returns when a refresh timer armed at @now for @interval ms fires */
+static guint64
+timer_wheel_refresh_expiry (TimerWheel *wheel, guint64 now, guint interval)
+{
+  guint64 due = now + interval;
+  guint window = MIN (interval / 10, REFRESH_MAX_EARLY);
+  guint64 target;
+
+  if (window < REFRESH_QUANTUM)
+    return due;
+
+  target = due - g_random_int_range (0, window - REFRESH_QUANTUM + 1);
+  return target - (target + wheel->refresh_phase) % REFRESH_QUANTUM;
+}
+
+static void
+timer_wheel_refresh_load_add (TimerWheel *wheel, NiceTimer *timer, gint n)
+{
+  gpointer key = GUINT_TO_POINTER ((guint) (timer->expiry / 1000));
+  gint count = GPOINTER_TO_INT (g_hash_table_lookup (wheel->refresh_load,
+          key)) + n;
+
+  if (count > 0)
+    g_hash_table_insert (wheel->refresh_load, key, GINT_TO_POINTER (count));
+  else
+    g_hash_table_remove (wheel->refresh_load, key);
+}
+
+static void
+timer_wheel_link (TimerWheel *wheel, NiceTimer *timer)
+{
+  guint64 expiry = MAX (timer->expiry, wheel->now);
+  guint64 wake;
+  guint level, slot, shift;
+
+  if (expiry - wheel->now > WHEEL_MAX_DELTA)
+    expiry = wheel->now + WHEEL_MAX_DELTA;
+
+  for (level = 0; level < WHEEL_LEVELS - 1; level++)
+    if (expiry - wheel->now < (G_GUINT64_CONSTANT (1) << level_shift (level + 1)))
+      break;
+
+  shift = level_shift (level);
+  slot = (expiry >> shift) & (level_size (level) - 1);
+
+  timer->level = level;
+  timer->slot = slot;
+  timer->prev = NULL;
+  timer->next = wheel->slots[level][slot];
+  if (timer->next)
+    timer->next->prev = timer;
+  wheel->slots[level][slot] = timer;
+  wheel->map[level][slot / 32] |= 1U << (slot % 32);
+
+  wake = MAX ((expiry >> shift) << shift, wheel->now);
+  if (wake < wheel->ready)
+    timer_wheel_set_ready (wheel, wake);
+}
+
+static void
+timer_wheel_unlink (TimerWheel *wheel, NiceTimer *timer)
+{
+  if (timer->prev)
+    timer->prev->next = timer->next;
+  else
+    wheel->slots[timer->level][timer->slot] = timer->next;
+  if (timer->next)
+    timer->next->prev = timer->prev;
+
+  if (wheel->slots[timer->level][timer->slot] == NULL)
+    wheel->map[timer->level][timer->slot / 32] &= ~(1U << (timer->slot % 32));
+
+  timer->prev = NULL;
+  timer->next = NULL;
+  timer->level = -1;
+}
+
+static void
+timer_wheel_cascade (TimerWheel *wheel, guint level)
+{
+  NiceTimer *timer;
+  guint slot;
+
+  if (level >= WHEEL_LEVELS)
+    return;
+
+  slot = (wheel->now >> level_shift (level)) & (level_size (level) - 1);
+  if (slot == 0)
+    timer_wheel_cascade (wheel, level + 1);
+
+  while ((timer = wheel->slots[level][slot]) != NULL) {
+    timer_wheel_unlink (wheel, timer);
+    timer_wheel_link (wheel, timer);
+  }
+}
+
+static gboolean
+timer_wheel_root_empty (TimerWheel *wheel)
+{
+  guint i;
+
+  for (i = 0; i < WHEEL_SLOTS / 32; i++)
+    if (wheel->map[0][i])
+      return FALSE;
+  return TRUE;
+}
+
+/*
+ * Moves every timer due at or before @target to a list linked through
+ * ->next, in firing order, taking a reference on each.
+ */
+static NiceTimer *
+timer_wheel_advance (TimerWheel *wheel, guint64 target)
+{
+  NiceTimer *expired = NULL;
+  NiceTimer **tail = &expired;
+
+  while (wheel->now <= target) {
+    guint slot = wheel->now & (WHEEL_SLOTS - 1);
+    NiceTimer *timer;
+
+    if (slot == 0)
+      timer_wheel_cascade (wheel, 1);
+
+    while ((timer = wheel->slots[0][slot]) != NULL) {
+      timer_wheel_unlink (wheel, timer);
+      if (timer->refresh)
+        timer_wheel_refresh_load_add (wheel, timer, -1);
+      g_atomic_int_inc (&timer->ref_count);
+      *tail = timer;
+      tail = &timer->next;
+    }
+
+    wheel->now++;
+
+    /* Nothing can fire before the next cascade, skip straight to it */
+    if ((wheel->now & (WHEEL_SLOTS - 1)) != 0 && timer_wheel_root_empty (wheel))
+      wheel->now = MIN (target + 1, (wheel->now | (WHEEL_SLOTS - 1)) + 1);
+  }
+
+  return expired;
+}
+
+/*
+ * Returns how many slots after @start the first occupied slot is, or -1
+ * if the level is empty.
+ */
+static gint
+timer_wheel_find_slot (const guint32 *map, guint size, guint start)
+{
+  guint n_words = size / 32;
+  guint word = start / 32;
+  guint32 bits = map[word] & (~0U << (start % 32));
+  guint i;
+
+  for (i = 0; i <= n_words; i++) {
+    if (bits) {
+      guint slot = word * 32 + g_bit_nth_lsf (bits, -1);
+      return (slot - start) & (size - 1);
+    }
+    word = (word + 1) % n_words;
+    bits = map[word];
+  }
+
+  return -1;
+}
+
+static guint64
+timer_wheel_next_tick (TimerWheel *wheel)
+{
+  guint64 next = G_MAXUINT64;
+  guint level;
+
+  for (level = 0; level < WHEEL_LEVELS; level++) {
+    guint shift = level_shift (level);
+    guint size = level_size (level);
+    guint64 block = wheel->now >> shift;
+    gint distance;
+
+    /* A block that has already started was cascaded when it did */
+    if (wheel->now & ((G_GUINT64_CONSTANT (1) << shift) - 1))
+      block++;
+
+    distance = timer_wheel_find_slot (wheel->map[level], size,
+        block & (size - 1));
+    if (distance >= 0)
+      next = MIN (next, (block + distance) << shift);
+  }
+
+  return next;
+}
+
+static void
+nice_timer_unref (NiceTimer *timer)
+{
+  if (g_atomic_int_dec_and_test (&timer->ref_count)) {
+    g_source_unref (&timer->wheel->source);
+    g_slice_free (NiceTimer, timer);
+  }
+}
+
+static gboolean
+timer_wheel_dispatch (GSource *source, GSourceFunc callback,
+    gpointer user_data)
+{
+  TimerWheel *wheel = (TimerWheel *) source;
+  NiceTimer *expired, *timer;
+
+  g_mutex_lock (&wheel->mutex);
+  expired = timer_wheel_advance (wheel, timer_wheel_clock ());
+  g_mutex_unlock (&wheel->mutex);
+
+  while ((timer = expired) != NULL) {
+    gboolean cancelled;
+
+    expired = timer->next;
+
+    g_mutex_lock (&wheel->mutex);
+    timer->next = NULL;
+    cancelled = timer->cancelled;
+    g_mutex_unlock (&wheel->mutex);
+
+    if (!cancelled) {
+      NiceTimer *previous = g_private_get (&current_timer);
+      gboolean again;
+
+      g_private_set (&current_timer, timer);
+      again = timer->function (timer->data);
+      g_private_set (&current_timer, previous);
+
+      g_mutex_lock (&wheel->mutex);
+      if (!timer->cancelled) {
+        if (again && timer->refresh) {
+          timer->expiry = timer_wheel_refresh_expiry (wheel,
+              timer_wheel_clock (), timer->interval);
+          timer_wheel_refresh_load_add (wheel, timer, 1);
+          timer_wheel_link (wheel, timer);
+        } else if (again) {
+          timer->expiry = timer_wheel_clock () + timer->interval;
+          timer_wheel_link (wheel, timer);
+        } else {
+          timer->cancelled = TRUE;
+        }
+      }
+      g_mutex_unlock (&wheel->mutex);
+    }
+
+    nice_timer_unref (timer);
+  }
+
+  g_mutex_lock (&wheel->mutex);
+  timer_wheel_set_ready (wheel, timer_wheel_next_tick (wheel));
+  g_mutex_unlock (&wheel->mutex);
+
+  return TRUE;
+}
+
+static void
+timer_wheel_finalize (GSource *source)
+{
+  TimerWheel *wheel = (TimerWheel *) source;
+
+  g_mutex_lock (&wheels_lock);
+  if (wheels && g_hash_table_lookup (wheels, wheel->context) == wheel)
+    g_hash_table_remove (wheels, wheel->context);
+  g_mutex_unlock (&wheels_lock);
+
+  g_hash_table_destroy (wheel->refresh_load);
+  g_mutex_clear (&wheel->mutex);
+}
+
+/* Returns a new reference to the wheel of @context, creating it if needed */
+static TimerWheel *
+timer_wheel_get (GMainContext *context)
+{
+  TimerWheel *wheel;
+
+  if (context == NULL)
+    context = g_main_context_default ();
+
+  g_mutex_lock (&wheels_lock);
+
+  if (wheels == NULL)
+    wheels = g_hash_table_new (NULL, NULL);
+
+  wheel = g_hash_table_lookup (wheels, context);
+  if (wheel && !g_source_is_destroyed (&wheel->source)) {
+    g_source_ref (&wheel->source);
+  } else {
+    wheel = (TimerWheel *) g_source_new (&timer_wheel_funcs,
+        sizeof (TimerWheel));
+    g_source_set_name (&wheel->source, "NiceTimerWheel");
+    g_mutex_init (&wheel->mutex);
+    wheel->context = context;
+    wheel->now = timer_wheel_clock ();
+    wheel->ready = G_MAXUINT64;
+    wheel->refresh_phase = g_random_int_range (0, REFRESH_QUANTUM);
+    wheel->refresh_load = g_hash_table_new (NULL, NULL);
+    g_source_attach (&wheel->source, context);
+    g_hash_table_insert (wheels, context, wheel);
+  }
+
+  g_mutex_unlock (&wheels_lock);
+
+  return wheel;
+}
+
+static NiceTimer *
+timer_wheel_add (GMainContext *context, guint interval, gboolean refresh,
+    GSourceFunc function, gpointer data)
+{
+  NiceTimer *timer;
+  TimerWheel *wheel;
+
+  wheel = timer_wheel_get (context);
+
+  timer = g_slice_new0 (NiceTimer);
+  timer->ref_count = 1;
+  timer->wheel = wheel;
+  timer->level = -1;
+  timer->interval = interval;
+  timer->refresh = refresh;
+  timer->function = function;
+  timer->data = data;
+
+  g_mutex_lock (&wheel->mutex);
+  if (refresh) {
+    timer->expiry = timer_wheel_refresh_expiry (wheel, timer_wheel_clock (),
+        interval);
+    timer_wheel_refresh_load_add (wheel, timer, 1);
+  } else {
+    timer->expiry = timer_wheel_clock () + interval;
+  }
+  timer_wheel_link (wheel, timer);
+  g_mutex_unlock (&wheel->mutex);
+
+  return timer;
+}
+
+NiceTimer *
+nice_timer_add (GMainContext *context, guint interval,
+    GSourceFunc function, gpointer data)
+{
+  g_return_val_if_fail (function != NULL, NULL);
+
+  return timer_wheel_add (context, interval, FALSE, function, data);
+}
+
+NiceTimer *
+nice_timer_add_seconds (GMainContext *context, guint interval,
+    GSourceFunc function, gpointer data)
+{
+  return nice_timer_add (context, interval * 1000, function, data);
+}
+
+NiceTimer *
+nice_timer_add_refresh (GMainContext *context, guint interval,
+    GSourceFunc function, gpointer data)
+{
+  g_return_val_if_fail (function != NULL, NULL);
+
+  return timer_wheel_add (context, interval, TRUE, function, data);
+}
+
+guint
+nice_timer_count_refreshes (GMainContext *context, guint within)
+{
+  TimerWheel *wheel;
+  GHashTableIter iter;
+  gpointer key, value;
+  guint64 limit;
+  guint count = 0;
+
+  if (context == NULL)
+    context = g_main_context_default ();
+
+  g_mutex_lock (&wheels_lock);
+  wheel = wheels ? g_hash_table_lookup (wheels, context) : NULL;
+  if (wheel == NULL || g_source_is_destroyed (&wheel->source)) {
+    g_mutex_unlock (&wheels_lock);
+    return 0;
+  }
+  g_source_ref (&wheel->source);
+  g_mutex_unlock (&wheels_lock);
+
+  limit = (timer_wheel_clock () + within) / 1000;
+
+  g_mutex_lock (&wheel->mutex);
+  g_hash_table_iter_init (&iter, wheel->refresh_load);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    if (GPOINTER_TO_UINT (key) <= limit)
+      count += GPOINTER_TO_UINT (value);
+  g_mutex_unlock (&wheel->mutex);
+
+  g_source_unref (&wheel->source);
+
+  return count;
+}
+
+void
+nice_timer_cancel (NiceTimer *timer)
+{
+  TimerWheel *wheel;
+
+  g_return_if_fail (timer != NULL);
+
+  wheel = timer->wheel;
+
+  g_mutex_lock (&wheel->mutex);
+  timer->cancelled = TRUE;
+  if (timer->level >= 0) {
+    timer_wheel_unlink (wheel, timer);
+    if (timer->refresh)
+      timer_wheel_refresh_load_add (wheel, timer, -1);
+  }
+  g_mutex_unlock (&wheel->mutex);
+
+  nice_timer_unref (timer);
+}
+
+gboolean
+nice_timer_is_cancelled (NiceTimer *timer)
+{
+  gboolean cancelled;
+
+  g_return_val_if_fail (timer != NULL, TRUE);
+
+  g_mutex_lock (&timer->wheel->mutex);
+  cancelled = timer->cancelled;
+  g_mutex_unlock (&timer->wheel->mutex);
+
+  return cancelled;
+}
+
+NiceTimer *
+nice_timer_current (void)
+{
+  return g_private_get (&current_timer);
+}
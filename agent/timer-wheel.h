@@ -0,0 +1,88 @@
+/*
+ * This file is part of the Nice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Nice GLib ICE library.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+#ifndef _NICE_TIMER_WHEEL_H
+#define _NICE_TIMER_WHEEL_H
+
+/*
+ * Shared timers for the agent and its sockets.
+ *
+ * Every GMainContext gets one hierarchical timer wheel, driven by a single
+ * GSource whose ready time is the earliest pending deadline, so a context
+ * running many streams, candidates and TURN allocations has one wakeup
+ * instead of one GSource per timer. Adding and cancelling a timer is O(1).
+ *
+ * A NiceTimer is owned by whoever created it: it stays valid until
+ * nice_timer_cancel() is called on it, whether or not it has fired. The
+ * callback follows the GSourceFunc convention: return TRUE to be called
+ * again after the same interval, FALSE to stop.
+ *
+ * A callback that may race with the cancellation of its own timer (because
+ * it has to take the agent lock first) should check
+ * nice_timer_is_cancelled (nice_timer_current ()) once it holds the lock,
+ * the same way g_source_is_destroyed (g_main_current_source ()) is used for
+ * ordinary sources.
+ *
+ * Refresh timers (TURN allocations, permissions and channel bindings) are
+ * added with nice_timer_add_refresh(). They may fire somewhat early, which
+ * lets the wheel batch the refreshes of every agent on the context into
+ * a few wakeups with some jitter, and nice_timer_count_refreshes() tells
+ * how many of them are coming up.
+ */
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _NiceTimer NiceTimer;
+
+NiceTimer *
+nice_timer_add (GMainContext *context, guint interval,
+    GSourceFunc function, gpointer data);
+
+NiceTimer *
+nice_timer_add_seconds (GMainContext *context, guint interval,
+    GSourceFunc function, gpointer data);
+
+NiceTimer *
+nice_timer_add_refresh (GMainContext *context, guint interval,
+    GSourceFunc function, gpointer data);
+
+guint
+nice_timer_count_refreshes (GMainContext *context, guint within);
+
+void
+nice_timer_cancel (NiceTimer *timer);
+
+gboolean
+nice_timer_is_cancelled (NiceTimer *timer);
+
+NiceTimer *
+nice_timer_current (void);
+
+G_END_DECLS
+
+#endif /* _NICE_TIMER_WHEEL_H */
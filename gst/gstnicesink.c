@@ -50,6 +50,13 @@ gst_nice_sink_render (
   GstBaseSink *basesink,
   GstBuffer *buffer);
 
+#if GST_CHECK_VERSION (1,0,0)
+static GstFlowReturn
+gst_nice_sink_render_list (
+  GstBaseSink *basesink,
+  GstBufferList *buffer_list);
+#endif
+
 static void
 gst_nice_sink_set_property (
   GObject *object,
@@ -104,6 +111,10 @@ gst_nice_sink_class_init (GstNiceSinkClass *klass)
 
   gstbasesink_class = (GstBaseSinkClass *) klass;
   gstbasesink_class->render = GST_DEBUG_FUNCPTR (gst_nice_sink_render);
+#if GST_CHECK_VERSION (1,0,0)
+  gstbasesink_class->render_list =
+      GST_DEBUG_FUNCPTR (gst_nice_sink_render_list);
+#endif
 
   gobject_class = (GObjectClass *) klass;
   gobject_class->set_property = gst_nice_sink_set_property;
@@ -240,6 +251,55 @@ gst_nice_sink_render (GstBaseSink *basesink, GstBuffer *buffer)
   return GST_FLOW_OK;
 }
 
+#if GST_CHECK_VERSION (1,0,0)
+/* Buffers of a list mapped and sent at once, to bound the stack use */
+#define RENDER_LIST_CHUNK 64
+
+static GstFlowReturn
+gst_nice_sink_render_list (GstBaseSink *basesink, GstBufferList *buffer_list)
+{
+  GstNiceSink *nicesink = GST_NICE_SINK (basesink);
+  guint n_buffers = gst_buffer_list_length (buffer_list);
+  NiceOutputMessage messages[RENDER_LIST_CHUNK];
+  GOutputVector vectors[RENDER_LIST_CHUNK];
+  GstMapInfo infos[RENDER_LIST_CHUNK];
+  GstBuffer *mapped[RENDER_LIST_CHUNK];
+  guint i, j, n_mapped;
+
+  for (i = 0; i < n_buffers; i += RENDER_LIST_CHUNK) {
+    guint n_chunk = MIN (n_buffers - i, RENDER_LIST_CHUNK);
+
+    n_mapped = 0;
+    for (j = 0; j < n_chunk; j++) {
+      GstBuffer *buffer = gst_buffer_list_get (buffer_list, i + j);
+
+      if (!gst_buffer_map (buffer, &infos[n_mapped], GST_MAP_READ)) {
+        GST_WARNING_OBJECT (nicesink, "Could not map buffer %u, dropping it",
+            i + j);
+        continue;
+      }
+      mapped[n_mapped] = buffer;
+      vectors[n_mapped].buffer = infos[n_mapped].data;
+      vectors[n_mapped].size = infos[n_mapped].size;
+      messages[n_mapped].buffers = &vectors[n_mapped];
+      messages[n_mapped].n_buffers = 1;
+      n_mapped++;
+    }
+
+    if (n_mapped > 0)
+      nice_agent_send_messages (nicesink->agent, nicesink->stream_id,
+          nicesink->component_id, messages, n_mapped);
+
+    for (j = 0; j < n_mapped; j++) {
+      gst_buffer_unmap (mapped[j], &infos[j]);
+      _set_time_on_buffer (nicesink, mapped[j]);
+    }
+  }
+
+  return GST_FLOW_OK;
+}
+#endif
+
 static void
 gst_nice_sink_on_overflow (GstNiceSink * sink,
     guint stream_id, guint component_id, NiceAgent * agent)
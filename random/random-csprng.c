@@ -0,0 +1,102 @@
+/*
+ * This file is part of the Nice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Nice GLib ICE library.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+/*
+ * NiceRNG on top of stun_rand_bytes(), so that credentials and tie-breakers
+ * come from the same per-thread ChaCha20 generator as transaction IDs.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "random-csprng.h"
+
+#include "stun/rand.h"
+
+static void
+rng_seed (
+  G_GNUC_UNUSED
+  NiceRNG *rng, G_GNUC_UNUSED guint32 seed)
+{
+  (void)rng;
+  (void)seed;
+  /* a cryptographic generator can't be made to repeat itself */
+}
+
+static void
+rng_generate_bytes (
+  G_GNUC_UNUSED
+  NiceRNG *rng,
+  guint len,
+  gchar *buf)
+{
+  (void)rng;
+  stun_rand_bytes ((uint8_t *) buf, len);
+}
+
+static guint
+rng_generate_int (
+  G_GNUC_UNUSED
+  NiceRNG *rng,
+  guint low,
+  guint high)
+{
+  guint32 range, threshold, value;
+
+  (void)rng;
+
+  g_return_val_if_fail (high > low, low);
+
+  /* reject the values that would make the low end of the range more
+   * likely than the high end */
+  range = high - low;
+  threshold = -range % range;
+  do {
+    stun_rand_bytes ((uint8_t *) &value, sizeof (value));
+  } while (value < threshold);
+
+  return low + value % range;
+}
+
+static void
+rng_free (NiceRNG *rng)
+{
+  g_slice_free (NiceRNG, rng);
+}
+
+NiceRNG *
+nice_rng_csprng_new (void)
+{
+  NiceRNG *ret;
+
+  ret = g_slice_new0 (NiceRNG);
+  ret->seed = rng_seed;
+  ret->generate_bytes = rng_generate_bytes;
+  ret->generate_int = rng_generate_int;
+  ret->free = rng_free;
+  return ret;
+}
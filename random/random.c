@@ -43,7 +43,7 @@
 #include <string.h>
 
 #include "random.h"
-#include "random-glib.h"
+#include "random-csprng.h"
 
 static NiceRNG * (*nice_rng_new_func) (void) = NULL;
 
@@ -54,7 +54,7 @@ NiceRNG *
 nice_rng_new (void)
 {
   if (nice_rng_new_func == NULL)
-    return nice_rng_glib_new ();
+    return nice_rng_csprng_new ();
   else
     return nice_rng_new_func ();
 }
@@ -42,6 +42,7 @@
 #include <string.h>
 
 #include "random-glib.h"
+#include "random-csprng.h"
 
 int
 main (void)
@@ -64,6 +65,34 @@ main (void)
   g_assert (0 == strcmp (buf, "\x1f\x0d\x47\xb8"));
 
   nice_rng_free (rng);
+
+  /* the default generator can't be predicted, only sanity checked */
+  nice_rng_set_new_func (NULL);
+  rng = nice_rng_new ();
+  {
+    gchar other[rngsize];
+    guint i, seen_low = 0, seen_high = 0;
+
+    nice_rng_generate_bytes (rng, rngsize, buf);
+    nice_rng_generate_bytes (rng, rngsize, other);
+    g_assert (memcmp (buf, other, rngsize) != 0);
+
+    for (i = 0; i < 10000; i++) {
+      guint v = nice_rng_generate_int (rng, 10, 13);
+
+      g_assert (v >= 10 && v < 13);
+      seen_low += (v == 10);
+      seen_high += (v == 12);
+    }
+    g_assert (seen_low > 0 && seen_high > 0);
+
+    nice_rng_generate_bytes_print (rng, rngsize - 1, buf);
+    buf[rngsize - 1] = '\0';
+    g_assert (strspn (buf, "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+            "abcdefghijklmnopqrstuvwxyz0123456789+/") == (size_t) rngsize - 1);
+  }
+  nice_rng_free (rng);
+
   return 0;
 }
 
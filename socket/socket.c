@@ -38,6 +38,8 @@
 #endif
 
 
+#include <string.h>
+
 #include <glib.h>
 
 #include "socket.h"
@@ -49,6 +51,36 @@ nice_socket_recv (NiceSocket *sock, NiceAddress *from, guint len, gchar *buf)
   return sock->recv (sock, from, len, buf);
 }
 
+/*
+ * Receives up to @n_messages datagrams. Returns the number of messages
+ * filled in, 0 if nothing was pending or a negative value on error. A
+ * message with a zero length was dropped by the socket (e.g. truncated).
+ */
+gint
+nice_socket_recv_messages (NiceSocket *sock, NiceInputMessage *messages,
+    guint n_messages)
+{
+  guint i;
+
+  if (sock->recv_messages != NULL)
+    return sock->recv_messages (sock, messages, n_messages);
+
+  for (i = 0; i < n_messages; i++) {
+    NiceInputMessage *message = &messages[i];
+    gint len;
+
+    len = sock->recv (sock, &message->from, message->size, message->buf);
+    if (len < 0)
+      return i > 0 ? (gint) i : len;
+    if (len == 0)
+      break;
+
+    message->length = len;
+  }
+
+  return i;
+}
+
 gint
 nice_socket_send (NiceSocket *sock, const NiceAddress *to,
     guint len, const gchar *buf)
@@ -56,6 +88,166 @@ nice_socket_send (NiceSocket *sock, const NiceAddress *to,
   return sock->send (sock, to, len, buf);
 }
 
+/*
+ * Sends @n_messages packets to @to. Returns the number of packets sent, or
+ * a negative value if the first one could not be sent.
+ */
+gint
+nice_socket_send_messages (NiceSocket *sock, const NiceAddress *to,
+    const NiceOutputMessage *messages, guint n_messages)
+{
+  if (sock->send_messages != NULL)
+    return sock->send_messages (sock, to, messages, n_messages);
+
+  return nice_socket_send_messages_default (sock, to, messages, n_messages);
+}
+
+/*
+ * Sends @n_messages packets to @to one at a time through the send()
+ * function of @sock, gathering each packet into a single buffer first if it
+ * is made of several. For socket types whose send_messages() can only
+ * handle some of the packets without copying.
+ */
+gint
+nice_socket_send_messages_default (NiceSocket *sock, const NiceAddress *to,
+    const NiceOutputMessage *messages, guint n_messages)
+{
+  guint i;
+
+  for (i = 0; i < n_messages; i++) {
+    const NiceOutputMessage *message = &messages[i];
+    gint ret;
+
+    if (message->n_buffers == 1) {
+      ret = sock->send (sock, to, message->buffers[0].size,
+          message->buffers[0].buffer);
+    } else {
+      gsize len;
+      gchar *buf = nice_output_message_gather (message, &len);
+
+      ret = sock->send (sock, to, len, buf);
+      g_free (buf);
+    }
+
+    if (ret < 0)
+      return i > 0 ? (gint) i : ret;
+  }
+
+  return i;
+}
+
+/*
+ * Returns the number of bytes in all the buffers of @message.
+ */
+gsize
+nice_output_message_size (const NiceOutputMessage *message)
+{
+  gsize size = 0;
+  guint i;
+
+  for (i = 0; i < message->n_buffers; i++)
+    size += message->buffers[i].size;
+
+  return size;
+}
+
+/*
+ * Copies the buffers of @message one after the other into a newly
+ * allocated one, for the paths that can't send them as they are. Its size
+ * is stored in @len. Free it with g_free().
+ */
+gchar *
+nice_output_message_gather (const NiceOutputMessage *message, gsize *len)
+{
+  gchar *buf;
+  gsize offset = 0;
+  guint i;
+
+  *len = nice_output_message_size (message);
+  buf = g_malloc (*len);
+
+  for (i = 0; i < message->n_buffers; i++) {
+    memcpy (buf + offset, message->buffers[i].buffer,
+        message->buffers[i].size);
+    offset += message->buffers[i].size;
+  }
+
+  return buf;
+}
+
+/*
+ * Sends @n_messages packets to @to through @base_socket, in batches of
+ * NICE_SOCKET_SEND_BATCH, each one wrapped by @frame into at most
+ * @n_framing buffers more than it has. Packets of up to @max_buffers
+ * buffers are passed on as they are, the others are gathered into one
+ * buffer first. Packets bigger than @max_size are dropped.
+ * Returns the number of packets sent, or a negative value if the first one
+ * could not be sent.
+ */
+gint
+nice_socket_send_framed_messages (NiceSocket *base_socket,
+    const NiceAddress *to, const NiceOutputMessage *messages, guint n_messages,
+    guint max_buffers, guint n_framing, gsize max_size,
+    NiceSocketFrameFunc frame, gpointer user_data)
+{
+  NiceOutputMessage out[NICE_SOCKET_SEND_BATCH];
+  GOutputVector vectors[NICE_SOCKET_SEND_BATCH][NICE_SOCKET_FRAME_MAX_BUFFERS];
+  guint sent = 0;
+
+  g_assert (max_buffers + n_framing <= NICE_SOCKET_FRAME_MAX_BUFFERS);
+
+  while (sent < n_messages) {
+    guint n_out = 0;
+    gint ret;
+
+    while (sent + n_out < n_messages && n_out < NICE_SOCKET_SEND_BATCH) {
+      const NiceOutputMessage *message = &messages[sent + n_out];
+      gsize size = nice_output_message_size (message);
+
+      if (message->n_buffers > max_buffers || size > max_size)
+        break;
+
+      out[n_out].buffers = vectors[n_out];
+      out[n_out].n_buffers = frame (message, size, n_out, vectors[n_out],
+          user_data);
+      n_out++;
+    }
+
+    if (n_out == 0) {
+      const NiceOutputMessage *message = &messages[sent];
+      gsize size = nice_output_message_size (message);
+
+      if (size <= max_size) {
+        /* Too many pieces to pass on as they are, gather them first */
+        GOutputVector vector;
+        NiceOutputMessage gathered = { &vector, 1 };
+        gchar *buf = nice_output_message_gather (message, &vector.size);
+
+        vector.buffer = buf;
+        ret = nice_socket_send_framed_messages (base_socket, to, &gathered, 1,
+            max_buffers, n_framing, max_size, frame, user_data);
+        g_free (buf);
+        if (ret < 0)
+          return sent > 0 ? (gint) sent : ret;
+        if (ret == 0)
+          break;
+      }
+      sent++;
+      continue;
+    }
+
+    ret = nice_socket_send_messages (base_socket, to, out, n_out);
+    if (ret < 0)
+      return sent > 0 ? (gint) sent : ret;
+
+    sent += ret;
+    if ((guint) ret < n_out)
+      break;
+  }
+
+  return sent;
+}
+
 gint
 nice_socket_get_tx_queue_size (NiceSocket *sock)
 {
@@ -38,6 +38,7 @@
 #define _SOCKET_H
 
 #include "address.h"
+#include "agent.h"
 #include <gio/gio.h>
 
 #ifdef G_OS_WIN32
@@ -74,8 +75,12 @@ struct _NiceSocket
   GSocket *fileno;
   gint (*recv) (NiceSocket *sock, NiceAddress *from, guint len,
       gchar *buf);
+  gint (*recv_messages) (NiceSocket *sock, NiceInputMessage *messages,
+      guint n_messages);
   gint (*send) (NiceSocket *sock, const NiceAddress *to, guint len,
       const gchar *buf);
+  gint (*send_messages) (NiceSocket *sock, const NiceAddress *to,
+      const NiceOutputMessage *messages, guint n_messages);
   gboolean (*is_reliable) (NiceSocket *sock);
   void (*close) (NiceSocket *sock);
   void (*attach) (NiceSocket *sock, GMainContext* ctx);
@@ -85,6 +90,18 @@ struct _NiceSocket
   void *priv;
 };
 
+/* Packets handed to the base socket per call by
+   nice_socket_send_framed_messages(), and the most buffers a framed packet
+   may be made of */
+#define NICE_SOCKET_SEND_BATCH 32
+#define NICE_SOCKET_FRAME_MAX_BUFFERS 16
+
+/* Fills @vectors with the buffers of @message, whose payload is @size bytes,
+   and whatever framing goes around them, and returns how many it used. The
+   packet is the @slot-th of its batch, for framing that needs storage. */
+typedef guint (*NiceSocketFrameFunc) (const NiceOutputMessage *message,
+    gsize size, guint slot, GOutputVector *vectors, gpointer user_data);
+
 typedef void (*SocketRXCallback)(NiceSocket* socket, NiceAddress* from, gchar* buf, gint len, gpointer userdata);
 typedef void (*SocketTXCallback)(NiceSocket* socket, gchar* buf, gint len, gsize queued, gpointer userdata);
 
@@ -92,10 +109,35 @@ G_GNUC_WARN_UNUSED_RESULT
 gint
 nice_socket_recv (NiceSocket *sock, NiceAddress *from, guint len, gchar *buf);
 
+G_GNUC_WARN_UNUSED_RESULT
+gint
+nice_socket_recv_messages (NiceSocket *sock, NiceInputMessage *messages,
+  guint n_messages);
+
 gint
 nice_socket_send (NiceSocket *sock, const NiceAddress *to,
   guint len, const gchar *buf);
 
+gint
+nice_socket_send_messages (NiceSocket *sock, const NiceAddress *to,
+  const NiceOutputMessage *messages, guint n_messages);
+
+gint
+nice_socket_send_messages_default (NiceSocket *sock, const NiceAddress *to,
+  const NiceOutputMessage *messages, guint n_messages);
+
+gsize
+nice_output_message_size (const NiceOutputMessage *message);
+
+gchar *
+nice_output_message_gather (const NiceOutputMessage *message, gsize *len);
+
+gint
+nice_socket_send_framed_messages (NiceSocket *base_socket,
+  const NiceAddress *to, const NiceOutputMessage *messages, guint n_messages,
+  guint max_buffers, guint n_framing, gsize max_size,
+  NiceSocketFrameFunc frame, gpointer user_data);
+
 gboolean
 nice_socket_is_reliable (NiceSocket *sock);
 
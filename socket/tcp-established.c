@@ -57,6 +57,9 @@ GST_DEBUG_CATEGORY_EXTERN (niceagent_debug);
 
 #define MAX_BUFFER_SIZE 65535
 
+/* Most buffers per packet written out without gathering them first */
+#define MAX_SEND_BUFFERS 8
+
 typedef struct {
   NiceAgent          *nice_agent;
   NiceAddress         remote_addr;
@@ -93,10 +96,15 @@ static gint socket_recv (NiceSocket *sock, NiceAddress *from,
     guint len, gchar *buf);
 static gint socket_send (NiceSocket *sock, const NiceAddress *to,
     guint len, const gchar *buf);
+static gint socket_send_messages (NiceSocket *sock, const NiceAddress *to,
+    const NiceOutputMessage *messages, guint n_messages);
 static gboolean socket_is_reliable (NiceSocket *sock);
 
 
 static void add_to_be_sent (NiceSocket *sock, const gchar *buf, guint len, gboolean add_to_head);
+static void add_buffers_to_be_sent (NiceSocket *sock,
+    const GOutputVector *buffers, guint n_buffers, gsize offset,
+    gboolean add_to_head);
 static void free_to_be_sent (struct to_be_sent *tbs);
 static gboolean socket_send_more (GSocket *gsocket, GIOCondition condition,
                                   gpointer data);
@@ -152,6 +160,7 @@ nice_tcp_established_socket_new (GSocket *gsock, GObject *nice_agent,
   sock->fileno = gsock;
   sock->addr = *local_addr;
   sock->send = socket_send;
+  sock->send_messages = socket_send_messages;
   sock->recv = socket_recv;
   sock->is_reliable = socket_is_reliable;
   sock->close = socket_close;
@@ -284,67 +293,107 @@ socket_recv (NiceSocket *sock, NiceAddress *from, guint len, gchar *buf)
   return ret;
 }
 
+/*
+ * Writes one packet made of @buffers with its RFC 4571 length prefix in
+ * front. The prefix goes out as a buffer of its own, so the payload is only
+ * copied when (part of) it has to be queued for later.
+ */
 static gint
-socket_send (NiceSocket *sock, const NiceAddress *to,
-    guint len, const gchar *buf)
+socket_send_buffers (NiceSocket *sock, const NiceAddress *to,
+    const GOutputVector *buffers, guint n_buffers)
 {
   TcpEstablishedPriv *priv = sock->priv;
-  int ret;
+  NiceOutputMessage message = { buffers, n_buffers };
+  GOutputVector vectors[MAX_SEND_BUFFERS + 1];
+  guint8 header[2];
+  gsize len;
+  gint ret;
   GError *gerr = NULL;
-  gchar buff[MAX_BUFFER_SIZE];
-
-  gchar to_string[NICE_ADDRESS_STRING_LEN];
-
-  nice_address_to_string (to, to_string);
-
-  if (nice_address_equal (to, &priv->remote_addr)) {
-
-    /* Don't try to access the socket if it had an error, otherwise we risk a
-       crash with SIGPIPE (Broken pipe) */
-    if (priv->error)
-      return -1;
-
-    buff[0] = (len >> 8);
-    buff[1] = (len & 0xFF);
-    memcpy (&buff[2], buf, len);
-    len += 2;
-
-    /* First try to send the data, don't send it later if it can be sent now
-       this way we avoid allocating memory on every send */
-    if (g_socket_is_connected (sock->fileno) &&
-        g_queue_is_empty (&priv->send_queue)) {
-      ret = g_socket_send (sock->fileno, buff, len, NULL, &gerr);
-      if (ret < 0) {
-        if (g_error_matches (gerr, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
-          add_to_be_sent (sock, buff, len, FALSE);
-          priv->txcb (sock, buff, len, priv->tx_queue_size_bytes, priv->userdata);
-          ret = len;
-        }
-      } else {
-        guint rest = len - ret;
-        if (rest > 0) {
-          add_to_be_sent (sock, &buff[ret], rest, FALSE);
-          ret = len;
-        }
-      }
 
-      if (gerr != NULL)
-        g_error_free (gerr);
+  if (!nice_address_equal (to, &priv->remote_addr))
+    return 0;
 
-      return ret;
-    } else {
-      add_to_be_sent (sock, buff, len, FALSE);
-      if (g_socket_is_connected (sock->fileno)) {
-        priv->txcb (sock, buff, len, priv->tx_queue_size_bytes, priv->userdata);
+  /* Don't try to access the socket if it had an error, otherwise we risk a
+     crash with SIGPIPE (Broken pipe) */
+  if (priv->error)
+    return -1;
+
+  len = nice_output_message_size (&message);
+
+  /* Doesn't fit the length prefix */
+  if (len > MAX_BUFFER_SIZE)
+    return 0;
+
+  if (n_buffers > MAX_SEND_BUFFERS) {
+    gchar *buf = nice_output_message_gather (&message, &len);
+
+    ret = socket_send (sock, to, len, buf);
+    g_free (buf);
+    return ret;
+  }
+
+  header[0] = (len >> 8);
+  header[1] = (len & 0xFF);
+  vectors[0].buffer = header;
+  vectors[0].size = sizeof (header);
+  memcpy (&vectors[1], buffers, n_buffers * sizeof (GOutputVector));
+  len += sizeof (header);
+
+  /* First try to send the data, don't send it later if it can be sent now
+     this way we avoid allocating memory on every send */
+  if (g_socket_is_connected (sock->fileno) &&
+      g_queue_is_empty (&priv->send_queue)) {
+    ret = g_socket_send_message (sock->fileno, NULL, vectors, n_buffers + 1,
+        NULL, 0, G_SOCKET_MSG_NONE, NULL, &gerr);
+    if (ret < 0) {
+      if (g_error_matches (gerr, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
+        add_buffers_to_be_sent (sock, vectors, n_buffers + 1, 0, FALSE);
+        priv->txcb (sock, NULL, len, priv->tx_queue_size_bytes,
+            priv->userdata);
+        ret = len;
       }
-      return len;
+    } else if ((gsize) ret < len) {
+      add_buffers_to_be_sent (sock, vectors, n_buffers + 1, ret, FALSE);
+      ret = len;
     }
+
+    if (gerr != NULL)
+      g_error_free (gerr);
+
+    return ret;
   } else {
-    gchar remote_string [NICE_ADDRESS_STRING_LEN];
+    add_buffers_to_be_sent (sock, vectors, n_buffers + 1, 0, FALSE);
+    if (g_socket_is_connected (sock->fileno)) {
+      priv->txcb (sock, NULL, len, priv->tx_queue_size_bytes, priv->userdata);
+    }
+    return len;
+  }
+}
 
-    nice_address_to_string (&priv->remote_addr, remote_string);
-    return 0;
+static gint
+socket_send (NiceSocket *sock, const NiceAddress *to,
+    guint len, const gchar *buf)
+{
+  GOutputVector vector = { buf, len };
+
+  return socket_send_buffers (sock, to, &vector, 1);
+}
+
+static gint
+socket_send_messages (NiceSocket *sock, const NiceAddress *to,
+    const NiceOutputMessage *messages, guint n_messages)
+{
+  guint i;
+
+  for (i = 0; i < n_messages; i++) {
+    gint ret = socket_send_buffers (sock, to, messages[i].buffers,
+        messages[i].n_buffers);
+
+    if (ret < 0)
+      return i > 0 ? (gint) i : ret;
   }
+
+  return i;
 }
 
 static gboolean
@@ -535,12 +584,31 @@ socket_send_more (
 
 static void
 add_to_be_sent (NiceSocket *sock, const gchar *buf, guint len, gboolean add_to_head)
+{
+  GOutputVector vector = { buf, len };
+
+  add_buffers_to_be_sent (sock, &vector, 1, 0, add_to_head);
+}
+
+/*
+ * Queues the bytes of @buffers past the first @offset ones, which were
+ * already written, as a single chunk.
+ */
+static void
+add_buffers_to_be_sent (NiceSocket *sock, const GOutputVector *buffers,
+    guint n_buffers, gsize offset, gboolean add_to_head)
 {
   TcpEstablishedPriv *priv = sock->priv;
   struct to_be_sent *tbs = NULL;
   NiceAgent *agent = priv->nice_agent;
+  gsize len = 0;
+  gsize copied = 0;
+  guint i;
 
-  if (len <= 0)
+  for (i = 0; i < n_buffers; i++)
+    len += buffers[i].size;
+
+  if (len <= offset)
     return;
 
   agent_lock (agent);
@@ -566,8 +634,20 @@ add_to_be_sent (NiceSocket *sock, const gchar *buf, guint len, gboolean add_to_h
   }
 
   tbs = g_slice_new0 (struct to_be_sent);
-  tbs->buf = g_memdup2 (buf, len);
-  tbs->length = len;
+  tbs->length = len - offset;
+  tbs->buf = g_malloc (tbs->length);
+  for (i = 0; i < n_buffers; i++) {
+    const gchar *data = buffers[i].buffer;
+    gsize size = buffers[i].size;
+
+    if (offset >= size) {
+      offset -= size;
+      continue;
+    }
+    memcpy (tbs->buf + copied, data + offset, size - offset);
+    copied += size - offset;
+    offset = 0;
+  }
 
   if (add_to_head) {
     g_queue_push_head (&priv->send_queue, tbs);
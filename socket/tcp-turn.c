@@ -62,11 +62,17 @@ typedef struct {
 
 #define MAX_UDP_MESSAGE_SIZE 65535
 
+/* The most buffers per packet framed without gathering them first: enough
+   for the ChannelData a TURN socket on top of this one sends uncopied */
+#define SEND_MAX_BUFFERS (NICE_TURN_SOCKET_MAX_BUFFERS + 1)
+
 static void socket_close (NiceSocket *sock);
 static gint socket_recv (NiceSocket *sock, NiceAddress *from,
     guint len, gchar *buf);
 static gint socket_send (NiceSocket *sock, const NiceAddress *to,
     guint len, const gchar *buf);
+static gint socket_send_messages (NiceSocket *sock, const NiceAddress *to,
+    const NiceOutputMessage *messages, guint n_messages);
 static gboolean socket_is_reliable (NiceSocket *sock);
 
 NiceSocket *
@@ -84,6 +90,7 @@ nice_tcp_turn_socket_new (NiceSocket *base_socket,
   sock->fileno = priv->base_socket->fileno;
   sock->addr = priv->base_socket->addr;
   sock->send = socket_send;
+  sock->send_messages = socket_send_messages;
   sock->recv = socket_recv;
   sock->is_reliable = socket_is_reliable;
   sock->close = socket_close;
@@ -184,34 +191,74 @@ static gint
 socket_send (NiceSocket *sock, const NiceAddress *to,
     guint len, const gchar *buf)
 {
-  TurnTcpPriv *priv = sock->priv;
-  gchar padbuf[3] = {0, 0, 0};
-  int padlen = (len%4) ? 4 - (len%4) : 0;
-  gchar buffer[MAX_UDP_MESSAGE_SIZE + sizeof(guint16) + sizeof(padbuf)];
-  guint buffer_len = 0;
+  GOutputVector vector = { buf, len };
+  NiceOutputMessage message = { &vector, 1 };
+  gint ret;
 
-  if (priv->compatibility != NICE_TURN_SOCKET_COMPATIBILITY_DRAFT9 &&
-      priv->compatibility != NICE_TURN_SOCKET_COMPATIBILITY_RFC5766)
-    padlen = 0;
+  ret = socket_send_messages (sock, to, &message, 1);
+  return ret == 1 ? (gint) len : ret;
+}
 
-  if (priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_GOOGLE) {
-    guint16 tmpbuf = htons (len);
-    memcpy (buffer + buffer_len, (gchar *)&tmpbuf, sizeof(guint16));
-    buffer_len += sizeof(guint16);
+typedef struct {
+  gboolean pad;
+  gboolean prefix;
+  guint16 lengths[NICE_SOCKET_SEND_BATCH];
+} TcpTurnFraming;
+
+static guint
+priv_frame_message (const NiceOutputMessage *message, gsize size,
+    guint slot, GOutputVector *vectors, gpointer user_data)
+{
+  TcpTurnFraming *framing = user_data;
+  static const gchar padbuf[3] = {0, 0, 0};
+  guint n = 0;
+
+  if (framing->prefix) {
+    framing->lengths[slot] = htons ((guint16) size);
+    vectors[n].buffer = &framing->lengths[slot];
+    vectors[n].size = sizeof (guint16);
+    n++;
   }
 
-  memcpy (buffer + buffer_len, buf, len);
-  buffer_len += len;
+  memcpy (&vectors[n], message->buffers,
+      message->n_buffers * sizeof (GOutputVector));
+  n += message->n_buffers;
 
-  if (priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_DRAFT9 ||
-      priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_RFC5766) {
-    memcpy (buffer + buffer_len, padbuf, padlen);
-    buffer_len += padlen;
+  if (framing->pad && size % 4) {
+    vectors[n].buffer = padbuf;
+    vectors[n].size = 4 - size % 4;
+    n++;
   }
-  return nice_socket_send (priv->base_socket, to, buffer_len, buffer);
 
+  return n;
 }
 
+/*
+ * Frames each packet for the TURN server with extra buffers around the
+ * caller's ones: the length prefix of the Google dialect in front, the
+ * padding to 4 bytes RFC 5766 wants for ChannelData over TCP behind. The
+ * payload itself is never copied unless it comes in too many pieces.
+ */
+static gint
+socket_send_messages (NiceSocket *sock, const NiceAddress *to,
+    const NiceOutputMessage *messages, guint n_messages)
+{
+  TurnTcpPriv *priv = sock->priv;
+  TcpTurnFraming framing;
+
+  framing.pad = (priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_DRAFT9 ||
+      priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_RFC5766);
+  framing.prefix =
+      (priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_GOOGLE);
+
+  if (!framing.pad && !framing.prefix)
+    return nice_socket_send_messages (priv->base_socket, to, messages,
+        n_messages);
+
+  return nice_socket_send_framed_messages (priv->base_socket, to, messages,
+      n_messages, SEND_MAX_BUFFERS, 2, MAX_UDP_MESSAGE_SIZE,
+      priv_frame_message, &framing);
+}
 
 static gboolean
 socket_is_reliable (NiceSocket *sock)
@@ -62,6 +62,16 @@ GST_DEBUG_CATEGORY_EXTERN (niceagent_debug);
 #define STUN_PERMISSION_TIMEOUT (300 - STUN_EXPIRE_TIMEOUT) /* 240 s */
 #define STUN_BINDING_TIMEOUT (600 - STUN_EXPIRE_TIMEOUT) /* 540 s */
 
+/* Channel numbers usable for ChannelData (RFC 5766 section 11) */
+#define TURN_CHANNEL_MIN 0x4000
+#define TURN_CHANNEL_MAX 0x7FFF
+#define TURN_CHANNEL_COUNT (TURN_CHANNEL_MAX - TURN_CHANNEL_MIN + 1)
+
+/* ChannelBind transactions in flight at once, and peers covered by a single
+   CreatePermission (24 bytes each for IPv6, so it stays below the MTU) */
+#define TURN_MAX_CHANNEL_BINDS 16
+#define TURN_MAX_PERMISSION_PEERS 32
+
 typedef struct {
   StunMessage message;
   uint8_t buffer[STUN_MAX_MESSAGE_SIZE];
@@ -72,20 +82,44 @@ typedef struct {
   NiceAddress peer;
   uint16_t channel;
   gboolean renew;
-  guint timeout_source;
+  NiceTimer *timeout_source;
 } ChannelBinding;
 
+/* A ChannelBind transaction, for the dialects with ChannelData */
+typedef struct {
+  TURNMessage msg;
+  ChannelBinding *binding;      /* the binding being created, NULL when
+                                   refreshing one that is installed */
+  NiceAddress peer;
+  uint16_t channel;
+} ChannelBindRequest;
+
+/* A CreatePermission transaction covering one or more peers */
+typedef struct {
+  TURNMessage msg;
+  NiceAddress peers[TURN_MAX_PERMISSION_PEERS];
+  guint n_peers;
+} CreatePermissionRequest;
+
 typedef struct {
   GMainContext *ctx;
   NiceAgent *nice_agent;
   StunAgent agent;
-  GList *channels;
+  GList *channels;              /* installed bindings, in install order */
+  GHashTable *channels_by_peer; /* NiceAddress -> ChannelBinding */
+  GHashTable *channels_by_number; /* channel -> ChannelBinding, created on
+                                     the first binding installed */
+  uint16_t next_channel;        /* where to start looking for a free one */
   GList *pending_bindings;
-  ChannelBinding *current_binding;
+  GList *channel_bind_requests; /* ChannelBindRequest in flight */
+  ChannelBinding *current_binding; /* the other dialects bind one at a time */
   TURNMessage *current_binding_msg;
-  TURNMessage *current_create_permission_msg;
-  GSource *tick_source_channel_bind;
-  GSource *tick_source_create_permission;
+  GList *create_permission_requests; /* CreatePermissionRequest in flight */
+  GPtrArray *permission_batch;  /* peers (NiceAddress) to send the next
+                                   CreatePermission for */
+  NiceTimer *permission_batch_source;
+  NiceTimer *tick_source_channel_bind;
+  NiceTimer *tick_source_create_permission;
   NiceSocket *base_socket;
   NiceAddress server_addr;
   uint8_t *username;
@@ -98,32 +132,60 @@ typedef struct {
   uint8_t ms_connection_id[20];
   uint32_t ms_sequence_num;
   bool ms_connection_id_valid;
-  GList *permissions;           /* the peers (NiceAddress) for which
+  GHashTable *permissions;      /* the peers (NiceAddress) for which
                                    there is an installed permission */
-  GList *sent_permissions; /* ongoing permission installed */
-  GHashTable *send_data_queues; /* stores a send data queue for per peer */
-  guint permission_timeout_source;      /* timer used to invalidate
+  GHashTable *sent_permissions; /* peers batched or in a CreatePermission
+                                   in flight */
+  guint8 *send_queue;           /* ring of SendData entries holding data
+                                   for peers without a permission yet,
+                                   allocated on first use */
+  gsize send_queue_size;
+  gsize send_queue_head;        /* offset of the oldest entry */
+  gsize send_queue_tail;        /* offset the next entry goes to */
+  gsize send_queue_used;        /* bytes from head to tail, counting the
+                                   unused end of the ring when wrapped */
+  gsize send_queue_live;        /* bytes of data still waiting */
+  gboolean send_queue_drop_oldest;
+  NiceTurnSocketQueueFunc send_queue_func; /* told about queued and
+                                              dropped bytes */
+  gpointer send_queue_data;
+  NiceTimer *permission_timeout_source; /* timer used to invalidate
                                            permissions */
 } TurnPriv;
 
 
 typedef struct {
   StunTransactionId id;
-  GSource *source;
+  NiceTimer *source;
   TurnPriv *priv;
 } SendRequest;
 
-/* used to store data sent while obtaining a permission */
+/* used to store data sent while obtaining a permission, each entry is
+   followed by its data in the send queue ring */
 typedef struct {
-  gchar *data;
-  guint data_len;
+  NiceAddress peer;
+  guint32 len;
+  guint32 state;
 } SendData;
 
+enum {
+  SEND_DATA_QUEUED,
+  SEND_DATA_DONE,               /* sent or dropped, space not reclaimed yet */
+  SEND_DATA_WRAP,               /* the rest of the ring is unused */
+};
+
+#define SEND_DATA_ALIGN 8
+#define SEND_DATA_SIZE(len) \
+  ((sizeof (SendData) + (len) + SEND_DATA_ALIGN - 1) & \
+      ~((gsize) SEND_DATA_ALIGN - 1))
+
 static void socket_close (NiceSocket *sock);
 static gint socket_recv (NiceSocket *sock, NiceAddress *from,
     guint len, gchar *buf);
 static gint socket_send (NiceSocket *sock, const NiceAddress *to,
     guint len, const gchar *buf);
+static gint socket_send_messages (NiceSocket *sock, const NiceAddress *to,
+    const NiceOutputMessage *messages, guint n_messages);
 static gboolean socket_is_reliable (NiceSocket *sock);
 
 static void priv_process_pending_bindings (TurnPriv *priv);
@@ -132,38 +194,185 @@ static gboolean priv_retransmissions_tick (gpointer pointer);
 static void priv_schedule_tick (TurnPriv *priv);
 static void priv_send_turn_message (TurnPriv *priv, TURNMessage *msg);
 static gboolean priv_send_create_permission (TurnPriv *priv,  StunMessage *resp,
-    const NiceAddress *peer);
+    const NiceAddress *peers, guint n_peers);
 static gboolean priv_send_channel_bind (TurnPriv *priv, StunMessage *resp,
     uint16_t channel,
-    const NiceAddress *peer);
+    const NiceAddress *peer, ChannelBinding *binding);
 static gboolean priv_add_channel_binding (TurnPriv *priv,
     const NiceAddress *peer);
 static gboolean priv_forget_send_request (gpointer pointer);
+static void priv_send_queue_report (TurnPriv *priv, gint64 queued,
+    guint64 dropped);
 static void priv_clear_permissions (TurnPriv *priv);
 
-static guint
-priv_nice_address_hash (gconstpointer data)
+static gboolean
+priv_uses_channel_data (TurnPriv *priv)
+{
+  return priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_DRAFT9 ||
+      priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_RFC5766;
+}
+
+/* Every change to priv->channels goes through the three helpers below so
+ * that the peer and channel number indexes never disagree with the list. */
+static void
+priv_channel_insert (TurnPriv *priv, ChannelBinding *b)
+{
+  priv->channels = g_list_append (priv->channels, b);
+
+  /* The first binding installed for a peer is the one used for sending */
+  if (!g_hash_table_contains (priv->channels_by_peer, &b->peer))
+    g_hash_table_insert (priv->channels_by_peer, &b->peer, b);
+
+  if (priv_uses_channel_data (priv) &&
+      b->channel >= TURN_CHANNEL_MIN && b->channel <= TURN_CHANNEL_MAX) {
+    if (priv->channels_by_number == NULL)
+      priv->channels_by_number = g_hash_table_new (NULL, NULL);
+    if (!g_hash_table_contains (priv->channels_by_number,
+            GUINT_TO_POINTER (b->channel)))
+      g_hash_table_insert (priv->channels_by_number,
+          GUINT_TO_POINTER (b->channel), b);
+  }
+}
+
+static void
+priv_channel_remove (TurnPriv *priv, ChannelBinding *b)
 {
-  gchar address[NICE_ADDRESS_STRING_LEN];
+  GList *i;
+
+  priv->channels = g_list_remove (priv->channels, b);
 
-  nice_address_to_string ((NiceAddress *) data, address);
+  if (g_hash_table_lookup (priv->channels_by_peer, &b->peer) == b) {
+    g_hash_table_remove (priv->channels_by_peer, &b->peer);
+    /* Fall back to another binding for the same peer, if any */
+    for (i = priv->channels; i; i = i->next) {
+      ChannelBinding *other = i->data;
+      if (nice_address_equal (&other->peer, &b->peer)) {
+        g_hash_table_insert (priv->channels_by_peer, &other->peer, other);
+        break;
+      }
+    }
+  }
 
-  return g_str_hash(address);
+  if (priv->channels_by_number &&
+      g_hash_table_lookup (priv->channels_by_number,
+          GUINT_TO_POINTER (b->channel)) == b)
+    g_hash_table_remove (priv->channels_by_number,
+        GUINT_TO_POINTER (b->channel));
 }
 
 static void
-priv_send_data_queue_destroy (gpointer data)
+priv_channels_clear (TurnPriv *priv)
+{
+  GList *i;
+
+  for (i = priv->channels; i; i = i->next) {
+    ChannelBinding *b = i->data;
+    if (b->timeout_source)
+      nice_timer_cancel (b->timeout_source);
+    g_free (b);
+  }
+  g_list_free (priv->channels);
+  priv->channels = NULL;
+
+  g_hash_table_remove_all (priv->channels_by_peer);
+  if (priv->channels_by_number)
+    g_hash_table_remove_all (priv->channels_by_number);
+}
+
+static ChannelBinding *
+priv_find_channel_by_peer (TurnPriv *priv, const NiceAddress *peer)
+{
+  return g_hash_table_lookup (priv->channels_by_peer, peer);
+}
+
+static ChannelBinding *
+priv_find_channel_by_number (TurnPriv *priv, uint16_t channel)
+{
+  if (priv->channels_by_number == NULL)
+    return NULL;
+
+  return g_hash_table_lookup (priv->channels_by_number,
+      GUINT_TO_POINTER (channel));
+}
+
+static gboolean
+priv_turn_message_matches (TURNMessage *msg, StunMessage *response)
+{
+  StunTransactionId request_id;
+  StunTransactionId response_id;
+
+  stun_message_id (&msg->message, request_id);
+  stun_message_id (response, response_id);
+
+  return memcmp (request_id, response_id, sizeof(StunTransactionId)) == 0;
+}
+
+static ChannelBindRequest *
+priv_find_channel_bind_request (TurnPriv *priv, StunMessage *response)
+{
+  GList *i;
+
+  for (i = priv->channel_bind_requests; i; i = i->next) {
+    ChannelBindRequest *req = i->data;
+    if (priv_turn_message_matches (&req->msg, response))
+      return req;
+  }
+
+  return NULL;
+}
+
+static ChannelBindRequest *
+priv_find_channel_bind_request_for_peer (TurnPriv *priv,
+    const NiceAddress *peer)
+{
+  GList *i;
+
+  for (i = priv->channel_bind_requests; i; i = i->next) {
+    ChannelBindRequest *req = i->data;
+    if (nice_address_equal (&req->peer, peer))
+      return req;
+  }
+
+  return NULL;
+}
+
+static gboolean
+priv_channel_bind_in_flight (TurnPriv *priv, uint16_t channel)
 {
-  GQueue *send_queue = (GQueue *) data;
   GList *i;
 
-  for (i = g_queue_peek_head_link (send_queue); i; i = i->next) {
-    SendData *data = (SendData *) i->data;
+  for (i = priv->channel_bind_requests; i; i = i->next) {
+    ChannelBindRequest *req = i->data;
+    if (req->channel == channel)
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+/* Whether a new binding has to wait in pending_bindings for now */
+static gboolean
+priv_binding_slots_full (TurnPriv *priv)
+{
+  if (priv_uses_channel_data (priv))
+    return g_list_length (priv->channel_bind_requests) >=
+        TURN_MAX_CHANNEL_BINDS;
+
+  return priv->current_binding != NULL;
+}
+
+static CreatePermissionRequest *
+priv_find_create_permission_request (TurnPriv *priv, StunMessage *response)
+{
+  GList *i;
 
-    g_free (data->data);
-    g_slice_free (SendData, data);
+  for (i = priv->create_permission_requests; i; i = i->next) {
+    CreatePermissionRequest *req = i->data;
+    if (priv_turn_message_matches (&req->msg, response))
+      return req;
   }
-  g_queue_free (send_queue);
+
+  return NULL;
 }
 
 NiceSocket *
@@ -171,7 +380,9 @@ nice_turn_socket_new (GMainContext *ctx,
     GObject *nice_agent, NiceAddress *addr,
     NiceSocket *base_socket, NiceAddress *server_addr,
     gchar *username, gchar *password,
-    NiceTurnSocketCompatibility compatibility)
+    NiceTurnSocketCompatibility compatibility,
+    guint queue_size, gboolean queue_drop_oldest,
+    NiceTurnSocketQueueFunc queue_func, gpointer queue_data)
 {
   TurnPriv *priv;
   NiceSocket *sock = g_slice_new0 (NiceSocket);
@@ -207,6 +418,9 @@ nice_turn_socket_new (GMainContext *ctx,
   }
 
   priv->channels = NULL;
+  priv->channels_by_peer = g_hash_table_new (
+      (GHashFunc) nice_address_hash, (GEqualFunc) nice_address_equal);
+  priv->next_channel = TURN_CHANNEL_MIN;
   priv->current_binding = NULL;
   priv->base_socket = base_socket;
   if (ctx)
@@ -231,17 +445,28 @@ nice_turn_socket_new (GMainContext *ctx,
   priv->server_addr = *server_addr;
   priv->compatibility = compatibility;
   priv->send_requests = g_queue_new ();
-
-  priv->send_data_queues =
-      g_hash_table_new_full (priv_nice_address_hash,
+  priv->permission_batch =
+      g_ptr_array_new_with_free_func ((GDestroyNotify) nice_address_free);
+
+  /* Keep entries aligned when the ring wraps */
+  priv->send_queue_size = queue_size & ~((gsize) SEND_DATA_ALIGN - 1);
+  priv->send_queue_drop_oldest = queue_drop_oldest;
+  priv->send_queue_func = queue_func;
+  priv->send_queue_data = queue_data;
+  priv->permissions =
+      g_hash_table_new_full ((GHashFunc) nice_address_hash,
+          (GEqualFunc) nice_address_equal,
+          (GDestroyNotify) nice_address_free, NULL);
+  priv->sent_permissions =
+      g_hash_table_new_full ((GHashFunc) nice_address_hash,
           (GEqualFunc) nice_address_equal,
-          (GDestroyNotify) nice_address_free,
-          priv_send_data_queue_destroy);
+          (GDestroyNotify) nice_address_free, NULL);
 
   sock->type = NICE_SOCKET_TYPE_TURN;
   sock->addr = *addr;
   sock->fileno = base_socket->fileno;
   sock->send = socket_send;
+  sock->send_messages = socket_send_messages;
   sock->recv = socket_recv;
   sock->is_reliable = socket_is_reliable;
   sock->close = socket_close;
@@ -260,35 +485,41 @@ socket_close (NiceSocket *sock)
   TurnPriv *priv = (TurnPriv *) sock->priv;
   GList *i = NULL;
 
-  for (i = priv->channels; i; i = i->next) {
-    ChannelBinding *b = i->data;
-    if (b->timeout_source)
-      g_source_remove (b->timeout_source);
-    g_free (b);
-  }
-  g_list_free (priv->channels);
+  priv_channels_clear (priv);
+  g_hash_table_destroy (priv->channels_by_peer);
+  if (priv->channels_by_number)
+    g_hash_table_destroy (priv->channels_by_number);
 
   g_list_foreach (priv->pending_bindings, (GFunc) nice_address_free,
       NULL);
   g_list_free (priv->pending_bindings);
 
+  for (i = priv->channel_bind_requests; i; i = i->next) {
+    ChannelBindRequest *req = i->data;
+    g_free (req->binding);
+    g_free (req);
+  }
+  g_list_free (priv->channel_bind_requests);
+
+  g_list_free_full (priv->create_permission_requests, g_free);
+  g_ptr_array_free (priv->permission_batch, TRUE);
+  if (priv->permission_batch_source != NULL)
+    nice_timer_cancel (priv->permission_batch_source);
+
   if (priv->tick_source_channel_bind != NULL) {
-    g_source_destroy (priv->tick_source_channel_bind);
-    g_source_unref (priv->tick_source_channel_bind);
+    nice_timer_cancel (priv->tick_source_channel_bind);
     priv->tick_source_channel_bind = NULL;
   }
 
   if (priv->tick_source_create_permission != NULL) {
-    g_source_destroy (priv->tick_source_create_permission);
-    g_source_unref (priv->tick_source_create_permission);
+    nice_timer_cancel (priv->tick_source_create_permission);
     priv->tick_source_create_permission = NULL;
   }
 
 
   for (i = g_queue_peek_head_link (priv->send_requests); i; i = i->next) {
     SendRequest *r = i->data;
-    g_source_destroy (r->source);
-    g_source_unref (r->source);
+    nice_timer_cancel (r->source);
     r->source = NULL;
 
     stun_agent_forget_transaction (&priv->agent, r->id);
@@ -298,20 +529,19 @@ socket_close (NiceSocket *sock)
   }
   g_queue_free (priv->send_requests);
 
-  priv_clear_permissions (priv);
-  g_list_foreach (priv->sent_permissions, (GFunc) nice_address_free, NULL);
-  g_list_free (priv->sent_permissions);
-  g_hash_table_destroy (priv->send_data_queues);
+  g_hash_table_destroy (priv->permissions);
+  g_hash_table_destroy (priv->sent_permissions);
+  priv_send_queue_report (priv, -(gint64) priv->send_queue_live, 0);
+  g_free (priv->send_queue);
 
   if (priv->permission_timeout_source)
-    g_source_remove (priv->permission_timeout_source);
+    nice_timer_cancel (priv->permission_timeout_source);
 
   if (priv->ctx)
     g_main_context_unref (priv->ctx);
 
   g_free (priv->current_binding);
   g_free (priv->current_binding_msg);
-  g_free (priv->current_create_permission_msg);
   g_free (priv->username);
   g_free (priv->password);
   g_free (priv);
@@ -337,20 +567,11 @@ socket_recv (NiceSocket *sock, NiceAddress *from, guint len, gchar *buf)
     return recv_len;
 }
 
-static GSource *
+static NiceTimer *
 priv_timeout_add_with_context (TurnPriv *priv, guint interval,
     GSourceFunc function, gpointer data)
 {
-  GSource *source;
-
-  g_return_val_if_fail (function != NULL, NULL);
-
-  source = g_timeout_source_new (interval);
-
-  g_source_set_callback (source, function, data, NULL);
-  g_source_attach (source, priv->ctx);
-
-  return source;
+  return nice_timer_add (priv->ctx, interval, function, data);
 }
 
 static StunMessageReturn
@@ -380,31 +601,16 @@ stun_message_ensure_ms_realm(StunMessage *msg, uint8_t *realm)
   }
 }
 
-static gboolean
-priv_is_peer_in_list (const GList *list, const NiceAddress *peer)
-{
-  const GList *iter;
-
-  for (iter = list ; iter ; iter = g_list_next (iter)) {
-    NiceAddress *address = (NiceAddress *) iter->data;
-
-    if (nice_address_equal (address, peer))
-      return TRUE;
-  }
-
-  return FALSE;
-}
-
 static gboolean
 priv_has_permission_for_peer (TurnPriv *priv, const NiceAddress *peer)
 {
-  return priv_is_peer_in_list (priv->permissions, peer);
+  return g_hash_table_contains (priv->permissions, peer);
 }
 
 static gboolean
 priv_has_sent_permission_for_peer (TurnPriv *priv, const NiceAddress *peer)
 {
-  return priv_is_peer_in_list (priv->sent_permissions, peer);
+  return g_hash_table_contains (priv->sent_permissions, peer);
 }
 
 static void
@@ -415,89 +621,277 @@ priv_add_permission_for_peer (TurnPriv *priv, const NiceAddress *peer)
 
   GST_DEBUG ("added permission for peer %s:%u", addrstring, nice_address_get_port(peer));
 
-  priv->permissions =
-      g_list_append (priv->permissions, nice_address_dup (peer));
+  if (!g_hash_table_contains (priv->permissions, peer))
+    g_hash_table_add (priv->permissions, nice_address_dup (peer));
 }
 
 static void
 priv_add_sent_permission_for_peer (TurnPriv *priv, const NiceAddress *peer)
 {
-  priv->sent_permissions =
-      g_list_append (priv->sent_permissions, nice_address_dup (peer));
+  if (!g_hash_table_contains (priv->sent_permissions, peer))
+    g_hash_table_add (priv->sent_permissions, nice_address_dup (peer));
 }
 
-static GList *
-priv_remove_peer_from_list (GList *list, const NiceAddress *peer)
+static void
+priv_remove_sent_permission_for_peer (TurnPriv *priv, const NiceAddress *peer)
 {
-  GList *iter;
+  g_hash_table_remove (priv->sent_permissions, peer);
+}
 
-  for (iter = list ; iter ; iter = g_list_next (iter)) {
-    NiceAddress *address = (NiceAddress *) iter->data;
+static void
+priv_clear_permissions (TurnPriv *priv)
+{
+  g_hash_table_remove_all (priv->permissions);
+}
 
-    if (nice_address_equal (address, peer)) {
-      nice_address_free (address);
-      list = g_list_delete_link (list, iter);
-      break;
+/*
+ * Returns the entry at *@offset in the send queue, or NULL once @remaining
+ * bytes have been walked through, and moves both past it. Starting from
+ * the head with send_queue_used bytes visits every entry, oldest first.
+ */
+static SendData *
+priv_send_queue_next (TurnPriv *priv, gsize *offset, gsize *remaining)
+{
+  SendData *data;
+  gsize size;
+
+  while (*remaining > 0) {
+    /* The end of the ring is unused if it was too short for the entry
+       after it, with a marker if there is room for one */
+    if (priv->send_queue_size - *offset < sizeof (SendData) ||
+        ((SendData *) (priv->send_queue + *offset))->state ==
+        SEND_DATA_WRAP) {
+      *remaining -= priv->send_queue_size - *offset;
+      *offset = 0;
+      continue;
     }
+
+    data = (SendData *) (priv->send_queue + *offset);
+    size = SEND_DATA_SIZE (data->len);
+    *remaining -= size;
+    *offset += size;
+    return data;
   }
 
-  return list;
+  return NULL;
 }
 
 static void
-priv_remove_sent_permission_for_peer (TurnPriv *priv, const NiceAddress *peer)
+priv_send_queue_report (TurnPriv *priv, gint64 queued, guint64 dropped)
 {
-  priv->sent_permissions =
-      priv_remove_peer_from_list (priv->sent_permissions, peer);
+  if (priv->send_queue_func && (queued != 0 || dropped != 0))
+    priv->send_queue_func (queued, dropped, priv->send_queue_data);
 }
 
 static void
-priv_clear_permissions (TurnPriv *priv)
+priv_send_queue_account (TurnPriv *priv, SendData *data, gboolean dropped)
 {
-  g_list_foreach (priv->permissions, (GFunc) nice_address_free, NULL);
-  g_list_free (priv->permissions);
-  priv->permissions = NULL;
+  data->state = SEND_DATA_DONE;
+  priv->send_queue_live -= data->len;
+  priv_send_queue_report (priv, -(gint64) data->len, dropped ? data->len : 0);
 }
 
+/* Frees the oldest entry, dropping its data if it is still waiting */
+static void
+priv_send_queue_pop (TurnPriv *priv)
+{
+  gsize offset = priv->send_queue_head;
+  gsize remaining = priv->send_queue_used;
+  SendData *data;
+
+  data = priv_send_queue_next (priv, &offset, &remaining);
+  if (data && data->state == SEND_DATA_QUEUED) {
+    GST_DEBUG ("TURN permission queue full, dropping %u bytes", data->len);
+    priv_send_queue_account (priv, data, TRUE);
+  }
+
+  priv->send_queue_head = offset;
+  priv->send_queue_used = remaining;
+  if (remaining == 0)
+    priv->send_queue_head = priv->send_queue_tail = 0;
+}
+
+/* Frees the entries at the head that have been sent already */
+static void
+priv_send_queue_reclaim (TurnPriv *priv)
+{
+  while (priv->send_queue_used > 0) {
+    gsize offset = priv->send_queue_head;
+    gsize remaining = priv->send_queue_used;
+    SendData *data = priv_send_queue_next (priv, &offset, &remaining);
+
+    if (data && data->state == SEND_DATA_QUEUED)
+      break;
+    priv_send_queue_pop (priv);
+  }
+}
+
+/* Returns where an entry of @size bytes fits in the send queue, or NULL */
+static guint8 *
+priv_send_queue_reserve (TurnPriv *priv, gsize size)
+{
+  guint8 *ret;
+
+  if (priv->send_queue_used == 0 ||
+      priv->send_queue_tail > priv->send_queue_head) {
+    /* Free space at the end of the ring and before the head */
+    if (priv->send_queue_size - priv->send_queue_tail < size) {
+      gsize gap = priv->send_queue_size - priv->send_queue_tail;
+
+      /* An empty ring starts at 0, so the entry is bigger than the ring */
+      if (priv->send_queue_used == 0 || priv->send_queue_head < size)
+        return NULL;
+
+      if (gap >= sizeof (SendData))
+        ((SendData *) (priv->send_queue + priv->send_queue_tail))->state =
+            SEND_DATA_WRAP;
+      priv->send_queue_used += gap;
+      priv->send_queue_tail = 0;
+    }
+  } else if (priv->send_queue_head - priv->send_queue_tail < size) {
+    return NULL;
+  }
+
+  ret = priv->send_queue + priv->send_queue_tail;
+  priv->send_queue_tail += size;
+  priv->send_queue_used += size;
+
+  return ret;
+}
+
+/*
+ * Queues a copy of @buf until there is a permission for @to. The queue is a
+ * ring of the queue_size bytes given to nice_turn_socket_new(), so a peer
+ * that never answers costs a bounded amount of memory and no allocation per
+ * packet. When it is full, the oldest data or @buf itself is dropped, as
+ * queue_drop_oldest says.
+ */
 static void
 socket_enqueue_data(TurnPriv *priv, const NiceAddress *to,
     guint len, const gchar *buf)
 {
-  SendData *data = g_slice_new0 (SendData);
-  GQueue *queue = g_hash_table_lookup (priv->send_data_queues, to);
+  gsize size = SEND_DATA_SIZE (len);
+  SendData *data;
+
+  /* Dropping the oldest data would not make room for it */
+  if (size > priv->send_queue_size) {
+    GST_DEBUG ("TURN permission queue too small, dropping %u bytes", len);
+    priv_send_queue_report (priv, 0, len);
+    return;
+  }
+
+  if (priv->send_queue == NULL)
+    priv->send_queue = g_malloc (priv->send_queue_size);
 
-  if (queue == NULL) {
-    queue = g_queue_new ();
-    g_hash_table_insert (priv->send_data_queues, nice_address_dup (to),
-        queue);
+  while ((data = (SendData *) priv_send_queue_reserve (priv, size)) == NULL) {
+    if (!priv->send_queue_drop_oldest || priv->send_queue_used == 0) {
+      GST_DEBUG ("TURN permission queue full, dropping %u bytes", len);
+      priv_send_queue_report (priv, 0, len);
+      return;
+    }
+    priv_send_queue_pop (priv);
   }
 
-  data->data = g_memdup2(buf, len);
-  data->data_len = len;
-  g_queue_push_tail (queue, data);
+  data->peer = *to;
+  data->len = len;
+  data->state = SEND_DATA_QUEUED;
+  memcpy (data + 1, buf, len);
+
+  priv->send_queue_live += len;
+  priv_send_queue_report (priv, len, 0);
+}
+
+static void
+priv_flush_permission_batch (TurnPriv *priv)
+{
+  guint i;
+
+  for (i = 0; i < priv->permission_batch->len;
+       i += TURN_MAX_PERMISSION_PEERS) {
+    NiceAddress peers[TURN_MAX_PERMISSION_PEERS];
+    guint n_peers = MIN (priv->permission_batch->len - i,
+        TURN_MAX_PERMISSION_PEERS);
+    guint j;
+
+    for (j = 0; j < n_peers; j++)
+      peers[j] = *(NiceAddress *) g_ptr_array_index (priv->permission_batch,
+          i + j);
+
+    GST_DEBUG ("sending createpermission request for %u peers", n_peers);
+    priv_send_create_permission (priv, NULL, peers, n_peers);
+  }
+
+  g_ptr_array_set_size (priv->permission_batch, 0);
+}
+
+static gboolean
+priv_permission_batch_timeout (gpointer data)
+{
+  TurnPriv *priv = (TurnPriv *) data;
+  NiceAgent *agent = priv->nice_agent;
+
+  agent_lock (agent);
+  if (nice_timer_is_cancelled (nice_timer_current ())) {
+    GST_DEBUG ("Source was destroyed. "
+        "Avoided race condition in turn.c:priv_permission_batch_timeout");
+    agent_unlock (agent);
+    return FALSE;
+  }
+
+  nice_timer_cancel (priv->permission_batch_source);
+  priv->permission_batch_source = NULL;
+  priv_flush_permission_batch (priv);
+
+  agent_unlock (agent);
+
+  return FALSE;
+}
+
+/*
+ * Asks for a permission for @peer unless one is already on its way. Peers
+ * asked for until the main loop comes around again share one
+ * CreatePermission, so a burst of new remote candidates costs a single
+ * round trip instead of one per peer.
+ */
+static void
+priv_request_permission (TurnPriv *priv, const NiceAddress *peer)
+{
+  if (priv_has_sent_permission_for_peer (priv, peer))
+    return;
+
+  priv_add_sent_permission_for_peer (priv, peer);
+  g_ptr_array_add (priv->permission_batch, nice_address_dup (peer));
+
+  if (priv->permission_batch_source == NULL)
+    priv->permission_batch_source = priv_timeout_add_with_context (priv, 0,
+        priv_permission_batch_timeout, priv);
 }
 
 static void
 check_for_pending_create_permissions (TurnPriv *priv)
 {
   /*
-   * Iterate over any queued requests and send createpermissions request
+   * Ask for permissions for any peer with queued data that isn't covered by
+   * a request yet (e.g. the request could not be built)
    */
-  GHashTableIter iter;
-  gpointer key, value;
+  gsize offset = priv->send_queue_head;
+  gsize remaining = priv->send_queue_used;
+  SendData *data;
 
-  if (priv->current_create_permission_msg == NULL) {
+  while ((data = priv_send_queue_next (priv, &offset, &remaining))) {
+    NiceAddress *to = &data->peer;
 
-    g_hash_table_iter_init (&iter, priv->send_data_queues);
-    while (g_hash_table_iter_next (&iter, &key, &value)) {
-      NiceAddress *to = key;
+    if (data->state != SEND_DATA_QUEUED)
+      continue;
+
+    if (!priv_has_permission_for_peer (priv, to) &&
+        !priv_has_sent_permission_for_peer (priv, to)) {
       gchar addrstring[INET6_ADDRSTRLEN];
 
       nice_address_to_string (to, addrstring);
       GST_DEBUG ("starting pending createpermission request for address : %s:%u", addrstring, nice_address_get_port (to));
 
-      priv_send_create_permission (priv, NULL, to);
-      break;
+      priv_request_permission (priv, to);
     }
   }
 }
@@ -505,24 +899,111 @@ check_for_pending_create_permissions (TurnPriv *priv)
 static void
 socket_dequeue_all_data (TurnPriv *priv, const NiceAddress *to)
 {
-  GQueue *send_queue = g_hash_table_lookup (priv->send_data_queues, to);
+  gsize offset = priv->send_queue_head;
+  gsize remaining = priv->send_queue_used;
+  SendData *data;
+
+  while ((data = priv_send_queue_next (priv, &offset, &remaining))) {
+    if (data->state != SEND_DATA_QUEUED ||
+        !nice_address_equal (&data->peer, to))
+      continue;
+
+    nice_socket_send (priv->base_socket, &priv->server_addr, data->len,
+        (const gchar *) (data + 1));
+    priv_send_queue_account (priv, data, FALSE);
+  }
 
-  if (send_queue) {
-    while (!g_queue_is_empty (send_queue)) {
-      SendData *data =
-          (SendData *) g_queue_pop_head(send_queue);
+  priv_send_queue_reclaim (priv);
+}
 
-      nice_socket_send (priv->base_socket, &priv->server_addr, data->data_len, data->data);
+/*
+ * Completes @req, successfully or not: the permissions of its peers count
+ * as installed and the data queued for them goes out. Frees @req.
+ */
+static void
+priv_create_permission_done (TurnPriv *priv, CreatePermissionRequest *req)
+{
+  guint i;
 
-      g_free (data->data);
-      g_slice_free (SendData, data);
-    }
+  priv->create_permission_requests =
+      g_list_remove (priv->create_permission_requests, req);
 
-    /* remove queue from table */
-    g_hash_table_remove (priv->send_data_queues, to);
+  for (i = 0; i < req->n_peers; i++) {
+    priv_remove_sent_permission_for_peer (priv, &req->peers[i]);
+    priv_add_permission_for_peer (priv, &req->peers[i]);
+
+    /* send enqued data */
+    socket_dequeue_all_data (priv, &req->peers[i]);
   }
+
+  g_free (req);
+}
+
+
+/*
+ * Returns the binding to wrap data for @to into ChannelData with, or NULL if
+ * it has to go through the copying path of socket_send(): no binding, a
+ * dialect without ChannelData or a permission that needs installing first.
+ */
+static ChannelBinding *
+priv_get_channel_data_binding (TurnPriv *priv, const NiceAddress *to)
+{
+  ChannelBinding *binding;
+
+  if (!priv_uses_channel_data (priv))
+    return NULL;
+
+  binding = priv_find_channel_by_peer (priv, to);
+  if (binding &&
+      priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_RFC5766 &&
+      !priv_has_permission_for_peer (priv, to))
+    return NULL;
+
+  return binding;
+}
+
+typedef struct {
+  uint16_t channel;
+  uint16_t headers[NICE_SOCKET_SEND_BATCH][2];
+} ChannelDataFraming;
+
+/* Puts the ChannelData header in front of the payload buffers */
+static guint
+priv_frame_channel_data (const NiceOutputMessage *message, gsize size,
+    guint slot, GOutputVector *vectors, gpointer user_data)
+{
+  ChannelDataFraming *framing = user_data;
+
+  framing->headers[slot][0] = htons (framing->channel);
+  framing->headers[slot][1] = htons ((uint16_t) size);
+  vectors[0].buffer = framing->headers[slot];
+  vectors[0].size = sizeof (framing->headers[slot]);
+  memcpy (&vectors[1], message->buffers,
+      message->n_buffers * sizeof (GOutputVector));
+
+  return message->n_buffers + 1;
 }
 
+/*
+ * Sends @messages to the peer of @binding as ChannelData. The 4 byte header
+ * of each packet goes to the base socket as a buffer of its own in front of
+ * the payload buffers, so the payload is never copied on this path. Anything
+ * too big for ChannelData is dropped, as in socket_send().
+ * Returns the number of packets sent, or a negative value if the first one
+ * could not be sent.
+ */
+static gint
+priv_send_channel_data (TurnPriv *priv, ChannelBinding *binding,
+    const NiceOutputMessage *messages, guint n_messages)
+{
+  ChannelDataFraming framing;
+
+  framing.channel = binding->channel;
+
+  return nice_socket_send_framed_messages (priv->base_socket,
+      &priv->server_addr, messages, n_messages, NICE_TURN_SOCKET_MAX_BUFFERS,
+      1, G_MAXUINT16, priv_frame_channel_data, &framing);
+}
 
 static gint
 socket_send (NiceSocket *sock, const NiceAddress *to,
@@ -533,17 +1014,19 @@ socket_send (NiceSocket *sock, const NiceAddress *to,
   uint8_t buffer[STUN_MAX_MESSAGE_SIZE];
   size_t msg_len;
   struct sockaddr_storage sa;
-  GList *i = priv->channels;
-  ChannelBinding *binding = NULL;
+  ChannelBinding *binding;
 
-  for (; i; i = i->next) {
-    ChannelBinding *b = i->data;
-    if (nice_address_equal (&b->peer, to)) {
-      binding = b;
-      break;
-    }
+  binding = priv_get_channel_data_binding (priv, to);
+  if (binding && len <= G_MAXUINT16) {
+    GOutputVector vector = { buf, len };
+    NiceOutputMessage message = { &vector, 1 };
+    gint ret;
+
+    ret = priv_send_channel_data (priv, binding, &message, 1);
+    return ret == 1 ? (gint) (len + sizeof(uint32_t)) : ret;
   }
 
+  binding = priv_find_channel_by_peer (priv, to);
   nice_address_copy_to_sockaddr (to, (struct sockaddr *)&sa);
 
   if (binding) {
@@ -633,8 +1116,8 @@ socket_send (NiceSocket *sock, const NiceAddress *to,
 
       GST_DEBUG ("Dont have permission for peer %s:%u", addrstring, nice_address_get_port(to));
 
-      if (priv->current_create_permission_msg == NULL) {
-        priv_send_create_permission (priv, NULL, to);
+      if (!priv_has_sent_permission_for_peer (priv, to)) {
+        priv_request_permission (priv, to);
       } else {
         GST_DEBUG ("Create permission in flight, not creating another");
       }
@@ -651,6 +1134,27 @@ socket_send (NiceSocket *sock, const NiceAddress *to,
   return nice_socket_send (priv->base_socket, to, len, buf);
 }
 
+static gint
+socket_send_messages (NiceSocket *sock, const NiceAddress *to,
+    const NiceOutputMessage *messages, guint n_messages)
+{
+  TurnPriv *priv = (TurnPriv *) sock->priv;
+  ChannelBinding *binding;
+
+  binding = priv_get_channel_data_binding (priv, to);
+  if (binding)
+    return priv_send_channel_data (priv, binding, messages, n_messages);
+
+  /* The older dialects relay data for the locked peer untouched */
+  if (!priv_uses_channel_data (priv) && priv_find_channel_by_peer (priv, to))
+    return nice_socket_send_messages (priv->base_socket, &priv->server_addr,
+        messages, n_messages);
+
+  /* Send indications and data waiting on a permission are built in (or
+     queued from) a buffer of their own anyway */
+  return nice_socket_send_messages_default (sock, to, messages, n_messages);
+}
+
 static gboolean
 socket_is_reliable (NiceSocket *sock)
 {
@@ -666,7 +1170,7 @@ priv_forget_send_request (gpointer pointer)
 
   agent_lock (agent);
 
-  if (g_source_is_destroyed (g_main_current_source ())) {
+  if (nice_timer_is_cancelled (nice_timer_current ())) {
     GST_DEBUG ("Source was destroyed. "
         "Avoided race condition in turn.c:priv_forget_send_request");
     agent_unlock (agent);
@@ -677,8 +1181,7 @@ priv_forget_send_request (gpointer pointer)
 
   g_queue_remove (req->priv->send_requests, req);
 
-  g_source_destroy (req->source);
-  g_source_unref (req->source);
+  nice_timer_cancel (req->source);
   req->source = NULL;
 
   agent_unlock (agent);
@@ -711,14 +1214,14 @@ priv_binding_expired_timeout (gpointer data)
   TurnPriv *priv = (TurnPriv *) data;
   NiceAgent *agent = priv->nice_agent;
   GList *i;
-  GSource *source = NULL;
+  NiceTimer *timer = NULL;
 
   GST_DEBUG ("Permission expired, refresh failed");
 
   agent_lock (agent);
 
-  source = g_main_current_source ();
-  if (g_source_is_destroyed (source)) {
+  timer = nice_timer_current ();
+  if (nice_timer_is_cancelled (timer)) {
     GST_DEBUG ("Source was destroyed. "
         "Avoided race condition in turn.c:priv_binding_expired_timeout");
     agent_unlock (agent);
@@ -728,26 +1231,20 @@ priv_binding_expired_timeout (gpointer data)
   /* find current binding and destroy it */
   for (i = priv->channels ; i; i = i->next) {
     ChannelBinding *b = i->data;
-    if (b->timeout_source == g_source_get_id (source)) {
-      priv->channels = g_list_remove (priv->channels, b);
+    if (b->timeout_source == timer) {
+      nice_timer_cancel (b->timeout_source);
+      b->timeout_source = NULL;
+      priv_channel_remove (priv, b);
       /* Make sure we don't free a currently being-refreshed binding */
-      if (priv->current_binding_msg && !priv->current_binding) {
-        struct sockaddr_storage sa;
-        socklen_t sa_len = sizeof(sa);
-        NiceAddress to;
-
-        /* look up binding associated with peer */
-        stun_message_find_xor_addr (
-            &priv->current_binding_msg->message,
-            STUN_ATTRIBUTE_XOR_PEER_ADDRESS, (struct sockaddr *) &sa,
-            &sa_len);
-        nice_address_set_from_sockaddr (&to, (struct sockaddr *) &sa);
-
-        /* If the binding is being refreshed, then move it to
-           priv->current_binding so it counts as a 'new' binding and
-           will get readded to the list if it succeeds */
-        if (nice_address_equal (&b->peer, &to)) {
-          priv->current_binding = b;
+      {
+        ChannelBindRequest *req =
+            priv_find_channel_bind_request_for_peer (priv, &b->peer);
+
+        /* If the binding is being refreshed, then hand it to the request
+           so it counts as a 'new' binding and will get readded to the list
+           if it succeeds */
+        if (req && req->binding == NULL) {
+          req->binding = b;
           break;
         }
       }
@@ -770,14 +1267,14 @@ priv_binding_timeout (gpointer data)
   TurnPriv *priv = (TurnPriv *) data;
   NiceAgent *agent = priv->nice_agent;
   GList *i;
-  GSource *source = NULL;
+  NiceTimer *timer = NULL;
 
   GST_DEBUG ("Permission is about to timeout, sending binding renewal");
 
   agent_lock (agent);
 
-  source = g_main_current_source ();
-  if (g_source_is_destroyed (source)) {
+  timer = nice_timer_current ();
+  if (nice_timer_is_cancelled (timer)) {
     GST_DEBUG ("Source was destroyed. "
         "Avoided race condition in turn.c:priv_binding_timeout");
     agent_unlock (agent);
@@ -787,14 +1284,17 @@ priv_binding_timeout (gpointer data)
   /* find current binding and mark it for renewal */
   for (i = priv->channels ; i; i = i->next) {
     ChannelBinding *b = i->data;
-    if (b->timeout_source == g_source_get_id (source)) {
+    if (b->timeout_source == timer) {
       b->renew = TRUE;
+      nice_timer_cancel (b->timeout_source);
       /* Install timer to expire the permission */
-      b->timeout_source = g_timeout_add_seconds (STUN_EXPIRE_TIMEOUT,
-              priv_binding_expired_timeout, priv);
-      /* Send renewal */
-      if (!priv->current_binding_msg)
-        priv_send_channel_bind (priv, NULL, b->channel, &b->peer);
+      b->timeout_source = nice_timer_add_seconds (priv->ctx,
+          STUN_EXPIRE_TIMEOUT, priv_binding_expired_timeout, priv);
+      /* Send renewal, or leave it to priv_process_pending_bindings() if
+         there are too many requests in flight already */
+      if (!priv_binding_slots_full (priv) &&
+          !priv_find_channel_bind_request_for_peer (priv, &b->peer))
+        priv_send_channel_bind (priv, NULL, b->channel, &b->peer, NULL);
       break;
     }
   }
@@ -815,7 +1315,6 @@ nice_turn_socket_parse_recv (NiceSocket *sock, NiceSocket **from_sock,
   StunMessage msg;
   struct sockaddr_storage sa;
   socklen_t from_len = sizeof (sa);
-  GList *i = priv->channels;
   ChannelBinding *binding = NULL;
 
   if (nice_address_equal (&priv->server_addr, recv_from)) {
@@ -850,8 +1349,7 @@ nice_turn_socket_parse_recv (NiceSocket *sock, NiceSocket **from_sock,
           }
 
           if (req) {
-            g_source_destroy (req->source);
-            g_source_unref (req->source);
+            nice_timer_cancel (req->source);
             req->source = NULL;
 
             g_queue_remove (priv->send_requests, req);
@@ -892,183 +1390,134 @@ nice_turn_socket_parse_recv (NiceSocket *sock, NiceSocket **from_sock,
 
         return 0;
       } else if (stun_message_get_method (&msg) == STUN_CHANNELBIND) {
-        StunTransactionId request_id;
-        StunTransactionId response_id;
-
-        if (priv->current_binding_msg) {
-          stun_message_id (&msg, response_id);
-          stun_message_id (&priv->current_binding_msg->message, request_id);
-          if (memcmp (request_id, response_id,
-                  sizeof(StunTransactionId)) == 0) {
-
-            if (priv->current_binding) {
-              /* New channel binding */
-              binding = priv->current_binding;
-            } else {
-              /* Existing binding refresh */
-              GList *i;
-              struct sockaddr_storage sa;
-              socklen_t sa_len = sizeof(sa);
-              NiceAddress to;
-
-              /* look up binding associated with peer */
-              stun_message_find_xor_addr (
-                  &priv->current_binding_msg->message,
-                  STUN_ATTRIBUTE_XOR_PEER_ADDRESS, (struct sockaddr *) &sa,
-                  &sa_len);
-              nice_address_set_from_sockaddr (&to, (struct sockaddr *) &sa);
-
-              for (i = priv->channels; i; i = i->next) {
-                ChannelBinding *b = i->data;
-                if (nice_address_equal (&b->peer, &to)) {
-                  binding = b;
-                  break;
-                }
-              }
-            }
+        ChannelBindRequest *req = priv_find_channel_bind_request (priv, &msg);
+
+        if (req) {
+          priv->channel_bind_requests =
+              g_list_remove (priv->channel_bind_requests, req);
+
+          if (req->binding) {
+            /* New channel binding */
+            binding = req->binding;
+          } else {
+            /* Existing binding refresh */
+            binding = priv_find_channel_by_peer (priv, &req->peer);
+          }
 
-            if (stun_message_get_class (&msg) == STUN_ERROR) {
-              int code = -1;
-              uint8_t *sent_realm = NULL;
-              uint8_t *recv_realm = NULL;
-              uint16_t sent_realm_len = 0;
-              uint16_t recv_realm_len = 0;
-
-              sent_realm =
-                  (uint8_t *) stun_message_find (
-                      &priv->current_binding_msg->message,
-                      STUN_ATTRIBUTE_REALM, &sent_realm_len);
-              recv_realm =
-                  (uint8_t *) stun_message_find (&msg,
-                      STUN_ATTRIBUTE_REALM, &recv_realm_len);
-
-              /* check for unauthorized error response */
-              if (stun_message_find_error (&msg, &code) ==
-                  STUN_MESSAGE_RETURN_SUCCESS &&
-                  (code == 438 || (code == 401 &&
-                      !(recv_realm != NULL &&
-                          recv_realm_len > 0 &&
-                          recv_realm_len == sent_realm_len &&
-                          sent_realm != NULL &&
-                          memcmp (sent_realm, recv_realm,
-                              sent_realm_len) == 0)))) {
-
-                g_free (priv->current_binding_msg);
-                priv->current_binding_msg = NULL;
-                if (binding)
-                  priv_send_channel_bind (priv, &msg, binding->channel,
-                      &binding->peer);
-              } else {
-                g_free (priv->current_binding);
-                priv->current_binding = NULL;
-                g_free (priv->current_binding_msg);
-                priv->current_binding_msg = NULL;
+          if (stun_message_get_class (&msg) == STUN_ERROR) {
+            int code = -1;
+            uint8_t *sent_realm = NULL;
+            uint8_t *recv_realm = NULL;
+            uint16_t sent_realm_len = 0;
+            uint16_t recv_realm_len = 0;
+
+            sent_realm =
+                (uint8_t *) stun_message_find (&req->msg.message,
+                    STUN_ATTRIBUTE_REALM, &sent_realm_len);
+            recv_realm =
+                (uint8_t *) stun_message_find (&msg,
+                    STUN_ATTRIBUTE_REALM, &recv_realm_len);
+
+            /* check for unauthorized error response */
+            if (stun_message_find_error (&msg, &code) ==
+                STUN_MESSAGE_RETURN_SUCCESS &&
+                (code == 438 || (code == 401 &&
+                    !(recv_realm != NULL &&
+                        recv_realm_len > 0 &&
+                        recv_realm_len == sent_realm_len &&
+                        sent_realm != NULL &&
+                        memcmp (sent_realm, recv_realm,
+                            sent_realm_len) == 0)))) {
+
+              stun_usage_turn_forget_credentials (&req->msg.message);
+              if (binding == NULL ||
+                  !priv_send_channel_bind (priv, &msg, req->channel,
+                      &req->peer, req->binding)) {
+                g_free (req->binding);
                 priv_process_pending_bindings (priv);
               }
-            } else if (stun_message_get_class (&msg) == STUN_RESPONSE) {
-              g_free (priv->current_binding_msg);
-              priv->current_binding_msg = NULL;
-
-              /* If it's a new channel binding, then add it to the list */
-              if (priv->current_binding)
-                priv->channels = g_list_append (priv->channels,
-                    priv->current_binding);
-              priv->current_binding = NULL;
-
-              if (binding) {
-                binding->renew = FALSE;
-
-                /* Remove any existing timer */
-                if (binding->timeout_source)
-                  g_source_remove (binding->timeout_source);
-                /* Install timer to schedule refresh of the permission */
-                binding->timeout_source =
-                    g_timeout_add_seconds (STUN_BINDING_TIMEOUT,
-                        priv_binding_timeout, priv);
-              }
+            } else {
+              g_free (req->binding);
               priv_process_pending_bindings (priv);
             }
+          } else if (stun_message_get_class (&msg) == STUN_RESPONSE) {
+            /* If it's a new channel binding, then add it to the list */
+            if (req->binding)
+              priv_channel_insert (priv, req->binding);
+
+            if (binding) {
+              binding->renew = FALSE;
+
+              /* Remove any existing timer */
+              if (binding->timeout_source)
+                nice_timer_cancel (binding->timeout_source);
+              /* Install timer to schedule refresh of the permission */
+              binding->timeout_source =
+                  nice_timer_add_refresh (priv->ctx,
+                      STUN_BINDING_TIMEOUT * 1000, priv_binding_timeout, priv);
+            }
+            priv_process_pending_bindings (priv);
           }
+          g_free (req);
         }
         return 0;
       } else if (stun_message_get_method (&msg) == STUN_CREATEPERMISSION) {
-        StunTransactionId request_id;
-        StunTransactionId response_id;
-
-        if (priv->current_create_permission_msg) {
-          stun_message_id (&msg, response_id);
-          stun_message_id (&priv->current_create_permission_msg->message,
-              request_id);
-
-          if (memcmp (request_id, response_id,
-                  sizeof(StunTransactionId)) == 0) {
-            struct sockaddr_storage peer;
-            socklen_t peer_len = sizeof(peer);
-            NiceAddress to;
-
-            stun_message_find_xor_addr (
-                &priv->current_create_permission_msg->message,
-                STUN_ATTRIBUTE_XOR_PEER_ADDRESS, (struct sockaddr *) &peer,
-                &peer_len);
-            nice_address_set_from_sockaddr (&to, (struct sockaddr *) &peer);
-
-            /* unathorized => resend with realm and nonce */
-            if (stun_message_get_class (&msg) == STUN_ERROR) {
-              int code = -1;
-              uint8_t *sent_realm = NULL;
-              uint8_t *recv_realm = NULL;
-              uint16_t sent_realm_len = 0;
-              uint16_t recv_realm_len = 0;
-
-              sent_realm =
-                  (uint8_t *) stun_message_find (
-                      &priv->current_create_permission_msg->message,
-                      STUN_ATTRIBUTE_REALM, &sent_realm_len);
-              recv_realm =
-                  (uint8_t *) stun_message_find (&msg,
-                      STUN_ATTRIBUTE_REALM, &recv_realm_len);
-
-              /* check for unauthorized error response */
-              if (stun_message_find_error (&msg, &code) ==
-                  STUN_MESSAGE_RETURN_SUCCESS &&
-                  (code == 438 || (code == 401 &&
-                      !(recv_realm != NULL &&
-                          recv_realm_len > 0 &&
-                          recv_realm_len == sent_realm_len &&
-                          sent_realm != NULL &&
-                          memcmp (sent_realm, recv_realm,
-                              sent_realm_len) == 0)))) {
-                g_free (priv->current_create_permission_msg);
-                priv->current_create_permission_msg = NULL;
-                /* resend CreatePermission */
-                priv_send_create_permission (priv, &msg, &to);
-                return 0;
-              }
-            }
-            /* If we get an error, we just assume the server somehow
-               doesn't support permissions and we ignore the error and
-               fake a successful completion. If the server needs a permission
-               but it failed to create it, then the connchecks will fail. */
-            priv_remove_sent_permission_for_peer (priv, &to);
-            priv_add_permission_for_peer (priv, &to);
-
-            /* install timer to schedule refresh of the permission */
-            /* (will not schedule refresh if we got an error) */
-            if (stun_message_get_class (&msg) == STUN_RESPONSE &&
-                !priv->permission_timeout_source) {
-              priv->permission_timeout_source =
-                  g_timeout_add_seconds (STUN_PERMISSION_TIMEOUT,
-                      priv_permission_timeout, priv);
+        CreatePermissionRequest *req =
+            priv_find_create_permission_request (priv, &msg);
+
+        if (req) {
+          /* unathorized => resend with realm and nonce */
+          if (stun_message_get_class (&msg) == STUN_ERROR) {
+            int code = -1;
+            uint8_t *sent_realm = NULL;
+            uint8_t *recv_realm = NULL;
+            uint16_t sent_realm_len = 0;
+            uint16_t recv_realm_len = 0;
+
+            sent_realm =
+                (uint8_t *) stun_message_find (&req->msg.message,
+                    STUN_ATTRIBUTE_REALM, &sent_realm_len);
+            recv_realm =
+                (uint8_t *) stun_message_find (&msg,
+                    STUN_ATTRIBUTE_REALM, &recv_realm_len);
+
+            /* check for unauthorized error response */
+            if (stun_message_find_error (&msg, &code) ==
+                STUN_MESSAGE_RETURN_SUCCESS &&
+                (code == 438 || (code == 401 &&
+                    !(recv_realm != NULL &&
+                        recv_realm_len > 0 &&
+                        recv_realm_len == sent_realm_len &&
+                        sent_realm != NULL &&
+                        memcmp (sent_realm, recv_realm,
+                            sent_realm_len) == 0)))) {
+              stun_usage_turn_forget_credentials (&req->msg.message);
+              priv->create_permission_requests =
+                  g_list_remove (priv->create_permission_requests, req);
+              /* resend CreatePermission */
+              priv_send_create_permission (priv, &msg, req->peers,
+                  req->n_peers);
+              g_free (req);
+              return 0;
             }
-
-            /* send enqued data */
-            socket_dequeue_all_data (priv, &to);
-
-            g_free (priv->current_create_permission_msg);
-            priv->current_create_permission_msg = NULL;
-
-            check_for_pending_create_permissions(priv);
           }
+          /* If we get an error, we just assume the server somehow
+             doesn't support permissions and we ignore the error and
+             fake a successful completion. If the server needs a permission
+             but it failed to create it, then the connchecks will fail. */
+          priv_create_permission_done (priv, req);
+
+          /* install timer to schedule refresh of the permission */
+          /* (will not schedule refresh if we got an error) */
+          if (stun_message_get_class (&msg) == STUN_RESPONSE &&
+              !priv->permission_timeout_source) {
+            priv->permission_timeout_source =
+                nice_timer_add_refresh (priv->ctx,
+                    STUN_PERMISSION_TIMEOUT * 1000, priv_permission_timeout,
+                    priv);
+          }
+
+          check_for_pending_create_permissions(priv);
         }
 
         return 0;
@@ -1108,20 +1557,22 @@ nice_turn_socket_parse_recv (NiceSocket *sock, NiceSocket **from_sock,
   }
 
  recv:
-  for (i = priv->channels; i; i = i->next) {
-    ChannelBinding *b = i->data;
-    if (priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_DRAFT9 ||
-        priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_RFC5766) {
-      if (b->channel == ntohs(((uint16_t *)recv_buf)[0])) {
-        recv_len = ntohs (((uint16_t *)recv_buf)[1]);
+  if (priv_uses_channel_data (priv)) {
+    if (recv_len >= sizeof(uint32_t)) {
+      binding = priv_find_channel_by_number (priv,
+          ntohs (((uint16_t *)recv_buf)[0]));
+      if (binding) {
+        guint16 data_len = ntohs (((uint16_t *)recv_buf)[1]);
+
+        /* a truncated ChannelData message, don't read past the datagram */
+        if (data_len > recv_len - sizeof(uint32_t))
+          return 0;
+        recv_len = data_len;
         recv_buf += sizeof(uint32_t);
-        binding = b;
-        break;
       }
-    } else {
-      binding = b;
-      break;
     }
+  } else if (priv->channels) {
+    binding = priv->channels->data;
   }
 
   if (binding) {
@@ -1137,13 +1588,8 @@ nice_turn_socket_parse_recv (NiceSocket *sock, NiceSocket **from_sock,
  msn_google_lock:
 
   if (priv->current_binding) {
-    GList *i = priv->channels;
-    for (; i; i = i->next) {
-      ChannelBinding *b = i->data;
-      g_free (b);
-    }
-    g_list_free (priv->channels);
-    priv->channels = g_list_append (NULL, priv->current_binding);
+    priv_channels_clear (priv);
+    priv_channel_insert (priv, priv->current_binding);
     priv->current_binding = NULL;
     priv_process_pending_bindings (priv);
   }
@@ -1162,27 +1608,25 @@ nice_turn_socket_set_peer (NiceSocket *sock, NiceAddress *peer)
 static void
 priv_process_pending_bindings (TurnPriv *priv)
 {
-  gboolean ret = FALSE;
-
-  while (priv->pending_bindings != NULL && ret == FALSE) {
+  while (priv->pending_bindings != NULL && !priv_binding_slots_full (priv)) {
     NiceAddress *peer = priv->pending_bindings->data;
-    ret = priv_add_channel_binding (priv, peer);
     priv->pending_bindings = g_list_remove (priv->pending_bindings, peer);
+    priv_add_channel_binding (priv, peer);
     nice_address_free (peer);
   }
 
-  /* If no new channel bindings are in progress and there are no
-     pending bindings, then renew the soon to be expired bindings */
-  if (priv->pending_bindings == NULL && priv->current_binding_msg == NULL) {
+  /* If there are no pending bindings left, then use the room left to renew
+     the soon to be expired bindings */
+  if (priv->pending_bindings == NULL) {
     GList *i = NULL;
 
-    /* find binding to renew */
-    for (i = priv->channels ; i; i = i->next) {
+    /* find bindings to renew */
+    for (i = priv->channels ; i && !priv_binding_slots_full (priv);
+         i = i->next) {
       ChannelBinding *b = i->data;
-      if (b->renew) {
-        priv_send_channel_bind (priv, NULL, b->channel, &b->peer);
-        break;
-      }
+      if (b->renew && !priv_find_channel_bind_request_for_peer (priv,
+              &b->peer))
+        priv_send_channel_bind (priv, NULL, b->channel, &b->peer, NULL);
     }
   }
 }
@@ -1191,7 +1635,9 @@ priv_process_pending_bindings (TurnPriv *priv)
 static gboolean
 priv_retransmissions_tick_unlocked (TurnPriv *priv)
 {
-  gboolean ret = FALSE;
+  gboolean ret;
+  gboolean timed_out = FALSE;
+  GList *i, *next;
 
   if (priv->current_binding_msg) {
     switch (stun_timer_refresh (&priv->current_binding_msg->timer)) {
@@ -1208,8 +1654,7 @@ priv_retransmissions_tick_unlocked (TurnPriv *priv)
           g_free (priv->current_binding_msg);
           priv->current_binding_msg = NULL;
 
-
-          priv_process_pending_bindings (priv);
+          timed_out = TRUE;
           break;
         }
       case STUN_USAGE_TIMER_RETURN_RETRANSMIT:
@@ -1217,14 +1662,50 @@ priv_retransmissions_tick_unlocked (TurnPriv *priv)
         nice_socket_send (priv->base_socket, &priv->server_addr,
             stun_message_length (&priv->current_binding_msg->message),
             (gchar *)priv->current_binding_msg->buffer);
-        ret = TRUE;
         break;
       case STUN_USAGE_TIMER_RETURN_SUCCESS:
-        ret = TRUE;
         break;
     }
   }
 
+  for (i = priv->channel_bind_requests; i; i = next) {
+    ChannelBindRequest *req = i->data;
+
+    next = i->next;
+    switch (stun_timer_refresh (&req->msg.timer)) {
+      case STUN_USAGE_TIMER_RETURN_TIMEOUT:
+        {
+          /* Time out */
+          StunTransactionId id;
+
+          stun_message_id (&req->msg.message, id);
+          stun_agent_forget_transaction (&priv->agent, id);
+
+          priv->channel_bind_requests =
+              g_list_delete_link (priv->channel_bind_requests, i);
+          g_free (req->binding);
+          g_free (req);
+
+          timed_out = TRUE;
+          break;
+        }
+      case STUN_USAGE_TIMER_RETURN_RETRANSMIT:
+        /* Retransmit */
+        nice_socket_send (priv->base_socket, &priv->server_addr,
+            stun_message_length (&req->msg.message),
+            (gchar *)req->msg.buffer);
+        break;
+      case STUN_USAGE_TIMER_RETURN_SUCCESS:
+        break;
+    }
+  }
+
+  /* This may start new requests, so look at what is in flight after */
+  if (timed_out)
+    priv_process_pending_bindings (priv);
+
+  ret = priv->current_binding_msg != NULL ||
+      priv->channel_bind_requests != NULL;
   if (ret)
     priv_schedule_tick (priv);
   return ret;
@@ -1233,54 +1714,47 @@ priv_retransmissions_tick_unlocked (TurnPriv *priv)
 static gboolean
 priv_retransmissions_create_permission_tick_unlocked (TurnPriv *priv)
 {
-  gboolean ret = FALSE;
+  gboolean ret;
+  gboolean timed_out = FALSE;
+  GList *i, *next;
+
+  for (i = priv->create_permission_requests; i; i = next) {
+    CreatePermissionRequest *req = i->data;
 
-  if (priv->current_create_permission_msg) {
-    switch (stun_timer_refresh (&priv->current_create_permission_msg->timer)) {
+    next = i->next;
+    switch (stun_timer_refresh (&req->msg.timer)) {
       case STUN_USAGE_TIMER_RETURN_TIMEOUT:
         {
           /* Time out */
           StunTransactionId id;
-          NiceAddress to;
-          struct sockaddr_storage addr;
-          socklen_t addr_len = sizeof(addr);
 
-          stun_message_id (&priv->current_create_permission_msg->message, id);
+          stun_message_id (&req->msg.message, id);
           stun_agent_forget_transaction (&priv->agent, id);
-          stun_message_find_xor_addr (
-              &priv->current_create_permission_msg->message,
-              STUN_ATTRIBUTE_XOR_PEER_ADDRESS, (struct sockaddr *) &addr,
-              &addr_len);
-          nice_address_set_from_sockaddr (&to, (struct sockaddr *) &addr);
-
-          priv_remove_sent_permission_for_peer (priv, &to);
-          g_free (priv->current_create_permission_msg);
-          priv->current_create_permission_msg = NULL;
 
           /* we got a timeout when retransmitting a CreatePermission
              message, assume we can just send the data, the server
              might not support RFC TURN, or connectivity check will
              fail eventually anyway */
-          priv_add_permission_for_peer (priv, &to);
-
-          socket_dequeue_all_data (priv, &to);
+          priv_create_permission_done (priv, req);
 
-          check_for_pending_create_permissions(priv);
+          timed_out = TRUE;
           break;
         }
       case STUN_USAGE_TIMER_RETURN_RETRANSMIT:
         /* Retransmit */
         nice_socket_send (priv->base_socket, &priv->server_addr,
-            stun_message_length (&priv->current_create_permission_msg->message),
-            (gchar *)priv->current_create_permission_msg->buffer);
-        ret = TRUE;
+            stun_message_length (&req->msg.message),
+            (gchar *)req->msg.buffer);
         break;
       case STUN_USAGE_TIMER_RETURN_SUCCESS:
-        ret = TRUE;
         break;
     }
   }
 
+  if (timed_out)
+    check_for_pending_create_permissions(priv);
+
+  ret = priv->create_permission_requests != NULL;
   if (ret)
     priv_schedule_tick (priv);
   return ret;
@@ -1293,7 +1767,7 @@ priv_retransmissions_tick (gpointer pointer)
   NiceAgent *agent = priv->nice_agent;
 
   agent_lock (agent);
-  if (g_source_is_destroyed (g_main_current_source ())) {
+  if (nice_timer_is_cancelled (nice_timer_current ())) {
     GST_DEBUG ("Source was destroyed. "
         "Avoided race condition in turn.c:priv_retransmissions_tick");
     agent_unlock (agent);
@@ -1302,8 +1776,7 @@ priv_retransmissions_tick (gpointer pointer)
 
   if (priv_retransmissions_tick_unlocked (priv) == FALSE) {
     if (priv->tick_source_channel_bind != NULL) {
-      g_source_destroy (priv->tick_source_channel_bind);
-      g_source_unref (priv->tick_source_channel_bind);
+      nice_timer_cancel (priv->tick_source_channel_bind);
       priv->tick_source_channel_bind = NULL;
     }
   }
@@ -1319,7 +1792,7 @@ priv_retransmissions_create_permission_tick (gpointer pointer)
   NiceAgent *agent = priv->nice_agent;
 
   agent_lock (agent);
-  if (g_source_is_destroyed (g_main_current_source ())) {
+  if (nice_timer_is_cancelled (nice_timer_current ())) {
     GST_DEBUG ("Source was destroyed. Avoided race condition in "
         "turn.c:priv_retransmissions_create_permission_tick");
     agent_unlock (agent);
@@ -1328,8 +1801,7 @@ priv_retransmissions_create_permission_tick (gpointer pointer)
 
   if (priv_retransmissions_create_permission_tick_unlocked (priv) == FALSE) {
     if (priv->tick_source_create_permission != NULL) {
-      g_source_destroy (priv->tick_source_create_permission);
-      g_source_unref (priv->tick_source_create_permission);
+      nice_timer_cancel (priv->tick_source_create_permission);
       priv->tick_source_create_permission = NULL;
     }
   }
@@ -1338,58 +1810,69 @@ priv_retransmissions_create_permission_tick (gpointer pointer)
   return FALSE;
 }
 
+/*
+ * Arms the two retransmission timers for the earliest deadline among the
+ * ChannelBind (or older dialect binding) and the CreatePermission requests
+ * in flight. A request already due is handled on the next main loop
+ * iteration rather than from here, as this is called while the request
+ * lists are being walked.
+ */
 static void
 priv_schedule_tick (TurnPriv *priv)
 {
+  gboolean pending = FALSE;
+  guint timeout = G_MAXUINT;
+  GList *i;
+
   if (priv->tick_source_channel_bind != NULL) {
-    g_source_destroy (priv->tick_source_channel_bind);
-    g_source_unref (priv->tick_source_channel_bind);
+    nice_timer_cancel (priv->tick_source_channel_bind);
     priv->tick_source_channel_bind = NULL;
   }
 
   if (priv->current_binding_msg) {
-    guint timeout = stun_timer_remainder (&priv->current_binding_msg->timer);
-    if (timeout > 0) {
-      priv->tick_source_channel_bind =
-          priv_timeout_add_with_context (priv, timeout,
-              priv_retransmissions_tick, priv);
-    } else {
-      priv_retransmissions_tick_unlocked (priv);
-    }
+    timeout = MIN (timeout,
+        stun_timer_remainder (&priv->current_binding_msg->timer));
+    pending = TRUE;
+  }
+  for (i = priv->channel_bind_requests; i; i = i->next) {
+    ChannelBindRequest *req = i->data;
+    timeout = MIN (timeout, stun_timer_remainder (&req->msg.timer));
+    pending = TRUE;
+  }
+
+  if (pending) {
+    priv->tick_source_channel_bind =
+        priv_timeout_add_with_context (priv, timeout,
+            priv_retransmissions_tick, priv);
   }
 
   if (priv->tick_source_create_permission != NULL) {
-    g_source_destroy (priv->tick_source_create_permission);
-    g_source_unref (priv->tick_source_create_permission);
+    nice_timer_cancel (priv->tick_source_create_permission);
     priv->tick_source_create_permission = NULL;
   }
 
-  if (priv->current_create_permission_msg) {
-    guint timeout =
-        stun_timer_remainder (&priv->current_create_permission_msg->timer);
+  pending = FALSE;
+  timeout = G_MAXUINT;
+  for (i = priv->create_permission_requests; i; i = i->next) {
+    CreatePermissionRequest *req = i->data;
+    timeout = MIN (timeout, stun_timer_remainder (&req->msg.timer));
+    pending = TRUE;
+  }
 
-    if (timeout > 0) {
-      priv->tick_source_create_permission =
-          priv_timeout_add_with_context (priv,
-              timeout,
-              priv_retransmissions_create_permission_tick,
-              priv);
-    } else {
-      priv_retransmissions_create_permission_tick_unlocked (priv);
-    }
+  if (pending) {
+    priv->tick_source_create_permission =
+        priv_timeout_add_with_context (priv,
+            timeout,
+            priv_retransmissions_create_permission_tick,
+            priv);
   }
 }
 
 static void
-priv_send_turn_message (TurnPriv *priv, TURNMessage *msg)
+priv_start_turn_message (TurnPriv *priv, TURNMessage *msg)
 {
   size_t stun_len = stun_message_length (&msg->message);
 
-  if (priv->current_binding_msg) {
-    g_free (priv->current_binding_msg);
-    priv->current_binding_msg = NULL;
-  }
-
   nice_socket_send (priv->base_socket, &priv->server_addr,
       stun_len, (gchar *)msg->buffer);
 
@@ -1400,6 +1883,17 @@ priv_send_turn_message (TurnPriv *priv, TURNMessage *msg)
     stun_timer_start (&msg->timer, STUN_TIMER_DEFAULT_TIMEOUT,
         STUN_TIMER_DEFAULT_MAX_RETRANSMISSIONS);
   }
+}
+
+static void
+priv_send_turn_message (TurnPriv *priv, TURNMessage *msg)
+{
+  if (priv->current_binding_msg) {
+    g_free (priv->current_binding_msg);
+    priv->current_binding_msg = NULL;
+  }
+
+  priv_start_turn_message (priv, msg);
 
   priv->current_binding_msg = msg;
   priv_schedule_tick (priv);
@@ -1407,16 +1901,19 @@ priv_send_turn_message (TurnPriv *priv, TURNMessage *msg)
 
 static gboolean
 priv_send_create_permission(TurnPriv *priv, StunMessage *resp,
-    const NiceAddress *peer)
+    const NiceAddress *peers, guint n_peers)
 {
   guint msg_buf_len;
-  gboolean res = FALSE;
-  TURNMessage *msg = g_new0 (TURNMessage, 1);
-  struct sockaddr_storage addr;
+  CreatePermissionRequest *req;
+  struct sockaddr_storage addrs[TURN_MAX_PERMISSION_PEERS];
   uint8_t *realm = NULL;
   uint16_t realm_len = 0;
   uint8_t *nonce = NULL;
   uint16_t nonce_len = 0;
+  guint i;
+
+  g_return_val_if_fail (n_peers > 0 && n_peers <= TURN_MAX_PERMISSION_PEERS,
+      FALSE);
 
   if (resp) {
     realm = (uint8_t *) stun_message_find (resp,
@@ -1425,72 +1922,74 @@ priv_send_create_permission(TurnPriv *priv, StunMessage *resp,
         STUN_ATTRIBUTE_NONCE, &nonce_len);
   }
 
-  /* register this peer as being pening a permission (if not already pending) */
-  if (!priv_has_sent_permission_for_peer (priv, peer)) {
-    priv_add_sent_permission_for_peer (priv, peer);
-  }
+  req = g_new0 (CreatePermissionRequest, 1);
+  for (i = 0; i < n_peers; i++) {
+    req->peers[i] = peers[i];
+    nice_address_copy_to_sockaddr (&peers[i], (struct sockaddr *) &addrs[i]);
 
-  nice_address_copy_to_sockaddr (peer, (struct sockaddr *) &addr);
+    /* register this peer as being pening a permission (if not already
+       pending) */
+    priv_add_sent_permission_for_peer (priv, &peers[i]);
+  }
+  req->n_peers = n_peers;
 
   /* send CreatePermission */
-  msg_buf_len = stun_usage_turn_create_permission(&priv->agent, &msg->message,
-      msg->buffer,
-      sizeof(msg->buffer),
+  msg_buf_len = stun_usage_turn_create_permissions (&priv->agent,
+      &req->msg.message,
+      req->msg.buffer,
+      sizeof(req->msg.buffer),
       priv->username,
       priv->username_len,
       priv->password,
       priv->password_len,
       realm, realm_len,
       nonce, nonce_len,
-      (struct sockaddr *) &addr, sizeof (addr),
+      addrs, n_peers,
       STUN_USAGE_TURN_COMPATIBILITY_RFC5766);
 
-  if (msg_buf_len > 0) {
-    res = nice_socket_send (priv->base_socket, &priv->server_addr,
-        msg_buf_len, (gchar *) msg->buffer);
-
-    if (nice_socket_is_reliable (priv->base_socket)) {
-      stun_timer_start_reliable (&msg->timer,
-        STUN_TIMER_DEFAULT_RELIABLE_TIMEOUT);
-    } else {
-      stun_timer_start (&msg->timer, STUN_TIMER_DEFAULT_TIMEOUT,
-        STUN_TIMER_DEFAULT_MAX_RETRANSMISSIONS);
-    }
-
-    if (priv->current_create_permission_msg)
-    {
-      g_free (priv->current_create_permission_msg);
-    }
-    priv->current_create_permission_msg = msg;
-    priv_schedule_tick (priv);
-  } else {
-    g_free(msg);
+  if (msg_buf_len == 0) {
+    /* Let the next packet to these peers ask again */
+    for (i = 0; i < n_peers; i++)
+      priv_remove_sent_permission_for_peer (priv, &peers[i]);
+    g_free (req);
+    return FALSE;
   }
 
-  return res;
+  priv_start_turn_message (priv, &req->msg);
+  priv->create_permission_requests =
+      g_list_append (priv->create_permission_requests, req);
+  priv_schedule_tick (priv);
+
+  return TRUE;
 }
 
+/*
+ * Sends a ChannelBind for @channel to @peer. @binding is the binding being
+ * created, owned by the request from now on, or NULL when refreshing the
+ * installed binding for @peer.
+ */
 static gboolean
 priv_send_channel_bind (TurnPriv *priv,  StunMessage *resp,
-    uint16_t channel, const NiceAddress *peer)
+    uint16_t channel, const NiceAddress *peer, ChannelBinding *binding)
 {
   uint32_t channel_attr = channel << 16;
   size_t stun_len;
   struct sockaddr_storage sa;
-  TURNMessage *msg = g_new0 (TURNMessage, 1);
+  ChannelBindRequest *req = g_new0 (ChannelBindRequest, 1);
+  TURNMessage *msg = &req->msg;
 
   nice_address_copy_to_sockaddr (peer, (struct sockaddr *)&sa);
 
   if (!stun_agent_init_request (&priv->agent, &msg->message,
           msg->buffer, sizeof(msg->buffer),
           STUN_CHANNELBIND)) {
-    g_free (msg);
+    g_free (req);
     return FALSE;
   }
 
   if (stun_message_append32 (&msg->message, STUN_ATTRIBUTE_CHANNEL_NUMBER,
           channel_attr) != STUN_MESSAGE_RETURN_SUCCESS) {
-    g_free (msg);
+    g_free (req);
     return FALSE;
   }
 
@@ -1498,7 +1997,7 @@ priv_send_channel_bind (TurnPriv *priv,  StunMessage *resp,
           (struct sockaddr *)&sa,
           sizeof(sa))
       != STUN_MESSAGE_RETURN_SUCCESS) {
-    g_free (msg);
+    g_free (req);
     return FALSE;
   }
 
@@ -1506,7 +2005,7 @@ priv_send_channel_bind (TurnPriv *priv,  StunMessage *resp,
     if (stun_message_append_bytes (&msg->message, STUN_ATTRIBUTE_USERNAME,
             priv->username, priv->username_len)
         != STUN_MESSAGE_RETURN_SUCCESS) {
-      g_free (msg);
+      g_free (req);
       return FALSE;
     }
   }
@@ -1521,7 +2020,7 @@ priv_send_channel_bind (TurnPriv *priv,  StunMessage *resp,
       if (stun_message_append_bytes (&msg->message, STUN_ATTRIBUTE_REALM,
               realm, len)
           != STUN_MESSAGE_RETURN_SUCCESS) {
-        g_free (msg);
+        g_free (req);
         return 0;
       }
     }
@@ -1530,7 +2029,7 @@ priv_send_channel_bind (TurnPriv *priv,  StunMessage *resp,
       if (stun_message_append_bytes (&msg->message, STUN_ATTRIBUTE_NONCE,
               nonce, len)
           != STUN_MESSAGE_RETURN_SUCCESS) {
-        g_free (msg);
+        g_free (req);
         return 0;
       }
     }
@@ -1540,11 +2039,17 @@ priv_send_channel_bind (TurnPriv *priv,  StunMessage *resp,
       priv->password, priv->password_len);
 
   if (stun_len > 0) {
-    priv_send_turn_message (priv, msg);
+    req->binding = binding;
+    req->peer = *peer;
+    req->channel = channel;
+    priv_start_turn_message (priv, msg);
+    priv->channel_bind_requests =
+        g_list_append (priv->channel_bind_requests, req);
+    priv_schedule_tick (priv);
     return TRUE;
   }
 
-  g_free (msg);
+  g_free (req);
   return FALSE;
 }
 
@@ -1556,33 +2061,40 @@ priv_add_channel_binding (TurnPriv *priv, const NiceAddress *peer)
 
   nice_address_copy_to_sockaddr (peer, (struct sockaddr *)&sa);
 
-  if (priv->current_binding) {
+  if (priv_binding_slots_full (priv)) {
     NiceAddress * pending= nice_address_new ();
     *pending = *peer;
     priv->pending_bindings = g_list_append (priv->pending_bindings, pending);
     return FALSE;
   }
 
-  if (priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_DRAFT9 ||
-      priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_RFC5766) {
-    uint16_t channel = 0x4000;
-    GList *i = priv->channels;
-    for (; i; i = i->next) {
-      ChannelBinding *b = i->data;
-      if (channel == b->channel) {
-        i = priv->channels;
-        channel++;
-        continue;
+  if (priv_uses_channel_data (priv)) {
+    uint16_t channel = 0;
+    guint n;
+
+    /* Pick the first free channel number after the last one handed out,
+       so a busy socket does not rescan the low, long-lived bindings */
+    for (n = 0; n < TURN_CHANNEL_COUNT; n++) {
+      uint16_t candidate = priv->next_channel;
+
+      priv->next_channel = candidate == TURN_CHANNEL_MAX ?
+          TURN_CHANNEL_MIN : candidate + 1;
+      if (priv_find_channel_by_number (priv, candidate) == NULL &&
+          !priv_channel_bind_in_flight (priv, candidate)) {
+        channel = candidate;
+        break;
       }
     }
 
-    if (channel >= 0x4000 && channel < 0xffff) {
-      gboolean ret = priv_send_channel_bind (priv, NULL, channel, peer);
-      if (ret) {
-        priv->current_binding = g_new0 (ChannelBinding, 1);
-        priv->current_binding->channel = channel;
-        priv->current_binding->peer = *peer;
-      }
+    if (channel != 0) {
+      ChannelBinding *binding = g_new0 (ChannelBinding, 1);
+      gboolean ret;
+
+      binding->channel = channel;
+      binding->peer = *peer;
+      ret = priv_send_channel_bind (priv, NULL, channel, peer, binding);
+      if (!ret)
+        g_free (binding);
       return ret;
     }
     return FALSE;
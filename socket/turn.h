@@ -52,6 +52,20 @@ typedef enum {
 
 G_BEGIN_DECLS
 
+/* The most payload buffers per packet a TURN socket sends as ChannelData
+   without gathering them first. Each packet gets one more, for the
+   ChannelData header, on its way to the base socket. */
+#define NICE_TURN_SOCKET_MAX_BUFFERS 8
+
+/*
+ * Called when @queued bytes are added to (or, when negative, removed from)
+ * the data waiting for a TURN permission, and when @dropped bytes of it are
+ * given up on. It is called from the same context as the socket functions,
+ * so with the agent lock held.
+ */
+typedef void (*NiceTurnSocketQueueFunc) (gint64 queued, guint64 dropped,
+    gpointer user_data);
+
 gint
 nice_turn_socket_parse_recv (NiceSocket *sock, NiceSocket **from_sock,
     NiceAddress *from, guint len, gchar *buf,
@@ -63,7 +77,9 @@ nice_turn_socket_set_peer (NiceSocket *sock, NiceAddress *peer);
 NiceSocket *
 nice_turn_socket_new (GMainContext *ctx, GObject *nice_agent,
     NiceAddress *addr, NiceSocket *base_socket, NiceAddress *server_addr,
-    gchar *username, gchar *password, NiceTurnSocketCompatibility compatibility);
+    gchar *username, gchar *password, NiceTurnSocketCompatibility compatibility,
+    guint queue_size, gboolean queue_drop_oldest,
+    NiceTurnSocketQueueFunc queue_func, gpointer queue_data);
 
 void
 nice_turn_socket_set_ms_realm(NiceSocket *sock, StunMessage *msg);
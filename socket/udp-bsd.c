@@ -44,6 +44,9 @@
 # include "config.h"
 #endif
 
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE /* for recvmmsg() and sendmmsg() */
+#endif
 
 #include <string.h>
 #include <errno.h>
@@ -55,20 +58,46 @@
 #include <unistd.h>
 #endif
 
+#if defined (__linux__) && defined (HAVE_SENDMMSG)
+#include <netinet/udp.h>
+/* UDP segmentation offload (GSO) and receive coalescing (GRO) */
+#define UDP_OFFLOAD 1
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#define MAX_GSO_SEGMENTS 64
+#define MAX_GSO_SIZE 65000
+#endif
+
 
 static void socket_close (NiceSocket *sock);
 static gint socket_recv (NiceSocket *sock, NiceAddress *from,
     guint len, gchar *buf);
+#ifdef HAVE_RECVMMSG
+static gint socket_recv_messages (NiceSocket *sock,
+    NiceInputMessage *messages, guint n_messages);
+#endif
 static gint socket_send (NiceSocket *sock, const NiceAddress *to,
     guint len, const gchar *buf);
+static gint socket_send_messages (NiceSocket *sock, const NiceAddress *to,
+    const NiceOutputMessage *messages, guint n_messages);
 static gboolean socket_is_reliable (NiceSocket *sock);
 
 struct UdpBsdSocketPrivate
 {
   NiceAddress niceaddr;
   GSocketAddress *gaddr;
+  gboolean gso;         /* send same sized packets as one super-datagram */
+  gboolean gro;         /* kernel may hand us coalesced datagrams */
+  gboolean no_sendmmsg; /* the kernel has no sendmmsg() */
 };
 
+/* gso and no_sendmmsg can be cleared on the send path, which runs without
+ * the agent lock, so they are only accessed with g_atomic_int_*() */
+
 NiceSocket *
 nice_udp_bsd_socket_new (NiceAddress *addr)
 {
@@ -141,7 +170,11 @@ nice_udp_bsd_socket_new (NiceAddress *addr)
   sock->type = NICE_SOCKET_TYPE_UDP_BSD;
   sock->fileno = gsock;
   sock->send = socket_send;
+  sock->send_messages = socket_send_messages;
   sock->recv = socket_recv;
+#ifdef HAVE_RECVMMSG
+  sock->recv_messages = socket_recv_messages;
+#endif
   sock->is_reliable = socket_is_reliable;
   sock->close = socket_close;
   sock->attach = NULL;
@@ -195,6 +228,171 @@ socket_recv (NiceSocket *sock, NiceAddress *from, guint len, gchar *buf)
   return recvd;
 }
 
+gboolean
+nice_udp_bsd_socket_set_offload (NiceSocket *sock, gboolean enabled)
+{
+  struct UdpBsdSocketPrivate *priv = sock->priv;
+#ifdef UDP_OFFLOAD
+  gint fd = g_socket_get_fd (sock->fileno);
+  int val = enabled ? 1 : 0;
+  int zero = 0;
+
+  /* a zero sized UDP_SEGMENT is accepted, and ignored, by kernels with GSO */
+  g_atomic_int_set (&priv->gso, enabled &&
+      setsockopt (fd, IPPROTO_UDP, UDP_SEGMENT, &zero, sizeof (zero)) == 0);
+  priv->gro = setsockopt (fd, IPPROTO_UDP, UDP_GRO, &val, sizeof (val)) == 0
+      && enabled;
+#else
+  g_atomic_int_set (&priv->gso, FALSE);
+  priv->gro = FALSE;
+#endif
+
+  return g_atomic_int_get (&priv->gso) || priv->gro;
+}
+
+gboolean
+nice_udp_bsd_socket_has_gro (NiceSocket *sock)
+{
+  struct UdpBsdSocketPrivate *priv = sock->priv;
+
+  if (sock->type != NICE_SOCKET_TYPE_UDP_BSD)
+    return FALSE;
+
+  return priv->gro;
+}
+
+/*
+ * Like nice_socket_recv(), but on a socket with GRO enabled the datagram
+ * returned may be several datagrams of @segment_size bytes (the last one
+ * possibly shorter) coalesced by the kernel. @segment_size is set to 0 for
+ * a plain datagram.
+ */
+gint
+nice_udp_bsd_socket_recv_segmented (NiceSocket *sock, NiceAddress *from,
+    guint len, gchar *buf, guint *segment_size)
+{
+#ifdef UDP_OFFLOAD
+  struct UdpBsdSocketPrivate *priv = sock->priv;
+#endif
+
+  *segment_size = 0;
+
+#ifdef UDP_OFFLOAD
+  if (priv->gro) {
+    struct sockaddr_storage sa;
+    struct iovec iov;
+    struct msghdr hdr;
+    struct cmsghdr *cmsg;
+    union {
+      char buf[CMSG_SPACE (sizeof (int))];
+      struct cmsghdr align;
+    } control;
+    gint recvd;
+
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    memset (&hdr, 0, sizeof (hdr));
+    hdr.msg_name = &sa;
+    hdr.msg_namelen = sizeof (sa);
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control.buf;
+    hdr.msg_controllen = sizeof (control.buf);
+
+    do {
+      recvd = recvmsg (g_socket_get_fd (sock->fileno), &hdr, MSG_DONTWAIT);
+    } while (recvd < 0 && errno == EINTR);
+
+    if (recvd < 0) {
+      GIOErrorEnum code = g_io_error_from_errno (errno);
+
+      if (code == G_IO_ERROR_WOULD_BLOCK || code == G_IO_ERROR_FAILED)
+        return 0;
+      return -1;
+    }
+
+    if (hdr.msg_flags & MSG_TRUNC)
+      return 0;
+
+    for (cmsg = CMSG_FIRSTHDR (&hdr); cmsg; cmsg = CMSG_NXTHDR (&hdr, cmsg)) {
+      if (cmsg->cmsg_level == IPPROTO_UDP && cmsg->cmsg_type == UDP_GRO) {
+        int gso_size;
+
+        memcpy (&gso_size, CMSG_DATA (cmsg), sizeof (gso_size));
+        if (gso_size > 0 && gso_size < recvd)
+          *segment_size = gso_size;
+      }
+    }
+
+    if (from != NULL)
+      nice_address_set_from_sockaddr (from, (struct sockaddr *) &sa);
+
+    return recvd;
+  }
+#endif
+
+  return socket_recv (sock, from, len, buf);
+}
+
+#ifdef HAVE_RECVMMSG
+static gint
+socket_recv_messages (NiceSocket *sock, NiceInputMessage *messages,
+    guint n_messages)
+{
+  struct mmsghdr hdrs[NICE_AGENT_MAX_RECV_MESSAGES];
+  struct iovec iovs[NICE_AGENT_MAX_RECV_MESSAGES];
+  struct sockaddr_storage addrs[NICE_AGENT_MAX_RECV_MESSAGES];
+  gint fd = g_socket_get_fd (sock->fileno);
+  gint recvd;
+  gint i;
+
+  n_messages = MIN (n_messages, NICE_AGENT_MAX_RECV_MESSAGES);
+  memset (hdrs, 0, n_messages * sizeof (struct mmsghdr));
+
+  for (i = 0; i < (gint) n_messages; i++) {
+    iovs[i].iov_base = messages[i].buf;
+    iovs[i].iov_len = messages[i].size;
+    hdrs[i].msg_hdr.msg_name = &addrs[i];
+    hdrs[i].msg_hdr.msg_namelen = sizeof (addrs[i]);
+    hdrs[i].msg_hdr.msg_iov = &iovs[i];
+    hdrs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  do {
+    recvd = recvmmsg (fd, hdrs, n_messages, MSG_DONTWAIT, NULL);
+  } while (recvd < 0 && errno == EINTR);
+
+  if (recvd < 0) {
+    GIOErrorEnum code;
+
+    if (errno == ENOSYS) {
+      /* Kernel without recvmmsg(), fall back to one datagram per call */
+      sock->recv_messages = NULL;
+      return nice_socket_recv_messages (sock, messages, n_messages);
+    }
+
+    code = g_io_error_from_errno (errno);
+    if (code == G_IO_ERROR_WOULD_BLOCK || code == G_IO_ERROR_FAILED)
+      return 0;
+
+    return -1;
+  }
+
+  for (i = 0; i < recvd; i++) {
+    if (hdrs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+      messages[i].length = 0;
+      continue;
+    }
+
+    messages[i].length = hdrs[i].msg_len;
+    nice_address_set_from_sockaddr (&messages[i].from,
+        (struct sockaddr *) &addrs[i]);
+  }
+
+  return recvd;
+}
+#endif
+
 static gint
 socket_send (NiceSocket *sock, const NiceAddress *to,
     guint len, const gchar *buf)
@@ -219,6 +417,243 @@ socket_send (NiceSocket *sock, const NiceAddress *to,
   return g_socket_send_to (sock->fileno, priv->gaddr, buf, len, NULL, NULL);
 }
 
+/*
+ * Sends to an already converted address. Unlike socket_send() it touches
+ * no per-socket state, so it may be called from any thread concurrently
+ * with the agent using the socket.
+ */
+gint
+nice_udp_bsd_socket_send_to_sockaddr (NiceSocket *sock,
+    const struct sockaddr *sa, socklen_t sa_len, guint len, const gchar *buf)
+{
+  gint sent;
+
+  do {
+    sent = sendto (g_socket_get_fd (sock->fileno), buf, len, 0, sa, sa_len);
+  } while (sent < 0 && errno == EINTR);
+
+  return sent < 0 ? -1 : sent;
+}
+
+/*
+ * Sends the packets one sendto() at a time, gathering those made of
+ * several buffers. Like nice_udp_bsd_socket_send_to_sockaddr() it touches
+ * no per-socket state.
+ */
+static gint
+send_each (NiceSocket *sock, const struct sockaddr *sa, socklen_t sa_len,
+    const NiceOutputMessage *messages, guint n_messages)
+{
+  guint i;
+
+  for (i = 0; i < n_messages; i++) {
+    const NiceOutputMessage *message = &messages[i];
+    gint ret;
+
+    if (message->n_buffers == 1) {
+      ret = nice_udp_bsd_socket_send_to_sockaddr (sock, sa, sa_len,
+          message->buffers[0].size, message->buffers[0].buffer);
+    } else {
+      gsize len;
+      gchar *buf = nice_output_message_gather (message, &len);
+
+      ret = nice_udp_bsd_socket_send_to_sockaddr (sock, sa, sa_len, len, buf);
+      g_free (buf);
+    }
+
+    if (ret < 0)
+      return i > 0 ? (gint) i : ret;
+  }
+
+  return i;
+}
+
+#ifdef HAVE_SENDMMSG
+/* GOutputVector is laid out like struct iovec, just as GSocket assumes */
+G_STATIC_ASSERT (sizeof (GOutputVector) == sizeof (struct iovec));
+G_STATIC_ASSERT (G_STRUCT_OFFSET (GOutputVector, buffer) ==
+    G_STRUCT_OFFSET (struct iovec, iov_base));
+G_STATIC_ASSERT (G_STRUCT_OFFSET (GOutputVector, size) ==
+    G_STRUCT_OFFSET (struct iovec, iov_len));
+
+#define MAX_SEND_MESSAGES 64
+
+static gsize
+output_message_size (const NiceOutputMessage *message)
+{
+  gsize size = 0;
+  guint i;
+
+  for (i = 0; i < message->n_buffers; i++)
+    size += message->buffers[i].size;
+
+  return size;
+}
+
+static gint
+send_mmsg (NiceSocket *sock, const struct sockaddr *sa, socklen_t sa_len,
+    const NiceOutputMessage *messages, guint n_messages)
+{
+  struct UdpBsdSocketPrivate *priv = sock->priv;
+  struct mmsghdr hdrs[MAX_SEND_MESSAGES];
+  guint n_packets[MAX_SEND_MESSAGES];
+#ifdef UDP_OFFLOAD
+  gboolean gso = g_atomic_int_get (&priv->gso);
+  struct iovec iovs[MAX_SEND_MESSAGES * 2];
+  union {
+    char buf[CMSG_SPACE (sizeof (guint16))];
+    struct cmsghdr align;
+  } controls[MAX_SEND_MESSAGES];
+#endif
+  gint fd = g_socket_get_fd (sock->fileno);
+  guint sent = 0;
+
+  while (sent < n_messages) {
+    guint n_hdrs = 0;
+    guint next = sent;
+    guint n_sent = 0;
+    guint i;
+    gint ret;
+#ifdef UDP_OFFLOAD
+    guint n_iovs = 0;
+#endif
+
+    memset (hdrs, 0, sizeof (hdrs));
+
+    while (next < n_messages && n_hdrs < MAX_SEND_MESSAGES) {
+      const NiceOutputMessage *message = &messages[next];
+      struct msghdr *hdr = &hdrs[n_hdrs].msg_hdr;
+      guint n = 0;
+
+      hdr->msg_name = (struct sockaddr *) sa;
+      hdr->msg_namelen = sa_len;
+
+#ifdef UDP_OFFLOAD
+      if (gso) {
+        /* Gather a run of packets of the same size (the last one may be
+         * shorter) into one super-datagram the kernel segments for us */
+        gsize segment_size = output_message_size (message);
+        gsize total = 0;
+        guint first_iov = n_iovs;
+
+        while (segment_size > 0 && next + n < n_messages &&
+            n < MAX_GSO_SEGMENTS &&
+            n_iovs + messages[next + n].n_buffers <= G_N_ELEMENTS (iovs)) {
+          const NiceOutputMessage *segment = &messages[next + n];
+          gsize size = output_message_size (segment);
+
+          if (size > segment_size || total + size > MAX_GSO_SIZE)
+            break;
+
+          memcpy (&iovs[n_iovs], segment->buffers,
+              segment->n_buffers * sizeof (struct iovec));
+          n_iovs += segment->n_buffers;
+          total += size;
+          n++;
+
+          if (size < segment_size)
+            break;
+        }
+
+        if (n > 1) {
+          struct cmsghdr *cmsg;
+          guint16 gso_size = segment_size;
+
+          hdr->msg_iov = &iovs[first_iov];
+          hdr->msg_iovlen = n_iovs - first_iov;
+          hdr->msg_control = controls[n_hdrs].buf;
+          hdr->msg_controllen = sizeof (controls[n_hdrs].buf);
+          cmsg = CMSG_FIRSTHDR (hdr);
+          cmsg->cmsg_level = IPPROTO_UDP;
+          cmsg->cmsg_type = UDP_SEGMENT;
+          cmsg->cmsg_len = CMSG_LEN (sizeof (gso_size));
+          memcpy (CMSG_DATA (cmsg), &gso_size, sizeof (gso_size));
+        } else {
+          n_iovs = first_iov;
+          n = 0;
+        }
+      }
+#endif
+
+      if (n == 0) {
+        hdr->msg_iov = (struct iovec *) message->buffers;
+        hdr->msg_iovlen = message->n_buffers;
+        n = 1;
+      }
+
+      n_packets[n_hdrs++] = n;
+      next += n;
+    }
+
+    do {
+      ret = sendmmsg (fd, hdrs, n_hdrs, MSG_DONTWAIT);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0) {
+      if (errno == ENOSYS && sent == 0) {
+        /* Kernel without sendmmsg(), fall back to one datagram per call */
+        g_atomic_int_set (&priv->no_sendmmsg, TRUE);
+        return send_each (sock, sa, sa_len, messages, n_messages);
+      }
+#ifdef UDP_OFFLOAD
+      if (gso && (errno == EIO || errno == EINVAL) &&
+          next - sent > n_hdrs) {
+        /* The route or device can't segment for us, stop trying */
+        gso = FALSE;
+        g_atomic_int_set (&priv->gso, FALSE);
+        continue;
+      }
+#endif
+      return sent > 0 ? (gint) sent : -1;
+    }
+
+    for (i = 0; i < (guint) ret; i++)
+      n_sent += n_packets[i];
+    sent += n_sent;
+
+    if ((guint) ret < n_hdrs)
+      break;
+  }
+
+  return sent;
+}
+#endif
+
+/*
+ * Sends @n_messages packets to an already converted address, with
+ * sendmmsg() when the kernel has it. Safe to call without the agent lock,
+ * just like nice_udp_bsd_socket_send_to_sockaddr().
+ */
+gint
+nice_udp_bsd_socket_send_messages_to_sockaddr (NiceSocket *sock,
+    const struct sockaddr *sa, socklen_t sa_len,
+    const NiceOutputMessage *messages, guint n_messages)
+{
+#ifdef HAVE_SENDMMSG
+  struct UdpBsdSocketPrivate *priv = sock->priv;
+
+  if (!g_atomic_int_get (&priv->no_sendmmsg))
+    return send_mmsg (sock, sa, sa_len, messages, n_messages);
+#endif
+
+  return send_each (sock, sa, sa_len, messages, n_messages);
+}
+
+static gint
+socket_send_messages (NiceSocket *sock, const NiceAddress *to,
+    const NiceOutputMessage *messages, guint n_messages)
+{
+  struct sockaddr_storage sa;
+  socklen_t sa_len;
+
+  nice_address_copy_to_sockaddr (to, (struct sockaddr *) &sa);
+  sa_len = sa.ss_family == AF_INET6 ?
+      sizeof (struct sockaddr_in6) : sizeof (struct sockaddr_in);
+
+  return nice_udp_bsd_socket_send_messages_to_sockaddr (sock,
+      (struct sockaddr *) &sa, sa_len, messages, n_messages);
+}
+
 static gboolean
 socket_is_reliable (NiceSocket *sock)
 {
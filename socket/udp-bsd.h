@@ -46,6 +46,26 @@ G_BEGIN_DECLS
 NiceSocket *
 nice_udp_bsd_socket_new (NiceAddress *addr);
 
+gboolean
+nice_udp_bsd_socket_set_offload (NiceSocket *sock, gboolean enabled);
+
+gboolean
+nice_udp_bsd_socket_has_gro (NiceSocket *sock);
+
+gint
+nice_udp_bsd_socket_send_to_sockaddr (NiceSocket *sock,
+    const struct sockaddr *sa, socklen_t sa_len, guint len, const gchar *buf);
+
+gint
+nice_udp_bsd_socket_send_messages_to_sockaddr (NiceSocket *sock,
+    const struct sockaddr *sa, socklen_t sa_len,
+    const NiceOutputMessage *messages, guint n_messages);
+
+G_GNUC_WARN_UNUSED_RESULT
+gint
+nice_udp_bsd_socket_recv_segmented (NiceSocket *sock, NiceAddress *from,
+    guint len, gchar *buf, guint *segment_size);
+
 G_END_DECLS
 
 #endif /* _UDP_BSD_H */
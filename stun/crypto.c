@@ -0,0 +1,261 @@
+/*
+ * This file is part of the Nice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Nice GLib ICE library.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include "crypto.h"
+
+#include <glib.h>
+#include <string.h>
+
+#ifdef HAVE_OPENSSL
+#include <openssl/evp.h>
+#endif
+
+static const StunCryptoOps builtin_ops = {
+  STUN_CRYPTO_BACKEND_BUILTIN,
+  "builtin",
+  sha1_builtin_vector,
+  md5_builtin_vector,
+  hmac_sha1_builtin_key_init,
+  hmac_sha1_builtin_key_clear,
+  hmac_sha1_builtin_vector_keyed,
+  hmac_sha1_builtin_vector,
+};
+
+#ifdef HAVE_OPENSSL
+
+/* Every digest on a thread reuses the same context instead of creating and
+ * destroying one per message */
+static void
+priv_scratch_ctx_free (gpointer ctx)
+{
+  EVP_MD_CTX_destroy (ctx);
+}
+
+static GPrivate scratch_ctx = G_PRIVATE_INIT (priv_scratch_ctx_free);
+
+static EVP_MD_CTX *
+priv_scratch_ctx (void)
+{
+  EVP_MD_CTX *ctx = g_private_get (&scratch_ctx);
+
+  if (G_UNLIKELY (ctx == NULL)) {
+    ctx = EVP_MD_CTX_create ();
+    if (ctx != NULL)
+      g_private_set (&scratch_ctx, ctx);
+  }
+
+  return ctx;
+}
+
+static bool
+priv_evp_update_vector (EVP_MD_CTX *ctx, size_t num_elem,
+    const uint8_t *addr[], const size_t *len)
+{
+  size_t i;
+
+  for (i = 0; i < num_elem; i++)
+    if (!EVP_DigestUpdate (ctx, addr[i], len[i]))
+      return false;
+
+  return true;
+}
+
+static bool
+priv_evp_vector (const EVP_MD *md, size_t num_elem, const uint8_t *addr[],
+    const size_t *len, uint8_t *mac)
+{
+  EVP_MD_CTX *ctx = priv_scratch_ctx ();
+
+  return ctx != NULL &&
+      EVP_DigestInit_ex (ctx, md, NULL) &&
+      priv_evp_update_vector (ctx, num_elem, addr, len) &&
+      EVP_DigestFinal_ex (ctx, mac, NULL);
+}
+
+static void
+priv_libcrypto_sha1_vector (size_t num_elem, const uint8_t *addr[],
+    const size_t *len, uint8_t *mac)
+{
+  if (!priv_evp_vector (EVP_sha1 (), num_elem, addr, len, mac))
+    sha1_builtin_vector (num_elem, addr, len, mac);
+}
+
+static EVP_MD_CTX *
+priv_evp_pad_ctx (const unsigned char pad[64])
+{
+  EVP_MD_CTX *ctx = EVP_MD_CTX_create ();
+
+  if (ctx != NULL && (!EVP_DigestInit_ex (ctx, EVP_sha1 (), NULL) ||
+          !EVP_DigestUpdate (ctx, pad, 64))) {
+    EVP_MD_CTX_destroy (ctx);
+    ctx = NULL;
+  }
+
+  return ctx;
+}
+
+static void
+priv_libcrypto_hmac_sha1_key_clear (HmacSha1Key *hkey)
+{
+  if (hkey->inner_ctx)
+    EVP_MD_CTX_destroy (hkey->inner_ctx);
+  if (hkey->outer_ctx)
+    EVP_MD_CTX_destroy (hkey->outer_ctx);
+  hkey->inner_ctx = NULL;
+  hkey->outer_ctx = NULL;
+  hmac_sha1_builtin_key_clear (hkey);
+}
+
+static void
+priv_libcrypto_hmac_sha1_key_init (HmacSha1Key *hkey,
+    const unsigned char k_ipad[64], const unsigned char k_opad[64])
+{
+  /* the builtin states are there to fall back on if libcrypto fails */
+  hmac_sha1_builtin_key_init (hkey, k_ipad, k_opad);
+
+  hkey->inner_ctx = priv_evp_pad_ctx (k_ipad);
+  hkey->outer_ctx = priv_evp_pad_ctx (k_opad);
+  if (hkey->inner_ctx == NULL || hkey->outer_ctx == NULL) {
+    if (hkey->inner_ctx)
+      EVP_MD_CTX_destroy (hkey->inner_ctx);
+    if (hkey->outer_ctx)
+      EVP_MD_CTX_destroy (hkey->outer_ctx);
+    hkey->inner_ctx = NULL;
+    hkey->outer_ctx = NULL;
+  }
+}
+
+static void
+priv_libcrypto_hmac_sha1_vector_keyed (const HmacSha1Key *hkey,
+    size_t num_elem, const uint8_t *addr[], const size_t *len, uint8_t *mac)
+{
+  EVP_MD_CTX *ctx;
+
+  if (hkey->inner_ctx != NULL && (ctx = priv_scratch_ctx ()) != NULL &&
+      EVP_MD_CTX_copy_ex (ctx, hkey->inner_ctx) &&
+      priv_evp_update_vector (ctx, num_elem, addr, len) &&
+      EVP_DigestFinal_ex (ctx, mac, NULL) &&
+      EVP_MD_CTX_copy_ex (ctx, hkey->outer_ctx) &&
+      EVP_DigestUpdate (ctx, mac, SHA1_MAC_LEN) &&
+      EVP_DigestFinal_ex (ctx, mac, NULL))
+    return;
+
+  hmac_sha1_builtin_vector_keyed (hkey, num_elem, addr, len, mac);
+}
+
+static void
+priv_libcrypto_hmac_sha1_vector (const unsigned char k_ipad[64],
+    const unsigned char k_opad[64], size_t num_elem,
+    const uint8_t *addr[], const size_t *len, uint8_t *mac)
+{
+  EVP_MD_CTX *ctx = priv_scratch_ctx ();
+
+  if (ctx != NULL &&
+      EVP_DigestInit_ex (ctx, EVP_sha1 (), NULL) &&
+      EVP_DigestUpdate (ctx, k_ipad, 64) &&
+      priv_evp_update_vector (ctx, num_elem, addr, len) &&
+      EVP_DigestFinal_ex (ctx, mac, NULL) &&
+      EVP_DigestInit_ex (ctx, EVP_sha1 (), NULL) &&
+      EVP_DigestUpdate (ctx, k_opad, 64) &&
+      EVP_DigestUpdate (ctx, mac, SHA1_MAC_LEN) &&
+      EVP_DigestFinal_ex (ctx, mac, NULL))
+    return;
+
+  hmac_sha1_builtin_vector (k_ipad, k_opad, num_elem, addr, len, mac);
+}
+
+/* MD5 is only used on the short inputs of the long-term keys, where the
+ * EVP dispatch costs more than the built-in implementation takes */
+static const StunCryptoOps libcrypto_ops = {
+  STUN_CRYPTO_BACKEND_LIBCRYPTO,
+  "libcrypto",
+  priv_libcrypto_sha1_vector,
+  md5_builtin_vector,
+  priv_libcrypto_hmac_sha1_key_init,
+  priv_libcrypto_hmac_sha1_key_clear,
+  priv_libcrypto_hmac_sha1_vector_keyed,
+  priv_libcrypto_hmac_sha1_vector,
+};
+
+#endif /* HAVE_OPENSSL */
+
+static const StunCryptoOps *current_ops = NULL;
+
+static const StunCryptoOps *
+priv_default_ops (void)
+{
+#ifdef HAVE_OPENSSL
+  const char *env = g_getenv ("NICE_STUN_CRYPTO");
+
+  if (env == NULL || strcmp (env, "builtin") != 0)
+    return &libcrypto_ops;
+#endif
+
+  return &builtin_ops;
+}
+
+const StunCryptoOps *
+stun_crypto_ops (void)
+{
+  const StunCryptoOps *ops = g_atomic_pointer_get (&current_ops);
+
+  if (G_UNLIKELY (ops == NULL)) {
+    g_atomic_pointer_compare_and_exchange (&current_ops, NULL,
+        priv_default_ops ());
+    ops = g_atomic_pointer_get (&current_ops);
+  }
+
+  return ops;
+}
+
+StunCryptoBackend
+stun_crypto_get_backend (void)
+{
+  return stun_crypto_ops ()->backend;
+}
+
+bool
+stun_crypto_set_backend (StunCryptoBackend backend)
+{
+  switch (backend) {
+    case STUN_CRYPTO_BACKEND_BUILTIN:
+      g_atomic_pointer_set (&current_ops, &builtin_ops);
+      return true;
+    case STUN_CRYPTO_BACKEND_LIBCRYPTO:
+#ifdef HAVE_OPENSSL
+      g_atomic_pointer_set (&current_ops, &libcrypto_ops);
+      return true;
+#else
+      return false;
+#endif
+  }
+
+  return false;
+}
@@ -0,0 +1,98 @@
+/*
+ * This file is part of the Nice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Nice GLib ICE library.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+#ifndef _STUN_CRYPTO_H
+#define _STUN_CRYPTO_H
+
+/*
+ * The digests behind MESSAGE-INTEGRITY and the long-term credentials can
+ * run on libcrypto, which has SHA-NI/AVX2 kernels, or on the portable code
+ * in sha1.c and md5.c. libcrypto is used when the library was built with
+ * it, unless the NICE_STUN_CRYPTO environment variable is set to "builtin".
+ */
+
+#ifdef _WIN32
+#include "win32_common.h"
+#else
+#include <stdint.h>
+#include <stdbool.h>
+#endif
+#include <stddef.h>
+
+#include "sha1.h"
+
+typedef enum
+{
+  STUN_CRYPTO_BACKEND_BUILTIN,
+  STUN_CRYPTO_BACKEND_LIBCRYPTO,
+} StunCryptoBackend;
+
+typedef struct _StunCryptoOps
+{
+  StunCryptoBackend backend;
+  const char *name;
+
+  void (*sha1_vector) (size_t num_elem, const uint8_t *addr[],
+      const size_t *len, uint8_t *mac);
+  void (*md5_vector) (size_t num_elem, const uint8_t *addr[],
+      const size_t *len, uint8_t *mac);
+  /* sets up the states of @hkey from the padded key blocks */
+  void (*hmac_sha1_key_init) (HmacSha1Key *hkey,
+      const unsigned char k_ipad[64], const unsigned char k_opad[64]);
+  void (*hmac_sha1_key_clear) (HmacSha1Key *hkey);
+  void (*hmac_sha1_vector_keyed) (const HmacSha1Key *hkey, size_t num_elem,
+      const uint8_t *addr[], const size_t *len, uint8_t *mac);
+  /* a one-off MAC from the padded key blocks, without a key state */
+  void (*hmac_sha1_vector) (const unsigned char k_ipad[64],
+      const unsigned char k_opad[64], size_t num_elem,
+      const uint8_t *addr[], const size_t *len, uint8_t *mac);
+} StunCryptoOps;
+
+const StunCryptoOps *stun_crypto_ops (void);
+
+StunCryptoBackend stun_crypto_get_backend (void);
+
+/*
+ * Switches the backend for the digests computed from now on. Returns false
+ * if @backend wasn't built in.
+ */
+bool stun_crypto_set_backend (StunCryptoBackend backend);
+
+/* The portable implementations, from sha1.c and md5.c */
+void sha1_builtin_vector (size_t num_elem, const uint8_t *addr[],
+    const size_t *len, uint8_t *mac);
+void md5_builtin_vector (size_t num_elem, const uint8_t *addr[],
+    const size_t *len, uint8_t *mac);
+void hmac_sha1_builtin_key_init (HmacSha1Key *hkey,
+    const unsigned char k_ipad[64], const unsigned char k_opad[64]);
+void hmac_sha1_builtin_key_clear (HmacSha1Key *hkey);
+void hmac_sha1_builtin_vector_keyed (const HmacSha1Key *hkey,
+    size_t num_elem, const uint8_t *addr[], const size_t *len, uint8_t *mac);
+void hmac_sha1_builtin_vector (const unsigned char k_ipad[64],
+    const unsigned char k_opad[64], size_t num_elem,
+    const uint8_t *addr[], const size_t *len, uint8_t *mac);
+
+#endif /* _STUN_CRYPTO_H */
@@ -53,6 +53,9 @@ void stun_debug_enable (void) {
 void stun_debug_disable (void) {
   debug_enabled = 0;
 }
+gboolean stun_debug_is_enabled (void) {
+  return debug_enabled;
+}
 
 void stun_message_log(StunMessage* msg, gboolean transmit, struct sockaddr* addr)
 {
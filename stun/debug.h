@@ -63,6 +63,14 @@ void stun_debug_enable (void);
  */
 void stun_debug_disable (void);
 
+/**
+ * stun_debug_is_enabled:
+ *
+ * Returns: %TRUE if stun_debug() messages are output, so callers can skip
+ * formatting their arguments otherwise
+ */
+gboolean stun_debug_is_enabled (void);
+
 
 void stun_debug (const char *fmt, ...);
 void stun_debug_bytes (const void *data, size_t len);
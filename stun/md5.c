@@ -13,6 +13,7 @@
  */
 
 #include "md5.h"
+#include "crypto.h"
 #include <string.h>
 
 /* ===== start - public domain MD5 implementation ===== */
@@ -165,6 +166,33 @@ void MD5Final(unsigned char digest[16], struct MD5Context *ctx)
   memset(ctx, 0, sizeof(struct MD5Context));	/* In case it's sensitive */
 }
 
+void md5_builtin_vector(size_t num_elem, const uint8_t *addr[],
+    const size_t *len, uint8_t *mac)
+{
+  MD5_CTX ctx;
+  size_t i;
+
+  MD5Init(&ctx);
+  for (i = 0; i < num_elem; i++)
+    MD5Update(&ctx, addr[i], len[i]);
+  MD5Final(mac, &ctx);
+}
+
+/**
+ * md5_vector:
+ * @num_elem: Number of elements in the data vector
+ * @addr: Pointers to the data areas
+ * @len: Lengths of the data blocks
+ * @mac: Buffer for the hash (16 bytes)
+ *
+ * MD5 hash for data vector, on the current crypto backend
+ */
+void md5_vector(size_t num_elem, const uint8_t *addr[], const size_t *len,
+    uint8_t *mac)
+{
+  stun_crypto_ops()->md5_vector(num_elem, addr, len, mac);
+}
+
 /* The four core functions - F1 is optimized somewhat */
 
 /* #define F1(x, y, z) (x & y | ~x & z) */
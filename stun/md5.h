@@ -35,6 +35,8 @@ typedef struct MD5Context MD5_CTX;
 void MD5Init(MD5_CTX *context);
 void MD5Update(MD5_CTX *context, unsigned char const *buf, unsigned len);
 void MD5Final(unsigned char digest[16], MD5_CTX *context);
+void md5_vector(size_t num_elem, const uint8_t *addr[], const size_t *len,
+    uint8_t *mac);
 
 
 #endif /* MD5_H */
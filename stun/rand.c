@@ -0,0 +1,294 @@
+/*
+ * This file is part of the Nice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Nice GLib ICE library.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+/* rand_s() is only declared if this is defined before <stdlib.h> is first
+ * included, which glib.h and config.h may already do */
+#ifdef _WIN32
+#define _CRT_RAND_S
+#endif
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include "rand.h"
+
+#include <glib.h>
+#include <string.h>
+
+#ifdef HAVE_OPENSSL
+#include <openssl/rand.h>
+#elif defined(_WIN32)
+#include <stdlib.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+#define CHACHA_KEY_LEN 32
+#define CHACHA_NONCE_LEN 8
+#define CHACHA_BLOCK_LEN 64
+
+/* keystream generated at once, the start of which becomes the next key */
+#define STUN_RAND_BUFFER_LEN (16 * CHACHA_BLOCK_LEN)
+/* bytes handed out before asking the system generator again */
+#define STUN_RAND_RESEED_INTERVAL (1024 * 1024)
+
+typedef struct {
+  uint32_t input[16];
+  uint8_t buffer[STUN_RAND_BUFFER_LEN];
+  size_t available;         /* unused bytes at the end of buffer */
+  size_t until_reseed;
+  unsigned fork_generation;
+} StunRandState;
+
+static void priv_rand_state_free (gpointer data);
+
+static GPrivate rand_state = G_PRIVATE_INIT (priv_rand_state_free);
+static unsigned rand_fork_generation = 0;
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QUARTERROUND(a, b, c, d) \
+  a += b; d ^= a; d = ROTL32 (d, 16); \
+  c += d; b ^= c; b = ROTL32 (b, 12); \
+  a += b; d ^= a; d = ROTL32 (d, 8); \
+  c += d; b ^= c; b = ROTL32 (b, 7)
+
+static inline uint32_t
+priv_load32_le (const uint8_t *p)
+{
+  return (uint32_t) p[0] | (uint32_t) p[1] << 8 |
+      (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static inline void
+priv_store32_le (uint8_t *p, uint32_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+/* The original ChaCha20 of D. J. Bernstein: 64 bit block counter in
+ * input[12..13] and 64 bit nonce in input[14..15] */
+static void
+priv_chacha20_block (uint32_t input[16], uint8_t out[CHACHA_BLOCK_LEN])
+{
+  uint32_t x[16];
+  unsigned i;
+
+  memcpy (x, input, sizeof (x));
+  for (i = 0; i < 10; i++) {
+    QUARTERROUND (x[0], x[4], x[8], x[12]);
+    QUARTERROUND (x[1], x[5], x[9], x[13]);
+    QUARTERROUND (x[2], x[6], x[10], x[14]);
+    QUARTERROUND (x[3], x[7], x[11], x[15]);
+    QUARTERROUND (x[0], x[5], x[10], x[15]);
+    QUARTERROUND (x[1], x[6], x[11], x[12]);
+    QUARTERROUND (x[2], x[7], x[8], x[13]);
+    QUARTERROUND (x[3], x[4], x[9], x[14]);
+  }
+  for (i = 0; i < 16; i++)
+    priv_store32_le (out + 4 * i, x[i] + input[i]);
+
+  if (++input[12] == 0)
+    input[13]++;
+}
+
+static void
+priv_chacha20_keysetup (StunRandState *state, const uint8_t *key,
+    const uint8_t *nonce)
+{
+  /* "expand 32-byte k" */
+  state->input[0] = 0x61707865;
+  state->input[1] = 0x3320646e;
+  state->input[2] = 0x79622d32;
+  state->input[3] = 0x6b206574;
+  state->input[4] = priv_load32_le (key + 0);
+  state->input[5] = priv_load32_le (key + 4);
+  state->input[6] = priv_load32_le (key + 8);
+  state->input[7] = priv_load32_le (key + 12);
+  state->input[8] = priv_load32_le (key + 16);
+  state->input[9] = priv_load32_le (key + 20);
+  state->input[10] = priv_load32_le (key + 24);
+  state->input[11] = priv_load32_le (key + 28);
+  state->input[12] = 0;
+  state->input[13] = 0;
+  state->input[14] = priv_load32_le (nonce + 0);
+  state->input[15] = priv_load32_le (nonce + 4);
+}
+
+static void
+priv_system_bytes (uint8_t *buf, size_t len)
+{
+#ifdef HAVE_OPENSSL
+  if (RAND_bytes (buf, len) == 1)
+    return;
+#elif defined(_WIN32)
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    unsigned int v;
+
+    if (rand_s (&v) != 0)
+      break;
+    buf[i] = v;
+  }
+  if (i == len)
+    return;
+#else
+  int fd = open ("/dev/urandom", O_RDONLY);
+
+  if (fd >= 0) {
+    size_t done = 0;
+
+    while (done < len) {
+      ssize_t ret = read (fd, buf + done, len - done);
+
+      if (ret <= 0)
+        break;
+      done += ret;
+    }
+    close (fd);
+    if (done == len)
+      return;
+  }
+#endif
+
+  /* There is no sensible way to go on without a secure seed: transaction
+   * IDs and credentials would become guessable */
+  g_error ("Could not get random bytes from the system");
+}
+
+#ifndef _WIN32
+static void
+priv_rand_atfork_child (void)
+{
+  /* the child must not replay the keystream its parent will also use */
+  rand_fork_generation++;
+}
+#endif
+
+/* Fills the buffer with keystream and immediately rekeys from its start,
+ * so that a copy of the state can't be used to recover what was handed out
+ * before */
+static void
+priv_rand_refill (StunRandState *state)
+{
+  size_t i;
+
+  if (state->until_reseed == 0 ||
+      state->fork_generation != rand_fork_generation) {
+    uint8_t seed[CHACHA_KEY_LEN + CHACHA_NONCE_LEN];
+
+    priv_system_bytes (seed, sizeof (seed));
+    if (state->input[0] == 0) {
+      priv_chacha20_keysetup (state, seed, seed + CHACHA_KEY_LEN);
+    } else {
+      /* mix the seed into what we have rather than replace it */
+      for (i = 0; i < 8; i++)
+        state->input[4 + i] ^= priv_load32_le (seed + 4 * i);
+      state->input[14] ^= priv_load32_le (seed + CHACHA_KEY_LEN);
+      state->input[15] ^= priv_load32_le (seed + CHACHA_KEY_LEN + 4);
+    }
+    memset (seed, 0, sizeof (seed));
+
+    state->until_reseed = STUN_RAND_RESEED_INTERVAL;
+    state->fork_generation = rand_fork_generation;
+  }
+
+  for (i = 0; i < STUN_RAND_BUFFER_LEN; i += CHACHA_BLOCK_LEN)
+    priv_chacha20_block (state->input, state->buffer + i);
+
+  priv_chacha20_keysetup (state, state->buffer,
+      state->buffer + CHACHA_KEY_LEN);
+  memset (state->buffer, 0, CHACHA_KEY_LEN + CHACHA_NONCE_LEN);
+  state->available = STUN_RAND_BUFFER_LEN - CHACHA_KEY_LEN - CHACHA_NONCE_LEN;
+}
+
+static void
+priv_rand_state_free (gpointer data)
+{
+  StunRandState *state = data;
+
+  memset (state, 0, sizeof (*state));
+  g_free (state);
+}
+
+static StunRandState *
+priv_rand_state_get (void)
+{
+  StunRandState *state = g_private_get (&rand_state);
+
+  if (G_UNLIKELY (state == NULL)) {
+#ifndef _WIN32
+    static gsize atfork_registered = 0;
+
+    if (g_once_init_enter (&atfork_registered)) {
+      pthread_atfork (NULL, NULL, priv_rand_atfork_child);
+      g_once_init_leave (&atfork_registered, 1);
+    }
+#endif
+
+    state = g_new0 (StunRandState, 1);
+    /* until_reseed == 0 makes the first refill take a system seed */
+    g_private_set (&rand_state, state);
+  }
+
+  return state;
+}
+
+void stun_rand_bytes (uint8_t *buf, size_t len)
+{
+  StunRandState *state = priv_rand_state_get ();
+
+  while (len > 0) {
+    size_t n;
+    uint8_t *src;
+
+    if (state->available == 0 ||
+        state->fork_generation != rand_fork_generation)
+      priv_rand_refill (state);
+
+    n = MIN (len, state->available);
+    src = state->buffer + STUN_RAND_BUFFER_LEN - state->available;
+    memcpy (buf, src, n);
+    /* what was handed out must not stay around */
+    memset (src, 0, n);
+
+    buf += n;
+    len -= n;
+    state->available -= n;
+    state->until_reseed = state->until_reseed > n ?
+        state->until_reseed - n : 0;
+  }
+}
@@ -0,0 +1,56 @@
+/*
+ * This file is part of the Nice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Nice GLib ICE library.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+#ifndef _STUN_RAND_H
+#define _STUN_RAND_H
+
+/*
+ * Cryptographically secure random bytes for transaction IDs, credentials and
+ * tie-breakers. Each thread runs its own ChaCha20 keystream, keyed from the
+ * system generator (RAND_bytes() when built with OpenSSL) and rekeyed from
+ * its own output after every refill, so the system generator is only asked
+ * for 40 bytes once per thread and then again every megabyte or after a
+ * fork().
+ */
+
+#ifdef _WIN32
+#include "win32_common.h"
+#else
+#include <stdint.h>
+#include <stddef.h>
+#endif
+
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+void stun_rand_bytes (uint8_t *buf, size_t len);
+
+# ifdef __cplusplus
+}
+# endif
+
+#endif /* _STUN_RAND_H */
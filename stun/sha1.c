@@ -13,40 +13,200 @@
  */
 
 #include "sha1.h"
+#include "crypto.h"
 
 #include <string.h>
-#include <openssl/evp.h>
+
+/*
+ * Built-in SHA-1 (FIPS 180-1), used when libcrypto isn't available or was
+ * not selected, see crypto.h.
+ */
+
+#define ROL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void SHA1Transform(uint32_t state[5], const unsigned char buffer[64])
+{
+  uint32_t w[80];
+  uint32_t a, b, c, d, e, t;
+  int i;
+
+  for (i = 0; i < 16; i++)
+    w[i] = ((uint32_t) buffer[4 * i] << 24) |
+        ((uint32_t) buffer[4 * i + 1] << 16) |
+        ((uint32_t) buffer[4 * i + 2] << 8) |
+        (uint32_t) buffer[4 * i + 3];
+  for (i = 16; i < 80; i++)
+    w[i] = ROL32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+  a = state[0];
+  b = state[1];
+  c = state[2];
+  d = state[3];
+  e = state[4];
+
+  for (i = 0; i < 80; i++) {
+    if (i < 20)
+      t = ((b & c) | (~b & d)) + 0x5A827999;
+    else if (i < 40)
+      t = (b ^ c ^ d) + 0x6ED9EBA1;
+    else if (i < 60)
+      t = ((b & c) | (b & d) | (c & d)) + 0x8F1BBCDC;
+    else
+      t = (b ^ c ^ d) + 0xCA62C1D6;
+    t += ROL32(a, 5) + e + w[i];
+    e = d;
+    d = c;
+    c = ROL32(b, 30);
+    b = a;
+    a = t;
+  }
+
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+}
+
+void SHA1Init(SHA1_CTX *context)
+{
+  context->state[0] = 0x67452301;
+  context->state[1] = 0xEFCDAB89;
+  context->state[2] = 0x98BADCFE;
+  context->state[3] = 0x10325476;
+  context->state[4] = 0xC3D2E1F0;
+  context->count[0] = context->count[1] = 0;
+}
+
+void SHA1Update(SHA1_CTX *context, const void *_data, uint32_t len)
+{
+  const unsigned char *data = _data;
+  uint32_t i, j;
+
+  j = (context->count[0] >> 3) & 63;
+  if ((context->count[0] += len << 3) < (len << 3))
+    context->count[1]++;
+  context->count[1] += (len >> 29);
+
+  if ((j + len) > 63) {
+    memcpy(&context->buffer[j], data, (i = 64 - j));
+    SHA1Transform(context->state, context->buffer);
+    for ( ; i + 63 < len; i += 64)
+      SHA1Transform(context->state, &data[i]);
+    j = 0;
+  } else {
+    i = 0;
+  }
+  memcpy(&context->buffer[j], &data[i], len - i);
+}
+
+void SHA1Final(unsigned char digest[20], SHA1_CTX *context)
+{
+  unsigned char finalcount[8];
+  uint32_t i;
+
+  for (i = 0; i < 8; i++)
+    finalcount[i] = (unsigned char)
+        ((context->count[(i >= 4 ? 0 : 1)] >> ((3 - (i & 3)) * 8)) & 255);
+  SHA1Update(context, (const unsigned char *) "\200", 1);
+  while ((context->count[0] & 504) != 448)
+    SHA1Update(context, (const unsigned char *) "\0", 1);
+  SHA1Update(context, finalcount, 8);
+  for (i = 0; i < 20; i++)
+    digest[i] = (unsigned char)
+        ((context->state[i >> 2] >> ((3 - (i & 3)) * 8)) & 255);
+
+  memset(context, 0, sizeof(*context));
+}
+
+void sha1_builtin_vector(size_t num_elem, const uint8_t *addr[],
+    const size_t *len, uint8_t *mac)
+{
+  SHA1_CTX ctx;
+  size_t i;
+
+  SHA1Init(&ctx);
+  for (i = 0; i < num_elem; i++)
+    SHA1Update(&ctx, addr[i], len[i]);
+  SHA1Final(mac, &ctx);
+}
+
+void hmac_sha1_builtin_key_init(HmacSha1Key *hkey,
+    const unsigned char k_ipad[64], const unsigned char k_opad[64])
+{
+  SHA1Init(&hkey->inner);
+  SHA1Update(&hkey->inner, k_ipad, 64);
+  SHA1Init(&hkey->outer);
+  SHA1Update(&hkey->outer, k_opad, 64);
+}
+
+void hmac_sha1_builtin_key_clear(HmacSha1Key *hkey)
+{
+  memset(&hkey->inner, 0, sizeof(hkey->inner));
+  memset(&hkey->outer, 0, sizeof(hkey->outer));
+}
+
+void hmac_sha1_builtin_vector_keyed(const HmacSha1Key *hkey,
+    size_t num_elem, const uint8_t *addr[], const size_t *len, uint8_t *mac)
+{
+  SHA1_CTX ctx = hkey->inner;
+  size_t i;
+
+  for (i = 0; i < num_elem; i++)
+    SHA1Update(&ctx, addr[i], len[i]);
+  SHA1Final(mac, &ctx);
+
+  ctx = hkey->outer;
+  SHA1Update(&ctx, mac, SHA1_MAC_LEN);
+  SHA1Final(mac, &ctx);
+}
+
+void hmac_sha1_builtin_vector(const unsigned char k_ipad[64],
+    const unsigned char k_opad[64], size_t num_elem,
+    const uint8_t *addr[], const size_t *len, uint8_t *mac)
+{
+  SHA1_CTX ctx;
+  size_t i;
+
+  SHA1Init(&ctx);
+  SHA1Update(&ctx, k_ipad, 64);
+  for (i = 0; i < num_elem; i++)
+    SHA1Update(&ctx, addr[i], len[i]);
+  SHA1Final(mac, &ctx);
+
+  SHA1Init(&ctx);
+  SHA1Update(&ctx, k_opad, 64);
+  SHA1Update(&ctx, mac, SHA1_MAC_LEN);
+  SHA1Final(mac, &ctx);
+}
+
 
 /**
- * hmac_sha1_vector:
- * @key: Key for HMAC operations
- * @key_len: Length of the key in bytes
+ * sha1_vector:
  * @num_elem: Number of elements in the data vector
  * @addr: Pointers to the data areas
  * @len: Lengths of the data blocks
- * @mac: Buffer for the hash (20 bytes)
+ * @mac: Buffer for the hash
  *
- * HMAC-SHA1 over data vector (RFC 2104)
+ * SHA-1 hash for data vector
  */
-void hmac_sha1_vector(const uint8_t *key, size_t key_len, size_t num_elem,
-    const uint8_t *addr[], const size_t *len, uint8_t *mac)
+void sha1_vector(size_t num_elem, const uint8_t *addr[], const size_t *len,
+    uint8_t *mac)
+{
+  stun_crypto_ops()->sha1_vector(num_elem, addr, len, mac);
+}
+
+
+/* Fills the key blocks of the inner and outer digests of HMAC-SHA1 */
+static void hmac_sha1_pads(const StunCryptoOps *ops, const uint8_t *key,
+    size_t key_len, unsigned char k_ipad[64], unsigned char k_opad[64])
 {
-  unsigned char k_pad[64]; /* padding - key XORd with ipad/opad */
   unsigned char tk[20];
-  const uint8_t *_addr[6];
-  size_t _len[6], i;
-
-  if (num_elem > 5) {
-    /*
-     * Fixed limit on the number of fragments to avoid having to
-     * allocate memory (which could fail).
-     */
-    return;
-  }
+  size_t i;
 
   /* if key is longer than 64 bytes reset it to key = SHA1(key) */
   if (key_len > 64) {
-    sha1_vector(1, &key, &key_len, tk);
+    ops->sha1_vector(1, &key, &key_len, tk);
     key = tk;
     key_len = 20;
   }
@@ -59,35 +219,100 @@ void hmac_sha1_vector(const uint8_t *key, size_t key_len, size_t num_elem,
    * ipad is the byte 0x36 repeated 64 times
    * opad is the byte 0x5c repeated 64 times
    * and text is the data being protected */
-
-  /* start out by storing key in ipad */
-  memset(k_pad, 0, sizeof(k_pad));
-  memcpy(k_pad, key, key_len);
-  /* XOR key with ipad values */
-  for (i = 0; i < 64; i++)
-    k_pad[i] ^= 0x36;
-
-  /* perform inner SHA1 */
-  _addr[0] = k_pad;
-  _len[0] = 64;
-  for (i = 0; i < num_elem; i++) {
-    _addr[i + 1] = addr[i];
-    _len[i + 1] = len[i];
+  memset(k_ipad, 0, 64);
+  memcpy(k_ipad, key, key_len);
+  memcpy(k_opad, k_ipad, 64);
+  for (i = 0; i < 64; i++) {
+    k_ipad[i] ^= 0x36;
+    k_opad[i] ^= 0x5c;
   }
-  sha1_vector(1 + num_elem, _addr, _len, mac);
+}
+
+
+/**
+ * hmac_sha1_key_init:
+ * @hkey: The key state to initialize
+ * @key: Key for HMAC operations
+ * @key_len: Length of the key in bytes
+ *
+ * Precomputes the inner and outer HMAC-SHA1 states for @key, to be used
+ * with hmac_sha1_vector_keyed() until hmac_sha1_key_clear() is called.
+ */
+void hmac_sha1_key_init(HmacSha1Key *hkey, const uint8_t *key,
+    size_t key_len)
+{
+  const StunCryptoOps *ops = stun_crypto_ops();
+  unsigned char k_ipad[64];
+  unsigned char k_opad[64];
 
-  memset(k_pad, 0, sizeof(k_pad));
-  memcpy(k_pad, key, key_len);
-  /* XOR key with opad values */
-  for (i = 0; i < 64; i++)
-    k_pad[i] ^= 0x5c;
+  hmac_sha1_pads(ops, key, key_len, k_ipad, k_opad);
 
-  /* perform outer SHA1 */
-  _addr[0] = k_pad;
-  _len[0] = 64;
-  _addr[1] = mac;
-  _len[1] = SHA1_MAC_LEN;
-  sha1_vector(2, _addr, _len, mac);
+  memset(hkey, 0, sizeof(*hkey));
+  hkey->ops = ops;
+  ops->hmac_sha1_key_init(hkey, k_ipad, k_opad);
+
+  memset(k_ipad, 0, sizeof(k_ipad));
+  memset(k_opad, 0, sizeof(k_opad));
+}
+
+
+/**
+ * hmac_sha1_key_clear:
+ * @hkey: The key state to free
+ *
+ * Frees the states set up by hmac_sha1_key_init().
+ */
+void hmac_sha1_key_clear(HmacSha1Key *hkey)
+{
+  if (hkey->ops)
+    hkey->ops->hmac_sha1_key_clear(hkey);
+  hkey->ops = NULL;
+}
+
+
+/**
+ * hmac_sha1_vector_keyed:
+ * @hkey: Key state from hmac_sha1_key_init()
+ * @num_elem: Number of elements in the data vector
+ * @addr: Pointers to the data areas
+ * @len: Lengths of the data blocks
+ * @mac: Buffer for the hash (20 bytes)
+ *
+ * HMAC-SHA1 over data vector (RFC 2104), with a precomputed key. It runs
+ * on the backend that was current when @hkey was set up.
+ */
+void hmac_sha1_vector_keyed(const HmacSha1Key *hkey, size_t num_elem,
+    const uint8_t *addr[], const size_t *len, uint8_t *mac)
+{
+  hkey->ops->hmac_sha1_vector_keyed(hkey, num_elem, addr, len, mac);
+}
+
+
+/**
+ * hmac_sha1_vector:
+ * @key: Key for HMAC operations
+ * @key_len: Length of the key in bytes
+ * @num_elem: Number of elements in the data vector
+ * @addr: Pointers to the data areas
+ * @len: Lengths of the data blocks
+ * @mac: Buffer for the hash (20 bytes)
+ *
+ * HMAC-SHA1 over data vector (RFC 2104)
+ */
+void hmac_sha1_vector(const uint8_t *key, size_t key_len, size_t num_elem,
+    const uint8_t *addr[], const size_t *len, uint8_t *mac)
+{
+  const StunCryptoOps *ops = stun_crypto_ops();
+  unsigned char k_ipad[64];
+  unsigned char k_opad[64];
+
+  /* A one-off MAC goes straight through the backend, setting up and
+   * copying key states only pays off when the key is used again */
+  hmac_sha1_pads(ops, key, key_len, k_ipad, k_opad);
+  ops->hmac_sha1_vector(k_ipad, k_opad, num_elem, addr, len, mac);
+
+  memset(k_ipad, 0, sizeof(k_ipad));
+  memset(k_opad, 0, sizeof(k_opad));
 }
 
 
@@ -154,26 +379,3 @@ void sha1_prf(const uint8_t *key, size_t key_len, const char *label,
     counter++;
   }
 }
-
-/**
- * sha1_vector:
- * @num_elem: Number of elements in the data vector
- * @addr: Pointers to the data areas
- * @len: Lengths of the data blocks
- * @mac: Buffer for the hash
- *
- * SHA-1 hash for data vector
- */
-void sha1_vector(size_t num_elem, const uint8_t *addr[], const size_t *len,
-    uint8_t *mac)
-{
-  EVP_MD_CTX *ctx = EVP_MD_CTX_create();
-  size_t i;
-
-  EVP_DigestInit_ex(ctx, EVP_sha1(), NULL);
-
-  for (i = 0; i < num_elem; i++)
-    EVP_DigestUpdate(ctx, addr[i], len[i]);
-  EVP_DigestFinal_ex(ctx, mac, NULL);
-  EVP_MD_CTX_destroy(ctx);
-}
@@ -24,10 +24,41 @@
 
 #define SHA1_MAC_LEN 20
 
+typedef struct {
+  uint32_t state[5];
+  uint32_t count[2];
+  unsigned char buffer[64];
+} SHA1_CTX;
+
+void SHA1Init(SHA1_CTX *context);
+void SHA1Update(SHA1_CTX *context, const void *data, uint32_t len);
+void SHA1Final(unsigned char digest[20], SHA1_CTX *context);
+
+struct _StunCryptoOps;
+
+/*
+ * HMAC-SHA1 state for a fixed key: the digest states right after the
+ * K XOR ipad and K XOR opad blocks, so that each MAC only costs the
+ * compressions of the data itself. Which members are used depends on the
+ * crypto backend that set it up, see crypto.h.
+ */
+typedef struct {
+  const struct _StunCryptoOps *ops;
+  SHA1_CTX inner;
+  SHA1_CTX outer;
+  void *inner_ctx;
+  void *outer_ctx;
+} HmacSha1Key;
+
 void sha1_vector(size_t num_elem, const uint8_t *addr[], const size_t *len,
     uint8_t *mac);
 void hmac_sha1_vector(const uint8_t *key, size_t key_len, size_t num_elem,
     const uint8_t *addr[], const size_t *len, uint8_t *mac);
+void hmac_sha1_key_init(HmacSha1Key *hkey, const uint8_t *key,
+    size_t key_len);
+void hmac_sha1_key_clear(HmacSha1Key *hkey);
+void hmac_sha1_vector_keyed(const HmacSha1Key *hkey, size_t num_elem,
+    const uint8_t *addr[], const size_t *len, uint8_t *mac);
 void hmac_sha1(const uint8_t *key, size_t key_len,
     const uint8_t *data, size_t data_len, uint8_t *mac);
 void sha1_prf(const uint8_t *key, size_t key_len, const char *label,
@@ -73,6 +73,8 @@ static void transaction_id_to_str (StunTransactionId msg_id, char* buff)
 static bool stun_agent_is_unknown (StunAgent *agent, uint16_t type);
 static unsigned stun_agent_find_unknowns (StunAgent *agent,
     const StunMessage * msg, uint16_t *list, unsigned max);
+static unsigned stun_agent_index_attributes (StunAgent *agent,
+    const StunMessage *msg, StunMessageIndex *index, uint16_t *unknown);
 
 void stun_agent_init (StunAgent *agent, const uint16_t *known_attributes,
     StunCompatibility compatibility, StunAgentUsageFlags usage_flags)
@@ -111,9 +113,36 @@ bool stun_agent_default_validater (StunAgent *agent,
 
 }
 
+static bool stun_agent_has_attribute (const StunMessage *msg,
+    const StunMessageIndex *index, StunAttribute type)
+{
+  uint16_t dummy;
+
+  return stun_message_find_indexed (msg, index, type, &dummy) != NULL;
+}
+
 StunValidationStatus stun_agent_validate (StunAgent *agent, StunMessage *msg,
     const uint8_t *buffer, size_t buffer_len,
     StunMessageIntegrityValidate validater, void * validater_data)
+{
+  return stun_agent_validate_indexed (agent, msg, NULL, buffer, buffer_len,
+      validater, validater_data);
+}
+
+StunValidationStatus stun_agent_validate_indexed (StunAgent *agent,
+    StunMessage *msg, StunMessageIndex *index,
+    const uint8_t *buffer, size_t buffer_len,
+    StunMessageIntegrityValidate validater, void * validater_data)
+{
+  return stun_agent_validate_with_keys (agent, msg, index, buffer, buffer_len,
+      validater, validater_data, NULL, NULL);
+}
+
+StunValidationStatus stun_agent_validate_with_keys (StunAgent *agent,
+    StunMessage *msg, StunMessageIndex *index,
+    const uint8_t *buffer, size_t buffer_len,
+    StunMessageIntegrityValidate validater, void * validater_data,
+    StunHmacKeyLookup key_lookup, void *key_lookup_data)
 {
   StunTransactionId msg_id;
   uint32_t fpr;
@@ -128,6 +157,7 @@ StunValidationStatus stun_agent_validate (StunAgent *agent, StunMessage *msg,
   uint16_t hlen;
   int sent_id_idx = -1;
   uint16_t unknown;
+  int unknowns = -1;
   int error_code;
   int ignore_credentials = 0;
   uint8_t long_term_key[16] = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0};
@@ -135,6 +165,9 @@ StunValidationStatus stun_agent_validate (StunAgent *agent, StunMessage *msg,
   char tmpbuf[STUN_MAX_TRANSACTION_STR_LENGTH];
   bool ignore_response_transid = (agent->usage_flags & STUN_AGENT_USAGE_IGNORE_RESPONSE_TRANSID) != 0;
 
+  if (index != NULL)
+    index->buffer = NULL;
+
   len = stun_message_validate_buffer_length (buffer, buffer_len,
        !(agent->usage_flags & STUN_AGENT_USAGE_NO_ALIGNED_ATTRIBUTES));
   if (len == STUN_MESSAGE_BUFFER_INVALID) {
@@ -152,6 +185,9 @@ StunValidationStatus stun_agent_validate (StunAgent *agent, StunMessage *msg,
   msg->key_len = 0;
   msg->long_term_valid = FALSE;
 
+  if (index != NULL)
+    unknowns = stun_agent_index_attributes (agent, msg, index, &unknown);
+
   /* TODO: reject it or not ? */
   if ((agent->compatibility == STUN_COMPATIBILITY_RFC5389 ||
           agent->compatibility == STUN_COMPATIBILITY_WLM2009) &&
@@ -165,12 +201,16 @@ StunValidationStatus stun_agent_validate (StunAgent *agent, StunMessage *msg,
       agent->usage_flags & STUN_AGENT_USAGE_USE_FINGERPRINT) {
 
     /* Look for FINGERPRINT */
-    if (stun_message_find32 (msg, STUN_ATTRIBUTE_FINGERPRINT, &fpr) ==
-        STUN_MESSAGE_RETURN_SUCCESS) {
+    const void *ptr;
+    uint16_t fpr_len;
+
+    ptr = stun_message_find_indexed (msg, index, STUN_ATTRIBUTE_FINGERPRINT,
+        &fpr_len);
+    if (ptr != NULL && fpr_len == 4) {
       /* Checks FINGERPRINT */
+      memcpy (&fpr, ptr, sizeof (fpr));
       crc32 = stun_fingerprint (msg->buffer, stun_message_length (msg),
                                 agent->compatibility == STUN_COMPATIBILITY_WLM2009);
-      fpr = ntohl (fpr);
       if (fpr != crc32) {
         stun_debug ("STUN demux error: bad fingerprint: 0x%08x,"
                     " expected: 0x%08x!\n", fpr, crc32);
@@ -212,17 +252,12 @@ StunValidationStatus stun_agent_validate (StunAgent *agent, StunMessage *msg,
   if ((stun_message_get_class (msg) == STUN_RESPONSE ||
        stun_message_get_class (msg) == STUN_ERROR) && !ignore_response_transid) {
     stun_message_id (msg, msg_id);
-    transaction_id_to_str (msg_id, tmpbuf);
-    stun_debug ("Received response: method=%d transaction id %s", stun_message_get_method (msg), tmpbuf);
+    if (stun_debug_is_enabled ()) {
+      transaction_id_to_str (msg_id, tmpbuf);
+      stun_debug ("Received response: method=%d transaction id %s", stun_message_get_method (msg), tmpbuf);
+    }
 
     for (sent_id_idx = 0; sent_id_idx < STUN_AGENT_MAX_SAVED_IDS; sent_id_idx++) {
-
-      if (agent->sent_ids[sent_id_idx].valid) {
-        transaction_id_to_str (agent->sent_ids[sent_id_idx].id, tmpbuf);
-        stun_debug ("Checking sent msg idx:%d valid=%d method=%d transaction-id:%s", sent_id_idx, agent->sent_ids[sent_id_idx].valid,
-                    agent->sent_ids[sent_id_idx].method, tmpbuf);
-      }
-
       if (agent->sent_ids[sent_id_idx].valid == TRUE &&
           agent->sent_ids[sent_id_idx].method == stun_message_get_method (msg) &&
           memcmp (msg_id, agent->sent_ids[sent_id_idx].id,
@@ -255,25 +290,25 @@ StunValidationStatus stun_agent_validate (StunAgent *agent, StunMessage *msg,
       (stun_message_get_class (msg) == STUN_REQUEST ||
        stun_message_get_class (msg) == STUN_INDICATION) &&
       (((agent->usage_flags & STUN_AGENT_USAGE_SHORT_TERM_CREDENTIALS) &&
-       (!stun_message_has_attribute (msg, STUN_ATTRIBUTE_USERNAME) ||
-        !stun_message_has_attribute (msg, STUN_ATTRIBUTE_MESSAGE_INTEGRITY))) ||
+       (!stun_agent_has_attribute (msg, index, STUN_ATTRIBUTE_USERNAME) ||
+        !stun_agent_has_attribute (msg, index, STUN_ATTRIBUTE_MESSAGE_INTEGRITY))) ||
       ((agent->usage_flags & STUN_AGENT_USAGE_LONG_TERM_CREDENTIALS) &&
         stun_message_get_class (msg) == STUN_REQUEST &&
-        (!stun_message_has_attribute (msg, STUN_ATTRIBUTE_USERNAME) ||
-         !stun_message_has_attribute (msg, STUN_ATTRIBUTE_MESSAGE_INTEGRITY) ||
-         !stun_message_has_attribute (msg, STUN_ATTRIBUTE_NONCE) ||
-         !stun_message_has_attribute (msg, STUN_ATTRIBUTE_REALM))) ||
+        (!stun_agent_has_attribute (msg, index, STUN_ATTRIBUTE_USERNAME) ||
+         !stun_agent_has_attribute (msg, index, STUN_ATTRIBUTE_MESSAGE_INTEGRITY) ||
+         !stun_agent_has_attribute (msg, index, STUN_ATTRIBUTE_NONCE) ||
+         !stun_agent_has_attribute (msg, index, STUN_ATTRIBUTE_REALM))) ||
        ((agent->usage_flags & STUN_AGENT_USAGE_IGNORE_CREDENTIALS) == 0 &&
-         stun_message_has_attribute (msg, STUN_ATTRIBUTE_USERNAME) &&
-         !stun_message_has_attribute (msg, STUN_ATTRIBUTE_MESSAGE_INTEGRITY)))) {
+         stun_agent_has_attribute (msg, index, STUN_ATTRIBUTE_USERNAME) &&
+         !stun_agent_has_attribute (msg, index, STUN_ATTRIBUTE_MESSAGE_INTEGRITY)))) {
         return STUN_VALIDATION_UNAUTHORIZED_BAD_REQUEST;
   }
 
-  if (stun_message_has_attribute (msg, STUN_ATTRIBUTE_MESSAGE_INTEGRITY) &&
+  if (stun_agent_has_attribute (msg, index, STUN_ATTRIBUTE_MESSAGE_INTEGRITY) &&
       ((key == NULL && ignore_credentials == 0) ||
           (agent->usage_flags & STUN_AGENT_USAGE_FORCE_VALIDATER))) {
     username_len = 0;
-    username = (uint8_t *) stun_message_find (msg, STUN_ATTRIBUTE_USERNAME,
+    username = (uint8_t *) stun_message_find_indexed (msg, index, STUN_ATTRIBUTE_USERNAME,
         &username_len);
     if (validater == NULL ||
         validater (agent, msg, username, username_len,
@@ -283,7 +318,7 @@ StunValidationStatus stun_agent_validate (StunAgent *agent, StunMessage *msg,
   }
 
   if (ignore_credentials == 0 && key != NULL && key_len > 0) {
-    hash = (uint8_t *) stun_message_find (msg,
+    hash = (uint8_t *) stun_message_find_indexed (msg, index,
         STUN_ATTRIBUTE_MESSAGE_INTEGRITY, &hlen);
 
     if (hash) {
@@ -299,8 +334,9 @@ StunValidationStatus stun_agent_validate (StunAgent *agent, StunMessage *msg,
         if (long_term_key_valid) {
           memcpy (md5, long_term_key, sizeof (md5));
         } else {
-          realm = (uint8_t *) stun_message_find (msg,  STUN_ATTRIBUTE_REALM, &realm_len);
-          username = (uint8_t *) stun_message_find (msg,
+          realm = (uint8_t *) stun_message_find_indexed (msg, index,
+              STUN_ATTRIBUTE_REALM, &realm_len);
+          username = (uint8_t *) stun_message_find_indexed (msg, index,
               STUN_ATTRIBUTE_USERNAME, &username_len);
           if (username == NULL || realm == NULL) {
             return STUN_VALIDATION_UNAUTHORIZED;
@@ -325,16 +361,21 @@ StunValidationStatus stun_agent_validate (StunAgent *agent, StunMessage *msg,
               hash - msg->buffer, sha, md5, sizeof(md5), FALSE);
         }
       } else {
+        const StunHmacKey *hkey = NULL;
+
+        if (key_lookup != NULL)
+          hkey = key_lookup (agent, msg, key, key_len, key_lookup_data);
+
         if (agent->compatibility == STUN_COMPATIBILITY_RFC3489 ||
             agent->compatibility == STUN_COMPATIBILITY_OC2007) {
-          stun_sha1 (msg->buffer, hash + 20 - msg->buffer, hash - msg->buffer,
-              sha, key, key_len, TRUE);
+          stun_sha1_keyed (msg->buffer, hash + 20 - msg->buffer,
+              hash - msg->buffer, sha, hkey, key, key_len, TRUE);
         } else if (agent->compatibility == STUN_COMPATIBILITY_WLM2009) {
-          stun_sha1 (msg->buffer, hash + 20 - msg->buffer,
-              stun_message_length (msg) - 20, sha, key, key_len, TRUE);
+          stun_sha1_keyed (msg->buffer, hash + 20 - msg->buffer,
+              stun_message_length (msg) - 20, sha, hkey, key, key_len, TRUE);
         } else {
-          stun_sha1 (msg->buffer, hash + 20 - msg->buffer,
-              hash - msg->buffer, sha, key, key_len, FALSE);
+          stun_sha1_keyed (msg->buffer, hash + 20 - msg->buffer,
+              hash - msg->buffer, sha, hkey, key, key_len, FALSE);
         }
       }
 
@@ -364,7 +405,9 @@ StunValidationStatus stun_agent_validate (StunAgent *agent, StunMessage *msg,
     agent->sent_ids[sent_id_idx].valid = FALSE;
   }
 
-  if (stun_agent_find_unknowns (agent, msg, &unknown, 1) > 0) {
+  if (unknowns < 0)
+    unknowns = stun_agent_find_unknowns (agent, msg, &unknown, 1);
+  if (unknowns > 0) {
     if (stun_message_get_class (msg) == STUN_REQUEST)
       return STUN_VALIDATION_UNKNOWN_REQUEST_ATTRIBUTE;
     else
@@ -425,6 +468,41 @@ bool stun_agent_init_request (StunAgent *agent, StunMessage *msg,
 }
 
 
+bool stun_agent_reuse_request (StunAgent *agent, StunMessage *msg,
+    uint8_t *buffer, size_t buffer_len, size_t length)
+{
+  StunTransactionId id;
+  size_t id_pos = STUN_MESSAGE_TRANS_ID_POS;
+  size_t id_len = STUN_MESSAGE_TRANS_ID_LEN;
+
+  if (length < STUN_MESSAGE_HEADER_LENGTH || length > buffer_len ||
+      length - STUN_MESSAGE_HEADER_LENGTH > 0xffff ||
+      stun_get_class (buffer) != STUN_REQUEST)
+    return FALSE;
+
+  msg->buffer = buffer;
+  msg->buffer_len = buffer_len;
+  msg->agent = agent;
+  msg->key = NULL;
+  msg->key_len = 0;
+  msg->long_term_valid = FALSE;
+
+  /* keep the magic cookie stun_agent_init_request() put there */
+  if (agent->compatibility == STUN_COMPATIBILITY_RFC5389 ||
+      agent->compatibility == STUN_COMPATIBILITY_WLM2009) {
+    id_pos += 4;
+    id_len -= 4;
+  }
+
+  stun_make_transid (id);
+  memcpy (buffer + id_pos, id + (id_pos - STUN_MESSAGE_TRANS_ID_POS), id_len);
+  stun_setw (buffer + STUN_MESSAGE_LENGTH_POS,
+      length - STUN_MESSAGE_HEADER_LENGTH);
+
+  return TRUE;
+}
+
+
 bool stun_agent_init_indication (StunAgent *agent, StunMessage *msg,
     uint8_t *buffer, size_t buffer_len, StunMethod m)
 {
@@ -560,6 +638,12 @@ size_t stun_agent_build_unknown_attributes_error (StunAgent *agent,
 
 size_t stun_agent_finish_message (StunAgent *agent, StunMessage *msg,
     const uint8_t *key, size_t key_len)
+{
+  return stun_agent_finish_message_with_key (agent, msg, key, key_len, NULL);
+}
+
+size_t stun_agent_finish_message_with_key (StunAgent *agent, StunMessage *msg,
+    const uint8_t *key, size_t key_len, const StunHmacKey *hkey)
 {
   uint8_t *ptr;
   uint32_t fpr;
@@ -635,18 +719,19 @@ size_t stun_agent_finish_message (StunAgent *agent, StunMessage *msg,
       } else {
         if (agent->compatibility == STUN_COMPATIBILITY_RFC3489 ||
             agent->compatibility == STUN_COMPATIBILITY_OC2007) {
-          stun_sha1 (msg->buffer, stun_message_length (msg),
-              stun_message_length (msg) - 20, ptr, key, key_len, TRUE);
+          stun_sha1_keyed (msg->buffer, stun_message_length (msg),
+              stun_message_length (msg) - 20, ptr, hkey, key, key_len, TRUE);
         } else if (agent->compatibility == STUN_COMPATIBILITY_WLM2009) {
           size_t minus = 20;
           if (agent->usage_flags & STUN_AGENT_USAGE_USE_FINGERPRINT)
             minus -= 8;
 
-          stun_sha1 (msg->buffer, stun_message_length (msg),
-              stun_message_length (msg) - minus, ptr, key, key_len, TRUE);
+          stun_sha1_keyed (msg->buffer, stun_message_length (msg),
+              stun_message_length (msg) - minus, ptr, hkey, key, key_len,
+              TRUE);
         } else {
-          stun_sha1 (msg->buffer, stun_message_length (msg),
-              stun_message_length (msg) - 20, ptr, key, key_len, FALSE);
+          stun_sha1_keyed (msg->buffer, stun_message_length (msg),
+              stun_message_length (msg) - 20, ptr, hkey, key, key_len, FALSE);
         }
       }
     }
@@ -737,6 +822,68 @@ stun_agent_find_unknowns (StunAgent *agent, const StunMessage * msg,
   return count;
 }
 
+/*
+ * Walks the attributes of a message once, recording in @index the ones
+ * stun_message_find() can return (the first of each type, but nothing
+ * after MESSAGE-INTEGRITY except FINGERPRINT and nothing after
+ * FINGERPRINT) and looking for an unknown comprehension-required
+ * attribute, like stun_agent_find_unknowns() with a @max of 1 would.
+ * @index only describes @msg if they all fit.
+ */
+static unsigned
+stun_agent_index_attributes (StunAgent *agent, const StunMessage *msg,
+    StunMessageIndex *index, uint16_t *unknown)
+{
+  unsigned count = 0;
+  uint16_t len = stun_message_length (msg);
+  size_t offset = STUN_MESSAGE_ATTRIBUTES_POS;
+  bool indexing = TRUE, after_integrity = FALSE, complete = TRUE;
+
+  memset (index, 0, sizeof (*index));
+
+  while (offset < len)
+  {
+    size_t alen = stun_getw (msg->buffer + offset + STUN_ATTRIBUTE_TYPE_LEN);
+    uint16_t atype = stun_getw (msg->buffer + offset);
+
+    if (count == 0 && !stun_optional (atype) &&
+        stun_agent_is_unknown (agent, atype))
+    {
+      stun_debug ("STUN unknown: attribute 0x%04x(%u bytes)\n",
+           (unsigned)atype, (unsigned)alen);
+      *unknown = htons (atype);
+      count++;
+    }
+
+    if (indexing &&
+        (!after_integrity || atype == STUN_ATTRIBUTE_FINGERPRINT) &&
+        !stun_message_index_add (index, atype,
+            offset + STUN_ATTRIBUTE_VALUE_POS, alen))
+    {
+      /* too many attributes, stun_message_find_indexed() will walk them */
+      indexing = complete = FALSE;
+    }
+
+    if (atype == STUN_ATTRIBUTE_FINGERPRINT)
+      indexing = FALSE;
+    else if (atype == STUN_ATTRIBUTE_MESSAGE_INTEGRITY)
+      after_integrity = TRUE;
+
+    if (!(agent->usage_flags & STUN_AGENT_USAGE_NO_ALIGNED_ATTRIBUTES))
+      alen = stun_align (alen);
+
+    offset += STUN_ATTRIBUTE_VALUE_POS + alen;
+  }
+
+  if (complete)
+    index->buffer = msg->buffer;
+
+  if (count > 0) {
+    stun_debug ("STUN unknown: %u mandatory attribute(s)!\n", count);
+  }
+  return count;
+}
+
 void stun_agent_set_software (StunAgent *agent, const char *software)
 {
   agent->software_attribute = software;
@@ -747,17 +894,12 @@ bool stun_agent_find_transaction (StunAgent *agent, StunMethod method, StunTrans
   char tmpbuf[STUN_MAX_TRANSACTION_STR_LENGTH];
   int sent_id_idx;
 
-  transaction_id_to_str (msg_id, tmpbuf);
-  stun_debug ("Received response: method=%d transaction id %s", method, tmpbuf);
+  if (stun_debug_is_enabled ()) {
+    transaction_id_to_str (msg_id, tmpbuf);
+    stun_debug ("Looking up response: method=%d transaction id %s", method, tmpbuf);
+  }
 
   for (sent_id_idx = 0; sent_id_idx < STUN_AGENT_MAX_SAVED_IDS; sent_id_idx++) {
-
-    if (agent->sent_ids[sent_id_idx].valid) {
-      transaction_id_to_str (agent->sent_ids[sent_id_idx].id, tmpbuf);
-      stun_debug ("Checking sent msg idx:%d valid=%d method=%d transaction-id:%s", sent_id_idx, agent->sent_ids[sent_id_idx].valid,
-                  agent->sent_ids[sent_id_idx].method, tmpbuf);
-    }
-
     if (agent->sent_ids[sent_id_idx].valid == TRUE &&
         agent->sent_ids[sent_id_idx].method == method &&
         memcmp (msg_id, agent->sent_ids[sent_id_idx].id,
@@ -71,6 +71,12 @@
  */
 typedef struct stun_agent_t StunAgent;
 
+/*
+ * A MESSAGE-INTEGRITY key with its HMAC states precomputed, defined in
+ * stunhmac.h.
+ */
+typedef struct stun_hmac_key_t StunHmacKey;
+
 #include "stunmessage.h"
 #include "debug.h"
 
@@ -165,6 +171,8 @@ typedef enum {
  * @STUN_AGENT_USAGE_NO_ALIGNED_ATTRIBUTES: The agent should not assume STUN
  * attributes are aligned on 32-bit boundaries when parsing messages and also
  * do not add padding when creating messages.
+ * @STUN_AGENT_USAGE_IGNORE_RESPONSE_TRANSID: The agent should not match the
+ * transaction ID of the responses it receives against the requests it sent.
  *
  * This enum defines a bitflag usages for a #StunAgent and they will define how
  * the agent should behave, independently of the compatibility mode it uses.
@@ -346,6 +354,48 @@ NICE_EXPORT StunValidationStatus stun_agent_validate (StunAgent *agent, StunMess
     const uint8_t *buffer, size_t buffer_len,
     StunMessageIntegrityValidate validater, void * validater_data);
 
+/**
+ * stun_agent_validate_indexed:
+ * @agent: The #StunAgent
+ * @msg: The #StunMessage to build
+ * @index: The #StunMessageIndex to fill in
+ * @buffer: The data buffer of the STUN message
+ * @buffer_len: The length of @buffer
+ * @validater: A #StunMessageIntegrityValidate function callback, as for
+ * stun_agent_validate()
+ * @validater_data: A user data to give to the @validater callback when it gets
+ * called.
+ *
+ * Validates an inbound STUN message like stun_agent_validate() does, but
+ * records where its attributes are in @index in a single pass over the
+ * message. stun_message_find_indexed() can then look them up without
+ * walking the message, for as long as neither @msg nor its buffer change.
+ *
+ * Returns: A #StunValidationStatus
+ */
+NICE_EXPORT StunValidationStatus stun_agent_validate_indexed (StunAgent *agent,
+    StunMessage *msg, StunMessageIndex *index,
+    const uint8_t *buffer, size_t buffer_len,
+    StunMessageIntegrityValidate validater, void * validater_data);
+
+/*
+ * Returns the #StunHmacKey holding the short-term @key that @msg is
+ * validated with, or NULL if there is none.
+ */
+typedef const StunHmacKey *(*StunHmacKeyLookup) (StunAgent *agent,
+    StunMessage *msg, const uint8_t *key, size_t key_len, void *user_data);
+
+/*
+ * Like stun_agent_validate_indexed(), but checks the short-term
+ * MESSAGE-INTEGRITY with the precomputed key states @key_lookup returns.
+ * Internal to libnice.
+ */
+StunValidationStatus stun_agent_validate_with_keys (StunAgent *agent,
+    StunMessage *msg, StunMessageIndex *index,
+    const uint8_t *buffer, size_t buffer_len,
+    StunMessageIntegrityValidate validater, void * validater_data,
+    StunHmacKeyLookup key_lookup, void *key_lookup_data);
+
 /**
  * stun_agent_init_request:
  * @agent: The #StunAgent
@@ -360,6 +410,24 @@ NICE_EXPORT StunValidationStatus stun_agent_validate (StunAgent *agent, StunMess
 NICE_EXPORT bool stun_agent_init_request (StunAgent *agent, StunMessage *msg,
     uint8_t *buffer, size_t buffer_len, StunMethod m);
 
+/**
+ * stun_agent_reuse_request:
+ * @agent: The #StunAgent
+ * @msg: The #StunMessage to build
+ * @buffer: The buffer holding a request previously built by @agent
+ * @buffer_len: The length of the buffer
+ * @length: How many bytes of the previous request to keep, header included
+ *
+ * Turns the header and the first attributes of a request previously built in
+ * @buffer back into an unfinished request with a new transaction ID, as if
+ * stun_agent_init_request() had been called and the same attributes appended
+ * again. @length would usually be the length of the request before
+ * stun_agent_finish_message() was called on it.
+ * Returns: %TRUE if the message was initialized correctly, %FALSE otherwise
+ */
+NICE_EXPORT bool stun_agent_reuse_request (StunAgent *agent, StunMessage *msg,
+    uint8_t *buffer, size_t buffer_len, size_t length);
+
 /**
  * stun_agent_init_indication:
  * @agent: The #StunAgent
@@ -466,6 +534,13 @@ NICE_EXPORT size_t stun_agent_build_unknown_attributes_error (StunAgent *agent,
 NICE_EXPORT size_t stun_agent_finish_message (StunAgent *agent, StunMessage *msg,
    const uint8_t *key, size_t key_len);
 
+/*
+ * Like stun_agent_finish_message(), but uses the precomputed states of
+ * @hkey (which may be NULL) if @key is its key. Internal to libnice.
+ */
+size_t stun_agent_finish_message_with_key (StunAgent *agent, StunMessage *msg,
+    const uint8_t *key, size_t key_len, const StunHmacKey *hkey);
+
 /**
  * stun_agent_forget_transaction:
  * @agent: The #StunAgent
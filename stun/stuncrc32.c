@@ -87,12 +87,36 @@
  */
 
 
+/*
+ * On top of the classic table-driven loop, which the WLM 2009 variant
+ * needs, the CRC is computed with slicing-by-8 (eight table lookups per
+ * 8 bytes) or, when the CPU has carry-less multiplication (PCLMULQDQ on
+ * x86, PMULL on aarch64), by folding 64 bytes at a time as described in
+ * Intel's "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ
+ * Instruction". The fastest one available is picked on first use.
+ */
+
 #ifdef HAVE_CONFIG_H
 # include <config.h>
 #endif
 
 #include "stuncrc32.h"
 
+#include <glib.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define STUN_CRC32_CLMUL 1
+# include <wmmintrin.h>
+# include <smmintrin.h>
+#elif defined(__GNUC__) && defined(__aarch64__) && defined(__linux__)
+# define STUN_CRC32_CLMUL 1
+# include <arm_neon.h>
+# include <sys/auxv.h>
+# ifndef HWCAP_PMULL
+#  define HWCAP_PMULL (1 << 4)
+# endif
+#endif
+
 static const uint32_t crc32_tab[] = {
         0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
         0xe963a535, 0x9e6495a3, 0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988,
@@ -140,23 +164,384 @@ static const uint32_t crc32_tab[] = {
 };
 
 
+static uint32_t crc32_slice_tab[8][256];
+
+typedef uint32_t (*Crc32Func) (uint32_t crc, const uint8_t *p, size_t len);
+
+static uint32_t
+priv_crc32_bytewise (uint32_t crc, const uint8_t *p, size_t len)
+{
+  while (len--)
+    crc = crc32_tab[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+
+  return crc;
+}
+
+static uint32_t
+priv_crc32_slice8 (uint32_t crc, const uint8_t *p, size_t len)
+{
+  while (len >= 8) {
+    /* assembled byte by byte, so it doesn't matter what the host order or
+     * the alignment of p are */
+    uint32_t one = crc ^ ((uint32_t) p[0] | (uint32_t) p[1] << 8 |
+        (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24);
+    uint32_t two = (uint32_t) p[4] | (uint32_t) p[5] << 8 |
+        (uint32_t) p[6] << 16 | (uint32_t) p[7] << 24;
+
+    crc = crc32_slice_tab[7][one & 0xFF] ^
+        crc32_slice_tab[6][(one >> 8) & 0xFF] ^
+        crc32_slice_tab[5][(one >> 16) & 0xFF] ^
+        crc32_slice_tab[4][one >> 24] ^
+        crc32_slice_tab[3][two & 0xFF] ^
+        crc32_slice_tab[2][(two >> 8) & 0xFF] ^
+        crc32_slice_tab[1][(two >> 16) & 0xFF] ^
+        crc32_slice_tab[0][two >> 24];
+    p += 8;
+    len -= 8;
+  }
+
+  return priv_crc32_bytewise (crc, p, len);
+}
+
+#ifdef STUN_CRC32_CLMUL
+
+/* Folding constants of the bit-reflected CRC-32 polynomial, from the
+ * paper: x^(4*128+32) and x^(4*128-32) mod P, x^(128+32) and x^(128-32)
+ * mod P, x^64 mod P, then P and mu for the Barrett reduction. */
+static const uint64_t crc32_k1k2[2] = { 0x0154442bd4, 0x01c6e41596 };
+static const uint64_t crc32_k3k4[2] = { 0x01751997d0, 0x00ccaa009e };
+static const uint64_t crc32_k5k0[2] = { 0x0163cd6124, 0x0000000000 };
+static const uint64_t crc32_poly[2] = { 0x01db710641, 0x01f7011641 };
+
+#if defined(__x86_64__) || defined(__i386__)
+
+/* @len must be a multiple of 16 and at least 64 */
+__attribute__ ((target ("pclmul,sse4.1")))
+static uint32_t
+priv_crc32_clmul_blocks (uint32_t crc, const uint8_t *p, size_t len)
+{
+  __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+  x1 = _mm_loadu_si128 ((const __m128i *) (p + 0x00));
+  x2 = _mm_loadu_si128 ((const __m128i *) (p + 0x10));
+  x3 = _mm_loadu_si128 ((const __m128i *) (p + 0x20));
+  x4 = _mm_loadu_si128 ((const __m128i *) (p + 0x30));
+  x1 = _mm_xor_si128 (x1, _mm_cvtsi32_si128 (crc));
+  x0 = _mm_loadu_si128 ((const __m128i *) crc32_k1k2);
+  p += 64;
+  len -= 64;
+
+  /* fold four 128-bit lanes in parallel */
+  while (len >= 64) {
+    x5 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+    x6 = _mm_clmulepi64_si128 (x2, x0, 0x00);
+    x7 = _mm_clmulepi64_si128 (x3, x0, 0x00);
+    x8 = _mm_clmulepi64_si128 (x4, x0, 0x00);
+    x1 = _mm_clmulepi64_si128 (x1, x0, 0x11);
+    x2 = _mm_clmulepi64_si128 (x2, x0, 0x11);
+    x3 = _mm_clmulepi64_si128 (x3, x0, 0x11);
+    x4 = _mm_clmulepi64_si128 (x4, x0, 0x11);
+    y5 = _mm_loadu_si128 ((const __m128i *) (p + 0x00));
+    y6 = _mm_loadu_si128 ((const __m128i *) (p + 0x10));
+    y7 = _mm_loadu_si128 ((const __m128i *) (p + 0x20));
+    y8 = _mm_loadu_si128 ((const __m128i *) (p + 0x30));
+    x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x5), y5);
+    x2 = _mm_xor_si128 (_mm_xor_si128 (x2, x6), y6);
+    x3 = _mm_xor_si128 (_mm_xor_si128 (x3, x7), y7);
+    x4 = _mm_xor_si128 (_mm_xor_si128 (x4, x8), y8);
+    p += 64;
+    len -= 64;
+  }
+
+  /* fold the four lanes into one */
+  x0 = _mm_loadu_si128 ((const __m128i *) crc32_k3k4);
+  x5 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128 (x1, x0, 0x11);
+  x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x2), x5);
+  x5 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128 (x1, x0, 0x11);
+  x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x3), x5);
+  x5 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128 (x1, x0, 0x11);
+  x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x4), x5);
+
+  /* then the remaining 16 byte blocks */
+  while (len >= 16) {
+    x2 = _mm_loadu_si128 ((const __m128i *) p);
+    x5 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128 (x1, x0, 0x11);
+    x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x2), x5);
+    p += 16;
+    len -= 16;
+  }
+
+  /* 128 to 64 bits */
+  x2 = _mm_clmulepi64_si128 (x1, x0, 0x10);
+  x3 = _mm_setr_epi32 (~0, 0, ~0, 0);
+  x1 = _mm_srli_si128 (x1, 8);
+  x1 = _mm_xor_si128 (x1, x2);
+  x0 = _mm_loadl_epi64 ((const __m128i *) crc32_k5k0);
+  x2 = _mm_srli_si128 (x1, 4);
+  x1 = _mm_and_si128 (x1, x3);
+  x1 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+  x1 = _mm_xor_si128 (x1, x2);
+
+  /* Barrett reduction to 32 bits */
+  x0 = _mm_loadu_si128 ((const __m128i *) crc32_poly);
+  x2 = _mm_and_si128 (x1, x3);
+  x2 = _mm_clmulepi64_si128 (x2, x0, 0x10);
+  x2 = _mm_and_si128 (x2, x3);
+  x2 = _mm_clmulepi64_si128 (x2, x0, 0x00);
+  x1 = _mm_xor_si128 (x1, x2);
+
+  return _mm_extract_epi32 (x1, 1);
+}
+
+static bool
+priv_crc32_clmul_supported (void)
+{
+  __builtin_cpu_init ();
+  return __builtin_cpu_supports ("pclmul") && __builtin_cpu_supports ("sse4.1");
+}
+
+#else /* aarch64 */
+
+__attribute__ ((target ("+crypto")))
+static inline uint64x2_t
+priv_clmul_lo (uint64x2_t a, uint64x2_t b)
+{
+  return vreinterpretq_u64_p128 (vmull_p64 (
+          (poly64_t) vgetq_lane_u64 (a, 0), (poly64_t) vgetq_lane_u64 (b, 0)));
+}
+
+__attribute__ ((target ("+crypto")))
+static inline uint64x2_t
+priv_clmul_hi (uint64x2_t a, uint64x2_t b)
+{
+  return vreinterpretq_u64_p128 (vmull_p64 (
+          (poly64_t) vgetq_lane_u64 (a, 1), (poly64_t) vgetq_lane_u64 (b, 1)));
+}
+
+/* multiplies the high half of a with the low half of b */
+__attribute__ ((target ("+crypto")))
+static inline uint64x2_t
+priv_clmul_hi_lo (uint64x2_t a, uint64x2_t b)
+{
+  return vreinterpretq_u64_p128 (vmull_p64 (
+          (poly64_t) vgetq_lane_u64 (a, 1), (poly64_t) vgetq_lane_u64 (b, 0)));
+}
+
+/* @len must be a multiple of 16 and at least 64, see the x86 version */
+__attribute__ ((target ("+crypto")))
+static uint32_t
+priv_crc32_clmul_blocks (uint32_t crc, const uint8_t *p, size_t len)
+{
+  uint64x2_t x0, x1, x2, x3, x4, x5, x6, x7, x8;
+  const uint64x2_t mask32 = vreinterpretq_u64_u32 (
+      (uint32x4_t) { ~0u, 0, ~0u, 0 });
+
+  x1 = vld1q_u64 ((const uint64_t *) (p + 0x00));
+  x2 = vld1q_u64 ((const uint64_t *) (p + 0x10));
+  x3 = vld1q_u64 ((const uint64_t *) (p + 0x20));
+  x4 = vld1q_u64 ((const uint64_t *) (p + 0x30));
+  x1 = veorq_u64 (x1, vreinterpretq_u64_u32 (vsetq_lane_u32 (crc,
+              vdupq_n_u32 (0), 0)));
+  x0 = vld1q_u64 (crc32_k1k2);
+  p += 64;
+  len -= 64;
+
+  while (len >= 64) {
+    x5 = priv_clmul_lo (x1, x0);
+    x6 = priv_clmul_lo (x2, x0);
+    x7 = priv_clmul_lo (x3, x0);
+    x8 = priv_clmul_lo (x4, x0);
+    x1 = priv_clmul_hi (x1, x0);
+    x2 = priv_clmul_hi (x2, x0);
+    x3 = priv_clmul_hi (x3, x0);
+    x4 = priv_clmul_hi (x4, x0);
+    x1 = veorq_u64 (veorq_u64 (x1, x5),
+        vld1q_u64 ((const uint64_t *) (p + 0x00)));
+    x2 = veorq_u64 (veorq_u64 (x2, x6),
+        vld1q_u64 ((const uint64_t *) (p + 0x10)));
+    x3 = veorq_u64 (veorq_u64 (x3, x7),
+        vld1q_u64 ((const uint64_t *) (p + 0x20)));
+    x4 = veorq_u64 (veorq_u64 (x4, x8),
+        vld1q_u64 ((const uint64_t *) (p + 0x30)));
+    p += 64;
+    len -= 64;
+  }
+
+  x0 = vld1q_u64 (crc32_k3k4);
+  x5 = priv_clmul_lo (x1, x0);
+  x1 = priv_clmul_hi (x1, x0);
+  x1 = veorq_u64 (veorq_u64 (x1, x2), x5);
+  x5 = priv_clmul_lo (x1, x0);
+  x1 = priv_clmul_hi (x1, x0);
+  x1 = veorq_u64 (veorq_u64 (x1, x3), x5);
+  x5 = priv_clmul_lo (x1, x0);
+  x1 = priv_clmul_hi (x1, x0);
+  x1 = veorq_u64 (veorq_u64 (x1, x4), x5);
+
+  while (len >= 16) {
+    x2 = vld1q_u64 ((const uint64_t *) p);
+    x5 = priv_clmul_lo (x1, x0);
+    x1 = priv_clmul_hi (x1, x0);
+    x1 = veorq_u64 (veorq_u64 (x1, x2), x5);
+    p += 16;
+    len -= 16;
+  }
+
+  /* 128 to 64 bits: _mm_clmulepi64_si128 (x1, x0, 0x10) takes the low
+   * half of x1 and the high half of x0 */
+  x2 = priv_clmul_hi_lo (vextq_u64 (x0, x0, 1), vextq_u64 (x1, x1, 1));
+  x1 = vreinterpretq_u64_u8 (vextq_u8 (vreinterpretq_u8_u64 (x1),
+          vdupq_n_u8 (0), 8));
+  x1 = veorq_u64 (x1, x2);
+  x0 = vld1q_u64 (crc32_k5k0);
+  x2 = vreinterpretq_u64_u8 (vextq_u8 (vreinterpretq_u8_u64 (x1),
+          vdupq_n_u8 (0), 4));
+  x1 = vandq_u64 (x1, mask32);
+  x1 = priv_clmul_lo (x1, x0);
+  x1 = veorq_u64 (x1, x2);
+
+  x0 = vld1q_u64 (crc32_poly);
+  x2 = vandq_u64 (x1, mask32);
+  x2 = priv_clmul_hi_lo (x0, x2);
+  x2 = vandq_u64 (x2, mask32);
+  x2 = priv_clmul_lo (x2, x0);
+  x1 = veorq_u64 (x1, x2);
+
+  return vgetq_lane_u32 (vreinterpretq_u32_u64 (x1), 1);
+}
+
+static bool
+priv_crc32_clmul_supported (void)
+{
+  return (getauxval (AT_HWCAP) & HWCAP_PMULL) != 0;
+}
+
+#endif
+
+static uint32_t
+priv_crc32_clmul (uint32_t crc, const uint8_t *p, size_t len)
+{
+  if (len >= 64) {
+    size_t blocks = len & ~(size_t) 15;
+
+    crc = priv_crc32_clmul_blocks (crc, p, blocks);
+    p += blocks;
+    len -= blocks;
+  }
+
+  return priv_crc32_slice8 (crc, p, len);
+}
+
+#endif /* STUN_CRC32_CLMUL */
+
+static Crc32Func crc32_func = NULL;
+static StunCrc32Impl crc32_impl;
+
+static void
+priv_crc32_init_tables (void)
+{
+  static gsize initialized = 0;
+
+  if (g_once_init_enter (&initialized)) {
+    unsigned i, k;
+
+    for (i = 0; i < 256; i++) {
+      uint32_t crc = crc32_tab[i];
+
+      crc32_slice_tab[0][i] = crc;
+      for (k = 1; k < 8; k++) {
+        crc = crc32_tab[crc & 0xFF] ^ (crc >> 8);
+        crc32_slice_tab[k][i] = crc;
+      }
+    }
+
+    g_once_init_leave (&initialized, 1);
+  }
+}
+
+static Crc32Func
+priv_crc32_func (void)
+{
+  Crc32Func func = g_atomic_pointer_get (&crc32_func);
+
+  if (G_UNLIKELY (func == NULL)) {
+    if (!stun_crc32_set_impl (STUN_CRC32_IMPL_CLMUL))
+      stun_crc32_set_impl (STUN_CRC32_IMPL_SLICE8);
+    func = g_atomic_pointer_get (&crc32_func);
+  }
+
+  return func;
+}
+
+bool stun_crc32_set_impl (StunCrc32Impl impl)
+{
+  Crc32Func func;
+
+  switch (impl) {
+    case STUN_CRC32_IMPL_BYTEWISE:
+      func = priv_crc32_bytewise;
+      break;
+    case STUN_CRC32_IMPL_SLICE8:
+      func = priv_crc32_slice8;
+      break;
+    case STUN_CRC32_IMPL_CLMUL:
+#ifdef STUN_CRC32_CLMUL
+      if (!priv_crc32_clmul_supported ())
+        return false;
+      func = priv_crc32_clmul;
+      break;
+#else
+      return false;
+#endif
+    default:
+      return false;
+  }
+
+  /* the tables must be there before another thread can pick func up */
+  priv_crc32_init_tables ();
+  crc32_impl = impl;
+  g_atomic_pointer_set (&crc32_func, func);
+  return true;
+}
+
+StunCrc32Impl stun_crc32_get_impl (void)
+{
+  priv_crc32_func ();
+  return crc32_impl;
+}
+
 uint32_t stun_crc32 (const crc_data *data, size_t n, bool wlm2009_stupid_crc32_typo)
 {
   size_t i;
   uint32_t crc = 0xffffffff;
+  Crc32Func func;
 
-  for (i = 0; i < n; i++)
-  {
-    const uint8_t *p = data[i].buf;
-    size_t size = data[i].len;
-
-    while (size--) {
-      uint32_t lkp = crc32_tab[(crc ^ *p++) & 0xFF];
-      if (lkp == 0x8bbeb8ea && wlm2009_stupid_crc32_typo)
-        lkp = 0x8bbe8ea;
-      crc =  lkp ^ (crc >> 8);
+  if (wlm2009_stupid_crc32_typo) {
+    /* one entry of the table is wrong, so the result isn't a CRC and only
+     * the byte-at-a-time loop can compute it */
+    for (i = 0; i < n; i++)
+    {
+      const uint8_t *p = data[i].buf;
+      size_t size = data[i].len;
+
+      while (size--) {
+        uint32_t lkp = crc32_tab[(crc ^ *p++) & 0xFF];
+        if (lkp == 0x8bbeb8ea)
+          lkp = 0x8bbe8ea;
+        crc =  lkp ^ (crc >> 8);
+      }
     }
+
+    return crc ^ 0xffffffff;
   }
 
+  func = priv_crc32_func ();
+  for (i = 0; i < n; i++)
+    crc = func (crc, data[i].buf, data[i].len);
+
   return crc ^ 0xffffffff;
 }
@@ -54,6 +54,20 @@ typedef struct {
 } crc_data;
 
 
+/* The ways of computing the CRC, fastest last */
+typedef enum {
+  STUN_CRC32_IMPL_BYTEWISE,
+  STUN_CRC32_IMPL_SLICE8,
+  STUN_CRC32_IMPL_CLMUL,
+} StunCrc32Impl;
+
 uint32_t stun_crc32 (const crc_data *data, size_t n, bool wlm2009_stupid_crc32_typo);
 
+/*
+ * Forces the implementation used by stun_crc32(), which otherwise picks the
+ * fastest the CPU supports. Returns false if @impl isn't available here.
+ */
+bool stun_crc32_set_impl (StunCrc32Impl impl);
+StunCrc32Impl stun_crc32_get_impl (void);
+
 #endif /* _CRC32_H */
@@ -45,13 +45,44 @@
 
 #include "stunmessage.h"
 #include "stunhmac.h"
+#include "rand.h"
 
+#include <glib.h>
 #include <string.h>
 #include <assert.h>
-#include <openssl/rand.h>
+
+void stun_hmac_key_set (StunHmacKey *hkey, const uint8_t *key,
+    size_t key_len)
+{
+  if (key_len >= sizeof (hkey->key))
+    key_len = sizeof (hkey->key) - 1;
+
+  if (hkey->sha1.ops != NULL && hkey->key_len == key_len &&
+      memcmp (hkey->key, key, key_len) == 0)
+    return;
+
+  hmac_sha1_key_clear (&hkey->sha1);
+  memcpy (hkey->key, key, key_len);
+  hkey->key_len = key_len;
+  hmac_sha1_key_init (&hkey->sha1, key, key_len);
+}
+
+void stun_hmac_key_clear (StunHmacKey *hkey)
+{
+  hmac_sha1_key_clear (&hkey->sha1);
+  memset (hkey->key, 0, sizeof (hkey->key));
+  hkey->key_len = 0;
+}
 
 void stun_sha1 (const uint8_t *msg, size_t len, size_t msg_len, uint8_t *sha,
     const void *key, size_t keylen, int padding)
+{
+  stun_sha1_keyed (msg, len, msg_len, sha, NULL, key, keylen, padding);
+}
+
+void stun_sha1_keyed (const uint8_t *msg, size_t len, size_t msg_len,
+    uint8_t *sha, const StunHmacKey *hkey, const void *key, size_t keylen,
+    int padding)
 {
   uint16_t fakelen = htons (msg_len);
   const uint8_t *vector[4];
@@ -79,7 +110,11 @@ void stun_sha1 (const uint8_t *msg, size_t len, size_t msg_len, uint8_t *sha,
     num_elements++;
   }
 
-  hmac_sha1_vector(key, keylen, num_elements, vector, lengths, sha);
+  if (hkey != NULL && hkey->sha1.ops != NULL && hkey->key_len == keylen &&
+      memcmp (hkey->key, key, keylen) == 0)
+    hmac_sha1_vector_keyed(&hkey->sha1, num_elements, vector, lengths, sha);
+  else
+    hmac_sha1_vector(key, keylen, num_elements, vector, lengths, sha);
 }
 
 static const uint8_t *priv_trim_var (const uint8_t *var, size_t *var_len)
@@ -100,28 +135,221 @@ static const uint8_t *priv_trim_var (const uint8_t *var, size_t *var_len)
 }
 
 
+/*
+ * The long-term key only depends on the credentials, and TURN asks for it
+ * on every Allocate, Refresh, CreatePermission and ChannelBind of every
+ * relay, so keep the last few around for the whole process. The cache is
+ * split in shards by username and realm, each with its own lock, so that
+ * agents on different threads seldom wait on each other.
+ *
+ * An entry holds the username and realm, which go on the wire anyway, and
+ * a SipHash of the password under a random key of the process instead of
+ * the password itself.
+ */
+#define STUN_CREDS_CACHE_SHARDS 8
+#define STUN_CREDS_CACHE_WAYS 4
+
+typedef struct {
+  uint8_t *data;                /* username then realm, trimmed, NULL if
+                                   the entry is free */
+  size_t username_len;
+  size_t realm_len;
+  uint64_t password_tag;
+  uint64_t last_use;
+  uint8_t md5[16];
+} StunCredsCacheEntry;
+
+typedef struct {
+  GMutex mutex;
+  uint64_t clock;
+  StunCredsCacheEntry entries[STUN_CREDS_CACHE_WAYS];
+} StunCredsCacheShard;
+
+static StunCredsCacheShard creds_cache[STUN_CREDS_CACHE_SHARDS];
+static uint8_t creds_cache_key[16];
+
+#define ROTL64(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND(v0, v1, v2, v3) \
+  v0 += v1; v1 = ROTL64 (v1, 13); v1 ^= v0; v0 = ROTL64 (v0, 32); \
+  v2 += v3; v3 = ROTL64 (v3, 16); v3 ^= v2; \
+  v0 += v3; v3 = ROTL64 (v3, 21); v3 ^= v0; \
+  v2 += v1; v1 = ROTL64 (v1, 17); v1 ^= v2; v2 = ROTL64 (v2, 32)
+
+static inline uint64_t priv_load64_le (const uint8_t *p, size_t len)
+{
+  uint64_t v = 0;
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    v |= (uint64_t) p[i] << (i * 8);
+
+  return v;
+}
+
+/* SipHash-2-4 of @data under @key */
+static uint64_t priv_siphash (const uint8_t key[16], const uint8_t *data,
+    size_t len)
+{
+  uint64_t k0 = priv_load64_le (key, 8);
+  uint64_t k1 = priv_load64_le (key + 8, 8);
+  uint64_t v0 = k0 ^ 0x736f6d6570736575ull;
+  uint64_t v1 = k1 ^ 0x646f72616e646f6dull;
+  uint64_t v2 = k0 ^ 0x6c7967656e657261ull;
+  uint64_t v3 = k1 ^ 0x7465646279746573ull;
+  uint64_t m;
+  size_t i;
+
+  for (i = 0; i + 8 <= len; i += 8) {
+    m = priv_load64_le (data + i, 8);
+    v3 ^= m;
+    SIPROUND (v0, v1, v2, v3);
+    SIPROUND (v0, v1, v2, v3);
+    v0 ^= m;
+  }
+
+  m = priv_load64_le (data + i, len - i) | ((uint64_t) (len & 0xff) << 56);
+  v3 ^= m;
+  SIPROUND (v0, v1, v2, v3);
+  SIPROUND (v0, v1, v2, v3);
+  v0 ^= m;
+
+  v2 ^= 0xff;
+  for (i = 0; i < 4; i++) {
+    SIPROUND (v0, v1, v2, v3);
+  }
+
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static StunCredsCacheShard *priv_creds_shard (const uint8_t *username,
+    size_t username_len, const uint8_t *realm, size_t realm_len)
+{
+  uint32_t hash = 2166136261u;
+  size_t i;
+
+  /* FNV-1a, only to spread the credentials over the shards */
+  for (i = 0; i < username_len; i++)
+    hash = (hash ^ username[i]) * 16777619u;
+  hash = (hash ^ ':') * 16777619u;
+  for (i = 0; i < realm_len; i++)
+    hash = (hash ^ realm[i]) * 16777619u;
+
+  return &creds_cache[hash % STUN_CREDS_CACHE_SHARDS];
+}
+
+static bool priv_creds_entry_matches (const StunCredsCacheEntry *entry,
+    const uint8_t *username, size_t username_len,
+    const uint8_t *realm, size_t realm_len)
+{
+  return entry->data != NULL &&
+      entry->username_len == username_len &&
+      entry->realm_len == realm_len &&
+      memcmp (entry->data, username, username_len) == 0 &&
+      memcmp (entry->data + username_len, realm, realm_len) == 0;
+}
+
+static void priv_creds_entry_clear (StunCredsCacheEntry *entry)
+{
+  g_free (entry->data);
+  memset (entry, 0, sizeof (*entry));
+}
+
 void stun_hash_creds (const uint8_t *realm, size_t realm_len,
     const uint8_t *username, size_t username_len,
     const uint8_t *password, size_t password_len,
     unsigned char md5[16])
 {
-  MD5_CTX ctx;
+  static gsize key_initialized = 0;
   const uint8_t *username_trimmed = priv_trim_var (username, &username_len);
   const uint8_t *password_trimmed = priv_trim_var (password, &password_len);
   const uint8_t *realm_trimmed = priv_trim_var (realm, &realm_len);
   const uint8_t *colon = (uint8_t *)":";
+  const uint8_t *vector[5];
+  size_t lengths[5];
+  StunCredsCacheShard *shard;
+  StunCredsCacheEntry *entry, *oldest;
+  uint64_t password_tag;
+  size_t i;
+
+  if (g_once_init_enter (&key_initialized)) {
+    stun_rand_bytes (creds_cache_key, sizeof (creds_cache_key));
+    g_once_init_leave (&key_initialized, 1);
+  }
+
+  password_tag = priv_siphash (creds_cache_key, password_trimmed,
+      password_len);
+  shard = priv_creds_shard (username_trimmed, username_len, realm_trimmed,
+      realm_len);
+
+  g_mutex_lock (&shard->mutex);
+  oldest = &shard->entries[0];
+  for (i = 0; i < STUN_CREDS_CACHE_WAYS; i++) {
+    entry = &shard->entries[i];
+    if (priv_creds_entry_matches (entry, username_trimmed, username_len,
+            realm_trimmed, realm_len) &&
+        entry->password_tag == password_tag) {
+      entry->last_use = ++shard->clock;
+      memcpy (md5, entry->md5, sizeof (entry->md5));
+      g_mutex_unlock (&shard->mutex);
+      return;
+    }
+    if (entry->last_use < oldest->last_use)
+      oldest = entry;
+  }
+  g_mutex_unlock (&shard->mutex);
+
+  vector[0] = username_trimmed;
+  lengths[0] = username_len;
+  vector[1] = colon;
+  lengths[1] = 1;
+  vector[2] = realm_trimmed;
+  lengths[2] = realm_len;
+  vector[3] = colon;
+  lengths[3] = 1;
+  vector[4] = password_trimmed;
+  lengths[4] = password_len;
+
+  md5_vector (5, vector, lengths, md5);
 
-  MD5Init (&ctx);
-  MD5Update (&ctx, username_trimmed, username_len);
-  MD5Update (&ctx, colon, 1);
-  MD5Update (&ctx, realm_trimmed, realm_len);
-  MD5Update (&ctx, colon, 1);
-  MD5Update (&ctx, password_trimmed, password_len);
-  MD5Final (md5, &ctx);
+  g_mutex_lock (&shard->mutex);
+  /* Another thread may have picked the same entry in the meantime, which
+   * only costs a recomputation later on */
+  priv_creds_entry_clear (oldest);
+  oldest->data = g_malloc (username_len + realm_len + 1);
+  memcpy (oldest->data, username_trimmed, username_len);
+  memcpy (oldest->data + username_len, realm_trimmed, realm_len);
+  oldest->username_len = username_len;
+  oldest->realm_len = realm_len;
+  oldest->password_tag = password_tag;
+  oldest->last_use = ++shard->clock;
+  memcpy (oldest->md5, md5, sizeof (oldest->md5));
+  g_mutex_unlock (&shard->mutex);
+}
+
+void stun_hash_creds_forget (const uint8_t *realm, size_t realm_len,
+    const uint8_t *username, size_t username_len)
+{
+  StunCredsCacheShard *shard;
+  size_t i;
+
+  realm = priv_trim_var (realm, &realm_len);
+  username = priv_trim_var (username, &username_len);
+  shard = priv_creds_shard (username, username_len, realm, realm_len);
+
+  g_mutex_lock (&shard->mutex);
+  for (i = 0; i < STUN_CREDS_CACHE_WAYS; i++) {
+    StunCredsCacheEntry *entry = &shard->entries[i];
+
+    if (priv_creds_entry_matches (entry, username, username_len,
+            realm, realm_len))
+      priv_creds_entry_clear (entry);
+  }
+  g_mutex_unlock (&shard->mutex);
 }
 
 
 void stun_make_transid (StunTransactionId id)
 {
-  RAND_bytes (id, 16);
+  stun_rand_bytes (id, sizeof (StunTransactionId));
 }
@@ -38,6 +38,26 @@
 #define _STUN_HMAC_H
 
 #include "stunmessage.h"
+#include "sha1.h"
+
+/*
+ * A MESSAGE-INTEGRITY key with its HMAC-SHA1 states precomputed, for keys
+ * that are used for many messages, like the ICE short-term passwords.
+ */
+struct stun_hmac_key_t {
+  uint8_t key[STUN_MAX_PWD];
+  size_t key_len;
+  HmacSha1Key sha1;
+};
+
+/*
+ * Sets @hkey to @key, reusing the current states if the key didn't change.
+ * @hkey must be zero-initialized before the first call.
+ */
+void stun_hmac_key_set (StunHmacKey *hkey, const uint8_t *key,
+    size_t key_len);
+
+void stun_hmac_key_clear (StunHmacKey *hkey);
 
 /*
  * Computes the MESSAGE-INTEGRITY hash of a STUN message.
@@ -53,6 +73,14 @@
 void stun_sha1 (const uint8_t *msg, size_t len, size_t msg_len,
     uint8_t *sha, const void *key, size_t keylen, int padding);
 
+/*
+ * Same as stun_sha1(), but uses the precomputed states of @hkey (which may
+ * be NULL) if @key is its key.
+ */
+void stun_sha1_keyed (const uint8_t *msg, size_t len, size_t msg_len,
+    uint8_t *sha, const StunHmacKey *hkey, const void *key, size_t keylen,
+    int padding);
+
 /*
  * SIP H(A1) computation
  */
@@ -61,6 +89,15 @@ void stun_hash_creds (const uint8_t *realm, size_t realm_len,
     const uint8_t *username, size_t username_len,
     const uint8_t *password, size_t password_len,
     unsigned char md5[16]);
+
+/*
+ * Drops the long-term key cached by stun_hash_creds() for @realm and
+ * @username, whatever the password was. To be called when a server rejects
+ * it with a new REALM or NONCE.
+ */
+void stun_hash_creds_forget (const uint8_t *realm, size_t realm_len,
+    const uint8_t *username, size_t username_len);
+
 /*
  * Generates a pseudo-random secure STUN transaction ID.
  */
@@ -83,6 +83,77 @@ uint16_t stun_message_length (const StunMessage *msg)
 
 
 
+static inline unsigned
+stun_message_index_hash (uint16_t type)
+{
+  /* attribute types cluster in the low and the 0x80xx ranges, multiply to
+   * spread them over the slots */
+  return ((uint32_t) type * 0x9E3779B1u) >> (32 - 4);
+}
+
+bool
+stun_message_index_add (StunMessageIndex *index, uint16_t type,
+    size_t offset, uint16_t length)
+{
+  unsigned i, used = 0;
+
+  G_STATIC_ASSERT (STUN_MESSAGE_INDEX_SLOTS == (1 << 4));
+
+  for (i = 0; i < STUN_MESSAGE_INDEX_SLOTS; i++)
+    if (index->slots[i].offset != 0)
+      used++;
+  if (used >= STUN_MESSAGE_INDEX_SLOTS * 3 / 4)
+    return FALSE;
+
+  for (i = stun_message_index_hash (type); index->slots[i].offset != 0;
+       i = (i + 1) % STUN_MESSAGE_INDEX_SLOTS) {
+    /* only the first one can be found */
+    if (index->slots[i].type == type)
+      return TRUE;
+  }
+
+  index->slots[i].type = type;
+  index->slots[i].length = length;
+  index->slots[i].offset = offset;
+  return TRUE;
+}
+
+static const void *
+stun_message_index_find (const StunMessage *msg,
+    const StunMessageIndex *index, uint16_t type, uint16_t *palen)
+{
+  unsigned i;
+
+  for (i = stun_message_index_hash (type); index->slots[i].offset != 0;
+       i = (i + 1) % STUN_MESSAGE_INDEX_SLOTS) {
+    if (index->slots[i].type == type) {
+      *palen = index->slots[i].length;
+      return msg->buffer + index->slots[i].offset;
+    }
+  }
+
+  return NULL;
+}
+
+const void *
+stun_message_find_indexed (const StunMessage *msg,
+    const StunMessageIndex *index, StunAttribute type, uint16_t *palen)
+{
+  if (index == NULL || index->buffer != msg->buffer)
+    return stun_message_find (msg, type, palen);
+
+  /* In MS-TURN, IDs of REALM and NONCE STUN attributes are swapped. */
+  if (msg->agent && msg->agent->compatibility == STUN_COMPATIBILITY_OC2007)
+  {
+    if (type == STUN_ATTRIBUTE_REALM)
+      type = STUN_ATTRIBUTE_NONCE;
+    else if (type == STUN_ATTRIBUTE_NONCE)
+      type = STUN_ATTRIBUTE_REALM;
+  }
+
+  return stun_message_index_find (msg, index, type, palen);
+}
+
 const void *
 stun_message_find (const StunMessage *msg, StunAttribute type,
     uint16_t *palen)
@@ -141,11 +212,19 @@ stun_message_find (const StunMessage *msg, StunAttribute type,
 
 StunMessageReturn
 stun_message_find_flag (const StunMessage *msg, StunAttribute type)
+{
+  return stun_message_find_flag_indexed (msg, NULL, type);
+}
+
+
+StunMessageReturn
+stun_message_find_flag_indexed (const StunMessage *msg,
+    const StunMessageIndex *index, StunAttribute type)
 {
   const void *ptr;
   uint16_t len = 0;
 
-  ptr = stun_message_find (msg, type, &len);
+  ptr = stun_message_find_indexed (msg, index, type, &len);
   if (ptr == NULL)
     return STUN_MESSAGE_RETURN_NOT_FOUND;
   return (len == 0) ? STUN_MESSAGE_RETURN_SUCCESS :
@@ -156,11 +235,19 @@ stun_message_find_flag (const StunMessage *msg, StunAttribute type)
 StunMessageReturn
 stun_message_find32 (const StunMessage *msg, StunAttribute type,
     uint32_t *pval)
+{
+  return stun_message_find32_indexed (msg, NULL, type, pval);
+}
+
+
+StunMessageReturn
+stun_message_find32_indexed (const StunMessage *msg,
+    const StunMessageIndex *index, StunAttribute type, uint32_t *pval)
 {
   const void *ptr;
   uint16_t len = 0;
 
-  ptr = stun_message_find (msg, type, &len);
+  ptr = stun_message_find_indexed (msg, index, type, &len);
   if (ptr == NULL)
     return STUN_MESSAGE_RETURN_NOT_FOUND;
 
@@ -179,11 +266,19 @@ stun_message_find32 (const StunMessage *msg, StunAttribute type,
 StunMessageReturn
 stun_message_find64 (const StunMessage *msg, StunAttribute type,
     uint64_t *pval)
+{
+  return stun_message_find64_indexed (msg, NULL, type, pval);
+}
+
+
+StunMessageReturn
+stun_message_find64_indexed (const StunMessage *msg,
+    const StunMessageIndex *index, StunAttribute type, uint64_t *pval)
 {
   const void *ptr;
   uint16_t len = 0;
 
-  ptr = stun_message_find (msg, type, &len);
+  ptr = stun_message_find_indexed (msg, index, type, &len);
   if (ptr == NULL)
     return STUN_MESSAGE_RETURN_NOT_FOUND;
 
@@ -342,7 +437,6 @@ stun_message_append (StunMessage *msg, StunAttribute type, size_t length)
   if ((size_t)mlen + STUN_ATTRIBUTE_HEADER_LENGTH + length > msg->buffer_len)
     return NULL;
 
-
   a = msg->buffer + mlen;
   a = stun_setw (a, type);
   if (msg->agent &&
@@ -529,6 +623,38 @@ stun_message_append_error (StunMessage *msg, StunError code)
   return STUN_MESSAGE_RETURN_SUCCESS;
 }
 
+StunMessageDemux stun_message_demux (const uint8_t *msg, size_t length,
+    bool check_cookie)
+{
+  uint8_t b;
+
+  if (length < 1)
+    return STUN_MESSAGE_DEMUX_UNKNOWN;
+
+  b = msg[0];
+  if (b < 4) {
+    uint32_t cookie = htonl (STUN_MAGIC_COOKIE);
+
+    if (check_cookie && (length < STUN_MESSAGE_HEADER_LENGTH ||
+            memcmp (msg + STUN_MESSAGE_TRANS_ID_POS, &cookie,
+                sizeof (cookie)) != 0))
+      return STUN_MESSAGE_DEMUX_INVALID;
+    return STUN_MESSAGE_DEMUX_STUN;
+  }
+  if (b < 16)
+    return STUN_MESSAGE_DEMUX_UNKNOWN;
+  if (b < 20)
+    return STUN_MESSAGE_DEMUX_ZRTP;
+  if (b < 64)
+    return STUN_MESSAGE_DEMUX_DTLS;
+  if (b < 80)
+    return STUN_MESSAGE_DEMUX_TURN_CHANNEL;
+  if (b >= 128 && b < 192)
+    return STUN_MESSAGE_DEMUX_RTP;
+
+  return STUN_MESSAGE_DEMUX_UNKNOWN;
+}
+
 int stun_message_validate_buffer_length (const uint8_t *msg, size_t length,
     bool has_padding)
 {
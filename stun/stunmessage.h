@@ -489,6 +489,72 @@ typedef enum
   STUN_MESSAGE_RETURN_UNSUPPORTED_ADDRESS
 } StunMessageReturn;
 
+/**
+ * StunMessageDemux:
+ * @STUN_MESSAGE_DEMUX_STUN: The packet looks like a STUN message (first byte
+ * 0 to 3, and the magic cookie if it was asked for)
+ * @STUN_MESSAGE_DEMUX_ZRTP: The packet is ZRTP (first byte 16 to 19)
+ * @STUN_MESSAGE_DEMUX_DTLS: The packet is DTLS (first byte 20 to 63)
+ * @STUN_MESSAGE_DEMUX_TURN_CHANNEL: The packet is TURN ChannelData (first
+ * byte 64 to 79)
+ * @STUN_MESSAGE_DEMUX_RTP: The packet is RTP or RTCP (first byte 128 to 191)
+ * @STUN_MESSAGE_DEMUX_INVALID: The first byte says STUN, but the packet is
+ * too short or has no magic cookie
+ * @STUN_MESSAGE_DEMUX_UNKNOWN: The packet matches none of the above
+ *
+ * The result of stun_message_demux(), following the first byte ranges of
+ * RFC 7983.
+ */
+typedef enum
+{
+  STUN_MESSAGE_DEMUX_STUN,
+  STUN_MESSAGE_DEMUX_ZRTP,
+  STUN_MESSAGE_DEMUX_DTLS,
+  STUN_MESSAGE_DEMUX_TURN_CHANNEL,
+  STUN_MESSAGE_DEMUX_RTP,
+  STUN_MESSAGE_DEMUX_INVALID,
+  STUN_MESSAGE_DEMUX_UNKNOWN
+} StunMessageDemux;
+
+/**
+ * STUN_MESSAGE_INDEX_SLOTS:
+ *
+ * The number of slots in a #StunMessageIndex. At most three quarters of
+ * them are used, messages with more distinct attributes are not indexed.
+ */
+#define STUN_MESSAGE_INDEX_SLOTS 16
+
+/**
+ * StunMessageIndexSlot:
+ * @type: The attribute type, as found in the message
+ * @length: The length of the attribute value
+ * @offset: The position of the attribute value in the buffer, 0 if the slot
+ * is free
+ *
+ * An entry of a #StunMessageIndex
+ */
+typedef struct {
+  uint16_t type;
+  uint16_t length;
+  uint32_t offset;
+} StunMessageIndexSlot;
+
+/**
+ * StunMessageIndex:
+ * @buffer: The buffer of the message the index describes, %NULL if it
+ * doesn't describe any
+ * @slots: Where the attributes stun_message_find() can return are
+ *
+ * Where the attributes of a STUN message are, recorded in a single pass by
+ * stun_agent_validate_indexed() so that stun_message_find_indexed() doesn't
+ * have to walk the message. It belongs to the caller, who must not use it
+ * for a message once its attributes have been changed.
+ */
+typedef struct {
+  const uint8_t *buffer;
+  StunMessageIndexSlot slots[STUN_MESSAGE_INDEX_SLOTS];
+} StunMessageIndex;
+
 #include "stunagent.h"
 
 /**
@@ -560,6 +626,22 @@ NICE_EXPORT uint16_t stun_message_length (const StunMessage *msg);
 NICE_EXPORT const void * stun_message_find (const StunMessage * msg, StunAttribute type,
     uint16_t *palen);
 
+/**
+ * stun_message_find_indexed:
+ * @msg: The #StunMessage
+ * @index: The #StunMessageIndex filled in when @msg was validated, or %NULL
+ * @type: The #StunAttribute to find
+ * @palen: A pointer to store the length of the attribute
+ *
+ * Finds an attribute like stun_message_find() does, but looks it up in
+ * @index instead of walking the message if @index describes @msg.
+ *
+ * Returns: A pointer to the start of the attribute payload if found,
+ * otherwise NULL.
+ */
+NICE_EXPORT const void * stun_message_find_indexed (const StunMessage *msg,
+    const StunMessageIndex *index, StunAttribute type, uint16_t *palen);
+
 
 /**
  * stun_message_find_flag:
@@ -574,6 +656,19 @@ NICE_EXPORT const void * stun_message_find (const StunMessage * msg, StunAttribu
 NICE_EXPORT StunMessageReturn stun_message_find_flag (const StunMessage *msg,
     StunAttribute type);
 
+/**
+ * stun_message_find_flag_indexed:
+ * @msg: The #StunMessage
+ * @index: The #StunMessageIndex filled in when @msg was validated, or %NULL
+ * @type: The #StunAttribute to find
+ *
+ * Like stun_message_find_flag(), looking the attribute up in @index.
+ *
+ * Returns: A #StunMessageReturn value.
+ */
+NICE_EXPORT StunMessageReturn stun_message_find_flag_indexed (
+    const StunMessage *msg, const StunMessageIndex *index, StunAttribute type);
+
 /**
  * stun_message_find32:
  * @msg: The #StunMessage
@@ -589,6 +684,21 @@ NICE_EXPORT StunMessageReturn stun_message_find_flag (const StunMessage *msg,
 NICE_EXPORT StunMessageReturn stun_message_find32 (const StunMessage *msg,
     StunAttribute type, uint32_t *pval);
 
+/**
+ * stun_message_find32_indexed:
+ * @msg: The #StunMessage
+ * @index: The #StunMessageIndex filled in when @msg was validated, or %NULL
+ * @type: The #StunAttribute to find
+ * @pval: A pointer where to store the value (host byte order)
+ *
+ * Like stun_message_find32(), looking the attribute up in @index.
+ *
+ * Returns: A #StunMessageReturn value.
+ */
+NICE_EXPORT StunMessageReturn stun_message_find32_indexed (
+    const StunMessage *msg, const StunMessageIndex *index,
+    StunAttribute type, uint32_t *pval);
+
 /**
  * stun_message_find64:
  * @msg: The #StunMessage
@@ -604,6 +714,21 @@ NICE_EXPORT StunMessageReturn stun_message_find32 (const StunMessage *msg,
 NICE_EXPORT StunMessageReturn stun_message_find64 (const StunMessage *msg,
     StunAttribute type, uint64_t *pval);
 
+/**
+ * stun_message_find64_indexed:
+ * @msg: The #StunMessage
+ * @index: The #StunMessageIndex filled in when @msg was validated, or %NULL
+ * @type: The #StunAttribute to find
+ * @pval: A pointer where to store the value (host byte order)
+ *
+ * Like stun_message_find64(), looking the attribute up in @index.
+ *
+ * Returns: A #StunMessageReturn value.
+ */
+NICE_EXPORT StunMessageReturn stun_message_find64_indexed (
+    const StunMessage *msg, const StunMessageIndex *index,
+    StunAttribute type, uint64_t *pval);
+
 /**
  * stun_message_find_string:
  * @msg: The #StunMessage
@@ -879,6 +1004,23 @@ NICE_EXPORT StunMessageReturn stun_message_append_error (StunMessage * msg,
 NICE_EXPORT int stun_message_validate_buffer_length (const uint8_t *msg, size_t length,
     bool has_padding);
 
+/**
+ * stun_message_demux:
+ * @msg: The received packet
+ * @length: The length of the packet
+ * @check_cookie: Whether STUN messages must carry the RFC5389 magic cookie
+ *
+ * Tells STUN apart from the other protocols that may share a transport
+ * address by looking at the first byte of the packet only, as described in
+ * RFC 7983, so that media doesn't have to go through
+ * stun_message_validate_buffer_length(). A packet classified as
+ * #STUN_MESSAGE_DEMUX_STUN still needs that validation.
+ *
+ * Returns: A #StunMessageDemux value
+ */
+NICE_EXPORT StunMessageDemux stun_message_demux (const uint8_t *msg,
+    size_t length, bool check_cookie);
+
 /**
  * stun_message_id:
  * @msg: The #StunMessage
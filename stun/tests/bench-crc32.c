@@ -0,0 +1,109 @@
+/*
+ * This file is part of the Nice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Nice GLib ICE library.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+
+/*
+ * Throughput of the CRC-32 implementations, on FINGERPRINT sized STUN
+ * messages and on larger buffers. Usage: bench-crc32 [megabytes]
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include "stun/stuncrc32.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const size_t sizes[] = { 20, 100, 200, 1500, 65536 };
+static const char *names[] = { "bytewise", "slice-by-8", "clmul" };
+
+/* microseconds on the monotonic clock */
+static int64_t
+now_us (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static double
+bench (size_t size, unsigned megabytes)
+{
+  static uint8_t buf[65536];
+  crc_data data = { buf, size };
+  size_t total = (size_t) megabytes << 20, done;
+  uint32_t crc = 0;
+  int64_t start;
+
+  memset (buf, 0xa5, sizeof (buf));
+  start = now_us ();
+  for (done = 0; done < total; done += size) {
+    crc ^= stun_crc32 (&data, 1, false);
+    buf[0] = crc;
+  }
+  start = now_us () - start;
+  if (start <= 0)
+    start = 1;
+
+  /* MB/s */
+  return (double) done / start;
+}
+
+static void
+run (StunCrc32Impl impl, unsigned megabytes)
+{
+  size_t i;
+
+  if (!stun_crc32_set_impl (impl))
+    return;
+
+  printf ("%-10s", names[impl]);
+  for (i = 0; i < sizeof (sizes) / sizeof (sizes[0]); i++)
+    printf ("  %5u B %7.1f MB/s", (unsigned) sizes[i],
+        bench (sizes[i], megabytes));
+  printf ("\n");
+}
+
+int main (int argc, char **argv)
+{
+  unsigned megabytes = 256;
+
+  if (argc > 1)
+    megabytes = strtoul (argv[1], NULL, 10);
+  if (megabytes == 0)
+    megabytes = 1;
+
+  run (STUN_CRC32_IMPL_BYTEWISE, megabytes);
+  run (STUN_CRC32_IMPL_SLICE8, megabytes);
+  run (STUN_CRC32_IMPL_CLMUL, megabytes);
+
+  return 0;
+}
@@ -0,0 +1,143 @@
+/*
+ * This file is part of the Nice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Nice GLib ICE library.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+/*
+ * Compares the crypto backends on messages of the size of ICE
+ * connectivity checks. Usage: bench-crypto [iterations]
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include "stun/crypto.h"
+#include "stun/sha1.h"
+#include "stun/md5.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const size_t sizes[] = { 100, 150, 200 };
+
+/* microseconds on the monotonic clock */
+static int64_t
+now_us (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static double
+bench_hmac (size_t size, unsigned iterations)
+{
+  static const uint8_t key[] = "Nf8UuW1Dh8nSHc0KVzvkKwkR";
+  uint8_t msg[256], mac[SHA1_MAC_LEN];
+  const uint8_t *addr = msg;
+  int64_t start;
+  unsigned i;
+
+  memset (msg, 0xa5, sizeof (msg));
+  start = now_us ();
+  for (i = 0; i < iterations; i++) {
+    hmac_sha1_vector (key, sizeof (key) - 1, 1, &addr, &size, mac);
+    msg[0] = mac[0];
+  }
+  return (now_us () - start) * 1000.0 / iterations;
+}
+
+static double
+bench_hmac_keyed (size_t size, unsigned iterations)
+{
+  static const uint8_t key[] = "Nf8UuW1Dh8nSHc0KVzvkKwkR";
+  uint8_t msg[256], mac[SHA1_MAC_LEN];
+  const uint8_t *addr = msg;
+  HmacSha1Key hkey;
+  int64_t start;
+  unsigned i;
+
+  memset (msg, 0xa5, sizeof (msg));
+  hmac_sha1_key_init (&hkey, key, sizeof (key) - 1);
+  start = now_us ();
+  for (i = 0; i < iterations; i++) {
+    hmac_sha1_vector_keyed (&hkey, 1, &addr, &size, mac);
+    msg[0] = mac[0];
+  }
+  start = now_us () - start;
+  hmac_sha1_key_clear (&hkey);
+  return start * 1000.0 / iterations;
+}
+
+static double
+bench_md5 (size_t size, unsigned iterations)
+{
+  uint8_t msg[256], md5[MD5_MAC_LEN];
+  const uint8_t *addr = msg;
+  int64_t start;
+  unsigned i;
+
+  memset (msg, 0xa5, sizeof (msg));
+  start = now_us ();
+  for (i = 0; i < iterations; i++) {
+    md5_vector (1, &addr, &size, md5);
+    msg[0] = md5[0];
+  }
+  return (now_us () - start) * 1000.0 / iterations;
+}
+
+static void
+run (StunCryptoBackend backend, unsigned iterations)
+{
+  size_t i;
+
+  if (!stun_crypto_set_backend (backend))
+    return;
+
+  for (i = 0; i < sizeof (sizes) / sizeof (sizes[0]); i++)
+    printf ("%-10s %4u bytes: HMAC-SHA1 %7.1f ns  keyed %7.1f ns  "
+        "MD5 %7.1f ns\n", stun_crypto_ops ()->name, (unsigned) sizes[i],
+        bench_hmac (sizes[i], iterations),
+        bench_hmac_keyed (sizes[i], iterations),
+        bench_md5 (sizes[i], iterations));
+}
+
+int main (int argc, char **argv)
+{
+  unsigned iterations = 200000;
+
+  if (argc > 1)
+    iterations = strtoul (argv[1], NULL, 10);
+  if (iterations == 0)
+    iterations = 1;
+
+  run (STUN_CRYPTO_BACKEND_BUILTIN, iterations);
+  run (STUN_CRYPTO_BACKEND_LIBCRYPTO, iterations);
+
+  return 0;
+}
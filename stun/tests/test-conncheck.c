@@ -78,15 +78,18 @@ int main (void)
   static char username[] = "L:R", ufrag[] = "L", pass[] = "secret";
   int code;
   uint16_t alen;
+  uint64_t q;
   bool control = false;
   StunAgent agent;
   StunMessage req;
+  StunMessageIndex index;
   StunMessage resp;
   StunDefaultValidaterData validater_data[] = {
     {ufrag, strlen (ufrag), pass, strlen (pass)},
     {username, strlen (username), pass, strlen (pass)},
     {NULL, 0, NULL, 0}};
   StunValidationStatus valid;
+  StunUsageIceConncheckTemplate tmpl;
 
   stun_agent_init (&agent, STUN_ALL_KNOWN_ATTRIBUTES,
       STUN_COMPATIBILITY_RFC5389,
@@ -188,6 +191,18 @@ int main (void)
   assert (stun_usage_ice_conncheck_priority (&req) == 0x12345678);
   assert (stun_usage_ice_conncheck_use_candidate (&req) == true);
 
+  /* Same lookups through the attribute index */
+  assert (stun_agent_validate_indexed (&agent, &req, &index, req_buf, rlen,
+          stun_agent_default_validater, validater_data) ==
+      STUN_VALIDATION_SUCCESS);
+  assert (stun_usage_ice_conncheck_priority_indexed (&req, &index) ==
+      0x12345678);
+  assert (stun_usage_ice_conncheck_use_candidate_indexed (&req, &index) ==
+      true);
+  assert (stun_message_find64_indexed (&req, &index,
+          STUN_ATTRIBUTE_ICE_CONTROLLING, &q) ==
+      STUN_MESSAGE_RETURN_NOT_FOUND);
+
   /* Invalid socket address */
   assert (stun_agent_init_request (&agent, &req, req_buf, sizeof(req_buf), STUN_BINDING));
   val = stun_message_append_string (&req, STUN_ATTRIBUTE_USERNAME, ufrag);
@@ -250,6 +265,41 @@ int main (void)
   stun_message_find_error (&resp, &code);
   assert (code == STUN_ERROR_ROLE_CONFLICT);
 
+  /* Requests rebuilt from a template */
+  memset (&tmpl, 0, sizeof (tmpl));
+  rlen = stun_usage_ice_conncheck_create_from_template (&agent, &req,
+      req_buf, sizeof (req_buf), &tmpl, (uint8_t *) username,
+      strlen (username), (uint8_t *) pass, strlen (pass), true, true, 1234,
+      tie, NULL, STUN_USAGE_ICE_COMPATIBILITY_RFC5245);
+  assert (rlen > 0);
+  assert (tmpl.length > 0 && tmpl.length < rlen);
+  memcpy (resp_buf, req_buf, rlen);
+
+  len = stun_usage_ice_conncheck_create_from_template (&agent, &req,
+      req_buf, sizeof (req_buf), &tmpl, (uint8_t *) username,
+      strlen (username), (uint8_t *) pass, strlen (pass), true, true, 1234,
+      tie, NULL, STUN_USAGE_ICE_COMPATIBILITY_RFC5245);
+  assert (len == rlen);
+  /* same attributes, new transaction ID */
+  assert (memcmp (req_buf, resp_buf, 8) == 0);
+  assert (memcmp (req_buf + 8, resp_buf + 8, 12) != 0);
+  assert (memcmp (req_buf + 20, resp_buf + 20, tmpl.length - 20) == 0);
+  assert (stun_agent_validate (&agent, &req, req_buf, len,
+          stun_agent_default_validater, validater_data) ==
+      STUN_VALIDATION_SUCCESS);
+  assert (stun_message_has_attribute (&req, STUN_ATTRIBUTE_USE_CANDIDATE));
+
+  /* a different argument builds the request again */
+  len = stun_usage_ice_conncheck_create_from_template (&agent, &req,
+      req_buf, sizeof (req_buf), &tmpl, (uint8_t *) username,
+      strlen (username), (uint8_t *) pass, strlen (pass), false, true, 4321,
+      tie, NULL, STUN_USAGE_ICE_COMPATIBILITY_RFC5245);
+  assert (len == rlen - 4);
+  assert (stun_agent_validate (&agent, &req, req_buf, len,
+          stun_agent_default_validater, validater_data) ==
+      STUN_VALIDATION_SUCCESS);
+  assert (!stun_message_has_attribute (&req, STUN_ATTRIBUTE_USE_CANDIDATE));
+  assert (stun_usage_ice_conncheck_priority (&req) == 4321);
 
   return 0;
 }
@@ -40,6 +40,7 @@
 #include <sys/types.h>
 
 #include "stun/stunagent.h"
+#include "stun/stuncrc32.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -172,6 +173,64 @@ check_af (const char *name, int family, socklen_t addrlen)
     fatal ("%s sockaddr xor test failed", name);
 }
 
+static void
+check_crc32 (void)
+{
+  static const StunCrc32Impl impls[] = {
+    STUN_CRC32_IMPL_BYTEWISE, STUN_CRC32_IMPL_SLICE8, STUN_CRC32_IMPL_CLMUL
+  };
+  uint8_t check[] = "123456789", typo[] = "\xa5";
+  uint8_t data[1500];
+  crc_data one = { check, 9 };
+  unsigned i, t;
+
+  for (i = 0; i < sizeof (data); i++)
+    data[i] = (uint8_t) (i * 7 + (i >> 3));
+
+  for (t = 0; t < sizeof (impls) / sizeof (impls[0]); t++) {
+    size_t len;
+
+    if (!stun_crc32_set_impl (impls[t])) {
+      if (impls[t] != STUN_CRC32_IMPL_CLMUL)
+        fatal ("CRC32 implementation %u missing", impls[t]);
+      continue;
+    }
+
+    if (stun_crc32 (&one, 1, false) != 0xCBF43926)
+      fatal ("CRC32 check value test failed with implementation %u",
+          impls[t]);
+
+    /* every length around the block sizes, split across pieces at an
+     * odd offset, against the byte-wise result */
+    for (len = 0; len < 300; len++) {
+      size_t split = len / 3, off = len % 5;
+      crc_data pieces[2] = {
+        { data + off, split }, { data + off + split, len - split }
+      };
+      uint32_t expected, got;
+
+      got = stun_crc32 (pieces, 2, false);
+      stun_crc32_set_impl (STUN_CRC32_IMPL_BYTEWISE);
+      expected = stun_crc32 (pieces, 2, false);
+      stun_crc32_set_impl (impls[t]);
+      if (got != expected)
+        fatal ("CRC32 implementation %u wrong for %u bytes", impls[t],
+            (unsigned) len);
+    }
+
+    /* the WLM 2009 variant only differs where the typo'd entry is hit */
+    if (stun_crc32 (&one, 1, true) != 0xCBF43926)
+      fatal ("CRC32 typo variant test failed");
+    one.buf = typo;
+    one.len = 1;
+    if (stun_crc32 (&one, 1, false) != 0x74beb8ea ||
+        stun_crc32 (&one, 1, true) != 0xf7bbe8ea)
+      fatal ("CRC32 typo variant lookup test failed");
+    one.buf = check;
+    one.len = 9;
+  }
+}
+
 int main (void)
 {
   uint8_t buf[100];
@@ -259,5 +318,7 @@ int main (void)
   check_af ("IPv6", AF_INET6, sizeof (struct sockaddr_in6));
 #endif
 
+  check_crc32 ();
+
   return 0;
 }
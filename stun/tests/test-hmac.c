@@ -38,8 +38,10 @@
 #endif
 
 
+#include "stun/crypto.h"
 #include "stun/sha1.h"
 #include "stun/md5.h"
+#include "stun/stunhmac.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -86,6 +88,64 @@ void test_hmac (uint8_t *key, uint8_t *str, uint8_t *expected) {
     exit (1);
 }
 
+void test_hmac_keyed (uint8_t *key, uint8_t *str, uint8_t *expected) {
+  HmacSha1Key hkey;
+  uint8_t hmac[20];
+  const uint8_t *addr[2];
+  size_t len[2];
+
+  /* split the data to check that the precomputed key states are not
+   * consumed by a MAC */
+  addr[0] = str;
+  len[0] = strlen (str) / 2;
+  addr[1] = str + len[0];
+  len[1] = strlen (str) - len[0];
+
+  hmac_sha1_key_init (&hkey, key, strlen (key));
+  hmac_sha1_vector_keyed (&hkey, 2, addr, len, hmac);
+  printf ("Keyed HMAC of '%s' with key '%s' is : ", str, key);
+  print_bytes (hmac, SHA1_MAC_LEN);
+  if (memcmp (hmac, expected, SHA1_MAC_LEN))
+    exit (1);
+
+  hmac_sha1_vector_keyed (&hkey, 2, addr, len, hmac);
+  hmac_sha1_key_clear (&hkey);
+  if (memcmp (hmac, expected, SHA1_MAC_LEN))
+    exit (1);
+}
+
+void test_sha1_keyed (void) {
+  StunHmacKey hkey, other;
+  uint8_t msg[48];
+  uint8_t expected[20], sha[20];
+  size_t i;
+
+  for (i = 0; i < sizeof (msg); i++)
+    msg[i] = i;
+  memset (&hkey, 0, sizeof (hkey));
+  memset (&other, 0, sizeof (other));
+  stun_hmac_key_set (&hkey, (const uint8_t *) "secret", 6);
+  stun_hmac_key_set (&other, (const uint8_t *) "public", 6);
+
+  stun_sha1 (msg, sizeof (msg), sizeof (msg) - 20, expected, "secret", 6,
+      FALSE);
+
+  /* the precomputed states give the same MAC as the raw key */
+  stun_sha1_keyed (msg, sizeof (msg), sizeof (msg) - 20, sha, &hkey,
+      "secret", 6, FALSE);
+  if (memcmp (sha, expected, sizeof (sha)))
+    exit (1);
+
+  /* and are not used for another key */
+  stun_sha1_keyed (msg, sizeof (msg), sizeof (msg) - 20, sha, &other,
+      "secret", 6, FALSE);
+  if (memcmp (sha, expected, sizeof (sha)))
+    exit (1);
+
+  stun_hmac_key_clear (&hkey);
+  stun_hmac_key_clear (&other);
+}
+
 void test_md5 (uint8_t *str, uint8_t *expected) {
   MD5_CTX ctx;
   uint8_t md5[20];
@@ -104,6 +164,37 @@ void test_md5 (uint8_t *str, uint8_t *expected) {
     exit (1);
 }
 
+void test_hash_creds (void) {
+  MD5_CTX ctx;
+  uint8_t expected[MD5_MAC_LEN];
+  uint8_t md5[MD5_MAC_LEN];
+  uint8_t other[MD5_MAC_LEN];
+  int i;
+
+  MD5Init(&ctx);
+  MD5Update(&ctx, "user:realm:pass", strlen ("user:realm:pass"));
+  MD5Final(expected, &ctx);
+
+  /* the second round is served from the cache, the third after a rejection */
+  for (i = 0; i < 3; i++) {
+    stun_hash_creds ("realm", 5, "user", 4, "pass", 4, md5);
+    if (memcmp (md5, expected, MD5_MAC_LEN))
+      exit (1);
+
+    /* quotes and trailing NULs are trimmed before looking up the cache */
+    stun_hash_creds ("\"realm\"", 7, "user", 4, "pass\0", 5, md5);
+    if (memcmp (md5, expected, MD5_MAC_LEN))
+      exit (1);
+
+    stun_hash_creds ("realm", 5, "user", 4, "pasS", 4, other);
+    if (memcmp (other, expected, MD5_MAC_LEN) == 0)
+      exit (1);
+
+    if (i == 1)
+      stun_hash_creds_forget ("realm", 5, "user", 4);
+  }
+}
+
 int main (void)
 {
 
@@ -129,6 +220,17 @@ int main (void)
                             0x87, 0x6c, 0x66, 0x4a};
 
   test_hmac ("hello", "world", hello_world_hmac);
+  test_hmac_keyed ("hello", "world", hello_world_hmac);
+
+  /* the same through the other backend, when there is one */
+  if (stun_crypto_set_backend (
+          stun_crypto_get_backend () == STUN_CRYPTO_BACKEND_BUILTIN ?
+          STUN_CRYPTO_BACKEND_LIBCRYPTO : STUN_CRYPTO_BACKEND_BUILTIN)) {
+    test_hmac ("hello", "world", hello_world_hmac);
+    test_hmac_keyed ("hello", "world", hello_world_hmac);
+  }
+
+  test_sha1_keyed ();
 
   test_sha1 ("abc", abc_sha1);
   test_md5 ("abc", abc_md5);
@@ -138,5 +240,7 @@ int main (void)
   test_md5 ("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
       abcd_etc_md5);
 
+  test_hash_creds ();
+
   return 0;
 }
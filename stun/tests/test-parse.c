@@ -301,8 +301,8 @@ bool test_attribute_validater (StunAgent *agent,
   return true;
 }
 
-/* Tests for message attribute parsing */
-static void test_attribute (void)
+/* Tests for message attribute parsing, with or without the attribute index */
+static void test_attribute (bool indexed)
 {
   static const uint8_t acme[] =
       {0x04, 0x55, 0x00, 0x6C, // <-- update message length if needed!!
@@ -366,25 +366,47 @@ static void test_attribute (void)
 
   StunAgent agent;
   StunMessage msg;
+  StunMessageIndex index;
+  StunMessageIndex *pindex = indexed ? &index : NULL;
+  const void *value;
+  uint16_t len;
   uint16_t known_attributes[] = {STUN_ATTRIBUTE_MESSAGE_INTEGRITY, STUN_ATTRIBUTE_USERNAME, 0};
 
   printf ("Attribute test message length: %lu\n", sizeof (acme));
 
   stun_agent_init (&agent, known_attributes,
-      STUN_COMPATIBILITY_RFC5389, STUN_AGENT_USAGE_SHORT_TERM_CREDENTIALS);
+      STUN_COMPATIBILITY_RFC5389,
+      STUN_AGENT_USAGE_SHORT_TERM_CREDENTIALS);
 
-  if (stun_agent_validate (&agent, &msg, acme, sizeof(acme),
+  if (stun_agent_validate_indexed (&agent, &msg, pindex, acme, sizeof(acme),
           NULL, NULL) != STUN_VALIDATION_UNAUTHORIZED)
     fatal ("Unauthorized validation failed");
 
-  if (stun_agent_validate (&agent, &msg, acme, sizeof(acme),
+  if (stun_agent_validate_indexed (&agent, &msg, pindex, acme, sizeof(acme),
           test_attribute_validater, "bad__guy") != STUN_VALIDATION_UNAUTHORIZED)
     fatal ("invalid password validation failed");
 
-  if (stun_agent_validate (&agent, &msg, acme, sizeof(acme),
+  if (stun_agent_validate_indexed (&agent, &msg, pindex, acme, sizeof(acme),
           test_attribute_validater, "good_guy") != STUN_VALIDATION_SUCCESS)
     fatal ("good password validation failed");
 
+  if (indexed && index.buffer != msg.buffer)
+    fatal ("Attribute index test failed");
+
+  value = stun_message_find_indexed (&msg, pindex, 0xff00, &len);
+  if (value != NULL)
+    fatal ("Absent indexed attribute test failed");
+  value = stun_message_find_indexed (&msg, pindex, 0xff02, &len);
+  if (value != stun_message_find (&msg, 0xff02, &len) || len != 4 ||
+      memcmp (value, "ABCD", 4))
+    fatal ("Indexed attribute test failed");
+  value = stun_message_find_indexed (&msg, pindex, STUN_ATTRIBUTE_USERNAME,
+      &len);
+  if (value == NULL || len != 4 || memcmp (value, "ABCD", 4))
+    fatal ("Indexed USERNAME test failed");
+  if (!stun_message_has_attribute (&msg, STUN_ATTRIBUTE_MESSAGE_INTEGRITY))
+    fatal ("Indexed MESSAGE-INTEGRITY test failed");
+
   if (stun_message_has_attribute (&msg, 0xff00))
     fatal ("Absent attribute test failed");
   if (!stun_message_has_attribute (&msg, 0xff01))
@@ -729,11 +751,68 @@ static void test_hash_creds (void)
 
 }
 
+static void test_demux (void)
+{
+  static const uint8_t stun[] =
+      {0x00, 0x01, 0x00, 0x00, 0x21, 0x12, 0xA4, 0x42,
+       0xb7, 0xe7, 0xa7, 0x01, 0xbc, 0x34, 0xd6, 0x86,
+       0xfa, 0x87, 0xdf, 0xae};
+  static const uint8_t classic[] =
+      {0x00, 0x01, 0x00, 0x00, 0xb7, 0xe7, 0xa7, 0x01,
+       0xbc, 0x34, 0xd6, 0x86, 0xfa, 0x87, 0xdf, 0xae,
+       0xb7, 0xe7, 0xa7, 0x01};
+  static const struct {
+    uint8_t first;
+    StunMessageDemux demux;
+  } ranges[] = {
+    {4, STUN_MESSAGE_DEMUX_UNKNOWN},
+    {16, STUN_MESSAGE_DEMUX_ZRTP},
+    {19, STUN_MESSAGE_DEMUX_ZRTP},
+    {20, STUN_MESSAGE_DEMUX_DTLS},
+    {63, STUN_MESSAGE_DEMUX_DTLS},
+    {64, STUN_MESSAGE_DEMUX_TURN_CHANNEL},
+    {79, STUN_MESSAGE_DEMUX_TURN_CHANNEL},
+    {80, STUN_MESSAGE_DEMUX_UNKNOWN},
+    {128, STUN_MESSAGE_DEMUX_RTP},
+    {191, STUN_MESSAGE_DEMUX_RTP},
+    {192, STUN_MESSAGE_DEMUX_UNKNOWN},
+  };
+  size_t i;
+
+  puts ("Testing first byte demultiplexing...");
+
+  if (stun_message_demux (stun, 0, FALSE) != STUN_MESSAGE_DEMUX_UNKNOWN)
+    fatal ("Empty packet demux failed");
+  if (stun_message_demux (stun, sizeof (stun), TRUE) != STUN_MESSAGE_DEMUX_STUN)
+    fatal ("RFC5389 message demux failed");
+  if (stun_message_demux (classic, sizeof (classic), FALSE) !=
+      STUN_MESSAGE_DEMUX_STUN)
+    fatal ("RFC3489 message demux failed");
+  if (stun_message_demux (classic, sizeof (classic), TRUE) !=
+      STUN_MESSAGE_DEMUX_INVALID)
+    fatal ("Missing magic cookie demux failed");
+  if (stun_message_demux (stun, 8, TRUE) != STUN_MESSAGE_DEMUX_INVALID)
+    fatal ("Short message demux failed");
+
+  for (i = 0; i < sizeof (ranges) / sizeof (ranges[0]); i++) {
+    uint8_t packet[sizeof (stun)];
+
+    memcpy (packet, stun, sizeof (stun));
+    packet[0] = ranges[i].first;
+    if (stun_message_demux (packet, sizeof (packet), TRUE) != ranges[i].demux)
+      fatal ("Demux of first byte %u failed", ranges[i].first);
+  }
+
+  puts ("Done.");
+}
+
 int main (void)
 {
   test_message ();
-  test_attribute ();
+  test_attribute (false);
+  test_attribute (true);
   test_vectors ();
   test_hash_creds ();
+  test_demux ();
   return 0;
 }
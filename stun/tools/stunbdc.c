@@ -50,9 +50,11 @@
 #include <sys/types.h>
 #include "stun/stunagent.h"
 #include "stun/usages/bind.h"
+#include "stunload.h"
 
 #include <unistd.h>
 #include <getopt.h>
+#include <errno.h>
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -60,6 +62,33 @@
 
 static int ai_flags = 0;
 
+/* load generation when the rate isn't 0 */
+static StunLoadConfig load_config = {
+  0, 1000, 1, 10, 1000, FALSE, NULL, NULL
+};
+
+/* Parses a load generation option between @min and @max into @value */
+static bool
+parse_option (const char *argv0, const char *name, const char *arg,
+    unsigned long min, unsigned long max, unsigned *value)
+{
+  char *end;
+  unsigned long n;
+
+  errno = 0;
+  n = strtoul (arg, &end, 10);
+  if (arg[0] < '0' || arg[0] > '9' || *end != '\0' || errno ||
+      n < min || n > max)
+  {
+    fprintf (stderr, "%s: invalid %s `%s' (%lu to %lu)\n", argv0, name, arg,
+        min, max);
+    return FALSE;
+  }
+
+  *value = n;
+  return TRUE;
+}
+
 static void
 printaddr (const char *str, const struct sockaddr *addr, socklen_t addrlen)
 {
@@ -105,6 +134,14 @@ static int run (int family, const char *hostname, const char *service)
 
     printaddr ("Server address", ptr->ai_addr, ptr->ai_addrlen);
 
+#ifndef _WIN32
+    if (load_config.rate > 0)
+    {
+      ret = stunload_run (ptr->ai_addr, ptr->ai_addrlen, &load_config);
+      break;
+    }
+#endif
+
     val = stun_usage_bind_run (ptr->ai_addr, ptr->ai_addrlen,
                          (struct sockaddr *)&addr, &addrlen);
     if (val)
@@ -130,6 +167,16 @@ int main (int argc, char *argv[])
     { "help",    no_argument, NULL, 'h' },
     { "numeric", no_argument, NULL, 'n' },
     { "version", no_argument, NULL, 'V' },
+#ifndef _WIN32
+    { "rate",     required_argument, NULL, 'r' },
+    { "window",   required_argument, NULL, 'w' },
+    { "sockets",  required_argument, NULL, 's' },
+    { "duration", required_argument, NULL, 'd' },
+    { "timeout",  required_argument, NULL, 't' },
+    { "turn",     no_argument,       NULL, 'T' },
+    { "username", required_argument, NULL, 'u' },
+    { "password", required_argument, NULL, 'p' },
+#endif
     { NULL,      0,           NULL, 0   }
   };
   const char *server = NULL, *port = NULL;
@@ -137,7 +184,7 @@ int main (int argc, char *argv[])
 
   for (;;)
   {
-    int val = getopt_long (argc, argv, "46hnV", opts, NULL);
+    int val = getopt_long (argc, argv, "46hnVr:w:s:d:t:Tu:p:", opts, NULL);
     if (val == EOF)
       break;
 
@@ -158,6 +205,20 @@ int main (int argc, char *argv[])
                 "  -4, --ipv4    Force IP version 4\n"
                 "  -6, --ipv6    Force IP version 6\n"
                 "  -n, --numeric Server in numeric form\n"
+#ifndef _WIN32
+                "\n"
+                "Load generation:\n"
+                "  -r, --rate=N      Send N requests per second\n"
+                "  -w, --window=N    Keep at most N requests in flight, or\n"
+                "                    N allocations with --turn (1000)\n"
+                "  -s, --sockets=N   Spread Binding requests over N sockets (1)\n"
+                "  -d, --duration=S  Run for S seconds (10)\n"
+                "  -t, --timeout=MS  Count a request as lost after MS ms (1000)\n"
+                "  -T, --turn        Cycle TURN Allocate, ChannelBind, Refresh\n"
+                "                    and deallocation instead of Binding\n"
+                "  -u, --username=U  TURN long-term credentials\n"
+                "  -p, --password=P\n"
+#endif
             "\n", argv[0]);
         return 0;
 
@@ -165,6 +226,48 @@ int main (int argc, char *argv[])
         ai_flags |= AI_NUMERICHOST;
         break;
 
+      case 'r':
+        if (!parse_option (argv[0], "rate", optarg, 1, 10000000,
+                &load_config.rate))
+          return 2;
+        break;
+
+      case 'w':
+        if (!parse_option (argv[0], "window", optarg, 1, 1000000,
+                &load_config.window))
+          return 2;
+        break;
+
+      case 's':
+        if (!parse_option (argv[0], "number of sockets", optarg, 1, 65536,
+                &load_config.sockets))
+          return 2;
+        break;
+
+      case 'd':
+        if (!parse_option (argv[0], "duration", optarg, 1, 86400,
+                &load_config.duration))
+          return 2;
+        break;
+
+      case 't':
+        if (!parse_option (argv[0], "timeout", optarg, 1, 3600000,
+                &load_config.timeout))
+          return 2;
+        break;
+
+      case 'T':
+        load_config.turn = TRUE;
+        break;
+
+      case 'u':
+        load_config.username = optarg;
+        break;
+
+      case 'p':
+        load_config.password = optarg;
+        break;
+
       case 'V':
         printf ("stunbcd: STUN Binding Discovery client (%s v%s)\n",
                 PACKAGE, VERSION);
@@ -185,5 +288,14 @@ int main (int argc, char *argv[])
     return 2;
   }
 
+#ifndef _WIN32
+  if (load_config.turn && load_config.window > stunload_max_turn_window ())
+  {
+    fprintf (stderr, "%s: invalid window `%u' with --turn (1 to %u)\n",
+        argv[0], load_config.window, stunload_max_turn_window ());
+    return 2;
+  }
+#endif
+
   return run (family, server, port) ? 1 : 0;
 }
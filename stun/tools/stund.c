@@ -44,6 +44,10 @@
 #define _XPG4_2 1
 #endif
 
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE /* for recvmmsg() and sendmmsg() */
+#endif
+
 #ifndef _WIN32
 
 #include <stdio.h>
@@ -79,9 +83,26 @@
 /** Default port for STUN binding discovery */
 #define IPPORT_STUN  3478
 
+/** Datagrams received and sent per system call */
+#define STUND_BATCH_SIZE 64
+
+/** Most worker threads, each has STUND_BATCH_SIZE full sized buffers */
+#define STUND_MAX_THREADS 256
+
+#include <glib.h>
+
 #include "stun/stunagent.h"
 #include "stund.h"
 
+typedef struct {
+  int sock;
+  StunAgent oldagent;
+  StunAgent newagent;
+  volatile guint requests;  /* since the last report */
+  volatile guint responses; /* since the last report */
+  uint8_t bufs[STUND_BATCH_SIZE][STUN_MAX_MESSAGE_SIZE];
+} StundWorker;
+
 static const uint16_t known_attributes[] =  {
   0
 };
@@ -89,7 +110,8 @@ static const uint16_t known_attributes[] =  {
 /*
  * Creates a listening socket
  */
-int listen_socket (int fam, int type, int proto, unsigned int port)
+int listen_socket (int fam, int type, int proto, unsigned int port,
+    int reuse_port)
 {
   int yes = 1;
   int fd = socket (fam, type, proto);
@@ -127,6 +149,20 @@ int listen_socket (int fam, int type, int proto, unsigned int port)
       break;
   }
 
+  if (reuse_port)
+  {
+#ifdef SO_REUSEPORT
+    if (setsockopt (fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof (yes)))
+    {
+      perror ("Error sharing IP port");
+      goto error;
+    }
+#else
+    fprintf (stderr, "Error sharing IP port: SO_REUSEPORT not supported\n");
+    goto error;
+#endif
+  }
+
   if (bind (fd, (struct sockaddr *)&addr, sizeof (struct sockaddr)))
   {
     perror ("Error opening IP port");
@@ -166,24 +202,19 @@ error:
   return -1;
 }
 
-static int dgram_process (int sock, StunAgent *oldagent, StunAgent *newagent)
+/*
+ * Processes the request in @buf, and builds the response in its place.
+ * Returns the length of the response, 0 if there is nothing to send.
+ */
+static size_t dgram_process (StunAgent *oldagent, StunAgent *newagent,
+    uint8_t *buf, size_t len, size_t buf_size,
+    const struct sockaddr *addr, socklen_t addr_len)
 {
-  struct sockaddr_storage addr;
-  socklen_t addr_len;
-  uint8_t buf[STUN_MAX_MESSAGE_SIZE];
-  size_t buf_len = 0;
-  size_t len = 0;
   StunMessage request;
   StunMessage response;
   StunValidationStatus validation;
   StunAgent *agent = NULL;
 
-  addr_len = sizeof (struct sockaddr_in);
-  len = recvfrom (sock, buf, sizeof(buf), 0,
-      (struct sockaddr *)&addr, &addr_len);
-  if (len == (size_t)-1)
-    return -1;
-
   validation = stun_agent_validate (newagent, &request, buf, len, NULL, 0);
 
   if (validation == STUN_VALIDATION_SUCCESS) {
@@ -197,59 +228,190 @@ static int dgram_process (int sock, StunAgent *oldagent, StunAgent *newagent)
   /* Unknown attributes */
   if (validation == STUN_VALIDATION_UNKNOWN_REQUEST_ATTRIBUTE)
   {
-    buf_len = stun_agent_build_unknown_attributes_error (agent, &response, buf,
-        sizeof (buf), &request);
-    goto send_buf;
+    return stun_agent_build_unknown_attributes_error (agent, &response, buf,
+        buf_size, &request);
   }
 
   /* Mal-formatted packets */
   if (validation != STUN_VALIDATION_SUCCESS ||
       stun_message_get_class (&request) != STUN_REQUEST) {
-    return -1;
+    return 0;
   }
 
   switch (stun_message_get_method (&request))
   {
     case STUN_BINDING:
-      stun_agent_init_response (agent, &response, buf, sizeof (buf), &request);
+      stun_agent_init_response (agent, &response, buf, buf_size, &request);
       if (stun_message_has_cookie (&request))
         stun_message_append_xor_addr (&response,
-            STUN_ATTRIBUTE_XOR_MAPPED_ADDRESS,
-            (struct sockaddr *)&addr, addr_len);
+            STUN_ATTRIBUTE_XOR_MAPPED_ADDRESS, addr, addr_len);
       else
          stun_message_append_addr (&response, STUN_ATTRIBUTE_MAPPED_ADDRESS,
-             (struct sockaddr *)&addr, addr_len);
+             addr, addr_len);
       break;
 
     default:
-      if (!stun_agent_init_error (agent, &response, buf, sizeof (buf),
+      if (!stun_agent_init_error (agent, &response, buf, buf_size,
               &request, STUN_ERROR_BAD_REQUEST))
-        return -1;
+        return 0;
   }
 
-  buf_len = stun_agent_finish_message (agent, &response, NULL, 0);
-send_buf:
-  len = sendto (sock, buf, buf_len, 0,
-      (struct sockaddr *)&addr, addr_len);
-  return (len < buf_len) ? -1 : 0;
+  return stun_agent_finish_message (agent, &response, NULL, 0);
 }
 
+#if defined (HAVE_RECVMMSG) && defined (HAVE_SENDMMSG)
+/*
+ * Receives up to STUND_BATCH_SIZE datagrams with one system call, and
+ * sends all their responses back with as few as possible.
+ */
+static int worker_process (StundWorker *worker)
+{
+  struct mmsghdr in[STUND_BATCH_SIZE];
+  struct mmsghdr out[STUND_BATCH_SIZE];
+  struct iovec iov[STUND_BATCH_SIZE];
+  struct sockaddr_storage addr[STUND_BATCH_SIZE];
+  int n, i, n_out = 0, sent = 0;
+
+  memset (in, 0, sizeof (in));
+  for (i = 0; i < STUND_BATCH_SIZE; i++)
+  {
+    iov[i].iov_base = worker->bufs[i];
+    iov[i].iov_len = sizeof (worker->bufs[i]);
+    in[i].msg_hdr.msg_name = &addr[i];
+    in[i].msg_hdr.msg_namelen = sizeof (addr[i]);
+    in[i].msg_hdr.msg_iov = &iov[i];
+    in[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  n = recvmmsg (worker->sock, in, STUND_BATCH_SIZE, MSG_WAITFORONE, NULL);
+  if (n <= 0)
+    return -1;
+
+  g_atomic_int_add (&worker->requests, n);
 
-static int run (int family, int protocol, unsigned port)
+  for (i = 0; i < n; i++)
+  {
+    size_t len = dgram_process (&worker->oldagent, &worker->newagent,
+        worker->bufs[i], in[i].msg_len, sizeof (worker->bufs[i]),
+        (struct sockaddr *) &addr[i], in[i].msg_hdr.msg_namelen);
+
+    if (len == 0)
+      continue;
+
+    /* the receive header is reused, only the length changes */
+    iov[i].iov_len = len;
+    out[n_out] = in[i];
+    out[n_out].msg_len = 0;
+    n_out++;
+  }
+
+  while (sent < n_out)
+  {
+    int ret = sendmmsg (worker->sock, out + sent, n_out - sent, 0);
+
+    if (ret < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      /* drop the one that failed, keep going with the others */
+      ret = 1;
+    }
+    else
+    {
+      g_atomic_int_add (&worker->responses, ret);
+    }
+    sent += ret;
+  }
+
+  return 0;
+}
+#else
+static int worker_process (StundWorker *worker)
 {
-  StunAgent oldagent;
-  StunAgent newagent;
-  int sock = listen_socket (family, SOCK_DGRAM, protocol, port);
-  if (sock == -1)
+  struct sockaddr_storage addr;
+  socklen_t addr_len = sizeof (addr);
+  uint8_t *buf = worker->bufs[0];
+  size_t buf_len;
+  ssize_t len;
+
+  len = recvfrom (worker->sock, buf, sizeof (worker->bufs[0]), 0,
+      (struct sockaddr *)&addr, &addr_len);
+  if (len == -1)
     return -1;
 
-  stun_agent_init (&oldagent, known_attributes,
-      STUN_COMPATIBILITY_RFC3489, 0);
-  stun_agent_init (&newagent, known_attributes,
-      STUN_COMPATIBILITY_RFC5389, STUN_AGENT_USAGE_USE_FINGERPRINT);
+  g_atomic_int_inc (&worker->requests);
+
+  buf_len = dgram_process (&worker->oldagent, &worker->newagent, buf, len,
+      sizeof (worker->bufs[0]), (struct sockaddr *)&addr, addr_len);
+  if (buf_len == 0)
+    return 0;
+
+  len = sendto (worker->sock, buf, buf_len, 0,
+      (struct sockaddr *)&addr, addr_len);
+  if (len < (ssize_t) buf_len)
+    return -1;
+
+  g_atomic_int_inc (&worker->responses);
+  return 0;
+}
+#endif
+
+static gpointer worker_run (gpointer data)
+{
+  StundWorker *worker = data;
+
+  for (;;)
+    worker_process (worker);
+
+  return NULL;
+}
+
+
+static int run (int family, int protocol, unsigned port, unsigned n_threads,
+    int stats)
+{
+  StundWorker **workers = g_new0 (StundWorker *, n_threads);
+  unsigned i;
+
+  /* one socket per thread, the kernel spreads the clients over them */
+  for (i = 0; i < n_threads; i++)
+  {
+    StundWorker *worker = g_new0 (StundWorker, 1);
+
+    worker->sock = listen_socket (family, SOCK_DGRAM, protocol, port,
+        n_threads > 1);
+    if (worker->sock == -1)
+      return -1;
+
+    stun_agent_init (&worker->oldagent, known_attributes,
+        STUN_COMPATIBILITY_RFC3489, 0);
+    stun_agent_init (&worker->newagent, known_attributes,
+        STUN_COMPATIBILITY_RFC5389, STUN_AGENT_USAGE_USE_FINGERPRINT);
+    workers[i] = worker;
+  }
+
+  if (n_threads == 1 && !stats)
+    worker_run (workers[0]);
+
+  for (i = 0; i < n_threads; i++)
+    g_thread_unref (g_thread_new ("stund", worker_run, workers[i]));
 
   for (;;)
-    dgram_process (sock, &oldagent, &newagent);
+  {
+    unsigned requests = 0, responses = 0;
+
+    sleep (1);
+    if (!stats)
+      continue;
+
+    for (i = 0; i < n_threads; i++)
+    {
+      requests += g_atomic_int_and (&workers[i]->requests, 0);
+      responses += g_atomic_int_and (&workers[i]->responses, 0);
+    }
+    printf ("%u requests/s, %u responses/s\n", requests, responses);
+    fflush (stdout);
+  }
 }
 
 
@@ -266,10 +428,12 @@ int main (int argc, char *argv[])
 {
   int family = AF_INET;
   unsigned port = IPPORT_STUN;
+  unsigned n_threads = 1;
+  int stats = 0;
 
   for (;;)
   {
-    int c = getopt (argc, argv, "46");
+    int c = getopt (argc, argv, "46st:");
     if (c == EOF)
       break;
 
@@ -282,6 +446,31 @@ int main (int argc, char *argv[])
       case '6':
         family = AF_INET6;
         break;
+
+      case 's':
+        stats = 1;
+        break;
+
+      case 't':
+      {
+        char *end;
+        unsigned long n;
+
+        errno = 0;
+        n = strtoul (optarg, &end, 10);
+        if (optarg[0] < '0' || optarg[0] > '9' || *end != '\0' || errno ||
+            n < 1 || n > STUND_MAX_THREADS)
+        {
+          fprintf (stderr, "%s: invalid number of threads `%s' "
+              "(1 to %u)\n", argv[0], optarg, STUND_MAX_THREADS);
+          return 2;
+        }
+        n_threads = n;
+        break;
+      }
+
+      default:
+        return 2;
     }
   }
 
@@ -290,7 +479,8 @@ int main (int argc, char *argv[])
 
   signal (SIGINT, exit_handler);
   signal (SIGTERM, exit_handler);
-  return run (family, IPPROTO_UDP, port) ? EXIT_FAILURE : EXIT_SUCCESS;
+  return run (family, IPPROTO_UDP, port, n_threads, stats) ?
+      EXIT_FAILURE : EXIT_SUCCESS;
 }
 
 #else
@@ -39,7 +39,8 @@
 #ifndef NICE_STUN_STUND_H
 # define NICE_STUN_STUND_H 1
 
-int listen_socket (int fam, int type, int proto, unsigned port);
+int listen_socket (int fam, int type, int proto, unsigned port,
+    int reuse_port);
 ssize_t send_safe (int fd, const struct msghdr *msg);
 ssize_t recv_safe (int fd, struct msghdr *msg);
 
@@ -0,0 +1,872 @@
+/*
+ * This file is part of the Nice GLib ICE library.
+ *
+ * (C) 2008-2009 Collabora Ltd.
+ *  Contact: Youness Alaoui
+ * (C) 2007-2009 Nokia Corporation. All rights reserved.
+ *  Contact: Rémi Denis-Courmont
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Nice GLib ICE library.
+ *
+ * The Initial Developers of the Original Code are Collabora Ltd and Nokia
+ * Corporation. All Rights Reserved.
+ *
+ * Contributors:
+ *   Youness Alaoui, Collabora Ltd.
+ *   Rémi Denis-Courmont, Nokia
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+/*
+ * Load generator for STUN and TURN servers: keeps up to a window of
+ * requests in flight at a fixed rate and reports the throughput, the loss
+ * and the round-trip time percentiles every second.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#ifndef _WIN32
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stun/stunagent.h"
+#include "stun/usages/turn.h"
+#include "stunload.h"
+
+/* Log-linear histogram: 16 buckets per power of two, about 6% precision */
+#define STUNLOAD_HIST_SUB_BITS 4
+#define STUNLOAD_HIST_BUCKETS (64 << STUNLOAD_HIST_SUB_BITS)
+
+/* Most datagrams read from one socket per poll() */
+#define STUNLOAD_RECV_BURST 256
+
+/* TURN flows have a socket each: no more of them than there are channel
+   numbers, nor than file descriptors, keeping some for everything else */
+#define STUNLOAD_MAX_TURN_WINDOW 0x4000
+#define STUNLOAD_RESERVED_FDS 64
+
+/* Ends a list of flows */
+#define STUNLOAD_NO_FLOW ((unsigned) -1)
+
+typedef struct {
+  uint64_t buckets[STUNLOAD_HIST_BUCKETS];
+  uint64_t count;
+  uint64_t max;
+} StunLoadHistogram;
+
+typedef struct {
+  uint64_t sent;
+  uint64_t received;
+  uint64_t errors;
+  uint64_t lost;
+  StunLoadHistogram rtt;
+} StunLoadStats;
+
+/* An outstanding Binding request */
+typedef struct {
+  uint32_t seq;
+  bool pending;
+  int64_t sent_us;
+} StunLoadSlot;
+
+typedef enum {
+  STUNLOAD_FLOW_ALLOCATE,
+  STUNLOAD_FLOW_CHANNEL_BIND,
+  STUNLOAD_FLOW_REFRESH,
+  STUNLOAD_FLOW_DEALLOCATE,
+} StunLoadFlowState;
+
+/* A TURN allocation, with at most one request in flight */
+typedef struct {
+  StunAgent *agent;
+  StunLoadFlowState state;
+  bool pending;
+  bool challenged;                /* the last response was a 401 or 438 */
+  bool backoff;                   /* waiting a timeout after being rejected
+                                     twice in a row */
+  int64_t sent_us;
+  unsigned prev, next;            /* in StunLoad idle or waiting list */
+  StunTransactionId id;
+  uint16_t channel;
+  StunMessage resp;               /* last response with REALM and NONCE */
+  uint8_t resp_buf[STUN_MAX_MESSAGE_SIZE_IPV6];
+} StunLoadFlow;
+
+typedef struct {
+  unsigned head, tail;
+} StunLoadFlowList;
+
+typedef struct {
+  const StunLoadConfig *config;
+  const struct sockaddr *srv;
+  socklen_t srvlen;
+  StunAgent agent;
+  struct pollfd *fds;
+  unsigned n_fds;
+
+  /* Binding requests, found back from the sequence number in their ID */
+  StunLoadSlot *slots;
+  uint32_t next_seq;
+  uint32_t oldest_seq;
+
+  /* TURN flows, one per socket. Their agents keep the transactions, with
+   * the key to check the MESSAGE-INTEGRITY of the responses, each one for as
+   * many flows as it has saved IDs */
+  StunLoadFlow *flows;
+  StunAgent *flow_agents;
+  StunLoadFlowList idle;          /* ready to send, longest idle first */
+  StunLoadFlowList waiting;       /* pending or backing off, in the order
+                                     they will expire */
+
+  StunLoadStats total;
+  StunLoadStats interval;
+} StunLoad;
+
+
+static int64_t now_us (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static unsigned hist_bucket (uint64_t value)
+{
+  unsigned msb;
+
+  if (value < (1 << STUNLOAD_HIST_SUB_BITS))
+    return value;
+
+  msb = 63 - __builtin_clzll (value);
+  return ((msb - STUNLOAD_HIST_SUB_BITS + 1) << STUNLOAD_HIST_SUB_BITS) +
+      ((value >> (msb - STUNLOAD_HIST_SUB_BITS)) &
+          ((1 << STUNLOAD_HIST_SUB_BITS) - 1));
+}
+
+/* Lower bound of the values counted in @bucket */
+static uint64_t hist_value (unsigned bucket)
+{
+  unsigned exponent = bucket >> STUNLOAD_HIST_SUB_BITS;
+  uint64_t mantissa = bucket & ((1 << STUNLOAD_HIST_SUB_BITS) - 1);
+
+  if (exponent == 0)
+    return mantissa;
+
+  return (mantissa | (1 << STUNLOAD_HIST_SUB_BITS)) << (exponent - 1);
+}
+
+static void hist_add (StunLoadHistogram *hist, uint64_t value)
+{
+  hist->buckets[hist_bucket (value)]++;
+  hist->count++;
+  if (value > hist->max)
+    hist->max = value;
+}
+
+static uint64_t hist_percentile (const StunLoadHistogram *hist, double pct)
+{
+  uint64_t rank = (uint64_t) (hist->count * pct / 100.0);
+  uint64_t seen = 0;
+  unsigned i;
+
+  if (hist->count == 0)
+    return 0;
+
+  for (i = 0; i < STUNLOAD_HIST_BUCKETS; i++)
+  {
+    seen += hist->buckets[i];
+    if (seen > rank)
+      return hist_value (i);
+  }
+
+  return hist->max;
+}
+
+static void stats_add_response (StunLoad *load, int64_t rtt, bool error)
+{
+  load->total.received++;
+  load->interval.received++;
+  if (error)
+  {
+    load->total.errors++;
+    load->interval.errors++;
+  }
+  hist_add (&load->total.rtt, rtt);
+  hist_add (&load->interval.rtt, rtt);
+}
+
+static void stats_add_sent (StunLoad *load)
+{
+  load->total.sent++;
+  load->interval.sent++;
+}
+
+static void stats_add_lost (StunLoad *load)
+{
+  load->total.lost++;
+  load->interval.lost++;
+}
+
+static void stats_print (const char *prefix, const StunLoadStats *stats,
+    double seconds)
+{
+  const StunLoadHistogram *rtt = &stats->rtt;
+
+  printf ("%s%.0f sent/s, %.0f received/s, %llu errors, %llu lost (%.2f%%), "
+      "rtt ms p50 %.3f p90 %.3f p99 %.3f p99.9 %.3f max %.3f\n", prefix,
+      stats->sent / seconds, stats->received / seconds,
+      (unsigned long long) stats->errors, (unsigned long long) stats->lost,
+      stats->sent ? 100.0 * stats->lost / stats->sent : 0.0,
+      hist_percentile (rtt, 50) / 1000.0, hist_percentile (rtt, 90) / 1000.0,
+      hist_percentile (rtt, 99) / 1000.0, hist_percentile (rtt, 99.9) / 1000.0,
+      rtt->max / 1000.0);
+  fflush (stdout);
+}
+
+
+static int open_socket (const struct sockaddr *srv, socklen_t srvlen)
+{
+  int fd = socket (srv->sa_family, SOCK_DGRAM, IPPROTO_UDP);
+
+  if (fd == -1)
+  {
+    perror ("Error opening socket");
+    return -1;
+  }
+
+  if (connect (fd, srv, srvlen) ||
+      fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK))
+  {
+    perror ("Error connecting socket");
+    close (fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+static bool send_request (StunLoad *load, int fd, StunMessage *msg,
+    size_t len)
+{
+  if (len == 0)
+    return FALSE;
+
+  /* A port unreachable for an earlier request fails the send, count the
+   * request as sent and lost since nobody is listening anyway */
+  if (send (fd, msg->buffer, len, 0) != (ssize_t) len && errno != ECONNREFUSED)
+    return FALSE;
+
+  stats_add_sent (load);
+  return TRUE;
+}
+
+
+static bool binding_send (StunLoad *load, int64_t now)
+{
+  uint32_t seq = load->next_seq;
+  StunLoadSlot *slot = &load->slots[seq % load->config->window];
+  uint8_t buf[STUN_MAX_MESSAGE_SIZE_IPV4];
+  StunMessage msg;
+  StunTransactionId id;
+  size_t len;
+  int fd;
+
+  /* the window is full */
+  if (slot->pending)
+    return FALSE;
+
+  stun_agent_init_request (&load->agent, &msg, buf, sizeof (buf),
+      STUN_BINDING);
+  /* after the magic cookie and 4 random bytes */
+  memcpy (buf + STUN_MESSAGE_TRANS_ID_POS + 8, &seq, sizeof (seq));
+  len = stun_agent_finish_message (&load->agent, &msg, NULL, 0);
+
+  /* Responses are matched here, the agent would only hold 200 of them */
+  stun_message_id (&msg, id);
+  stun_agent_forget_transaction (&load->agent, id);
+
+  fd = load->fds[seq % load->n_fds].fd;
+  if (!send_request (load, fd, &msg, len))
+    return FALSE;
+
+  slot->seq = seq;
+  slot->pending = TRUE;
+  slot->sent_us = now;
+  load->next_seq++;
+  return TRUE;
+}
+
+static void binding_recv (StunLoad *load, unsigned idx, uint8_t *buf,
+    size_t len, int64_t now)
+{
+  StunMessage msg;
+  StunTransactionId id;
+  StunLoadSlot *slot;
+  StunClass klass;
+  uint32_t seq;
+
+  (void) idx;
+
+  if (stun_agent_validate (&load->agent, &msg, buf, len, NULL, NULL) !=
+      STUN_VALIDATION_SUCCESS)
+    return;
+
+  klass = stun_message_get_class (&msg);
+  if (klass != STUN_RESPONSE && klass != STUN_ERROR)
+    return;
+
+  stun_message_id (&msg, id);
+  memcpy (&seq, id + 8, sizeof (seq));
+  slot = &load->slots[seq % load->config->window];
+  if (!slot->pending || slot->seq != seq)
+    return;
+
+  slot->pending = FALSE;
+  stats_add_response (load, now - slot->sent_us, klass == STUN_ERROR);
+}
+
+/* Counts the requests that timed out, oldest first */
+static void binding_expire (StunLoad *load, int64_t now)
+{
+  int64_t timeout = (int64_t) load->config->timeout * 1000;
+
+  while (load->oldest_seq != load->next_seq)
+  {
+    StunLoadSlot *slot =
+        &load->slots[load->oldest_seq % load->config->window];
+
+    if (slot->pending && slot->seq == load->oldest_seq)
+    {
+      if (now - slot->sent_us < timeout)
+        break;
+      slot->pending = FALSE;
+      stats_add_lost (load);
+    }
+    load->oldest_seq++;
+  }
+}
+
+/* When binding_expire() will next free a slot, -1 if none is pending */
+static int64_t binding_next_expiry (StunLoad *load)
+{
+  StunLoadSlot *slot;
+
+  if (load->oldest_seq == load->next_seq)
+    return -1;
+
+  /* binding_expire() stopped at the oldest pending request */
+  slot = &load->slots[load->oldest_seq % load->config->window];
+  return slot->sent_us + (int64_t) load->config->timeout * 1000;
+}
+
+
+static void flow_list_append (StunLoad *load, StunLoadFlowList *list,
+    unsigned idx)
+{
+  StunLoadFlow *flow = &load->flows[idx];
+
+  flow->prev = list->tail;
+  flow->next = STUNLOAD_NO_FLOW;
+  if (list->tail == STUNLOAD_NO_FLOW)
+    list->head = idx;
+  else
+    load->flows[list->tail].next = idx;
+  list->tail = idx;
+}
+
+static void flow_list_remove (StunLoad *load, StunLoadFlowList *list,
+    unsigned idx)
+{
+  StunLoadFlow *flow = &load->flows[idx];
+
+  if (flow->prev == STUNLOAD_NO_FLOW)
+    list->head = flow->next;
+  else
+    load->flows[flow->prev].next = flow->next;
+  if (flow->next == STUNLOAD_NO_FLOW)
+    list->tail = flow->prev;
+  else
+    load->flows[flow->next].prev = flow->prev;
+}
+
+static size_t flow_build (StunLoad *load, StunLoadFlow *flow, uint8_t *buf,
+    size_t buf_len, StunMessage *msg)
+{
+  const StunLoadConfig *config = load->config;
+  uint8_t *username = (uint8_t *) config->username;
+  uint8_t *password = (uint8_t *) config->password;
+  size_t username_len = username ? strlen (config->username) : 0;
+  size_t password_len = password ? strlen (config->password) : 0;
+  StunMessage *resp = flow->resp.buffer ? &flow->resp : NULL;
+
+  switch (flow->state)
+  {
+    case STUNLOAD_FLOW_ALLOCATE:
+      return stun_usage_turn_create (flow->agent, msg, buf, buf_len, resp,
+          STUN_USAGE_TURN_REQUEST_PORT_NORMAL, -1, -1,
+          username, username_len, password, password_len,
+          STUN_USAGE_TURN_COMPATIBILITY_RFC5766);
+
+    case STUNLOAD_FLOW_CHANNEL_BIND:
+    {
+      struct sockaddr_storage peer;
+      uint8_t *attr;
+      uint16_t attr_len;
+
+      /* any peer will do, the server doesn't send anything to it */
+      memcpy (&peer, load->srv, load->srvlen);
+
+      stun_agent_init_request (flow->agent, msg, buf, buf_len,
+          STUN_CHANNELBIND);
+      if (stun_message_append32 (msg, STUN_ATTRIBUTE_CHANNEL_NUMBER,
+              (uint32_t) flow->channel << 16) != STUN_MESSAGE_RETURN_SUCCESS ||
+          stun_message_append_xor_addr (msg, STUN_ATTRIBUTE_XOR_PEER_ADDRESS,
+              (struct sockaddr *) &peer, load->srvlen) !=
+          STUN_MESSAGE_RETURN_SUCCESS)
+        return 0;
+      if (username && stun_message_append_bytes (msg,
+              STUN_ATTRIBUTE_USERNAME, username, username_len) !=
+          STUN_MESSAGE_RETURN_SUCCESS)
+        return 0;
+      if (resp)
+      {
+        attr = (uint8_t *) stun_message_find (resp, STUN_ATTRIBUTE_REALM,
+            &attr_len);
+        if (attr && stun_message_append_bytes (msg, STUN_ATTRIBUTE_REALM,
+                attr, attr_len) != STUN_MESSAGE_RETURN_SUCCESS)
+          return 0;
+        attr = (uint8_t *) stun_message_find (resp, STUN_ATTRIBUTE_NONCE,
+            &attr_len);
+        if (attr && stun_message_append_bytes (msg, STUN_ATTRIBUTE_NONCE,
+                attr, attr_len) != STUN_MESSAGE_RETURN_SUCCESS)
+          return 0;
+      }
+      return stun_agent_finish_message (flow->agent, msg, password,
+          password_len);
+    }
+
+    case STUNLOAD_FLOW_REFRESH:
+    case STUNLOAD_FLOW_DEALLOCATE:
+      return stun_usage_turn_create_refresh (flow->agent, msg, buf, buf_len,
+          resp, flow->state == STUNLOAD_FLOW_REFRESH ? 600 : 0,
+          username, username_len, password, password_len,
+          STUN_USAGE_TURN_COMPATIBILITY_RFC5766);
+  }
+
+  return 0;
+}
+
+static bool flow_send (StunLoad *load, int64_t now)
+{
+  unsigned idx = load->idle.head;
+  StunLoadFlow *flow;
+  uint8_t buf[STUN_MAX_MESSAGE_SIZE_IPV6];
+  StunMessage msg;
+  size_t len;
+
+  /* all the flows are waiting for a response */
+  if (idx == STUNLOAD_NO_FLOW)
+    return FALSE;
+
+  flow = &load->flows[idx];
+  len = flow_build (load, flow, buf, sizeof (buf), &msg);
+  if (len > 0)
+    stun_message_id (&msg, flow->id);
+  if (!send_request (load, load->fds[idx].fd, &msg, len))
+  {
+    if (len > 0)
+      stun_agent_forget_transaction (flow->agent, flow->id);
+    return FALSE;
+  }
+
+  flow->pending = TRUE;
+  flow->sent_us = now;
+  flow_list_remove (load, &load->idle, idx);
+  flow_list_append (load, &load->waiting, idx);
+  return TRUE;
+}
+
+static void flow_recv (StunLoad *load, unsigned idx, uint8_t *buf,
+    size_t len, int64_t now)
+{
+  StunLoadFlow *flow = &load->flows[idx];
+  StunMessage msg;
+  StunTransactionId id;
+  StunClass klass;
+  int code = -1;
+
+  if (stun_agent_validate (flow->agent, &msg, buf, len, NULL, NULL) !=
+      STUN_VALIDATION_SUCCESS)
+    return;
+
+  klass = stun_message_get_class (&msg);
+  stun_message_id (&msg, id);
+  if ((klass != STUN_RESPONSE && klass != STUN_ERROR) || !flow->pending ||
+      memcmp (id, flow->id, sizeof (id)) != 0)
+    return;
+
+  stun_agent_forget_transaction (flow->agent, id);
+  flow->pending = FALSE;
+  flow_list_remove (load, &load->waiting, idx);
+  if (klass == STUN_ERROR)
+    stun_message_find_error (&msg, &code);
+
+  /* The challenge of the long-term credentials isn't an error, unless the
+   * request answering the previous one is challenged again: the credentials
+   * are wrong, retrying straight away would only hammer the server */
+  if (code == 401 || code == 438)
+  {
+    if (flow->challenged)
+    {
+      stats_add_response (load, now - flow->sent_us, TRUE);
+      flow->challenged = FALSE;
+      flow->resp.buffer = NULL;
+      flow->backoff = TRUE;
+      flow->sent_us = now;
+      flow_list_append (load, &load->waiting, idx);
+      return;
+    }
+
+    stats_add_response (load, now - flow->sent_us, FALSE);
+    flow->challenged = TRUE;
+    flow_list_append (load, &load->idle, idx);
+
+    /* retry the same request with the new REALM and NONCE */
+    if (len <= sizeof (flow->resp_buf))
+    {
+      memcpy (flow->resp_buf, buf, len);
+      flow->resp = msg;
+      flow->resp.buffer = flow->resp_buf;
+      flow->resp.buffer_len = sizeof (flow->resp_buf);
+    }
+    return;
+  }
+
+  stats_add_response (load, now - flow->sent_us, klass == STUN_ERROR);
+  flow->challenged = FALSE;
+  flow_list_append (load, &load->idle, idx);
+
+  switch (flow->state)
+  {
+    case STUNLOAD_FLOW_ALLOCATE:
+      /* 437: left over from a previous run, get rid of it first */
+      if (klass == STUN_RESPONSE)
+        flow->state = STUNLOAD_FLOW_CHANNEL_BIND;
+      else if (code == 437)
+        flow->state = STUNLOAD_FLOW_DEALLOCATE;
+      break;
+
+    case STUNLOAD_FLOW_CHANNEL_BIND:
+      flow->state = klass == STUN_RESPONSE ?
+          STUNLOAD_FLOW_REFRESH : STUNLOAD_FLOW_DEALLOCATE;
+      break;
+
+    case STUNLOAD_FLOW_REFRESH:
+      flow->state = STUNLOAD_FLOW_DEALLOCATE;
+      break;
+
+    case STUNLOAD_FLOW_DEALLOCATE:
+      flow->state = STUNLOAD_FLOW_ALLOCATE;
+      break;
+  }
+}
+
+/* Counts the flows whose request timed out, they send it again. The
+ * waiting list is in send order, so they are all at its head. */
+static void flow_expire (StunLoad *load, int64_t now)
+{
+  int64_t timeout = (int64_t) load->config->timeout * 1000;
+
+  while (load->waiting.head != STUNLOAD_NO_FLOW)
+  {
+    unsigned idx = load->waiting.head;
+    StunLoadFlow *flow = &load->flows[idx];
+
+    if (now - flow->sent_us < timeout)
+      break;
+
+    if (flow->pending)
+    {
+      stun_agent_forget_transaction (flow->agent, flow->id);
+      flow->pending = FALSE;
+      flow->challenged = FALSE;
+      stats_add_lost (load);
+    }
+    flow->backoff = FALSE;
+    flow_list_remove (load, &load->waiting, idx);
+    flow_list_append (load, &load->idle, idx);
+  }
+}
+
+/* When flow_expire() will next free a flow, -1 if none is waiting */
+static int64_t flow_next_expiry (StunLoad *load)
+{
+  if (load->waiting.head == STUNLOAD_NO_FLOW)
+    return -1;
+
+  return load->flows[load->waiting.head].sent_us +
+      (int64_t) load->config->timeout * 1000;
+}
+
+unsigned stunload_max_turn_window (void)
+{
+  struct rlimit rl;
+  rlim_t max = STUNLOAD_MAX_TURN_WINDOW;
+
+  if (getrlimit (RLIMIT_NOFILE, &rl) == 0 && rl.rlim_max != RLIM_INFINITY)
+  {
+    if (rl.rlim_max <= STUNLOAD_RESERVED_FDS)
+      return 1;
+    if (rl.rlim_max - STUNLOAD_RESERVED_FDS < max)
+      max = rl.rlim_max - STUNLOAD_RESERVED_FDS;
+  }
+
+  return max;
+}
+
+/* Raises the soft limit on file descriptors so that @n_fds sockets fit */
+static void raise_fd_limit (unsigned n_fds)
+{
+  struct rlimit rl;
+  rlim_t needed = (rlim_t) n_fds + STUNLOAD_RESERVED_FDS;
+
+  if (getrlimit (RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY &&
+      rl.rlim_cur < needed)
+  {
+    rl.rlim_cur = rl.rlim_max == RLIM_INFINITY || needed < rl.rlim_max ?
+        needed : rl.rlim_max;
+    setrlimit (RLIMIT_NOFILE, &rl);
+  }
+}
+
+static int load_init (StunLoad *load, const struct sockaddr *srv,
+    socklen_t srvlen, const StunLoadConfig *config)
+{
+  unsigned i;
+
+  memset (load, 0, sizeof (*load));
+  load->config = config;
+  load->srv = srv;
+  load->srvlen = srvlen;
+
+  if (config->turn)
+  {
+    unsigned n_agents = (config->window + STUN_AGENT_MAX_SAVED_IDS - 1) /
+        STUN_AGENT_MAX_SAVED_IDS;
+
+    if (config->window > stunload_max_turn_window ())
+      return -1;
+    raise_fd_limit (config->window);
+
+    load->n_fds = config->window;
+    load->flows = calloc (config->window, sizeof (StunLoadFlow));
+    load->flow_agents = calloc (n_agents, sizeof (StunAgent));
+    if (load->flows == NULL || load->flow_agents == NULL)
+      return -1;
+    for (i = 0; i < n_agents; i++)
+      stun_agent_init (&load->flow_agents[i], STUN_ALL_KNOWN_ATTRIBUTES,
+          STUN_COMPATIBILITY_RFC5389, config->username ?
+          STUN_AGENT_USAGE_LONG_TERM_CREDENTIALS : 0);
+    load->idle.head = load->idle.tail = STUNLOAD_NO_FLOW;
+    load->waiting.head = load->waiting.tail = STUNLOAD_NO_FLOW;
+    for (i = 0; i < config->window; i++)
+    {
+      load->flows[i].agent = &load->flow_agents[i / STUN_AGENT_MAX_SAVED_IDS];
+      load->flows[i].channel = 0x4000 + i;
+      flow_list_append (load, &load->idle, i);
+    }
+  }
+  else
+  {
+    stun_agent_init (&load->agent, STUN_ALL_KNOWN_ATTRIBUTES,
+        STUN_COMPATIBILITY_RFC5389,
+        STUN_AGENT_USAGE_IGNORE_RESPONSE_TRANSID |
+        STUN_AGENT_USAGE_USE_FINGERPRINT);
+    load->n_fds = config->sockets;
+    load->slots = calloc (config->window, sizeof (StunLoadSlot));
+    if (load->slots == NULL)
+      return -1;
+  }
+
+  load->fds = calloc (load->n_fds, sizeof (struct pollfd));
+  if (load->fds == NULL)
+    return -1;
+
+  for (i = 0; i < load->n_fds; i++)
+  {
+    load->fds[i].fd = open_socket (srv, srvlen);
+    load->fds[i].events = POLLIN;
+    if (load->fds[i].fd == -1)
+      return -1;
+  }
+
+  return 0;
+}
+
+static void load_clear (StunLoad *load)
+{
+  unsigned i;
+
+  for (i = 0; load->fds && i < load->n_fds; i++)
+    if (load->fds[i].fd > 0)
+      close (load->fds[i].fd);
+
+  free (load->fds);
+  free (load->slots);
+  free (load->flows);
+  free (load->flow_agents);
+}
+
+int stunload_run (const struct sockaddr *srv, socklen_t srvlen,
+    const StunLoadConfig *config)
+{
+  StunLoad *load = malloc (sizeof (StunLoad));
+  int64_t start, end, next_send, next_report, interval_start;
+  double send_interval;
+  uint64_t n_scheduled = 0;
+  uint8_t buf[STUN_MAX_MESSAGE_SIZE_IPV6];
+
+  if (load == NULL || config->rate == 0 || config->window == 0 ||
+      config->sockets == 0)
+  {
+    free (load);
+    return -1;
+  }
+
+  if (load_init (load, srv, srvlen, config))
+  {
+    load_clear (load);
+    free (load);
+    return -1;
+  }
+
+  send_interval = 1000000.0 / config->rate;
+  start = now_us ();
+  end = start + (int64_t) config->duration * 1000000;
+  next_send = start;
+  next_report = interval_start = start;
+
+  for (;;)
+  {
+    int64_t now = now_us ();
+    int64_t wake;
+    unsigned i;
+
+    if (config->turn)
+      flow_expire (load, now);
+    else
+      binding_expire (load, now);
+
+    if (now >= next_report)
+    {
+      if (now > start)
+        stats_print ("", &load->interval, (now - interval_start) / 1e6);
+      memset (&load->interval, 0, sizeof (load->interval));
+      interval_start = now;
+      next_report += 1000000;
+    }
+
+    if (now >= end)
+      break;
+
+    /* Don't try to catch up on more than 100 ms when the window was full */
+    if (next_send < now - 100000)
+    {
+      n_scheduled = (uint64_t) ((now - 100000 - start) / send_interval);
+      next_send = start + (int64_t) (n_scheduled * send_interval);
+    }
+
+    while (next_send <= now)
+    {
+      if (!(config->turn ? flow_send (load, now) : binding_send (load, now)))
+        break;
+      n_scheduled++;
+      next_send = start + (int64_t) (n_scheduled * send_interval);
+    }
+
+    wake = next_send < next_report ? next_send : next_report;
+    if (next_send <= now)
+    {
+      /* Blocked on the window: a response or an expiry frees it, spinning
+       * until then would only eat the CPU the load is measured with. When
+       * nothing is in flight the socket refused the request, retry soon. */
+      int64_t expiry = config->turn ?
+          flow_next_expiry (load) : binding_next_expiry (load);
+
+      if (expiry < 0)
+        expiry = now + 1000;
+      wake = expiry < next_report ? expiry : next_report;
+    }
+    if (poll (load->fds, load->n_fds,
+            wake > now ? (int) ((wake - now + 999) / 1000) : 0) < 0 &&
+        errno != EINTR)
+    {
+      perror ("Error polling sockets");
+      break;
+    }
+
+    now = now_us ();
+    for (i = 0; i < load->n_fds; i++)
+    {
+      unsigned burst;
+
+      if (!(load->fds[i].revents & POLLIN))
+        continue;
+
+      for (burst = 0; burst < STUNLOAD_RECV_BURST; burst++)
+      {
+        ssize_t len = recv (load->fds[i].fd, buf, sizeof (buf), 0);
+
+        if (len <= 0)
+          break;
+
+        if (config->turn)
+          flow_recv (load, i, buf, len, now);
+        else
+          binding_recv (load, i, buf, len, now);
+      }
+    }
+  }
+
+  stats_print ("total: ", &load->total, (now_us () - start) / 1e6);
+
+  load_clear (load);
+  free (load);
+  return 0;
+}
+
+#endif
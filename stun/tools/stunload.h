@@ -0,0 +1,63 @@
+/*
+ * This file is part of the Nice GLib ICE library.
+ *
+ * (C) 2008-2009 Collabora Ltd.
+ *  Contact: Youness Alaoui
+ * (C) 2007-2009 Nokia Corporation. All rights reserved.
+ *  Contact: Rémi Denis-Courmont
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Nice GLib ICE library.
+ *
+ * The Initial Developers of the Original Code are Collabora Ltd and Nokia
+ * Corporation. All Rights Reserved.
+ *
+ * Contributors:
+ *   Youness Alaoui, Collabora Ltd.
+ *   Rémi Denis-Courmont, Nokia
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+#ifndef NICE_STUN_STUNLOAD_H
+# define NICE_STUN_STUNLOAD_H 1
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdbool.h>
+
+typedef struct {
+  unsigned rate;          /* requests per second */
+  unsigned window;        /* outstanding requests, or TURN allocations */
+  unsigned sockets;       /* client sockets for Binding requests */
+  unsigned duration;      /* seconds */
+  unsigned timeout;       /* milliseconds before a request counts as lost */
+  bool turn;              /* run Allocate/ChannelBind/Refresh flows */
+  const char *username;
+  const char *password;
+} StunLoadConfig;
+
+/* Largest window allowed with turn, each TURN flow needs a socket */
+unsigned stunload_max_turn_window (void);
+
+int stunload_run (const struct sockaddr *srv, socklen_t srvlen,
+    const StunLoadConfig *config);
+
+#endif
@@ -54,23 +54,24 @@
 
 
 #include "stunagent.h"
+#include "stunhmac.h"
 
 /** ICE connectivity checks **/
 #include "ice.h"
 
 
-size_t
-stun_usage_ice_conncheck_create (StunAgent *agent, StunMessage *msg,
+static bool
+priv_conncheck_build (StunAgent *agent, StunMessage *msg,
     uint8_t *buffer, size_t buffer_len,
     const uint8_t *username, const size_t username_len,
-    const uint8_t *password, const size_t password_len,
     bool cand_use, bool controlling, uint32_t priority,
     uint64_t tie, const char *candidate_identifier,
     StunUsageIceCompatibility compatibility)
 {
   StunMessageReturn val;
 
-  stun_agent_init_request (agent, msg, buffer, buffer_len, STUN_BINDING);
+  if (!stun_agent_init_request (agent, msg, buffer, buffer_len, STUN_BINDING))
+    return FALSE;
 
   if (compatibility == STUN_USAGE_ICE_COMPATIBILITY_RFC5245 ||
       compatibility == STUN_USAGE_ICE_COMPATIBILITY_WLM2009) {
@@ -78,26 +79,26 @@ stun_usage_ice_conncheck_create (StunAgent *agent, StunMessage *msg,
     {
       val = stun_message_append_flag (msg, STUN_ATTRIBUTE_USE_CANDIDATE);
       if (val != STUN_MESSAGE_RETURN_SUCCESS)
-        return 0;
+        return FALSE;
     }
 
     val = stun_message_append32 (msg, STUN_ATTRIBUTE_PRIORITY, priority);
     if (val != STUN_MESSAGE_RETURN_SUCCESS)
-      return 0;
+      return FALSE;
 
     if (controlling)
       val = stun_message_append64 (msg, STUN_ATTRIBUTE_ICE_CONTROLLING, tie);
     else
       val = stun_message_append64 (msg, STUN_ATTRIBUTE_ICE_CONTROLLED, tie);
     if (val != STUN_MESSAGE_RETURN_SUCCESS)
-      return 0;
+      return FALSE;
   }
 
   if (username && username_len > 0) {
     val = stun_message_append_bytes (msg, STUN_ATTRIBUTE_USERNAME,
         username, username_len);
     if (val != STUN_MESSAGE_RETURN_SUCCESS)
-      return 0;
+      return FALSE;
   }
 
   if (compatibility == STUN_USAGE_ICE_COMPATIBILITY_WLM2009) {
@@ -121,7 +122,7 @@ stun_usage_ice_conncheck_create (StunAgent *agent, StunMessage *msg,
     free(buf);
 
     if (val != STUN_MESSAGE_RETURN_SUCCESS)
-		return 0;
+		return FALSE;
 
   }
 
@@ -129,11 +130,167 @@ stun_usage_ice_conncheck_create (StunAgent *agent, StunMessage *msg,
     val = stun_message_append32 (msg, STUN_ATTRIBUTE_IMPLEMENTATION_VERSION, 2);
 
     if (val != STUN_MESSAGE_RETURN_SUCCESS)
-      return 0;
+      return FALSE;
   }
 
+  return TRUE;
+}
+
+
+size_t
+stun_usage_ice_conncheck_create (StunAgent *agent, StunMessage *msg,
+    uint8_t *buffer, size_t buffer_len,
+    const uint8_t *username, const size_t username_len,
+    const uint8_t *password, const size_t password_len,
+    bool cand_use, bool controlling, uint32_t priority,
+    uint64_t tie, const char *candidate_identifier,
+    StunUsageIceCompatibility compatibility)
+{
+  if (!priv_conncheck_build (agent, msg, buffer, buffer_len,
+          username, username_len, cand_use, controlling, priority, tie,
+          candidate_identifier, compatibility))
+    return 0;
+
   return stun_agent_finish_message (agent, msg, password, password_len);
+}
+
+
+static size_t
+priv_template_attribute (StunMessage *msg, StunAttribute type, size_t *len)
+{
+  uint16_t alen;
+  const uint8_t *ptr = stun_message_find (msg, type, &alen);
+
+  if (ptr == NULL) {
+    *len = 0;
+    return 0;
+  }
+  *len = alen;
+  return ptr - msg->buffer;
+}
+
+static bool
+priv_template_matches (const StunUsageIceConncheckTemplate *tmpl,
+    StunAgent *agent, const uint8_t *buffer,
+    const uint8_t *username, const size_t username_len,
+    bool cand_use, bool controlling, uint32_t priority,
+    uint64_t tie, const char *candidate_identifier,
+    StunUsageIceCompatibility compatibility)
+{
+  bool has_software;
+
+  if (tmpl->length == 0 ||
+      tmpl->agent != agent ||
+      tmpl->agent_compatibility != agent->compatibility ||
+      tmpl->agent_usage_flags != agent->usage_flags ||
+      tmpl->compatibility != compatibility)
+    return FALSE;
+
+  if (compatibility == STUN_USAGE_ICE_COMPATIBILITY_RFC5245 ||
+      compatibility == STUN_USAGE_ICE_COMPATIBILITY_WLM2009) {
+    if (tmpl->cand_use != cand_use || tmpl->controlling != controlling ||
+        tmpl->priority != priority || tmpl->tie != tie)
+      return FALSE;
+  }
+
+  if (username == NULL || username_len == 0) {
+    if (tmpl->username_pos != 0)
+      return FALSE;
+  } else if (tmpl->username_pos == 0 || tmpl->username_len != username_len ||
+      memcmp (buffer + tmpl->username_pos, username, username_len)) {
+    return FALSE;
+  }
+
+  /* same condition as in stun_agent_init_request() */
+  has_software = (agent->compatibility == STUN_COMPATIBILITY_RFC5389 ||
+          agent->compatibility == STUN_COMPATIBILITY_WLM2009) &&
+      (agent->software_attribute != NULL ||
+          agent->usage_flags & STUN_AGENT_USAGE_ADD_SOFTWARE);
+  if (has_software != (tmpl->software_pos != 0))
+    return FALSE;
+  if (has_software) {
+    /* stun_message_append_software() may have truncated it, in which case
+     * the request is just built again */
+    const char *software = agent->software_attribute;
+
+    if (software == NULL)
+      software = PACKAGE_STRING;
+    if (strncmp (software, (const char *) buffer + tmpl->software_pos,
+            tmpl->software_len) || software[tmpl->software_len] != '\0')
+      return FALSE;
+  }
+
+  if (compatibility == STUN_USAGE_ICE_COMPATIBILITY_WLM2009) {
+    size_t identifier_len = strlen (candidate_identifier);
+
+    /* zero padded to a multiple of 4 */
+    if (tmpl->identifier_len != ((identifier_len + 3) & ~(size_t) 3) ||
+        memcmp (buffer + tmpl->identifier_pos, candidate_identifier,
+            identifier_len))
+      return FALSE;
+  }
 
+  return TRUE;
+}
+
+size_t
+stun_usage_ice_conncheck_create_from_template (StunAgent *agent,
+    StunMessage *msg, uint8_t *buffer, size_t buffer_len,
+    StunUsageIceConncheckTemplate *tmpl,
+    const uint8_t *username, const size_t username_len,
+    const uint8_t *password, const size_t password_len,
+    bool cand_use, bool controlling, uint32_t priority,
+    uint64_t tie, const char *candidate_identifier,
+    StunUsageIceCompatibility compatibility)
+{
+  return stun_usage_ice_conncheck_create_from_template_with_key (agent, msg,
+      buffer, buffer_len, tmpl, username, username_len, password,
+      password_len, cand_use, controlling, priority, tie,
+      candidate_identifier, compatibility, NULL);
+}
+
+size_t
+stun_usage_ice_conncheck_create_from_template_with_key (StunAgent *agent,
+    StunMessage *msg, uint8_t *buffer, size_t buffer_len,
+    StunUsageIceConncheckTemplate *tmpl,
+    const uint8_t *username, const size_t username_len,
+    const uint8_t *password, const size_t password_len,
+    bool cand_use, bool controlling, uint32_t priority,
+    uint64_t tie, const char *candidate_identifier,
+    StunUsageIceCompatibility compatibility, const StunHmacKey *hkey)
+{
+  if (priv_template_matches (tmpl, agent, buffer, username, username_len,
+          cand_use, controlling, priority, tie, candidate_identifier,
+          compatibility) &&
+      stun_agent_reuse_request (agent, msg, buffer, buffer_len,
+          tmpl->length))
+    return stun_agent_finish_message_with_key (agent, msg, password,
+        password_len, hkey);
+
+  tmpl->length = 0;
+  if (!priv_conncheck_build (agent, msg, buffer, buffer_len,
+          username, username_len, cand_use, controlling, priority, tie,
+          candidate_identifier, compatibility))
+    return 0;
+
+  tmpl->agent = agent;
+  tmpl->username_pos = priv_template_attribute (msg, STUN_ATTRIBUTE_USERNAME,
+      &tmpl->username_len);
+  tmpl->software_pos = priv_template_attribute (msg, STUN_ATTRIBUTE_SOFTWARE,
+      &tmpl->software_len);
+  tmpl->identifier_pos = priv_template_attribute (msg,
+      STUN_ATTRIBUTE_CANDIDATE_IDENTIFIER, &tmpl->identifier_len);
+  tmpl->tie = tie;
+  tmpl->priority = priority;
+  tmpl->cand_use = cand_use;
+  tmpl->controlling = controlling;
+  tmpl->compatibility = compatibility;
+  tmpl->agent_compatibility = agent->compatibility;
+  tmpl->agent_usage_flags = agent->usage_flags;
+  tmpl->length = stun_message_length (msg);
+
+  return stun_agent_finish_message_with_key (agent, msg, password,
+      password_len, hkey);
 }
 
 
@@ -205,7 +362,7 @@ StunUsageIceReturn stun_usage_ice_conncheck_process (StunMessage *msg,
 static int
 stun_bind_error (StunAgent *agent, StunMessage *msg,
     uint8_t *buf, size_t *plen, const StunMessage *req,
-    StunError code)
+    StunError code, const StunHmacKey *hkey)
 {
   size_t len = *plen;
   int val;
@@ -217,7 +374,7 @@ stun_bind_error (StunAgent *agent, StunMessage *msg,
   if (!val)
     return val;
 
-  len = stun_agent_finish_message (agent, msg, NULL, 0);
+  len = stun_agent_finish_message_with_key (agent, msg, NULL, 0, hkey);
   if (len == 0)
     return 0;
 
@@ -233,6 +390,18 @@ stun_usage_ice_conncheck_create_reply (StunAgent *agent, StunMessage *req,
     const struct sockaddr *src, socklen_t srclen,
     bool *control, uint64_t tie,
     StunUsageIceCompatibility compatibility)
+{
+  return stun_usage_ice_conncheck_create_reply_with_key (agent, req, NULL,
+      msg, buf, plen, src, srclen, control, tie, compatibility, NULL);
+}
+
+StunUsageIceReturn
+stun_usage_ice_conncheck_create_reply_with_key (StunAgent *agent,
+    StunMessage *req, const StunMessageIndex *index,
+    StunMessage *msg, uint8_t *buf, size_t *plen,
+    const struct sockaddr *src, socklen_t srclen,
+    bool *control, uint64_t tie,
+    StunUsageIceCompatibility compatibility, const StunHmacKey *hkey)
 {
   const char *username = NULL;
   uint16_t username_len;
@@ -243,7 +412,7 @@ stun_usage_ice_conncheck_create_reply (StunAgent *agent, StunMessage *req,
 
 
 #define err( code ) \
-  stun_bind_error (agent, msg, buf, &len, req, code); \
+  stun_bind_error (agent, msg, buf, &len, req, code, hkey); \
   *plen = len
 
   *plen = 0;
@@ -266,7 +435,8 @@ stun_usage_ice_conncheck_create_reply (StunAgent *agent, StunMessage *req,
 
   /* Role conflict handling */
   assert (control != NULL);
-  if (stun_message_find64 (req, *control ? STUN_ATTRIBUTE_ICE_CONTROLLING
+  if (stun_message_find64_indexed (req, index,
+          *control ? STUN_ATTRIBUTE_ICE_CONTROLLING
           : STUN_ATTRIBUTE_ICE_CONTROLLED, &q) == STUN_MESSAGE_RETURN_SUCCESS)
   {
     stun_debug ("STUN Role Conflict detected:\n");
@@ -315,7 +485,7 @@ stun_usage_ice_conncheck_create_reply (StunAgent *agent, StunMessage *req,
     goto failure;
   }
 
-  username = (const char *)stun_message_find (req,
+  username = (const char *)stun_message_find_indexed (req, index,
       STUN_ATTRIBUTE_USERNAME, &username_len);
   if (username) {
     val = stun_message_append_bytes (msg, STUN_ATTRIBUTE_USERNAME,
@@ -337,7 +507,7 @@ stun_usage_ice_conncheck_create_reply (StunAgent *agent, StunMessage *req,
   }
 
   /* the stun agent will automatically use the password of the request */
-  len = stun_agent_finish_message (agent, msg, NULL, 0);
+  len = stun_agent_finish_message_with_key (agent, msg, NULL, 0, hkey);
   if (len == 0)
     goto failure;
 
@@ -364,11 +534,18 @@ failure:
 
 
 uint32_t stun_usage_ice_conncheck_priority (const StunMessage *msg)
+{
+  return stun_usage_ice_conncheck_priority_indexed (msg, NULL);
+}
+
+
+uint32_t stun_usage_ice_conncheck_priority_indexed (const StunMessage *msg,
+    const StunMessageIndex *index)
 {
   uint32_t value;
 
-  if (stun_message_find32 (msg, STUN_ATTRIBUTE_PRIORITY, &value)
-      != STUN_MESSAGE_RETURN_SUCCESS)
+  if (stun_message_find32_indexed (msg, index, STUN_ATTRIBUTE_PRIORITY,
+          &value) != STUN_MESSAGE_RETURN_SUCCESS)
     return 0;
   return value;
 }
@@ -376,7 +553,14 @@ uint32_t stun_usage_ice_conncheck_priority (const StunMessage *msg)
 
 bool stun_usage_ice_conncheck_use_candidate (const StunMessage *msg)
 {
-  return (stun_message_find_flag (msg,
+  return stun_usage_ice_conncheck_use_candidate_indexed (msg, NULL);
+}
+
+
+bool stun_usage_ice_conncheck_use_candidate_indexed (const StunMessage *msg,
+    const StunMessageIndex *index)
+{
+  return (stun_message_find_flag_indexed (msg, index,
           STUN_ATTRIBUTE_USE_CANDIDATE) == STUN_MESSAGE_RETURN_SUCCESS);
 }
 
@@ -155,6 +155,87 @@ stun_usage_ice_conncheck_create (StunAgent *agent, StunMessage *msg,
     StunUsageIceCompatibility compatibility);
 
 
+/**
+ * StunUsageIceConncheckTemplate:
+ * @agent: The #StunAgent the request was built with
+ * @length: The length of the request before MESSAGE-INTEGRITY and
+ * FINGERPRINT were added, 0 if there is none
+ * @username_pos: The position of the USERNAME value in the buffer, 0 if absent
+ * @username_len: The length of the USERNAME value
+ * @software_pos: The position of the SOFTWARE value in the buffer, 0 if absent
+ * @software_len: The length of the SOFTWARE value
+ * @identifier_pos: The position of the CANDIDATE-IDENTIFIER value in the
+ * buffer, 0 if absent
+ * @identifier_len: The length of the CANDIDATE-IDENTIFIER value
+ * @tie: The tie-breaker in the request
+ * @priority: The priority in the request
+ * @cand_use: Whether the request has the USE-CANDIDATE flag
+ * @controlling: Whether the request has ICE-CONTROLLING
+ * @compatibility: The compatibility mode the request was built for
+ * @agent_compatibility: The compatibility mode of @agent at the time
+ * @agent_usage_flags: The usage flags of @agent at the time
+ *
+ * Describes the last connectivity check built in a buffer by
+ * stun_usage_ice_conncheck_create_from_template(), so that the next one can
+ * reuse it when only the transaction ID, MESSAGE-INTEGRITY and FINGERPRINT
+ * change. It must be zero-initialized before first use.
+ */
+typedef struct {
+  StunAgent *agent;
+  size_t length;
+  size_t username_pos;
+  size_t username_len;
+  size_t software_pos;
+  size_t software_len;
+  size_t identifier_pos;
+  size_t identifier_len;
+  uint64_t tie;
+  uint32_t priority;
+  bool cand_use;
+  bool controlling;
+  StunUsageIceCompatibility compatibility;
+  StunCompatibility agent_compatibility;
+  StunAgentUsageFlags agent_usage_flags;
+} StunUsageIceConncheckTemplate;
+
+/**
+ * stun_usage_ice_conncheck_create_from_template:
+ * @agent: The #StunAgent to use to build the request
+ * @msg: The #StunMessage to build
+ * @buffer: The buffer to use for creating the #StunMessage
+ * @buffer_len: The size of the @buffer
+ * @tmpl: What was last built in @buffer
+ * @username: The username to use in the request
+ * @username_len: The length of @username
+ * @password: The key to use for building the MESSAGE-INTEGRITY
+ * @password_len: The length of @password
+ * @cand_use: Set to %TRUE to append the USE-CANDIDATE flag to the request
+ * @controlling: Set to %TRUE if you are the controlling agent or set to
+ * %FALSE if you are the controlled agent.
+ * @priority: The value of the PRIORITY attribute
+ * @tie: The value of the tie-breaker to put in the ICE-CONTROLLED or
+ * ICE-CONTROLLING attribute
+ * @candidate_identifier: The foundation value to put in the
+ * CANDIDATE-IDENTIFIER attribute
+ * @compatibility: The compatibility mode to use for building the conncheck
+ * request
+ *
+ * Builds the same message as stun_usage_ice_conncheck_create(), but if @buffer
+ * still holds a request with the same attributes, only its transaction ID,
+ * MESSAGE-INTEGRITY and FINGERPRINT are computed again. @buffer must not be
+ * modified between calls other than by this function.
+ * Returns: The length of the message built.
+ */
+size_t
+stun_usage_ice_conncheck_create_from_template (StunAgent *agent,
+    StunMessage *msg, uint8_t *buffer, size_t buffer_len,
+    StunUsageIceConncheckTemplate *tmpl,
+    const uint8_t *username, const size_t username_len,
+    const uint8_t *password, const size_t password_len,
+    bool cand_use, bool controlling, uint32_t priority,
+    uint64_t tie, const char *candidate_identifier,
+    StunUsageIceCompatibility compatibility);
+
 /**
  * stun_usage_ice_conncheck_process:
  * @msg: The #StunMessage to process
@@ -211,6 +292,30 @@ stun_usage_ice_conncheck_create_reply (StunAgent *agent, StunMessage *req,
     bool *control, uint64_t tie,
     StunUsageIceCompatibility compatibility);
 
+/*
+ * Variants of stun_usage_ice_conncheck_create_from_template() and
+ * stun_usage_ice_conncheck_create_reply() that compute the short-term
+ * MESSAGE-INTEGRITY with the precomputed states of @hkey (see
+ * stun_agent_finish_message_with_key()). The reply also takes the
+ * #StunMessageIndex @req was validated with. Internal to libnice.
+ */
+size_t stun_usage_ice_conncheck_create_from_template_with_key (
+    StunAgent *agent, StunMessage *msg, uint8_t *buffer, size_t buffer_len,
+    StunUsageIceConncheckTemplate *tmpl,
+    const uint8_t *username, const size_t username_len,
+    const uint8_t *password, const size_t password_len,
+    bool cand_use, bool controlling, uint32_t priority,
+    uint64_t tie, const char *candidate_identifier,
+    StunUsageIceCompatibility compatibility, const StunHmacKey *hkey);
+
+StunUsageIceReturn stun_usage_ice_conncheck_create_reply_with_key (
+    StunAgent *agent, StunMessage *req, const StunMessageIndex *index,
+    StunMessage *msg,
+    uint8_t *buf, size_t *plen,
+    const struct sockaddr *src, socklen_t srclen,
+    bool *control, uint64_t tie,
+    StunUsageIceCompatibility compatibility, const StunHmacKey *hkey);
+
 /**
  * stun_usage_ice_conncheck_priority:
  * @msg: The #StunMessage to parse
@@ -220,6 +325,18 @@ stun_usage_ice_conncheck_create_reply (StunAgent *agent, StunMessage *req,
  */
 uint32_t stun_usage_ice_conncheck_priority (const StunMessage *msg);
 
+/**
+ * stun_usage_ice_conncheck_priority_indexed:
+ * @msg: The #StunMessage to parse
+ * @index: The #StunMessageIndex filled in when @msg was validated, or %NULL
+ *
+ * Like stun_usage_ice_conncheck_priority(), looking the attribute up in
+ * @index.
+ * Returns: host byte order priority, or 0 if not specified.
+ */
+uint32_t stun_usage_ice_conncheck_priority_indexed (const StunMessage *msg,
+    const StunMessageIndex *index);
+
 /**
  * stun_usage_ice_conncheck_use_candidate:
  * @msg: The #StunMessage to parse
@@ -229,6 +346,18 @@ uint32_t stun_usage_ice_conncheck_priority (const StunMessage *msg);
  */
 bool stun_usage_ice_conncheck_use_candidate (const StunMessage *msg);
 
+/**
+ * stun_usage_ice_conncheck_use_candidate_indexed:
+ * @msg: The #StunMessage to parse
+ * @index: The #StunMessageIndex filled in when @msg was validated, or %NULL
+ *
+ * Like stun_usage_ice_conncheck_use_candidate(), looking the attribute up
+ * in @index.
+ * Returns: %TRUE if the flag is set, %FALSE if not.
+ */
+bool stun_usage_ice_conncheck_use_candidate_indexed (const StunMessage *msg,
+    const StunMessageIndex *index);
+
 # ifdef __cplusplus
 }
 # endif
@@ -48,6 +48,7 @@
 #endif
 
 #include "stun/stunagent.h"
+#include "stun/stunhmac.h"
 #include "turn.h"
 
 #include <string.h>
@@ -227,16 +228,43 @@ size_t stun_usage_turn_create_permission (StunAgent *agent, StunMessage *msg,
     struct sockaddr *peer, size_t peer_len,
     StunUsageTurnCompatibility compatibility)
 {
-  if (!peer)
+  struct sockaddr_storage peer_storage;
+
+  if (!peer || peer_len > sizeof (peer_storage))
+    return 0;
+
+  memset (&peer_storage, 0, sizeof (peer_storage));
+  memcpy (&peer_storage, peer, peer_len);
+
+  return stun_usage_turn_create_permissions (agent, msg, buffer, buffer_len,
+      username, username_len, password, password_len, realm, realm_len,
+      nonce, nonce_len, &peer_storage, 1, compatibility);
+}
+
+size_t stun_usage_turn_create_permissions (StunAgent *agent, StunMessage *msg,
+    uint8_t *buffer, size_t buffer_len,
+    uint8_t *username, size_t username_len,
+    uint8_t *password, size_t password_len,
+    uint8_t *realm, size_t realm_len,
+    uint8_t *nonce, size_t nonce_len,
+    const struct sockaddr_storage *peers, size_t n_peers,
+    StunUsageTurnCompatibility compatibility)
+{
+  size_t i;
+
+  if (!peers || n_peers == 0)
     return 0;
 
   stun_agent_init_request (agent, msg, buffer, buffer_len,
       STUN_CREATEPERMISSION);
 
-  /* PEER address */
-  if (stun_message_append_xor_addr (msg, STUN_ATTRIBUTE_XOR_PEER_ADDRESS,
-          peer, peer_len) != STUN_MESSAGE_RETURN_SUCCESS) {
-    return 0;
+  /* PEER addresses, RFC 5766 allows any number of them in one request */
+  for (i = 0; i < n_peers; i++) {
+    if (stun_message_append_xor_addr (msg, STUN_ATTRIBUTE_XOR_PEER_ADDRESS,
+            (const struct sockaddr *) &peers[i], sizeof (peers[i])) !=
+        STUN_MESSAGE_RETURN_SUCCESS) {
+      return 0;
+    }
   }
 
   /* nonce */
@@ -263,6 +291,24 @@ size_t stun_usage_turn_create_permission (StunAgent *agent, StunMessage *msg,
   return stun_agent_finish_message (agent, msg, password, password_len);
 }
 
+void stun_usage_turn_forget_credentials (StunMessage *request)
+{
+  uint8_t *realm;
+  uint8_t *username;
+  uint16_t realm_len = 0;
+  uint16_t username_len = 0;
+
+  realm = (uint8_t *) stun_message_find (request, STUN_ATTRIBUTE_REALM,
+      &realm_len);
+  username = (uint8_t *) stun_message_find (request, STUN_ATTRIBUTE_USERNAME,
+      &username_len);
+
+  /* Nothing was derived from a request without them */
+  if (realm == NULL || username == NULL)
+    return;
+
+  stun_hash_creds_forget (realm, realm_len, username, username_len);
+}
 
 StunUsageTurnReturn stun_usage_turn_process (StunMessage *msg,
     struct sockaddr *relay_addr, socklen_t *relay_addrlen,
@@ -215,6 +215,48 @@ size_t stun_usage_turn_create_permission (StunAgent *agent, StunMessage *msg,
     struct sockaddr *peer, size_t peer_len,
     StunUsageTurnCompatibility compatibility);
 
+/**
+ * stun_usage_turn_create_permissions:
+ * @agent: The #StunAgent to use to build the request
+ * @msg: The #StunMessage to build
+ * @buffer: The buffer to use for creating the #StunMessage
+ * @buffer_len: The size of the @buffer
+ * @username: The username to use in the request
+ * @username_len: The length of @username
+ * @password: The key to use for building the MESSAGE-INTEGRITY
+ * @password_len: The length of @password
+ * @realm: The REALM of the last response from the server, or NULL
+ * @realm_len: The length of @realm
+ * @nonce: The NONCE of the last response from the server, or NULL
+ * @nonce_len: The length of @nonce
+ * @peers: (array length=n_peers): The peers to install permissions for
+ * @n_peers: The number of addresses in @peers
+ * @compatibility: The compatibility mode to use for building the request
+ *
+ * Create a new TURN CreatePermission request installing permissions for
+ * all of @peers at once, with one XOR-PEER-ADDRESS attribute each.
+ * Returns: The length of the message to send, or 0 if it doesn't fit in
+ * @buffer
+ */
+size_t stun_usage_turn_create_permissions (StunAgent *agent, StunMessage *msg,
+    uint8_t *buffer, size_t buffer_len,
+    uint8_t *username, size_t username_len,
+    uint8_t *password, size_t password_len,
+    uint8_t *realm, size_t realm_len,
+    uint8_t *nonce, size_t nonce_len,
+    const struct sockaddr_storage *peers, size_t n_peers,
+    StunUsageTurnCompatibility compatibility);
+
+/**
+ * stun_usage_turn_forget_credentials:
+ * @request: The request that the server rejected
+ *
+ * Drops the long-term key cached for the REALM and USERNAME of @request.
+ * To be called when a 401 with a new realm or a 438 (stale nonce) error
+ * response comes back, so that the key for the retry gets rederived.
+ */
+void stun_usage_turn_forget_credentials (StunMessage *request);
+
 /**
  * stun_usage_turn_process:
  * @msg: The message containing the response
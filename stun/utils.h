@@ -76,6 +76,13 @@ StunMessageReturn stun_xor_address (const StunMessage *msg,
 
 bool stun_get_transaction_id (uint8_t *buf, size_t len, StunTransactionId msg_id);
 
+/*
+ * Records where the attribute @type of the message is, unless one is
+ * already there. Returns false once @index is too full to take it.
+ */
+bool stun_message_index_add (StunMessageIndex *index, uint16_t type,
+    size_t offset, uint16_t length);
+
 # ifdef __cplusplus
 }
 # endif
@@ -71,6 +71,7 @@ test_ipv4 (void)
   nice_address_to_string (&addr, str);
   nice_address_to_string (&other, str);
   g_assert (TRUE == nice_address_equal (&addr, &other));
+  g_assert (nice_address_hash (&addr) == nice_address_hash (&other));
 
   /* different IP */
   nice_address_set_ipv4 (&other, 0x01020305);
@@ -124,6 +125,7 @@ test_ipv6 (void)
   nice_address_copy_to_sockaddr (&other, (struct sockaddr*)&sin2);
   nice_address_copy_to_sockaddr (&addr, (struct sockaddr*)&sin);
   g_assert (nice_address_equal (&addr, &other) == TRUE);
+  g_assert (nice_address_hash (&addr) == nice_address_hash (&other));
   nice_address_to_string (&addr, str);
   nice_address_to_string (&other, str);
 
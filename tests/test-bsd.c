@@ -42,6 +42,84 @@
 
 #include "socket.h"
 
+#define OFFLOAD_PACKETS 8
+#define OFFLOAD_SEGMENT 100
+#define OFFLOAD_LAST 40
+
+/* With UDP offload, a batch of packets of the same size leaves as one
+ * datagram the receiver gets coalesced, and has to split back into the
+ * packets that were sent */
+static void
+test_offload (NiceSocket *client, NiceSocket *server, const NiceAddress *to)
+{
+  gchar payloads[OFFLOAD_PACKETS][OFFLOAD_SEGMENT];
+  GOutputVector vectors[OFFLOAD_PACKETS];
+  NiceOutputMessage messages[OFFLOAD_PACKETS];
+  gchar buf[OFFLOAD_PACKETS * OFFLOAD_SEGMENT];
+  gboolean coalesced = FALSE;
+  guint n_packets = 0;
+  guint tries = 0;
+  guint i;
+
+  if (!nice_udp_bsd_socket_set_offload (client, TRUE) ||
+      !nice_udp_bsd_socket_set_offload (server, TRUE) ||
+      !nice_udp_bsd_socket_has_gro (server)) {
+    g_debug ("UDP offload not supported, skipping");
+    nice_udp_bsd_socket_set_offload (client, FALSE);
+    nice_udp_bsd_socket_set_offload (server, FALSE);
+    return;
+  }
+
+  for (i = 0; i < OFFLOAD_PACKETS; i++) {
+    memset (payloads[i], 'a' + i, OFFLOAD_SEGMENT);
+    vectors[i].buffer = payloads[i];
+    vectors[i].size = i < OFFLOAD_PACKETS - 1 ? OFFLOAD_SEGMENT : OFFLOAD_LAST;
+    messages[i].buffers = &vectors[i];
+    messages[i].n_buffers = 1;
+  }
+  g_assert (OFFLOAD_PACKETS ==
+      nice_socket_send_messages (client, to, messages, OFFLOAD_PACKETS));
+
+  while (n_packets < OFFLOAD_PACKETS) {
+    NiceAddress from;
+    guint segment_size;
+    guint offset;
+    gint len;
+
+    len = nice_udp_bsd_socket_recv_segmented (server, &from, sizeof (buf),
+        buf, &segment_size);
+    g_assert (len >= 0);
+    if (len == 0) {
+      g_assert (++tries < 1000);
+      g_usleep (1000);
+      continue;
+    }
+
+    g_assert (nice_address_get_port (&from)
+               == nice_address_get_port (&client->addr));
+    if (segment_size > 0)
+      coalesced = TRUE;
+    else
+      segment_size = len;
+
+    for (offset = 0; offset < (guint) len; offset += segment_size) {
+      guint size = MIN (segment_size, len - offset);
+
+      g_assert (n_packets < OFFLOAD_PACKETS);
+      g_assert (size == vectors[n_packets].size);
+      g_assert (0 == memcmp (buf + offset, payloads[n_packets], size));
+      n_packets++;
+    }
+  }
+
+  g_assert (coalesced);
+  g_assert (0 == nice_udp_bsd_socket_recv_segmented (server, NULL,
+          sizeof (buf), buf, &i));
+
+  nice_udp_bsd_socket_set_offload (client, FALSE);
+  nice_udp_bsd_socket_set_offload (server, FALSE);
+}
+
 int
 main (void)
 {
@@ -49,6 +127,11 @@ main (void)
   NiceSocket *client;
   NiceAddress tmp;
   gchar buf[5];
+  gchar bufs[4][16];
+  NiceInputMessage messages[4];
+  GOutputVector vectors[3];
+  NiceOutputMessage out_messages[2];
+  guint i;
 
   g_type_init ();
   server = nice_udp_bsd_socket_new (NULL);
@@ -85,6 +168,44 @@ main (void)
   g_assert (nice_address_get_port (&tmp)
              == nice_address_get_port (&server->addr));
 
+  /* batched receive drains everything pending in one call */
+  nice_socket_send (client, &tmp, 5, "one..");
+  nice_socket_send (client, &tmp, 5, "two..");
+  nice_socket_send (client, &tmp, 5, "three");
+
+  for (i = 0; i < 4; i++) {
+    messages[i].buf = bufs[i];
+    messages[i].size = sizeof (bufs[i]);
+    messages[i].length = 0;
+  }
+  g_assert (3 == nice_socket_recv_messages (server, messages, 4));
+  g_assert (messages[0].length == 5);
+  g_assert (0 == strncmp (messages[0].buf, "one..", 5));
+  g_assert (0 == strncmp (messages[2].buf, "three", 5));
+  g_assert (nice_address_get_port (&messages[2].from)
+             == nice_address_get_port (&client->addr));
+  g_assert (0 == nice_socket_recv_messages (server, messages, 4));
+
+  /* vectored batch send, the second packet gathered from two buffers */
+  vectors[0].buffer = "four.";
+  vectors[0].size = 5;
+  vectors[1].buffer = "fi";
+  vectors[1].size = 2;
+  vectors[2].buffer = "ve.";
+  vectors[2].size = 3;
+  out_messages[0].buffers = &vectors[0];
+  out_messages[0].n_buffers = 1;
+  out_messages[1].buffers = &vectors[1];
+  out_messages[1].n_buffers = 2;
+  g_assert (2 == nice_socket_send_messages (client, &tmp, out_messages, 2));
+
+  g_assert (2 == nice_socket_recv_messages (server, messages, 4));
+  g_assert (0 == strncmp (messages[0].buf, "four.", 5));
+  g_assert (messages[1].length == 5);
+  g_assert (0 == strncmp (messages[1].buf, "five.", 5));
+
+  test_offload (client, server, &tmp);
+
   nice_socket_free (client);
   nice_socket_free (server);
   return 0;
@@ -39,60 +39,187 @@
 #include <string.h>
 #include <stdio.h>
 
+#include "agent-priv.h"
 #include "socket.h"
 
+#define SMALL_PACKET 16
+#define LARGE_PACKET 30000
+
 GMainLoop *mainloop = NULL;
+NiceAgent *agent;
 NiceSocket *active_sock, *client;
 NiceSocket *passive_sock, *server;
 NiceAddress tmp;
 gchar buf[5];
+NiceSocket *rx_sock;
+
+/* packets of the short write test, checked as they are reassembled */
+guint32 tx_seq, rx_seq;
 
 static gboolean
 on_server_connection_available (gpointer user_data)
 {
   server = nice_tcp_passive_socket_accept (passive_sock);
   g_assert (server);
-  nice_socket_free (passive_sock);
-  passive_sock = NULL;
 
   g_main_loop_quit (mainloop);
 
   return FALSE;
 }
 
-static gboolean
-on_server_input_available (gpointer user_data)
+static guint8
+packet_byte (guint32 seq, gsize i)
 {
-  g_assert (5 == nice_socket_recv (server, &tmp, 5, buf));
-  g_assert (nice_address_get_port (&tmp)
-             == nice_address_get_port (&client->addr));
+  return (seq * 7 + i) & 0xff;
+}
 
-  g_main_loop_quit (mainloop);
+static void
+check_packet (const gchar *data, gint len)
+{
+  guint32 seq;
+  gint i;
 
-  return FALSE;
+  g_assert (len == SMALL_PACKET || len == LARGE_PACKET);
+  memcpy (&seq, data, sizeof (seq));
+  g_assert (seq == rx_seq);
+  for (i = sizeof (seq); i < len; i++)
+    g_assert ((guint8) data[i] == packet_byte (seq, i));
+
+  rx_seq++;
 }
 
-static gboolean
-on_client_input_available (gpointer user_data)
+static void
+on_rx (NiceSocket *sock, NiceAddress *from, gchar *data, gint len,
+    gpointer user_data)
 {
-  g_assert (5 == nice_socket_recv (client, &tmp, 5, buf));
-  g_assert (nice_address_get_port (&tmp)
-             == nice_address_get_port (&server->addr));
+  if (tx_seq > 0) {
+    g_assert (sock == passive_sock);
+    check_packet (data, len);
+    return;
+  }
+
+  g_assert (len == 5);
+  memcpy (buf, data, 5);
+  rx_sock = sock;
+  tmp = *from;
 
   g_main_loop_quit (mainloop);
+}
 
-  return FALSE;
+static void
+on_tx (NiceSocket *sock, gchar *data, gint len, gsize queued,
+    gpointer user_data)
+{
+}
+
+/* Sends a packet gathered from three buffers, which are overwritten as soon
+ * as the send returns, so whatever is queued must be a copy */
+static void
+send_packet (gsize len)
+{
+  gchar *payload = g_malloc (len);
+  GOutputVector vectors[3];
+  NiceOutputMessage message = { vectors, G_N_ELEMENTS (vectors) };
+  gsize i;
+
+  memcpy (payload, &tx_seq, sizeof (tx_seq));
+  for (i = sizeof (tx_seq); i < len; i++)
+    payload[i] = packet_byte (tx_seq, i);
+
+  vectors[0].buffer = payload;
+  vectors[0].size = 1;
+  vectors[1].buffer = payload + 1;
+  vectors[1].size = len / 2 - 1;
+  vectors[2].buffer = payload + len / 2;
+  vectors[2].size = len - len / 2;
+
+  g_assert (1 == nice_socket_send_messages (client, &tmp, &message, 1));
+  tx_seq++;
+
+  memset (payload, 0xff, len);
+  g_free (payload);
+}
+
+/* Sends packets of @len until the kernel doesn't take one whole, and
+ * returns how much of it was queued */
+static gint
+fill_socket (gsize len)
+{
+  gint queued;
+
+  g_assert (nice_socket_get_tx_queue_size (client) == 0);
+  while ((queued = nice_socket_get_tx_queue_size (client)) == 0)
+    send_packet (len);
+
+  return queued;
+}
+
+static void
+drain_socket (void)
+{
+  gint64 deadline = g_get_monotonic_time () + 10 * G_USEC_PER_SEC;
+
+  while (rx_seq < tx_seq || nice_socket_get_tx_queue_size (client) > 0) {
+    g_assert (g_get_monotonic_time () < deadline);
+    g_main_context_iteration (g_main_loop_get_context (mainloop), TRUE);
+  }
+}
+
+/* The kernel takes part of a packet, or none of it, while the receiver
+ * isn't reading. The rest has to go out later without breaking the RFC 4571
+ * framing of the stream. */
+static void
+test_short_writes (void)
+{
+  gint size = 2048;
+  gboolean seen_short = FALSE, seen_would_block = FALSE;
+  guint round;
+
+  /* small kernel buffers on both ends, so that they fill up quickly */
+  setsockopt (g_socket_get_fd (client->fileno), SOL_SOCKET, SO_SNDBUF,
+      &size, sizeof (size));
+  setsockopt (g_socket_get_fd (server->fileno), SOL_SOCKET, SO_RCVBUF,
+      &size, sizeof (size));
+
+  /* which one happens is up to the kernel, try a few times */
+  for (round = 0; round < 20 && !(seen_short && seen_would_block); round++) {
+    guint i;
+
+    /* a big packet is mostly cut short */
+    if (fill_socket (LARGE_PACKET) < LARGE_PACKET + 2)
+      seen_short = TRUE;
+    /* and the next ones go behind what is left of it */
+    for (i = 0; i < 10; i++)
+      send_packet (SMALL_PACKET);
+    drain_socket ();
+
+    /* small ones fill the buffer until one doesn't fit at all */
+    if (fill_socket (SMALL_PACKET) == SMALL_PACKET + 2)
+      seen_would_block = TRUE;
+    drain_socket ();
+  }
+
+  g_assert (seen_short);
+  g_assert (seen_would_block);
+  g_assert (rx_seq == tx_seq);
 }
 
 int
 main (void)
 {
   NiceAddress active_bind_addr, passive_bind_addr;
-  GSource *srv_listen_source, *srv_input_source, *cli_input_source;
+  GSource *srv_listen_source;
+  TcpUserData userdata;
 
   g_type_init ();
 
   mainloop = g_main_loop_new (NULL, FALSE);
+  agent = nice_agent_new (g_main_loop_get_context (mainloop),
+      NICE_COMPATIBILITY_RFC5245, NICE_COMPATIBILITY_RFC5245);
+
+  /* the established sockets only look at the agent */
+  memset (&userdata, 0, sizeof (userdata));
+  userdata.agent = agent;
 
   nice_address_init (&active_bind_addr);
   g_assert (nice_address_set_from_string (&active_bind_addr, "::1"));
@@ -104,7 +231,7 @@ main (void)
   nice_address_init (&tmp);
 
   passive_sock = nice_tcp_passive_socket_new (g_main_loop_get_context (mainloop),
-      &passive_bind_addr);
+      &passive_bind_addr, on_rx, on_tx, &userdata, NULL, 0);
   g_assert (passive_sock);
 
   srv_listen_source = g_socket_create_source (passive_sock->fileno,
@@ -114,26 +241,15 @@ main (void)
   g_source_attach (srv_listen_source, g_main_loop_get_context (mainloop));
 
   active_sock = nice_tcp_active_socket_new (g_main_loop_get_context (mainloop),
-      &active_bind_addr);
+      &active_bind_addr, on_rx, on_tx, &userdata, NULL, 0);
   g_assert (active_sock);
 
   client = nice_tcp_active_socket_connect (active_sock, &passive_bind_addr);
   g_assert (client);
-  nice_socket_free (active_sock);
-  active_sock = NULL;
 
   g_main_loop_run (mainloop); /* -> on_server_connection_available */
   g_assert (server);
-
-  srv_input_source = g_socket_create_source (server->fileno, G_IO_IN, NULL);
-  g_source_set_callback (srv_input_source,
-      on_server_input_available, NULL, NULL);
-  g_source_attach (srv_input_source, g_main_loop_get_context (mainloop));
-
-  cli_input_source = g_socket_create_source (client->fileno, G_IO_IN, NULL);
-  g_source_set_callback (cli_input_source,
-      on_client_input_available, NULL, NULL);
-  g_source_attach (cli_input_source, g_main_loop_get_context (mainloop));
+  g_source_destroy (srv_listen_source);
 
   g_assert (nice_address_get_port (&client->addr) != 0);
   g_assert (nice_address_get_port (&server->addr) == 23456);
@@ -143,21 +259,33 @@ main (void)
   g_assert (nice_address_get_port (&tmp) != 0);
 
 
-  g_assert (5 == nice_socket_send (client, &tmp, 5, "hello"));
-  g_main_loop_run (mainloop); /* -> on_server_input_available */
+  g_assert (nice_socket_send (client, &tmp, 5, "hello") > 0);
+  g_main_loop_run (mainloop); /* -> on_rx */
+  g_assert (rx_sock == passive_sock);
   g_assert (0 == strncmp (buf, "hello", 5));
+  g_assert (nice_address_get_port (&tmp)
+             == nice_address_get_port (&client->addr));
 
-  g_assert (5 == nice_socket_send (server, &tmp, 5, "uryyb"));
-  g_main_loop_run (mainloop); /* -> on_client_input_available */
+  g_assert (nice_socket_send (server, &tmp, 5, "uryyb") > 0);
+  g_main_loop_run (mainloop); /* -> on_rx */
+  g_assert (rx_sock == active_sock);
   g_assert (0 == strncmp (buf, "uryyb", 5));
+  g_assert (nice_address_get_port (&tmp)
+             == nice_address_get_port (&server->addr));
+
+  test_short_writes ();
 
+  /* the established sockets must be closed with the agent lock held */
+  agent_lock (agent);
   nice_socket_free (client);
   nice_socket_free (server);
+  agent_unlock (agent);
+  nice_socket_free (active_sock);
+  nice_socket_free (passive_sock);
 
   g_source_unref (srv_listen_source);
-  g_source_unref (srv_input_source);
-  g_source_unref (cli_input_source);
   g_main_loop_unref (mainloop);
+  g_object_unref (agent);
 
   return 0;
 }
@@ -39,6 +39,7 @@
 #endif
 
 #include "agent.h"
+#include "agent-priv.h" /* for testing purposes */
 
 #include <stdlib.h>
 #include <string.h>
@@ -177,6 +178,217 @@ static void cb_component_state_changed (NiceAgent *agent,
     }
 }
 
+/*
+ * Stream scaling stress: one agent pair with many streams, every stream
+ * receiving in its own thread. The streams share nothing but the agent,
+ * so sending from one thread per stream should scale with the cores
+ * instead of serialising on the agent lock. The threaded run holds the
+ * agent lock of the receiving agent all along and checks that receives
+ * on different streams overlap.
+ */
+
+#define SCALING_STREAMS 16
+#define SCALING_PACKETS 20000
+#define SCALING_WINDOW 256
+
+typedef struct {
+  NiceAgent *agent;             /* sending side */
+  guint stream_id;
+  guint remote_stream_id;
+  gint sent;
+  gint received;
+  GMainContext *ctx;
+  GMainLoop *loop;
+  GThread *thread;
+} ScalingStream;
+
+static gint scaling_receiving;          /* receive callbacks running now */
+static gint scaling_max_receiving;      /* the most ever seen at once */
+static gboolean scaling_rendezvous;     /* wait for an overlapping receive */
+
+static void
+cb_scaling_recv (NiceAgent *agent, guint stream_id, guint component_id,
+    guint len, gchar *buf, gpointer user_data, const NiceAddress *from,
+    const NiceAddress *to)
+{
+  ScalingStream *ss = user_data;
+  gint receiving, max;
+
+  g_assert (len == 100);
+
+  receiving = g_atomic_int_add (&scaling_receiving, 1) + 1;
+  do {
+    max = g_atomic_int_get (&scaling_max_receiving);
+  } while (receiving > max &&
+      !g_atomic_int_compare_and_exchange (&scaling_max_receiving, max,
+          receiving));
+
+  if (g_atomic_int_get (&scaling_rendezvous)) {
+    gint64 deadline = g_get_monotonic_time () + G_USEC_PER_SEC;
+
+    /* hold this stream's receive until another stream's one is running */
+    while (g_atomic_int_get (&scaling_max_receiving) < 2 &&
+        g_get_monotonic_time () < deadline)
+      g_thread_yield ();
+  }
+
+  g_atomic_int_inc (&ss->received);
+  g_atomic_int_add (&scaling_receiving, -1);
+}
+
+static void
+scaling_send (ScalingStream *ss, guint n_packets)
+{
+  gchar data[100];
+  guint i;
+
+  memset (data, 'x', sizeof (data));
+
+  for (i = 0; i < n_packets; i++) {
+    gint64 deadline = g_get_monotonic_time () + 10000;
+
+    /* don't outrun the receiver, losing packets proves nothing */
+    while (g_atomic_int_get (&ss->sent) -
+        g_atomic_int_get (&ss->received) > SCALING_WINDOW &&
+        g_get_monotonic_time () < deadline)
+      g_thread_yield ();
+
+    if (nice_agent_send (ss->agent, ss->stream_id, 1, sizeof (data),
+            data) == sizeof (data))
+      g_atomic_int_inc (&ss->sent);
+  }
+}
+
+static gpointer
+scaling_send_thread (gpointer data)
+{
+  scaling_send (data, SCALING_PACKETS);
+  return NULL;
+}
+
+static gdouble
+scaling_run (ScalingStream *streams, gboolean threaded)
+{
+  GThread *threads[SCALING_STREAMS];
+  gint64 start;
+  guint i, j;
+
+  for (i = 0; i < SCALING_STREAMS; i++) {
+    g_atomic_int_set (&streams[i].sent, 0);
+    g_atomic_int_set (&streams[i].received, 0);
+  }
+
+  start = g_get_monotonic_time ();
+
+  if (threaded) {
+    for (i = 0; i < SCALING_STREAMS; i++)
+      threads[i] = g_thread_new ("scaling sender", scaling_send_thread,
+          &streams[i]);
+    for (i = 0; i < SCALING_STREAMS; i++)
+      g_thread_join (threads[i]);
+  } else {
+    for (j = 0; j < SCALING_PACKETS; j += 100)
+      for (i = 0; i < SCALING_STREAMS; i++)
+        scaling_send (&streams[i], 100);
+  }
+
+  return (gdouble) (g_get_monotonic_time () - start) / G_USEC_PER_SEC;
+}
+
+static void
+scaling_connect (NiceAgent *from, guint from_id, NiceAgent *to, guint to_id)
+{
+  GSList *cands;
+
+  cands = nice_agent_get_local_candidates (to, to_id, 1);
+  g_assert (cands != NULL);
+  g_assert (nice_agent_set_selected_remote_candidate (from, from_id, 1,
+          cands->data));
+  g_slist_free_full (cands, (GDestroyNotify) nice_candidate_free);
+}
+
+static void
+test_stream_scaling (void)
+{
+  NiceAgent *lagent, *ragent;
+  NiceAddress baseaddr;
+  ScalingStream streams[SCALING_STREAMS];
+  gdouble serial_time, threaded_time;
+  guint i;
+
+  lagent = nice_agent_new (NULL, NICE_COMPATIBILITY_RFC5245,
+      NICE_COMPATIBILITY_RFC5245);
+  ragent = nice_agent_new (NULL, NICE_COMPATIBILITY_RFC5245,
+      NICE_COMPATIBILITY_RFC5245);
+
+  if (!nice_address_set_from_string (&baseaddr, "127.0.0.1"))
+    g_assert_not_reached ();
+  nice_agent_add_local_address (lagent, &baseaddr);
+  nice_agent_add_local_address (ragent, &baseaddr);
+
+  for (i = 0; i < SCALING_STREAMS; i++) {
+    ScalingStream *ss = &streams[i];
+
+    memset (ss, 0, sizeof (*ss));
+    ss->agent = lagent;
+    ss->stream_id = nice_agent_add_stream (lagent, 1);
+    ss->remote_stream_id = nice_agent_add_stream (ragent, 1);
+    g_assert (ss->stream_id > 0);
+    g_assert (ss->remote_stream_id > 0);
+    nice_agent_set_transport (lagent, ss->stream_id, 1,
+        NICE_CANDIDATE_TRANSPORT_UDP);
+    nice_agent_set_transport (ragent, ss->remote_stream_id, 1,
+        NICE_CANDIDATE_TRANSPORT_UDP);
+    g_assert (nice_agent_gather_candidates (lagent, ss->stream_id));
+    g_assert (nice_agent_gather_candidates (ragent, ss->remote_stream_id));
+
+    /* every receiving stream gets a thread of its own */
+    ss->ctx = g_main_context_new ();
+    ss->loop = g_main_loop_new (ss->ctx, FALSE);
+    nice_agent_attach_recv (ragent, ss->remote_stream_id, 1, ss->ctx,
+        cb_scaling_recv, ss);
+    ss->thread = g_thread_new ("scaling receiver", mainloop_thread, ss->loop);
+
+    scaling_connect (lagent, ss->stream_id, ragent, ss->remote_stream_id);
+    scaling_connect (ragent, ss->remote_stream_id, lagent, ss->stream_id);
+  }
+
+  serial_time = scaling_run (streams, FALSE);
+  for (i = 0; i < SCALING_STREAMS; i++)
+    g_assert (streams[i].received > 0);
+
+  /* Data on established UDP pairs never needs the agent lock, so the
+   * receiving threads can't be serialised on it */
+  g_atomic_int_set (&scaling_max_receiving, 0);
+  g_atomic_int_set (&scaling_rendezvous, TRUE);
+  agent_lock (ragent);
+  threaded_time = scaling_run (streams, TRUE);
+  agent_unlock (ragent);
+  g_atomic_int_set (&scaling_rendezvous, FALSE);
+  for (i = 0; i < SCALING_STREAMS; i++)
+    g_assert (streams[i].received > 0);
+  g_assert (g_atomic_int_get (&scaling_max_receiving) >= 2);
+
+  g_message ("test-thread: %u streams x %u packets: %.3fs from one thread, "
+      "%.3fs from %u threads (%.2fx on %u cores)", SCALING_STREAMS,
+      SCALING_PACKETS, serial_time, threaded_time, SCALING_STREAMS,
+      serial_time / threaded_time, g_get_num_processors ());
+
+  for (i = 0; i < SCALING_STREAMS; i++) {
+    ScalingStream *ss = &streams[i];
+
+    while (!g_main_loop_is_running (ss->loop));
+    while (g_main_loop_is_running (ss->loop))
+      g_main_loop_quit (ss->loop);
+    g_thread_join (ss->thread);
+    g_main_loop_unref (ss->loop);
+    g_main_context_unref (ss->ctx);
+  }
+
+  g_object_unref (lagent);
+  g_object_unref (ragent);
+}
+
 int main (void)
 {
   NiceAgent *lagent, *ragent;      /* agent's L and R */
@@ -347,6 +559,8 @@ int main (void)
   g_main_loop_unref (rdmainloop);
 
   g_main_loop_unref (error_loop);
+
+  test_stream_scaling ();
 #ifdef G_OS_WIN32
   WSACleanup();
 #endif
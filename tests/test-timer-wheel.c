@@ -0,0 +1,263 @@
+/*
+ * This file is part of the Nice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Nice GLib ICE library.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <string.h>
+
+#include "timer-wheel.h"
+
+typedef struct {
+  gint id;
+  gint *order;
+  gint *n_fired;
+  gint64 added;
+  gint64 fired;
+  gint repeat;                  /* times to ask to be called again */
+  NiceTimer *timer;
+  NiceTimer *victim;            /* timer to cancel when this one fires */
+} Fired;
+
+static gboolean
+cb_record (gpointer data)
+{
+  Fired *f = data;
+
+  g_assert (nice_timer_current () == f->timer);
+
+  f->fired = g_get_monotonic_time ();
+  f->order[(*f->n_fired)++] = f->id;
+
+  if (f->victim) {
+    nice_timer_cancel (f->victim);
+    f->victim = NULL;
+  }
+
+  if (f->repeat > 0) {
+    f->repeat--;
+    return TRUE;
+  }
+  return FALSE;
+}
+
+static gboolean
+cb_cancel_self (gpointer data)
+{
+  Fired *f = data;
+
+  f->order[(*f->n_fired)++] = f->id;
+
+  /* asks to be called again, but the cancel wins */
+  nice_timer_cancel (nice_timer_current ());
+  f->timer = NULL;
+  return TRUE;
+}
+
+static void
+run_until (GMainContext *ctx, gint *n_fired, gint n)
+{
+  gint64 deadline = g_get_monotonic_time () + 10 * G_USEC_PER_SEC;
+
+  while (*n_fired < n) {
+    g_assert (g_get_monotonic_time () < deadline);
+    g_main_context_iteration (ctx, TRUE);
+  }
+}
+
+static void
+add_timer (GMainContext *ctx, Fired *f, gint id, guint interval,
+    gint *order, gint *n_fired)
+{
+  f->id = id;
+  f->order = order;
+  f->n_fired = n_fired;
+  f->added = g_get_monotonic_time ();
+  f->timer = nice_timer_add (ctx, interval, cb_record, f);
+}
+
+/* The wheel counts whole milliseconds, so a timer can fire up to 1 ms
+ * before its interval has elapsed in microseconds */
+#define ELAPSED(f, ms) ((f)->fired - (f)->added >= ((gint64) (ms) - 1) * 1000)
+
+/* Timers fire in deadline order, across the levels of the wheel, and never
+ * before they are due */
+static void
+test_expiry_order (GMainContext *ctx)
+{
+  static const guint intervals[] = { 1100, 30, 0, 300, 10, 600, 20 };
+  static const gint expected[] = { 2, 4, 6, 1, 3, 5, 0 };
+  Fired fired[G_N_ELEMENTS (intervals)] = { { 0, }, };
+  gint order[G_N_ELEMENTS (intervals)];
+  gint n_fired = 0;
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (intervals); i++)
+    add_timer (ctx, &fired[i], i, intervals[i], order, &n_fired);
+
+  run_until (ctx, &n_fired, G_N_ELEMENTS (intervals));
+
+  for (i = 0; i < G_N_ELEMENTS (intervals); i++) {
+    g_assert (order[i] == expected[i]);
+    g_assert (ELAPSED (&fired[i], intervals[i]));
+    g_assert (nice_timer_is_cancelled (fired[i].timer));
+    nice_timer_cancel (fired[i].timer);
+  }
+}
+
+/* A callback can cancel a timer due in the same dispatch, and itself */
+static void
+test_cancel_from_callback (GMainContext *ctx)
+{
+  Fired fired[4] = { { 0, }, };
+  gint order[4];
+  gint n_fired = 0;
+
+  add_timer (ctx, &fired[0], 0, 20, order, &n_fired);
+  add_timer (ctx, &fired[1], 1, 20, order, &n_fired);
+  add_timer (ctx, &fired[2], 2, 40, order, &n_fired);
+  fired[0].victim = fired[1].timer;
+  fired[1].victim = fired[0].timer;
+
+  fired[3].id = 3;
+  fired[3].order = order;
+  fired[3].n_fired = &n_fired;
+  fired[3].timer = nice_timer_add (ctx, 10, cb_cancel_self, &fired[3]);
+
+  run_until (ctx, &n_fired, 3);
+
+  /* whichever of 0 and 1 came first cancelled the other */
+  g_assert (order[0] == 3);
+  g_assert (order[1] == 0 || order[1] == 1);
+  g_assert (order[2] == 2);
+  g_assert (fired[3].timer == NULL);
+
+  if (order[1] == 0) {
+    g_assert (fired[1].fired == 0);
+    nice_timer_cancel (fired[0].timer);
+  } else {
+    g_assert (fired[0].fired == 0);
+    nice_timer_cancel (fired[1].timer);
+  }
+  nice_timer_cancel (fired[2].timer);
+}
+
+/* Returning TRUE runs the callback again after the same interval */
+static void
+test_repeat (GMainContext *ctx)
+{
+  Fired fired = { 0, };
+  gint order[4];
+  gint n_fired = 0;
+
+  fired.repeat = 3;
+  add_timer (ctx, &fired, 0, 15, order, &n_fired);
+
+  run_until (ctx, &n_fired, 4);
+  g_assert (ELAPSED (&fired, 4 * 15));
+  g_assert (fired.repeat == 0);
+  g_assert (nice_timer_is_cancelled (fired.timer));
+
+  /* and not a fifth time */
+  g_main_context_iteration (ctx, FALSE);
+  g_assert (n_fired == 4);
+  nice_timer_cancel (fired.timer);
+}
+
+/* Refresh timers fire at most a tenth of their interval, capped at 30 s,
+ * early, and are counted in the upcoming load until they fire or are
+ * cancelled */
+static void
+test_refresh (GMainContext *ctx)
+{
+  NiceTimer *timers[200];
+  Fired fired = { 0, };
+  gint order[1];
+  gint n_fired = 0;
+  guint i;
+
+  g_assert (nice_timer_count_refreshes (ctx, 3600 * 1000) == 0);
+
+  /* 100 s, may fire from 90 s on */
+  for (i = 0; i < 100; i++)
+    timers[i] = nice_timer_add_refresh (ctx, 100 * 1000, cb_record, &fired);
+  /* 600 s, may fire from 570 s on */
+  for (i = 100; i < 200; i++)
+    timers[i] = nice_timer_add_refresh (ctx, 600 * 1000, cb_record, &fired);
+
+  g_assert (nice_timer_count_refreshes (ctx, 88 * 1000) == 0);
+  g_assert (nice_timer_count_refreshes (ctx, 100 * 1000) == 100);
+  g_assert (nice_timer_count_refreshes (ctx, 568 * 1000) == 100);
+  g_assert (nice_timer_count_refreshes (ctx, 600 * 1000) == 200);
+
+  /* ordinary timers are not refreshes */
+  add_timer (ctx, &fired, 0, 50 * 1000, order, &n_fired);
+  g_assert (nice_timer_count_refreshes (ctx, 600 * 1000) == 200);
+  nice_timer_cancel (fired.timer);
+
+  for (i = 0; i < 150; i++)
+    nice_timer_cancel (timers[i]);
+  g_assert (nice_timer_count_refreshes (ctx, 100 * 1000) == 0);
+  g_assert (nice_timer_count_refreshes (ctx, 600 * 1000) == 50);
+  for (i = 150; i < 200; i++)
+    nice_timer_cancel (timers[i]);
+  g_assert (nice_timer_count_refreshes (ctx, 3600 * 1000) == 0);
+
+  /* too short to be moved, fires when due and leaves the load */
+  memset (&fired, 0, sizeof (fired));
+  fired.order = order;
+  fired.n_fired = &n_fired;
+  fired.added = g_get_monotonic_time ();
+  fired.timer = nice_timer_add_refresh (ctx, 200, cb_record, &fired);
+  g_assert (nice_timer_count_refreshes (ctx, 1000) == 1);
+
+  run_until (ctx, &n_fired, 1);
+  g_assert (ELAPSED (&fired, 200));
+  g_assert (nice_timer_count_refreshes (ctx, 3600 * 1000) == 0);
+  nice_timer_cancel (fired.timer);
+}
+
+int
+main (void)
+{
+  GMainContext *ctx;
+
+  g_type_init ();
+
+  ctx = g_main_context_new ();
+
+  test_expiry_order (ctx);
+  test_cancel_from_callback (ctx);
+  test_repeat (ctx);
+  test_refresh (ctx);
+
+  /* every context has a wheel of its own */
+  g_assert (nice_timer_count_refreshes (NULL, 3600 * 1000) == 0);
+
+  g_main_context_unref (ctx);
+
+  return 0;
+}
@@ -0,0 +1,659 @@
+/*
+ * This file is part of the Nice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Nice GLib ICE library.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <string.h>
+
+#include "agent.h"
+#include "socket.h"
+#include "stun/stunagent.h"
+
+#define PERMISSION_PEERS 40     /* more than fit in one CreatePermission */
+#define PERMISSION_BATCH 32
+#define BINDING_PEERS 20        /* more than may be in flight at once */
+#define BINDINGS_IN_FLIGHT 16
+#define PEER_PORT 20000
+#define QUEUE_SIZE 4096         /* of the pre-permission queue tests */
+#define PAYLOAD_LEN 200
+
+static GMainContext *ctx;
+static NiceAgent *agent;
+static NiceSocket *server;      /* plays the TURN server */
+static NiceAddress server_addr;
+static StunAgent server_agent;
+
+/* A request received by the server, kept to answer it later */
+typedef struct {
+  uint8_t buf[STUN_MAX_MESSAGE_SIZE];
+  StunMessage msg;
+} ServerRequest;
+
+static bool
+server_validater (StunAgent *stun_agent, StunMessage *message,
+    uint8_t *username, uint16_t username_len,
+    uint8_t **password, size_t *password_len, void *user_data)
+{
+  *password = (uint8_t *) "password";
+  *password_len = strlen ("password");
+
+  return TRUE;
+}
+
+static void
+peer_init (NiceAddress *peer, guint i)
+{
+  g_assert (nice_address_set_from_string (peer, "127.0.0.1"));
+  nice_address_set_port (peer, PEER_PORT + i);
+}
+
+/* Returns the next message the server got, without waiting for it, or NULL.
+ * Requests without credentials are fine, the server asks for them. */
+static ServerRequest *
+server_recv_now (void)
+{
+  ServerRequest *req = g_new0 (ServerRequest, 1);
+  StunValidationStatus valid;
+  NiceAddress from;
+  gint len;
+
+  len = nice_socket_recv (server, &from, sizeof (req->buf),
+      (gchar *) req->buf);
+  if (len == 0) {
+    g_free (req);
+    return NULL;
+  }
+
+  g_assert (len > 0);
+  valid = stun_agent_validate (&server_agent, &req->msg, req->buf, len,
+      server_validater, NULL);
+  g_assert (valid == STUN_VALIDATION_SUCCESS ||
+      valid == STUN_VALIDATION_UNAUTHORIZED_BAD_REQUEST);
+
+  return req;
+}
+
+/* Runs the main loop until the server gets something */
+static ServerRequest *
+server_recv (void)
+{
+  gint64 deadline = g_get_monotonic_time () + 30 * G_USEC_PER_SEC;
+  ServerRequest *req;
+
+  while ((req = server_recv_now ()) == NULL) {
+    g_assert (g_get_monotonic_time () < deadline);
+    g_main_context_iteration (ctx, TRUE);
+  }
+
+  return req;
+}
+
+/* Answers @req with a success if @code is 0, or the error @code. A 401 comes
+ * with the REALM and NONCE the client has to use. */
+static void
+server_reply (NiceSocket *turn, ServerRequest *req, StunError code)
+{
+  StunMessage resp;
+  uint8_t resp_buf[STUN_MAX_MESSAGE_SIZE];
+  NiceSocket *from_sock = NULL;
+  NiceAddress from;
+  gchar out[STUN_MAX_MESSAGE_SIZE];
+  size_t resp_len;
+
+  if (code == 0) {
+    g_assert (stun_agent_init_response (&server_agent, &resp, resp_buf,
+            sizeof (resp_buf), &req->msg));
+  } else {
+    g_assert (stun_agent_init_error (&server_agent, &resp, resp_buf,
+            sizeof (resp_buf), &req->msg, code));
+  }
+  if (code == STUN_ERROR_UNAUTHORIZED) {
+    g_assert (stun_message_append_string (&resp, STUN_ATTRIBUTE_REALM,
+            "realm") == STUN_MESSAGE_RETURN_SUCCESS);
+    g_assert (stun_message_append_string (&resp, STUN_ATTRIBUTE_NONCE,
+            "nonce") == STUN_MESSAGE_RETURN_SUCCESS);
+  }
+  resp_len = stun_agent_finish_message (&server_agent, &resp, NULL, 0);
+  g_assert (resp_len > 0);
+
+  g_assert (nice_turn_socket_parse_recv (turn, &from_sock, &from,
+          sizeof (out), out, &server_addr, (gchar *) resp_buf,
+          resp_len) == 0);
+}
+
+/* Returns the index of the peer @value (a XOR-PEER-ADDRESS) is for */
+static guint
+peer_index (const uint8_t *value, uint16_t len)
+{
+  uint16_t port;
+
+  g_assert (len == 8 && value[1] == 0x01);
+  memcpy (&port, value + 2, sizeof (port));
+  port = ntohs (port) ^ (STUN_MAGIC_COOKIE >> 16);
+  g_assert (port >= PEER_PORT);
+
+  return port - PEER_PORT;
+}
+
+/* Marks the peers of a CreatePermission in @seen, each only once, and
+ * returns how many there are */
+static guint
+permission_peers (ServerRequest *req, gboolean *seen)
+{
+  uint16_t length = stun_message_length (&req->msg);
+  size_t offset = STUN_MESSAGE_ATTRIBUTES_POS;
+  guint n_peers = 0;
+
+  g_assert (stun_message_get_method (&req->msg) == STUN_CREATEPERMISSION);
+
+  while (offset + STUN_ATTRIBUTE_VALUE_POS <= length) {
+    uint16_t type, alen;
+
+    memcpy (&type, req->buf + offset, sizeof (type));
+    memcpy (&alen, req->buf + offset + 2, sizeof (alen));
+    type = ntohs (type);
+    alen = ntohs (alen);
+
+    if (type == STUN_ATTRIBUTE_XOR_PEER_ADDRESS) {
+      guint i = peer_index (req->buf + offset + STUN_ATTRIBUTE_VALUE_POS,
+          alen);
+
+      g_assert (i < PERMISSION_PEERS && !seen[i]);
+      seen[i] = TRUE;
+      n_peers++;
+    }
+    offset += STUN_ATTRIBUTE_VALUE_POS + ((alen + 3) & ~3);
+  }
+
+  return n_peers;
+}
+
+/* Returns the peer a Send indication with data from send_data() is for */
+static guint
+send_indication_peer (ServerRequest *req)
+{
+  const uint8_t *data;
+  uint16_t data_len;
+  guint32 i;
+
+  g_assert (stun_message_get_class (&req->msg) == STUN_INDICATION);
+  g_assert (stun_message_get_method (&req->msg) == STUN_IND_SEND);
+
+  data = stun_message_find (&req->msg, STUN_ATTRIBUTE_DATA, &data_len);
+  g_assert (data != NULL && data_len == sizeof (i));
+  memcpy (&i, data, sizeof (i));
+
+  return i;
+}
+
+static void
+send_data (NiceSocket *turn, guint32 i)
+{
+  NiceAddress peer;
+
+  peer_init (&peer, i);
+  g_assert (nice_socket_send (turn, &peer, sizeof (i), (gchar *) &i) ==
+      sizeof (i));
+}
+
+/* Checks the server gets the data sent to each of the first @n_peers */
+static void
+check_data_sent (guint n_peers)
+{
+  gboolean *seen = g_new0 (gboolean, n_peers);
+  ServerRequest *req;
+  guint n = 0;
+
+  while (n < n_peers) {
+    guint i;
+
+    req = server_recv ();
+    /* a CreatePermission may still be retransmitted */
+    if (stun_message_get_method (&req->msg) == STUN_CREATEPERMISSION) {
+      g_free (req);
+      continue;
+    }
+
+    i = send_indication_peer (req);
+    g_assert (i < n_peers && !seen[i]);
+    seen[i] = TRUE;
+    n++;
+    g_free (req);
+  }
+
+  g_free (seen);
+}
+
+/* What the TURN sockets reported about their pre-permission queues */
+static guint64 queued_total;
+static guint64 dropped_total;
+
+static void
+queue_cb (gint64 queued, guint64 dropped, gpointer user_data)
+{
+  queued_total += queued;
+  dropped_total += dropped;
+}
+
+static guint64
+queued_bytes (void)
+{
+  return queued_total;
+}
+
+static guint64
+dropped_bytes (void)
+{
+  return dropped_total;
+}
+
+/* Creates a TURN socket talking to the server, queueing up to @queue_size
+ * bytes for each peer without a permission */
+static NiceSocket *
+turn_socket_new (guint queue_size, gboolean drop_oldest, NiceSocket **base)
+{
+  *base = nice_udp_bsd_socket_new (NULL);
+  g_assert (*base != NULL);
+
+  return nice_turn_socket_new (ctx, G_OBJECT (agent), &(*base)->addr, *base,
+      &server_addr, "username", "password",
+      NICE_TURN_SOCKET_COMPATIBILITY_RFC5766, queue_size, drop_oldest,
+      queue_cb, NULL);
+}
+
+/* The peers asked for in one main loop iteration share CreatePermission
+ * requests, of up to 32 peers each */
+static void
+test_permission_batch (void)
+{
+  NiceSocket *base, *turn;
+  ServerRequest *reqs[2];
+  gboolean seen[PERMISSION_PEERS] = { FALSE, };
+  guint i;
+
+  turn = turn_socket_new (65536, FALSE, &base);
+
+  for (i = 0; i < PERMISSION_PEERS; i++)
+    send_data (turn, i);
+
+  /* nothing goes out before the main loop comes around */
+  g_assert (server_recv_now () == NULL);
+
+  reqs[0] = server_recv ();
+  g_assert (permission_peers (reqs[0], seen) == PERMISSION_BATCH);
+  reqs[1] = server_recv_now ();
+  g_assert (reqs[1] != NULL);
+  g_assert (permission_peers (reqs[1], seen) ==
+      PERMISSION_PEERS - PERMISSION_BATCH);
+  g_assert (server_recv_now () == NULL);
+
+  for (i = 0; i < PERMISSION_PEERS; i++)
+    g_assert (seen[i]);
+
+  /* a server without permissions refuses them, the data goes out anyway */
+  server_reply (turn, reqs[0], STUN_ERROR_BAD_REQUEST);
+  server_reply (turn, reqs[1], STUN_ERROR_BAD_REQUEST);
+  check_data_sent (PERMISSION_PEERS);
+  g_assert (server_recv_now () == NULL);
+  g_assert (queued_bytes () == 0);
+
+  g_free (reqs[0]);
+  g_free (reqs[1]);
+  nice_socket_free (turn);
+  nice_socket_free (base);
+}
+
+/* A timed out CreatePermission sends what was queued for all its peers */
+static void
+test_permission_timeout (void)
+{
+  NiceSocket *base, *turn;
+  ServerRequest *req;
+  gboolean seen[PERMISSION_PEERS] = { FALSE, };
+  guint i;
+
+  turn = turn_socket_new (65536, FALSE, &base);
+
+  for (i = 0; i < 3; i++)
+    send_data (turn, i);
+
+  req = server_recv ();
+  g_assert (permission_peers (req, seen) == 3);
+  g_free (req);
+
+  /* never answered */
+  check_data_sent (3);
+  g_assert (queued_bytes () == 0);
+
+  nice_socket_free (turn);
+  nice_socket_free (base);
+}
+
+static uint16_t
+channel_bind_channel (ServerRequest *req, NiceAddress *peer)
+{
+  union {
+    struct sockaddr_storage storage;
+    struct sockaddr addr;
+  } sa;
+  socklen_t sa_len = sizeof (sa);
+  uint32_t channel;
+
+  g_assert (stun_message_get_method (&req->msg) == STUN_CHANNELBIND);
+  g_assert (stun_message_find32 (&req->msg, STUN_ATTRIBUTE_CHANNEL_NUMBER,
+          &channel) == STUN_MESSAGE_RETURN_SUCCESS);
+  g_assert (stun_message_find_xor_addr (&req->msg,
+          STUN_ATTRIBUTE_XOR_PEER_ADDRESS, &sa.addr, &sa_len) ==
+      STUN_MESSAGE_RETURN_SUCCESS);
+  nice_address_set_from_sockaddr (peer, &sa.addr);
+
+  return channel >> 16;
+}
+
+/* Up to 16 ChannelBinds are in flight at once, the next ones wait for
+ * one of them to complete */
+static void
+test_channel_bind_window (void)
+{
+  NiceSocket *base, *turn;
+  ServerRequest *reqs[BINDING_PEERS];
+  gboolean seen[BINDING_PEERS] = { FALSE, };
+  guint16 channels[BINDING_PEERS];
+  guint i, j, n_reqs = 0, n_done = 0;
+
+  turn = turn_socket_new (65536, FALSE, &base);
+
+  for (i = 0; i < BINDING_PEERS; i++) {
+    NiceAddress peer;
+
+    peer_init (&peer, i);
+    g_assert (nice_turn_socket_set_peer (turn, &peer) ==
+        (i < BINDINGS_IN_FLIGHT));
+  }
+
+  while (n_done < BINDING_PEERS) {
+    ServerRequest *req;
+
+    while ((req = server_recv_now ()) != NULL) {
+      NiceAddress peer;
+
+      g_assert (n_reqs < BINDING_PEERS);
+      channels[n_reqs] = channel_bind_channel (req, &peer);
+      i = nice_address_get_port (&peer) - PEER_PORT;
+      g_assert (i < BINDING_PEERS && !seen[i]);
+      seen[i] = TRUE;
+      for (j = 0; j < n_reqs; j++)
+        g_assert (channels[j] != channels[n_reqs]);
+      reqs[n_reqs++] = req;
+    }
+
+    g_assert (n_reqs - n_done ==
+        MIN (BINDINGS_IN_FLIGHT, BINDING_PEERS - n_done));
+
+    /* which lets the next pending one go */
+    server_reply (turn, reqs[n_done], STUN_ERROR_BAD_REQUEST);
+    g_free (reqs[n_done++]);
+  }
+
+  g_assert (server_recv_now () == NULL);
+
+  nice_socket_free (turn);
+  nice_socket_free (base);
+}
+
+/* The ChannelBind sent again with credentials after a 401 still installs
+ * the binding it was created for */
+static void
+test_channel_bind_unauthorized (void)
+{
+  NiceSocket *base, *turn, *from_sock = NULL;
+  ServerRequest *req;
+  NiceAddress peer, bound, from;
+  uint16_t channel, header[2];
+  gchar buf[64];
+  gchar out[64];
+
+  turn = turn_socket_new (65536, FALSE, &base);
+
+  peer_init (&peer, 0);
+  g_assert (nice_turn_socket_set_peer (turn, &peer));
+
+  req = server_recv_now ();
+  g_assert (req != NULL);
+  g_assert (!stun_message_has_attribute (&req->msg,
+          STUN_ATTRIBUTE_MESSAGE_INTEGRITY));
+  channel = channel_bind_channel (req, &bound);
+  server_reply (turn, req, STUN_ERROR_UNAUTHORIZED);
+  g_free (req);
+
+  req = server_recv_now ();
+  g_assert (req != NULL);
+  g_assert (stun_message_has_attribute (&req->msg,
+          STUN_ATTRIBUTE_MESSAGE_INTEGRITY));
+  g_assert (channel_bind_channel (req, &bound) == channel);
+  g_assert (nice_address_equal (&bound, &peer));
+  server_reply (turn, req, 0);
+  g_free (req);
+
+  /* ChannelData on that channel now comes from the peer */
+  header[0] = htons (channel);
+  header[1] = htons (4);
+  memcpy (buf, header, sizeof (header));
+  memcpy (buf + sizeof (header), "data", 4);
+  g_assert (nice_turn_socket_parse_recv (turn, &from_sock, &from,
+          sizeof (out), out, &server_addr, buf, sizeof (header) + 4) == 4);
+  g_assert (from_sock == turn);
+  g_assert (nice_address_equal (&from, &peer));
+  g_assert (memcmp (out, "data", 4) == 0);
+
+  /* and is dropped when its length goes past the end of the datagram */
+  header[1] = htons (1000);
+  memcpy (buf, header, sizeof (header));
+  g_assert (nice_turn_socket_parse_recv (turn, &from_sock, &from,
+          sizeof (out), out, &server_addr, buf, sizeof (header) + 4) == 0);
+
+  nice_socket_free (turn);
+  nice_socket_free (base);
+}
+
+/* Sends @seq to the first peer, which has no permission yet */
+static void
+send_seq (NiceSocket *turn, guint32 seq, guint len)
+{
+  NiceAddress peer;
+  gchar buf[8192];
+
+  peer_init (&peer, 0);
+  g_assert (len <= sizeof (buf));
+  memset (buf, 0, len);
+  memcpy (buf, &seq, sizeof (seq));
+  g_assert (nice_socket_send (turn, &peer, len, buf) == (gint) len);
+}
+
+/* Returns the size of one queued packet, and how many the queue holds */
+static guint
+fill_queue (NiceSocket *turn, guint64 *entry_len)
+{
+  guint64 queued = queued_bytes ();
+  guint64 dropped = dropped_bytes ();
+  guint n = 0;
+
+  send_seq (turn, n++, PAYLOAD_LEN);
+  *entry_len = queued_bytes () - queued;
+  g_assert (*entry_len > PAYLOAD_LEN);
+
+  while (dropped_bytes () == dropped) {
+    g_assert (n < QUEUE_SIZE / PAYLOAD_LEN);
+    send_seq (turn, n++, PAYLOAD_LEN);
+  }
+
+  /* the last one didn't fit */
+  return n - 1;
+}
+
+/* Refuses the CreatePermission for the peer, as a server without
+ * permissions would, which sends everything queued for it. Returns the
+ * sequence number of the first packet and checks the others follow. */
+static guint32
+flush_queue (NiceSocket *turn, guint n_expected)
+{
+  ServerRequest *req;
+  guint32 first = 0, seq;
+  guint i;
+
+  req = server_recv ();
+  g_assert (stun_message_get_method (&req->msg) == STUN_CREATEPERMISSION);
+  server_reply (turn, req, STUN_ERROR_BAD_REQUEST);
+  g_free (req);
+
+  for (i = 0; i < n_expected; i++) {
+    const uint8_t *data;
+    uint16_t data_len;
+
+    req = server_recv_now ();
+    g_assert (req != NULL);
+    g_assert (stun_message_get_method (&req->msg) == STUN_IND_SEND);
+
+    data = stun_message_find (&req->msg, STUN_ATTRIBUTE_DATA, &data_len);
+    g_assert (data != NULL && data_len == PAYLOAD_LEN);
+    memcpy (&seq, data, sizeof (seq));
+    if (i == 0)
+      first = seq;
+    g_assert (seq == first + i);
+    g_free (req);
+  }
+
+  /* and nothing else */
+  g_assert (server_recv_now () == NULL);
+  g_assert (queued_bytes () == 0);
+
+  return first;
+}
+
+/* A full queue drops what comes next and keeps the oldest packets */
+static void
+test_queue_drop_newest (void)
+{
+  NiceSocket *base, *turn;
+  guint64 entry_len, dropped;
+  guint n_fit;
+
+  turn = turn_socket_new (QUEUE_SIZE, FALSE, &base);
+
+  dropped = dropped_bytes ();
+  n_fit = fill_queue (turn, &entry_len);
+  g_assert (n_fit > 2);
+  g_assert (queued_bytes () == n_fit * entry_len);
+  g_assert (dropped_bytes () == dropped + entry_len);
+
+  dropped = dropped_bytes ();
+  send_seq (turn, 1000, PAYLOAD_LEN);
+  g_assert (queued_bytes () == n_fit * entry_len);
+  g_assert (dropped_bytes () == dropped + entry_len);
+
+  /* too big for the whole queue */
+  dropped = dropped_bytes ();
+  send_seq (turn, 1001, QUEUE_SIZE + 100);
+  g_assert (queued_bytes () == n_fit * entry_len);
+  g_assert (dropped_bytes () > dropped + QUEUE_SIZE);
+
+  g_assert (flush_queue (turn, n_fit) == 0);
+
+  nice_socket_free (turn);
+  nice_socket_free (base);
+}
+
+/* A full queue drops its oldest packets, wrapping around the ring, but
+ * keeps them all for a packet that would never fit */
+static void
+test_queue_drop_oldest (void)
+{
+  NiceSocket *base, *turn;
+  guint64 entry_len, dropped_before, dropped;
+  guint n_fit, n_sent, n_queued;
+
+  dropped_before = dropped_bytes ();
+  turn = turn_socket_new (QUEUE_SIZE, TRUE, &base);
+
+  n_fit = fill_queue (turn, &entry_len);
+  n_sent = n_fit + 1;
+
+  /* go around the ring a few times */
+  while (n_sent < 5 * n_fit)
+    send_seq (turn, n_sent++, PAYLOAD_LEN);
+
+  /* the end of the ring may be too short for an entry once it wrapped */
+  n_queued = queued_bytes () / entry_len;
+  g_assert (queued_bytes () == n_queued * entry_len);
+  g_assert (n_queued == n_fit || n_queued == n_fit - 1);
+  g_assert (dropped_bytes () - dropped_before ==
+      (n_sent - n_queued) * entry_len);
+
+  dropped = dropped_bytes ();
+  send_seq (turn, n_sent, QUEUE_SIZE + 100);
+  g_assert (queued_bytes () == n_queued * entry_len);
+  g_assert (dropped_bytes () > dropped + QUEUE_SIZE);
+
+  /* the newest ones are left, in order */
+  g_assert (flush_queue (turn, n_queued) == n_sent - n_queued);
+
+  nice_socket_free (turn);
+  nice_socket_free (base);
+}
+
+int
+main (void)
+{
+  g_type_init ();
+
+  ctx = g_main_context_new ();
+  agent = nice_agent_new (ctx, NICE_COMPATIBILITY_RFC5245,
+      NICE_COMPATIBILITY_RFC5245);
+
+  stun_agent_init (&server_agent, STUN_ALL_KNOWN_ATTRIBUTES,
+      STUN_COMPATIBILITY_RFC5389,
+      STUN_AGENT_USAGE_LONG_TERM_CREDENTIALS |
+      STUN_AGENT_USAGE_NO_INDICATION_AUTH);
+
+  server = nice_udp_bsd_socket_new (NULL);
+  g_assert (server != NULL);
+  g_assert (nice_address_set_from_string (&server_addr, "127.0.0.1"));
+  nice_address_set_port (&server_addr, nice_address_get_port (&server->addr));
+
+  test_queue_drop_newest ();
+  test_queue_drop_oldest ();
+  test_permission_batch ();
+  test_permission_timeout ();
+  test_channel_bind_window ();
+  test_channel_bind_unauthorized ();
+
+  nice_socket_free (server);
+  g_object_unref (agent);
+  g_main_context_unref (ctx);
+
+  return 0;
+}